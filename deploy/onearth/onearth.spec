@@ -280,6 +280,7 @@ rm -rf %{buildroot}
 %{_datadir}/onearth/empty_tiles
 %defattr(755,root,root,-)
 %{_bindir}/oe_create_cache_config
+%{_bindir}/oe_tile_server
 %{_datadir}/cgicc
 
 %post
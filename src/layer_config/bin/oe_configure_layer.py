@@ -73,6 +73,7 @@ import re
 import distutils.spawn
 import sqlite3
 import glob
+import struct
 from datetime import datetime, time, timedelta
 from time import asctime
 from dateutil.relativedelta import relativedelta
@@ -982,6 +983,48 @@ def generate_empty_tile(colormap, output, width, height):
     return empty_size
 
 
+def occupancy_map_current(idx, idm):
+    """
+    Checks if an occupancy map was made from the current version of an index file,
+    with the index size and modification time stored in its header
+    Arguments:
+        idx -- the index file
+        idm -- the occupancy map
+    """
+    try:
+        with open(idm, 'rb') as f:
+            magic, chunks, records, size, mtime, nsec = struct.unpack(
+                '=4siqqqq', f.read(40))
+    except (IOError, struct.error):
+        return False
+    stat = os.stat(idx)
+    return magic == 'IDM2' and size == stat.st_size and mtime == int(
+        stat.st_mtime) and abs(mtime + nsec / 1e9 - stat.st_mtime) < 1e-6
+
+
+def generate_occupancy_maps(archiveLocation, fileNamePrefix, year):
+    """
+    Generate the occupancy maps (.idm) of the index files of a layer that don't have a current one,
+    used by mod_onearth to answer the tiles without data without reading the index
+    Arguments:
+        archiveLocation -- the location of the archive data
+        fileNamePrefix -- the prefix of the MRF files
+        year -- whether or not the layer uses a year-based directory structure
+    """
+    pattern = archiveLocation + ('[0-9]*/' if year else '') + fileNamePrefix + '*.idx'
+    for idx in sorted(glob.glob(pattern)):
+        if os.path.islink(idx):  # Default links point to a map with generate_links
+            continue
+        idm = idx[:-4] + '.idm'
+        if occupancy_map_current(idx, idm):
+            continue
+        try:
+            run_command(depth + '/oe_create_cache_config -o ' + idx + ' ' + idm,
+                        sigevent_url)
+        except Exception:
+            log_sig_warn("Can't generate occupancy map " + idm, sigevent_url)
+
+
 def generate_links(detected_times, archiveLocation, fileNamePrefix, year,
                    dataFileLocation, has_zdb):
     """
@@ -1027,8 +1070,10 @@ def generate_links(detected_times, archiveLocation, fileNamePrefix, year,
     idx = archiveLocation + filename + ".idx"
     data = archiveLocation + filename + data_ext
     zdb = archiveLocation + filename + ".zdb"
+    idm = archiveLocation + filename + ".idm"
     mrf_link = link_pre + ".mrf"
     idx_link = link_pre + ".idx"
+    idm_link = link_pre + ".idm"
     data_link = link_pre + data_ext
     zdb_link = link_pre + ".zdb"
 
@@ -1068,6 +1113,13 @@ def generate_links(detected_times, archiveLocation, fileNamePrefix, year,
             print "Removed existing file " + zdb_link
         os.symlink(zdb, zdb_link)
         print "Created soft link " + zdb_link + " -> " + zdb
+    # The occupancy map goes with the index, a map left from the previous default is removed
+    if os.path.lexists(idm_link):
+        os.remove(idm_link)
+        print "Removed existing file " + idm_link
+    if os.path.isfile(idm):
+        os.symlink(idm, idm_link)
+        print "Created soft link " + idm_link + " -> " + idm
 
     # special handling for shapefiles
     if data_ext == ".shp":
@@ -1093,7 +1145,7 @@ if os.environ.has_key('LCDIR') == False:
 else:
     lcdir = os.environ['LCDIR']
 
-usageText = 'oe_configure_layer.py --conf_file [layer_configuration_file.xml] --layer_dir [$LCDIR/layers/] --lcdir [$LCDIR] --projection_config [projection.xml] --time [ISO 8601] --restart_apache --no_xml --no_cache --no_twms --no_wmts --generate_legend --generate_links --skip_empty_tiles --create_mapfile'
+usageText = 'oe_configure_layer.py --conf_file [layer_configuration_file.xml] --layer_dir [$LCDIR/layers/] --lcdir [$LCDIR] --projection_config [projection.xml] --time [ISO 8601] --restart_apache --no_xml --no_cache --no_twms --no_wmts --generate_legend --generate_links --generate_occupancy_maps --skip_empty_tiles --create_mapfile'
 
 # Define command line options and args.
 parser = OptionParser(usage=usageText, version=versionNumber)
@@ -1279,6 +1331,15 @@ parser.add_option(
     default=False,
     help="Create MapServer configuration.")
 
+parser.add_option(
+    "--generate_occupancy_maps",
+    action="store_true",
+    dest="generate_occupancy_maps",
+    default=False,
+    help=
+    "Generate occupancy maps (.idm) of the archive index files that don't have a current one."
+)
+
 # Read command line args.
 (options, args) = parser.parse_args()
 # Configuration filename.
@@ -1310,6 +1371,8 @@ skip_empty_tiles = options.skip_empty_tiles
 legend = options.generate_legend
 # Generate links
 links = options.generate_links
+# Generate occupancy maps
+occupancy_maps = options.generate_occupancy_maps
 # Projection configuration
 if options.projection_configuration:
     projection_configuration = options.projection_configuration
@@ -2465,6 +2528,11 @@ for conf in conf_files:
                 detected_times = detect_time(time, archiveLocation,
                                              fileNamePrefix, year, has_zdb)
 
+    # generate occupancy maps if requested, before the links so the default one gets linked
+    if occupancy_maps == True and archiveLocation != None:
+        print "Generating occupancy maps for " + fileNamePrefix
+        generate_occupancy_maps(archiveLocation, fileNamePrefix, year)
+
     # generate archive links if requested
     if links == True:
         if len(detected_times) > 0:
@@ -3112,7 +3180,12 @@ if no_twms == False:
         #twms
         if twms_endpoint.cacheConfigBasename:
             print "\nRunning commands for endpoint: " + twms_endpoint.path
-            cmd = depth + '/oe_create_cache_config -cbd ' + twms_endpoint.path + " " + twms_endpoint.path + '/' + twms_endpoint.cacheConfigBasename + '.config'
+            # Relative file names are stored as seen from where the server reads the configuration
+            if no_cache == False and twms_endpoint.cacheConfigLocation:
+                config_dir = twms_endpoint.cacheConfigLocation
+            else:
+                config_dir = twms_endpoint.path
+            cmd = depth + '/oe_create_cache_config -cbd -a ' + config_dir + ' ' + twms_endpoint.path + " " + twms_endpoint.path + '/' + twms_endpoint.cacheConfigBasename + '.config'
             run_command(cmd, sigevent_url)
             cmd = depth + '/oe_create_cache_config -cxd ' + twms_endpoint.path + " " + twms_endpoint.path + '/' + twms_endpoint.cacheConfigBasename + '.xml'
             run_command(cmd, sigevent_url)
@@ -3190,7 +3263,12 @@ if no_wmts == False:
         #wmts
         if wmts_endpoint.cacheConfigBasename:
             print "\nRunning commands for endpoint: " + wmts_endpoint.path
-            cmd = depth + '/oe_create_cache_config -cbd ' + wmts_endpoint.path + " " + wmts_endpoint.path + '/' + wmts_endpoint.cacheConfigBasename + '.config'
+            # Relative file names are stored as seen from where the server reads the configuration
+            if no_cache == False and wmts_endpoint.cacheConfigLocation:
+                config_dir = wmts_endpoint.cacheConfigLocation
+            else:
+                config_dir = wmts_endpoint.path
+            cmd = depth + '/oe_create_cache_config -cbd -a ' + config_dir + ' ' + wmts_endpoint.path + " " + wmts_endpoint.path + '/' + wmts_endpoint.cacheConfigBasename + '.config'
             try:
                 run_command(cmd, sigevent_url)
             except:
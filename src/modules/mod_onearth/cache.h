@@ -31,6 +31,9 @@
 * limitations under the License.
 */
 
+#ifndef CACHE_H
+#define CACHE_H
+
 // #define STRING_SIZE 2048
 
 // One such record is stored for each page, in the indes file
@@ -55,7 +58,7 @@ typedef struct {
   // values for the pages size.
   double levelx,levely;
 
-  char *dfname; // These are pointers or offsets
+  char *dfname; // Offsets of the strings, see GETSTRING
   char *ifname;
 } WMSlevel;
 
@@ -86,3 +89,153 @@ typedef struct { // One of these per cache pack
 #define GETCACHE(C,X) ((WMSCache *) ( ((char *) C) + sizeof(Caches) + X*sizeof(WMSCache) ))
 // Macro to get a pointer to the level table of a given cache C, relative to the cache itself
 #define GETLEVELS(C) ((WMSlevel *) ( ((char *) C) + C->levelt_offset ))
+// Macro to get a string from the cache file, the string fields hold offsets from the Caches record
+#define GETSTRING(C,S) (((char *) C) + (size_t)(S))
+
+// Version 2 of the binary configuration, made by oe_create_cache_config -b
+// It has no pointers, so the server maps it read-only and all the processes share it
+// The header is followed by the Caches record, then the same layout as version 1, then the
+// layer hash table, the list of caches which need regexp matching and the strings
+// The size in the Caches record counts from the Caches record to the end of the file
+// Offsets are from the Caches record, the file names are absolute
+#define CACHE_MAGIC "OEC2"
+#define CACHE_VERSION 2
+
+typedef struct {
+  char magic[4];
+  int version;
+  int hash_size;       // Slots in the layer hash table, a power of two
+  int hash_offset;
+  int fallback_count;  // Caches with patterns that can't be hashed, highest number first
+  int fallback_offset;
+} cache_header;
+
+// Layer hash table slot, the key is VERSION&LAYER&STYLE&TILEMATRIXSET&FORMAT from a WMTS pattern,
+// with CACHE_KEY_WILD for the dots
+// Open addressing with linear probing, key is 0 for an empty slot
+typedef struct {
+  int key;   // Offset of the key, not null terminated
+  int len;
+  int cache; // The highest numbered cache for this key
+} cache_hash_entry;
+
+// FNV-1a, for the layer hash table
+static inline unsigned int cache_key_hash(const char *key, int len) {
+  unsigned int h=2166136261u;
+  while (len--) {
+    h^=(unsigned char)*key++;
+    h*=16777619u;
+  }
+  return h;
+}
+
+// In a pattern value an unescaped dot matches any character, the keys have CACHE_KEY_WILD in its
+// place.  A request is looked up once for each set of wildcard positions found in the table
+#define CACHE_KEY_WILD '\n'
+#define CACHE_KEY_FIELDS 5  // VERSION LAYER STYLE TILEMATRIXSET FORMAT
+#define CACHE_KEY_MASKS 16  // Sets of wildcard positions, patterns past this are matched by regexp
+
+typedef struct {
+  int count;
+  unsigned long long mask[CACHE_KEY_MASKS][CACHE_KEY_FIELDS]; // Bit i is set for a wildcard at i
+} cache_key_masks;
+
+// Key value for a pattern field, with the wildcards, in out.  Returns the length,
+// -1 if the field has regexp syntax other than the dot
+static inline int cache_key_value(const char *s, int len, char *out) {
+  static const char special[]="\\^$|?*+()[]{}";
+  int i,j,n=0;
+  for (i=0;i<len;i++) {
+    if ('\\'==s[i] && i+1<len && '.'==s[i+1]) {
+      out[n++]=s[++i];
+      continue;
+    }
+    if ('.'==s[i]) {
+      out[n++]=CACHE_KEY_WILD;
+      continue;
+    }
+    if (CACHE_KEY_WILD==s[i]) return -1;
+    for (j=0;special[j];j++)
+      if (special[j]==s[i]) return -1;
+    out[n++]=s[i];
+  }
+  return n;
+}
+
+// Adds the wildcard positions of a key, returns -1 if they don't fit
+static inline int cache_key_masks_add(cache_key_masks *m, const char *key, int len) {
+  unsigned long long mask[CACHE_KEY_FIELDS]={0};
+  int i,f=0,pos=0;
+  for (i=0;i<len;i++,pos++) {
+    if ('&'==key[i]) {
+      if (++f==CACHE_KEY_FIELDS) return -1;
+      pos=-1;
+    }
+    else if (CACHE_KEY_WILD==key[i]) {
+      if (pos>=64) return -1;
+      mask[f]|=1ULL<<pos;
+    }
+  }
+  for (i=0;i<m->count;i++) {
+    for (f=0;f<CACHE_KEY_FIELDS && m->mask[i][f]==mask[f];f++);
+    if (CACHE_KEY_FIELDS==f) return 0;
+  }
+  if (CACHE_KEY_MASKS==m->count) return -1;
+  for (f=0;f<CACHE_KEY_FIELDS;f++)
+    m->mask[m->count][f]=mask[f];
+  m->count++;
+  return 0;
+}
+
+// Compact z-index table, made from a ZDB file with oe_create_cache_config -z
+// It sits next to the ZDB, with the .zdx extension, and gets mapped by the server
+// A header, then the records sorted by key, then the strings
+// String fields are offsets from the start of the file, 0 means null
+#define ZDX_MAGIC "ZDX1"
+
+typedef struct {
+  char magic[4];
+  int count;  // How many records
+  int latest; // Record used when the request has no key, -1 if none
+  int reserved;
+} zdx_header;
+
+typedef struct {
+  int key;
+  int z;
+  int source_url;
+  int scale;
+  int offset;
+  int uom;
+} zdx_record;
+
+// Occupancy map of an index file, made from the index with oe_create_cache_config -o
+// It sits next to the .idx, with the .idm extension, and gets mapped by the server, so tiles
+// that have no data are answered without reading the index
+// One bit per index record, set when the record has a size.  The records are grouped in chunks
+// of IDM_CHUNK, each one stored empty, full, as the sorted list of the set records or as a
+// bitmap, whichever is smaller.  All the levels and z slices of the index are covered
+// The header has the size and modification time of the index it was made from, the map is
+// only used while the index still has them
+#define IDM_MAGIC "IDM2"
+#define IDM_CHUNK 65536
+#define IDM_ARRAY_MAX 4096 // Chunks with more records set are stored as a bitmap
+
+enum {IDM_EMPTY, IDM_FULL, IDM_ARRAY, IDM_BITMAP};
+
+typedef struct {
+  char magic[4];
+  int chunks;          // IDM_CHUNK records each, the last one can be short
+  long long records;   // Records covered, the ones past the end are read from the index
+  long long index_size;  // Of the index file
+  long long index_mtime; // Seconds
+  long long index_nsec;  // and nanoseconds
+} idm_header;
+
+typedef struct {       // One per chunk, after the header
+  int type;
+  int count;           // Records set
+  long long offset;    // From the start of the file, of the unsigned short list or the bitmap
+} idm_chunk;
+
+#endif
@@ -59,17 +59,35 @@
 #include "http_request.h"
 #include "util_script.h"
 #include "http_connection.h"
+#include "ap_mpm.h"
 
 #include "cache.h"
 #include "apr_lib.h"
 #include "apr_strings.h"
 #include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_cond.h"
+#include "apr_atomic.h"
+#include "apr_buckets.h"
+#include "apr_mmap.h"
+#include "apr_shm.h"
 
 #include <sqlite3.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
 #include <math.h>
 
 #include "mod_wmts_wrapper.h"
+#include "oe_read.h"
+#include "oe_tile.h"
+#include "oe_stats.h"
+#include "oe_match.h"
 
 // Use APLOG_WARNING APLOG_DEBUG or APLOG_ERR.  Sets the level for the "Unhandled .." 
 #define LOG_LEVEL APLOG_ERR
@@ -83,12 +101,30 @@ typedef struct {
   void *data;
 } wms_empty_record;
 
+// Blank tile of an endpoint, for one mime type.  Sent when a tile is missing and the layer
+// has no empty tile, in place of the CGI
+typedef struct {
+  const char *mime_type;
+  const char *etag;
+  void *data;
+  apr_size_t size;
+} wms_blank;
+
+// Time periods, parsed once from the cache configuration
+typedef oe_periods wms_periods;
+
 typedef struct {
   // This points to a table, one per match
   ap_regex_t **regex;
   char *mime_type;
   // this is a table, one such per level
   wms_empty_record *empties;
+  wms_periods periods;
+  oe_level_index levels; // Tiled WMS level lookup by tile width
+  int stats_layer;  // Slot in the request statistics plus one, 0 until the first request
+  int matched;      // All the patterns are in the configuration matcher
+  oe_fname *fnames; // Index and data file names, two per level
+  oe_fname zidx;    // z-index database name, the name is 0 if there is none
 } meta_cache;
 
 // All pointers, can be copied as long as the pool stays around
@@ -98,6 +134,16 @@ typedef struct {
   char *cachedir;   // The cache directory name
   meta_cache *meta; // Run-time information for each cache
   char *dir;		// The server directory
+  int sendfile;     // Send tiles as file buckets instead of reading them
+  int empty_vector; // HTTP status for empty vector tiles, 0 to send the empty tile
+  int pattern_memory; // MB for the pattern matcher, 0 to match each pattern by itself
+  apr_hash_t *blanks; // wms_blank by mime type, 0 if there are none
+  apr_hash_t *layer_index;     // Cache number for each decomposed WMTS pattern key
+  cache_key_masks *key_masks;  // Wildcard positions in the layer keys
+  const cache_header *header;  // Version 2 configuration, mapped read-only.  0 for version 1
+  apr_array_header_t *fallback; // Caches that still need regexp matching, highest first
+  oe_matcher *matcher;          // The fallback cache patterns, all in one.  0 if not used
+  struct wms_reload *reload;    // Reload state, shared by all copies.  0 without a WMSCache
 } wms_cfg;
 
 // WMTS error handling
@@ -108,10 +154,52 @@ struct wmts_error{
   char *exceptionText;
 };
 typedef struct wmts_error wmts_error;
-struct wmts_error wmts_errors[5];
-int errors = 0;
+
+// Max number of WMTS errors reported for one request
+#define MAX_WMTS_ERRORS 16
+
+// Pointer and length into a string, not null terminated
+typedef oe_str wms_str;
+
+// Request type, from the SERVICE and REQUEST parameters
+enum {WMS_REQ_OTHER,WMS_REQ_WMTS,WMS_REQ_TWMS};
+
+// The request parameters, found in one pass over the argument string
+// Values point into the original string, s is 0 when the parameter is absent
+typedef struct {
+  const char *src;  // The argument string these were parsed from
+  size_t srclen;    // and its length, the string can change in place
+  int type;
+  int batch;        // WMTS GetTiles, TILEROW and TILECOL point to the first tile in TILES
+  int rest;         // WMTS GetTile from a REST path, there is no argument string
+  wms_str service,request,version,format,time,zindex;
+  // WMTS
+  wms_str layer,style,tilematrixset,tilematrix,tilerow,tilecol,tiles;
+  apr_int64_t matrix,row,col;  // Numeric values of TILEMATRIX, TILEROW and TILECOL
+  // TWMS
+  wms_str layers,srs,styles,width,height,bbox,transparent,bgcolor,exceptions,elevation;
+} wms_args;
+
+// Per request state, attached to the request_rec so threads don't share it
+typedef struct {
+  wmts_error errors[MAX_WMTS_ERRORS];
+  int nerrors;
+  wms_args args;
+  wms_cfg *cfg;     // The configuration used by this request, see get_cfg
+  int snapped;      // The time was snapped to a period
+  int index_miss;   // The index record was not in the index cache
+} wms_req_ctx;
+
+// Hit and miss counters for the MISS_MARK log, shared by all threads in a process
+static volatile apr_uint32_t hit_count=0;
+static volatile apr_uint32_t miss_count=0;
+
 static int wmts_add_error(request_rec *r, int status, char *exceptionCode, char *locator, char *exceptionText);
+static int wmts_errors(request_rec *r);
 static int wmts_return_all_errors(request_rec *r);
+static wms_args *parse_args(request_rec *r);
+static const wms_str *req_time(request_rec *r);
+static wms_req_ctx *get_req_ctx(request_rec *r);
 
 // Module constants
 static char kmltype[]="application/vnd.google-earth.kml+xml";
@@ -119,9 +207,232 @@ static int kmlt_len=36; // Number of charachters in kmltype
 static char Matrix[]="TILEMATRIX=";
 static int matrix_len=11; // Number of chars in Matrix;
 static char WMTS_marker[]="=WMTS";
-static int moffset[12]={0,31,59,90,120,151,181,212,243,273,304,334};
 static char colon[] = "%3A";
 
+// The canonical WMTS argument string, as built by order_args, is this prefix followed by
+// the VERSION value and then by these fields, in order.  The values can't contain an ampersand
+static char wmts_prefix[]="SERVICE=WMTS&REQUEST=GetTile&VERSION=";
+static const char *wmts_fields[]={"&LAYER=","&STYLE=","&TILEMATRIXSET=",
+  "&TILEMATRIX=","&TILEROW=","&TILECOL=","&FORMAT="};
+#define WMTS_NFIELDS 8 // VERSION plus the ones above
+enum {WF_VERSION,WF_LAYER,WF_STYLE,WF_TMS,WF_MATRIX,WF_ROW,WF_COL,WF_FORMAT};
+
+// Split a canonical WMTS string starting at s into the field values
+// Returns a pointer past the FORMAT value, 0 if the string doesn't have the canonical form
+static const char *wmts_split(const char *s, wms_str *v)
+{
+  int i;
+  if (strncmp(s,wmts_prefix,sizeof(wmts_prefix)-1)) return 0;
+  s+=sizeof(wmts_prefix)-1;
+  for (i=0;i<WMTS_NFIELDS;i++) {
+    if (i) {
+      int len=strlen(wmts_fields[i-1]);
+      if (strncmp(s,wmts_fields[i-1],len)) return 0;
+      s+=len;
+    }
+    v[i].s=s;
+    while (*s && '&'!=*s) s++;
+    v[i].len=s-v[i].s;
+  }
+  return s;
+}
+
+// Builds the layer index key from the field values, returns the length or -1 if it doesn't fit
+static int wmts_key(char *key, int size, const wms_str *v, const wms_str *style)
+{
+  return oe_wmts_key(key,size,&v[WF_VERSION],&v[WF_LAYER],style,&v[WF_TMS],&v[WF_FORMAT]);
+}
+
+static int is_digits(const wms_str *v)
+{
+  int i;
+  for (i=0;i<v->len;i++)
+    if (!apr_isdigit(v->s[i])) return 0;
+  return 1;
+}
+
+// Add a WMTS pattern to the layer index, if it has the canonical form with literal values
+// A dot in a value goes in the key as a wildcard, see cache_key_value
+// Returns 0 if the pattern can't be indexed and the cache has to be matched by regexp
+static int index_wmts_pattern(wms_cfg *cfg, const char *pattern, int count)
+{
+  static const char digits[]="[0-9]*";
+  static const int fields[]={WF_VERSION,WF_LAYER,WF_STYLE,WF_TMS,WF_FORMAT};
+  wms_str v[WMTS_NFIELDS];
+  wms_str styles[2];
+  char keys[2][1024];
+  int lens[2];
+  const char *end=wmts_split(pattern,v);
+  int i,j,nstyles=1;
+
+  if (!end || *end) return 0;
+  for (i=WF_MATRIX;i<=WF_COL;i++)
+    if (v[i].len!=sizeof(digits)-1 || strncmp(v[i].s,digits,v[i].len)) return 0;
+
+  // The style is a literal or an optional literal, like (default)?
+  styles[0]=v[WF_STYLE];
+  if (v[WF_STYLE].len>3 && '('==v[WF_STYLE].s[0] && !strncmp(v[WF_STYLE].s+v[WF_STYLE].len-2,")?",2)) {
+    styles[0].s++; styles[0].len-=3;
+    styles[1].s=""; styles[1].len=0;
+    nstyles=2;
+  }
+
+  for (i=0;i<nstyles;i++) {
+    char *k=keys[i];
+    int size=sizeof(keys[i]);
+    for (j=0;j<CACHE_KEY_FIELDS;j++) {
+      const wms_str *f=(WF_STYLE==fields[j])?&styles[i]:&v[fields[j]];
+      int len;
+      if (f->len+1>size || 0>(len=cache_key_value(f->s,f->len,k))) return 0;
+      k+=len;
+      size-=len+1;
+      *k++='&';
+    }
+    lens[i]=k-1-keys[i];
+    if (cache_key_masks_add(cfg->key_masks,keys[i],lens[i])) return 0;
+  }
+
+  for (i=0;i<nstyles;i++) {
+    int *value;
+    // Caches are indexed from the last one, the highest numbered cache wins, same as the regexp scan
+    if (apr_hash_get(cfg->layer_index,keys[i],lens[i])) continue;
+    value=(int *)apr_palloc(cfg->p,sizeof(int));
+    *value=count;
+    apr_hash_set(cfg->layer_index,apr_pstrmemdup(cfg->p,keys[i],lens[i]),lens[i],value);
+  }
+  return 1;
+}
+
+static int index_probe(void *data, const char *key, int len)
+{
+  int *value=(int *)apr_hash_get((apr_hash_t *)data,key,len);
+  return value?*value:-1;
+}
+
+// Cache number for a request layer key, -1 if no indexed cache matches
+static int layer_lookup(wms_cfg *cfg, const char *key, int len)
+{
+  if (cfg->header) return oe_layer_find(cfg->header,cfg->caches,cfg->key_masks,key,len);
+  return oe_key_lookup(cfg->key_masks,key,len,index_probe,cfg->layer_index);
+}
+
+static apr_status_t matcher_cleanup(void *data)
+{
+  oe_matcher_free((oe_matcher *)data);
+  return APR_SUCCESS;
+}
+
+// Puts the patterns of the fallback caches in one matcher, which finds the highest numbered
+// cache matching a request in a single pass.  Caches with a pattern it can't handle are still
+// matched by regexp
+static void matcher_build(server_rec *server, wms_cfg *cfg)
+{
+  int *fallback=(int *)cfg->fallback->elts;
+  int i,k,matched=0;
+
+  if (cfg->pattern_memory<=0 || !cfg->fallback->nelts) return;
+  if (!(cfg->matcher=oe_matcher_create((apr_size_t)cfg->pattern_memory*1024*1024))) return;
+  for (i=0;i<cfg->fallback->nelts;i++) {
+    WMSCache *cache=GETCACHE(cfg->caches,fallback[i]);
+    char *pattern=GETSTRING(cfg->caches,cache->pattern);
+    cfg->meta[fallback[i]].matched=1;
+    for (k=0;k<cache->num_patterns;k++,pattern+=strlen(pattern)+1)
+      if (!oe_matcher_add(cfg->matcher,pattern,fallback[i])) {
+        ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server,
+          "Pattern %s is matched by regexp",pattern);
+        cfg->meta[fallback[i]].matched=0;
+      }
+    matched+=cfg->meta[fallback[i]].matched;
+  }
+
+  if (!oe_matcher_compile(cfg->matcher)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,"Can't build the pattern matcher");
+    matched=0;
+  }
+  if (!matched) { // Not worth it
+    oe_matcher_free(cfg->matcher);
+    cfg->matcher=0;
+    for (i=0;i<cfg->fallback->nelts;i++) cfg->meta[fallback[i]].matched=0;
+    return;
+  }
+  apr_pool_cleanup_register(cfg->p,cfg->matcher,matcher_cleanup,apr_pool_cleanup_null);
+  ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server,
+    "%d of %d regexp matched caches are in the pattern matcher",matched,cfg->fallback->nelts);
+}
+
+static int match_cache(wms_cfg *cfg, int count, const char *args)
+{
+  WMSCache *cache=GETCACHE(cfg->caches,count);
+  int i=cache->num_patterns;
+  if (!cfg->meta[count].regex) return 0; // Hashed caches of a version 2 configuration
+  while (i--)
+    if (cfg->meta[count].regex[i] && !ap_regexec(cfg->meta[count].regex[i],args,0,NULL,0))
+      return 1;
+  return 0;
+}
+
+// Find the cache for the argument string, returns -1 if none matches
+// When more than one cache matches, the highest numbered one is used
+// The WMTS field values can be passed in v, if the caller has them already.  With v and
+// no argument string, returns -2 if a cache has to be matched by regexp
+static int find_cache(wms_cfg *cfg, const char *args, const wms_str *v)
+{
+  int count=-1;
+  int i;
+  int *fallback=(int *)cfg->fallback->elts;
+  wms_str split[WMTS_NFIELDS];
+
+  if (!v) {
+    const char *s=ap_strstr_c(args,wmts_prefix);
+    if (s && wmts_split(s,split)) v=split;
+  }
+
+  if (v && is_digits(&v[WF_MATRIX]) && is_digits(&v[WF_ROW]) && is_digits(&v[WF_COL])) {
+    char key[1024];
+    int len=wmts_key(key,sizeof(key),v,&v[WF_STYLE]);
+    if (len<0) { // Too long for the index, check every cache
+      if (!args) return -2;
+      for (count=cfg->caches->count-1;count>=0;count--)
+        if (match_cache(cfg,count,args)) break;
+      return count;
+    }
+    count=layer_lookup(cfg,key,len);
+  }
+
+  // Only caches numbered above the indexed one can take precedence
+  if (cfg->matcher && cfg->fallback->nelts && fallback[0]>count) {
+    int m;
+    if (!args) return -2;
+    // -2 if the matcher is out of memory, then the loop below does it
+    if (-2!=(m=oe_matcher_max(cfg->matcher,args,strlen(args)))) {
+      if (m>count) count=m;
+      // Caches with patterns the matcher doesn't handle
+      for (i=0;i<cfg->fallback->nelts && fallback[i]>count;i++)
+        if (!cfg->meta[fallback[i]].matched && match_cache(cfg,fallback[i],args)) return fallback[i];
+      return count;
+    }
+  }
+  for (i=0;i<cfg->fallback->nelts && fallback[i]>count;i++) {
+    if (!args) return -2;
+    if (match_cache(cfg,fallback[i],args)) return fallback[i];
+  }
+  return count;
+}
+
+// File name field from the configuration.  Relative names are in the cache directory,
+// absolute ones, which version 2 has, are used in place
+static char *cache_fname(apr_pool_t *p, wms_cfg *cfg, char *name)
+{
+  name=GETSTRING(cfg->caches,name);
+  return ('/'==*name)?name:apr_pstrcat(p,cfg->cachedir,name,NULL);
+}
+
+// The index or data file name of a level, parsed when the configuration was loaded
+static const oe_fname *level_fname(wms_cfg *cfg, int count, const WMSlevel *level, int data)
+{
+  return cfg->meta[count].fnames+2*(level-GETLEVELS(GETCACHE(cfg->caches,count)))+data;
+}
+
 // This module
 module AP_MODULE_DECLARE_DATA onearth_module;
 
@@ -150,427 +461,873 @@ static const char get_interval_char(apr_pool_t *p, const char *period_string )
     return interval_string[strlen(interval_string) - 1];
 }
 
-// Evaluate the time period for days or seconds
-static int evaluate_period(char *time_period)
+// Parses the time periods of a cache, num_periods strings one after the other
+static void compile_periods(apr_pool_t *pool, wms_periods *wp, char *time_period, int num_periods)
 {
-	int period = 1;
-	if (strlen(time_period) > 43) {
-		if (time_period[43] == 'T') {
-			period = apr_atoi64(time_period+44);
-		}
-	} else {
-		if (time_period[22] == 'P') {
-			period = apr_atoi64(time_period+23);
-		}
-	}
-	return period;
+	wp->p = (oe_period *)apr_pcalloc(pool, (num_periods + 1) * sizeof(oe_period));
+	wp->by_start = (int *)apr_pcalloc(pool, (num_periods + 1) * sizeof(int));
+	wp->reach = (long long *)apr_pcalloc(pool, (num_periods + 1) * sizeof(long long));
+	oe_periods_parse(wp, time_period, num_periods);
 }
 
-static apr_time_t get_pre_1970_epoch(apr_time_exp_t date)
-{
-	struct tm t;
-	t.tm_year = date.tm_year;
-	t.tm_mon = date.tm_mon;
-	t.tm_mday = date.tm_mday;
-	t.tm_hour = date.tm_hour;
-	t.tm_min = date.tm_min;
-	t.tm_sec = date.tm_sec;
-	apr_time_t epoch = (apr_time_t)timegm(&t) * 1000 * 1000;
-	return epoch;
-}
+//
+// Open file descriptor cache, one per child process, shared by all threads
+// Keyed on the resolved file name, after the time stamp substitution
+// The least recently used descriptor is closed when the cache is full
+// The file identity is checked every fd_cache_check seconds, so files replaced
+// by ingest are picked up without a restart
+//
 
-static apr_time_t add_date_interval(apr_time_t start_epoch, long interval, char *units) {
-	apr_time_exp_t date = {0};
-	// Convert start date to apr_time_exp_t
-	apr_time_exp_gmt(&date, start_epoch);
-	int i;
-	if(apr_strnatcmp(units, "months") == 0) {
-		for(i=0; i<interval; i++) {
-			date.tm_mon++;
-			if(date.tm_mon == 12) {
-				date.tm_mon = 0;
-				date.tm_year++;
-			}
-		}
+typedef struct fd_entry {
+  char *fname;  // Resolved file name and hash key, malloc'ed
+  int fd;
+  dev_t dev;    // Identity of the file when it was opened
+  ino_t ino;
+  time_t mtime;
+  long nsec;          // Nanoseconds of the mtime, files rewritten in place within a second differ
+  apr_off_t size;     // File size when it was opened
+  apr_time_t checked; // Last time the identity was verified
+  int refs;     // Number of readers using the descriptor
+  int stale;    // No longer in the cache, close when the last reader is done
+  char *occ;    // Occupancy map of an index file, if there is one
+  apr_size_t occ_size;
+  struct fd_entry *prev,*next; // LRU list, the head is the most recently used
+} fd_entry;
+
+static struct {
+  apr_thread_mutex_t *mutex;
+  apr_hash_t *hash;
+  fd_entry *head,*tail;
+  int count;
+} fd_cache;
 
-	} else if (apr_strnatcmp(units, "years") == 0) {
-		// Add one interval
-		date.tm_year += (interval);
-	}
-	// Convert it back to epoch form
-	if (date.tm_year < 70) return get_pre_1970_epoch(date);
-	apr_time_exp_get(&start_epoch, &date);
-	return start_epoch;		
+static int fd_cache_size=256;   // Max number of open descriptors, 0 disables the cache
+static int fd_cache_check=1;    // Seconds between file identity checks
 
+static void fd_entry_free(fd_entry *e)
+{
+  if (e->occ) munmap(e->occ,e->occ_size);
+  if (e->fd>=0) close(e->fd);
+  free(e->fname);
+  free(e);
 }
 
-static apr_time_t parse_date_string(char *string)
-// This function parses a date string into a UNIX time int (microseconds since 1970)
+// Take an entry out of the cache, needs the lock
+static void fd_cache_unlink(fd_entry *e)
 {
-	// First we parse the date into a apr_time_exp_t struct.
-	apr_time_exp_t date = {0};
-	date.tm_year = apr_atoi64(string) - 1900; // tm_year is years since 1900
+  apr_hash_set(fd_cache.hash,e->fname,APR_HASH_KEY_STRING,NULL);
+  if (e->prev) e->prev->next=e->next; else fd_cache.head=e->next;
+  if (e->next) e->next->prev=e->prev; else fd_cache.tail=e->prev;
+  e->prev=e->next=0;
+  fd_cache.count--;
+  if (e->refs) e->stale=1;
+  else fd_entry_free(e);
+}
 
-	// Push the pointer forward
-	string += 5;
-	date.tm_mon = apr_atoi64(string) - 1; // tm_mon is zero-indexed
-	string += 3;
-	date.tm_mday = apr_atoi64(string);
-	string += 2;
+// Move an entry to the head of the LRU list, needs the lock
+static void fd_cache_touch(fd_entry *e)
+{
+  if (fd_cache.head==e) return;
+  e->prev->next=e->next;
+  if (e->next) e->next->prev=e->prev; else fd_cache.tail=e->prev;
+  e->prev=0;
+  e->next=fd_cache.head;
+  fd_cache.head->prev=e;
+  fd_cache.head=e;
+}
 
-	// Check if we have a time value in this string
-	if (string[0] == 'T')
-	{
-		string++;
-		date.tm_hour = apr_atoi64(string);
-		string += 3;
-		date.tm_min = apr_atoi64(string);
-		string += 3;
-		date.tm_sec = apr_atoi64(string);
-	}
+// Maps the occupancy map of an index file, if there is a valid one made from this version of
+// the index, same size and modification time.  Only names ending in .idx have one, the map
+// is the same name with .idm
+static char *idm_map(const char *fname, const struct stat *ist, apr_size_t *size)
+{
+  int len=strlen(fname);
+  char mname[len+1];
+  struct stat st;
+  idm_header *hd;
+  idm_chunk *c;
+  char *map;
+  int f,i;
+
+  if (len<4 || strcmp(fname+len-4,".idx")) return 0;
+  strcpy(mname,fname);
+  strcpy(mname+len-4,".idm");
+
+  if (0>(f=open(mname,O_RDONLY))) return 0;
+  if (fstat(f,&st) || st.st_size<sizeof(idm_header)) {
+    close(f);
+    return 0;
+  }
+  map=(char *)mmap(0,st.st_size,PROT_READ,MAP_SHARED,f,0);
+  close(f);
+  if (MAP_FAILED==map) return 0;
+
+  // Check it once, so the lookups don't have to
+  hd=(idm_header *)map;
+  c=(idm_chunk *)(hd+1);
+  if (memcmp(hd->magic,IDM_MAGIC,4) || hd->index_size!=ist->st_size
+    || hd->index_mtime!=ist->st_mtim.tv_sec || hd->index_nsec!=ist->st_mtim.tv_nsec
+    || hd->records<0 || hd->chunks<0
+    || hd->chunks!=(hd->records+IDM_CHUNK-1)/IDM_CHUNK
+    || sizeof(idm_header)+(apr_size_t)hd->chunks*sizeof(idm_chunk)>st.st_size) {
+    munmap(map,st.st_size);
+    return 0;
+  }
+  for (i=0;i<hd->chunks;i++) {
+    apr_off_t end=c[i].offset;
+    if (IDM_ARRAY==c[i].type)
+      end+=(apr_off_t)c[i].count*sizeof(unsigned short);
+    else if (IDM_BITMAP==c[i].type)
+      end+=IDM_CHUNK/8;
+    else if (IDM_EMPTY!=c[i].type && IDM_FULL!=c[i].type)
+      end=-1;
+    if (end<0 || end>st.st_size || c[i].offset<0 || c[i].offset%sizeof(unsigned short)
+      || c[i].count<0 || (IDM_ARRAY==c[i].type && c[i].count>IDM_ARRAY_MAX)) {
+      munmap(map,st.st_size);
+      return 0;
+    }
+  }
+  *size=st.st_size;
+  return map;
+}
 
-	// The Apache time struct doesn't support dates before Jan 01, 1970, so we use the normal UNIX date stuff
-	// to get a negative epoch for those cases.
-	if (date.tm_year < 70) return get_pre_1970_epoch(date);
+// Is the index record at location known to be empty?  0 if not, or if there is no map
+static int idm_empty(const fd_entry *fe, apr_off_t location)
+{
+  const idm_header *hd=(const idm_header *)fe->occ;
+  const idm_chunk *c;
+  const unsigned short *set;
+  apr_off_t rec;
+  unsigned int low;
+  int lo,hi;
+
+  if (!hd || location%sizeof(index_s)) return 0;
+  rec=location/sizeof(index_s);
+  if (rec<0 || rec>=hd->records) return 0;
+  c=(const idm_chunk *)(hd+1)+rec/IDM_CHUNK;
+  low=rec%IDM_CHUNK;
+  switch (c->type) {
+  case IDM_EMPTY:
+    return 1;
+  case IDM_BITMAP:
+    return !(((unsigned char)fe->occ[c->offset+low/8]>>(low%8))&1);
+  case IDM_ARRAY:
+    set=(const unsigned short *)(fe->occ+c->offset);
+    lo=0;
+    hi=c->count-1;
+    while (lo<=hi) {
+      int mid=(lo+hi)/2;
+      if (set[mid]==low) return 0;
+      if (set[mid]<low) lo=mid+1; else hi=mid-1;
+    }
+    return 1;
+  }
+  return 0;
+}
 
-	// Now convert the string into UNIX time and return it
-	apr_time_t epoch = 0;
-	apr_time_exp_get(&epoch, &date);
-	return epoch;
+// Is st the file the entry was opened on, unchanged?  A file rewritten in place keeps its inode,
+// the mtime nanoseconds and the size tell, and its occupancy map has to be made again
+static int fd_same(const fd_entry *e, const struct stat *st)
+{
+  return st->st_ino==e->ino && st->st_dev==e->dev && st->st_mtime==e->mtime
+    && st->st_mtim.tv_nsec==e->nsec && st->st_size==e->size;
 }
 
-// single shot, open fname file, read nbytes from location, close file.
-// Allocates memory form request pool, returns a pointer to the buffer
-static void *p_file_pread(apr_pool_t *p, char *fname, 
-                          apr_size_t nbytes, apr_off_t location)
+// Release a descriptor obtained from fd_open
+static void fd_release(fd_entry *e)
+{
+  if (!e) return;
+  if (!fd_cache.mutex) { // Not cached
+    fd_entry_free(e);
+    return;
+  }
+  apr_thread_mutex_lock(fd_cache.mutex);
+  if (!--e->refs && e->stale) fd_entry_free(e);
+  apr_thread_mutex_unlock(fd_cache.mutex);
+}
+
+// Returns an entry holding an open read only descriptor for fname, or 0 if the file can't be opened
+// The caller has to call fd_release when done
+static fd_entry *fd_open(const char *fname)
 {
+  struct stat st;
+  fd_entry *e;
+  apr_time_t now;
+  char *occ;
+  apr_size_t occ_size=0;
   int fd;
 
-  void *buffer;
-  apr_size_t readbytes;
+  if (!fd_cache.mutex) { // No cache in this process, single use entry
+    if (0>(fd=open(fname,O_RDONLY))) return 0;
+    e=(fd_entry *)calloc(1,sizeof(fd_entry));
+    e->fd=fd;
+    if (!fstat(fd,&st)) {
+      e->dev=st.st_dev;
+      e->ino=st.st_ino;
+      e->mtime=st.st_mtime;
+      e->nsec=st.st_mtim.tv_nsec;
+      e->size=st.st_size;
+      e->occ=idm_map(fname,&st,&e->occ_size);
+    }
+    e->fname=strdup(fname);
+    e->refs=1;
+    e->stale=1;
+    return e;
+  }
 
-  if (!(buffer=apr_pcalloc(p,nbytes))) return 0;
-  if (0>(fd=open(fname,O_RDONLY))) return 0;
+  now=apr_time_now();
+  apr_thread_mutex_lock(fd_cache.mutex);
+  if ((e=(fd_entry *)apr_hash_get(fd_cache.hash,fname,APR_HASH_KEY_STRING))) {
+    e->refs++;
+    fd_cache_touch(e);
+    if (now-e->checked<apr_time_from_sec(fd_cache_check)) {
+      apr_thread_mutex_unlock(fd_cache.mutex);
+      return e;
+    }
+    apr_thread_mutex_unlock(fd_cache.mutex);
+
+    // Check that the name still points to the same file, unchanged
+    if (!stat(fname,&st) && fd_same(e,&st)) {
+      apr_thread_mutex_lock(fd_cache.mutex);
+      e->checked=now;
+      apr_thread_mutex_unlock(fd_cache.mutex);
+      return e;
+    }
 
-  readbytes=pread64(fd,buffer,nbytes,location);
-  close(fd);
+    // File was replaced, changed or removed, drop the old descriptor and occupancy map
+    apr_thread_mutex_lock(fd_cache.mutex);
+    if (!e->stale) fd_cache_unlink(e);
+    if (!--e->refs && e->stale) fd_entry_free(e);
+    apr_thread_mutex_unlock(fd_cache.mutex);
+  } else
+    apr_thread_mutex_unlock(fd_cache.mutex);
 
-  return (readbytes==nbytes)?buffer:0;
+  // Not in the cache, open it outside of the lock
+  if (0>(fd=open(fname,O_RDONLY))) return 0;
+  if (fstat(fd,&st)) {
+    close(fd);
+    return 0;
+  }
+  occ=idm_map(fname,&st,&occ_size);
+
+  apr_thread_mutex_lock(fd_cache.mutex);
+  // Another thread might have opened the same file in the meantime
+  if ((e=(fd_entry *)apr_hash_get(fd_cache.hash,fname,APR_HASH_KEY_STRING)) && fd_same(e,&st)) {
+    e->refs++;
+    fd_cache_touch(e);
+    apr_thread_mutex_unlock(fd_cache.mutex);
+    if (occ) munmap(occ,occ_size);
+    close(fd);
+    return e;
+  }
+  if (e) fd_cache_unlink(e);
+
+  e=(fd_entry *)calloc(1,sizeof(fd_entry));
+  e->fname=strdup(fname);
+  e->fd=fd;
+  e->occ=occ;
+  e->occ_size=occ_size;
+  e->dev=st.st_dev;
+  e->ino=st.st_ino;
+  e->mtime=st.st_mtime;
+  e->nsec=st.st_mtim.tv_nsec;
+  e->size=st.st_size;
+  e->checked=now;
+  e->refs=1;
+  e->next=fd_cache.head;
+  if (fd_cache.head) fd_cache.head->prev=e; else fd_cache.tail=e;
+  fd_cache.head=e;
+  fd_cache.count++;
+  apr_hash_set(fd_cache.hash,e->fname,APR_HASH_KEY_STRING,e);
+
+  // Evict the least recently used, descriptors in use get closed on release
+  while (fd_cache.count>fd_cache_size && fd_cache.tail!=e)
+    fd_cache_unlink(fd_cache.tail);
+
+  apr_thread_mutex_unlock(fd_cache.mutex);
+  return e;
 }
 
-// Get the filename with timestamp
-char *tstamp_fname(request_rec *r,char *fname)
-{
-  static char* timearg="time=";
-  static char* tstamp="TTTTTTT_";
-  char *targ;
-
-  if ((targ=ap_strcasestr(r->args,timearg))&&ap_strstr(fname,tstamp)) { 
-    // This part is not apr compatible, since mktime is not available easily
-    int year=0,month=0,day=0;
-    char *fn=apr_pstrdup(r->pool,fname);
-    char *fnloc=ap_strstr(fn,tstamp);
-    // Get a new place
-    char old_char=*(fnloc+7);
-    char *yearloc=0;
-
-    targ+=5; // Skip the time= part
-    year=apr_atoi64(targ);
-    targ+=5; // Skip the YYYY- part
-    month=apr_atoi64(targ);
-    targ+=3; // Due to UV bug
-    if ('-'==*targ) targ++;
-    day=apr_atoi64(targ);
-
-    if ((year>0)&&(month>0)&&(day>0)) { // We do have a time stamp
-      int leap=(year%4)?0:((year%400)?((year%100)?1:0):1);
-      sprintf(fnloc,"%04d%03d",year,day+moffset[month-1]+((month>2)?leap:0));
-      *(fnloc+7)=old_char; // We have to put this character back
-
-	  // Name change for Year
-	  if ((yearloc=ap_strstr(fn,"YYYY"))) {
-		  old_char=*(yearloc+4);
-		  sprintf(yearloc,"%04d",year); // replace YYYY with actual year
-		  *(yearloc+4)=old_char;
-	  }
-    }
-    return fn;
-  } 
-  return fname;
+// Does the file reach to end?  Checks again if the file grew since it was opened
+static int fd_covers(fd_entry *e, apr_off_t end)
+{
+  struct stat st;
+  if (end<=e->size) return 1;
+  return !fstat(e->fd,&st) && end<=st.st_size;
+}
+
+static apr_status_t fd_cache_cleanup(void *data)
+{
+  while (fd_cache.head) fd_cache_unlink(fd_cache.head);
+  fd_cache.mutex=0;
+  return APR_SUCCESS;
 }
 
-// Same, but uses a request, and does the time stamp part
+//
+// Single flight, one table per child process, shared by all threads, with a lock for each
+// group of buckets so unrelated reads don't wait on each other
+// Requests that need the same read or lookup at the same time wait for the first one to do it
+// and use its result, so a tile that everybody asks for at once is read once per process.
+// A flight is keyed on a file identity and either a range of the file or a name, and it is
+// only in the table while the first request works, the ones that come later start a new one
+//
+
+#define FLIGHT_BUCKETS 256
+#define FLIGHT_LOCKS 16 // Each lock covers the buckets with the same number modulo FLIGHT_LOCKS
+#define FLIGHT_FREE 8   // Flights kept for reuse under each lock
+
+typedef struct flight {
+  dev_t dev;           // Key
+  ino_t ino;
+  time_t mtime;
+  apr_off_t offset;
+  apr_size_t len;
+  char *name;          // malloc'ed, 0 for file ranges
+  apr_uint32_t hash;
+  struct flight *chain;
+  int refs;            // The leader, the waiters and the requests still using the result
+  int done;
+  int status;          // Result, set by the leader
+  void *data;          // malloc'ed, freed with the flight
+} flight;
 
-static void *r_file_pread(request_rec *r, char *fname, 
-                          apr_size_t nbytes, apr_off_t location, char *time_period, int num_periods, int zlevels)
+typedef struct {
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond; // Waiters for the flights under this lock
+  flight *free;            // Landed and released flights, chained, so most flights don't malloc
+  int nfree;
+} flight_lock;
+
+static struct {
+  flight_lock locks[FLIGHT_LOCKS];
+  flight *buckets[FLIGHT_BUCKETS];
+  volatile apr_uint32_t flights,joined; // Totals for the process
+  int on;
+} flights;
+
+static int flight_on=1; // Set by WMSCoalesce
+
+static apr_uint32_t flight_hash(dev_t dev, ino_t ino, time_t mtime, apr_off_t offset, const char *name)
 {
-  int fd;
-  int leap=0;
-  int hastime=0;
-  static char* timearg="time=";
-  static char* tstamp="TTTTTTT_";
-  static char* year="YYYY";
-  char *targ=0,*fnloc=0,*yearloc=0;
-  apr_time_exp_t tm = {0};
+  apr_uint64_t h=(((apr_uint64_t)ino*31+dev)*31+mtime)*31+offset;
+  if (name) h=h*31+cache_key_hash(name,strlen(name));
+  h*=0x9E3779B97F4A7C15ULL;
+  return (apr_uint32_t)(h>>32);
+}
 
-  void *buffer;
-  apr_size_t readbytes;
+// Joins the flight for the key, or starts one if there is none
+// The leader does the work and calls flight_land, the others return once it landed
+// Everybody calls flight_release when done with the result.  Returns 0 if flights are off
+static flight *flight_join(dev_t dev, ino_t ino, time_t mtime, apr_off_t offset, apr_size_t len,
+                           const char *name, int *leader)
+{
+  apr_uint32_t h;
+  flight_lock *l;
+  flight *f;
+
+  if (!flights.on) return 0;
+  h=flight_hash(dev,ino,mtime,offset,name);
+  l=flights.locks+h%FLIGHT_LOCKS;
+  apr_thread_mutex_lock(l->mutex);
+  for (f=flights.buckets[h%FLIGHT_BUCKETS];f;f=f->chain)
+    if (f->hash==h && f->offset==offset && f->len==len && f->ino==ino && f->dev==dev
+      && f->mtime==mtime && (name?f->name && !strcmp(f->name,name):!f->name))
+      break;
 
-//  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"r_file_pread file %s size %ld at %ld",fname,nbytes,location);
+  if (f) {
+    f->refs++;
+    apr_atomic_inc32(&flights.joined);
+    *leader=0;
+    while (!f->done)
+      apr_thread_cond_wait(l->cond,l->mutex);
+    apr_thread_mutex_unlock(l->mutex);
+    return f;
+  }
 
-  // Duplicate the file name, in case we need to change it
-  char *fn=apr_pstrdup(r->pool,fname);
-  if (!(buffer=apr_pcalloc(r->pool,nbytes))) {
-    ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
-      "Can't get memory for pread");
+  if ((f=l->free)) {
+    l->free=f->chain;
+    l->nfree--;
+    memset(f,0,sizeof(flight));
+  } else if (!(f=(flight *)calloc(1,sizeof(flight)))) {
+    apr_thread_mutex_unlock(l->mutex);
+    return 0;
+  }
+  if (name && !(f->name=strdup(name))) {
+    apr_thread_mutex_unlock(l->mutex);
+    free(f);
     return 0;
   }
+  f->dev=dev;
+  f->ino=ino;
+  f->mtime=mtime;
+  f->offset=offset;
+  f->len=len;
+  f->hash=h;
+  f->refs=1;
+  f->chain=flights.buckets[h%FLIGHT_BUCKETS];
+  flights.buckets[h%FLIGHT_BUCKETS]=f;
+  *leader=1;
+  apr_thread_mutex_unlock(l->mutex);
+  apr_atomic_inc32(&flights.flights);
+  return f;
+}
 
-  // Hook and name change for time variant file names
-  if ((targ=ap_strcasestr(r->args,timearg))&&(fnloc=ap_strstr(fn,tstamp))) { 
-    // This part is not apr compatible, since mktime is not available easily
-//    apr_time_exp_t tm;
-    char old_char=*(fnloc+7);
-    targ+=5; // Skip the time= part    
+// Called by the leader, publishes the result and wakes up the waiters
+static void flight_land(flight *f, int status, void *data)
+{
+  flight_lock *l=flights.locks+f->hash%FLIGHT_LOCKS;
+  flight **b;
+
+  apr_thread_mutex_lock(l->mutex);
+  for (b=flights.buckets+f->hash%FLIGHT_BUCKETS;*b!=f;b=&(*b)->chain);
+  *b=f->chain;
+  f->status=status;
+  f->data=data;
+  f->done=1;
+  if (f->refs>1)
+    apr_thread_cond_broadcast(l->cond);
+  apr_thread_mutex_unlock(l->mutex);
+}
 
-    // Treat "DEFAULT" time parameter same as empty
-    if (apr_strnatcasecmp(targ,"default")==0) {
-    	targ[0] = 0;
-    }
+static void flight_release(flight *f)
+{
+  flight_lock *l=flights.locks+f->hash%FLIGHT_LOCKS;
 
-    if (strlen(targ)==24 || strlen(targ)==10 || strlen(targ)==0) { // Make sure time is in correct length
-		tm.tm_year=apr_atoi64(targ);
-		targ+=5; // Skip the YYYY- part
-		tm.tm_mon=apr_atoi64(targ);
-		targ+=3; // Skip the MM- part
-		tm.tm_mday=apr_atoi64(targ);
-		if (strlen(targ)==16 && zlevels==0 && ap_strstr(fn,"TTTTTTTTTTTTT_") != 0) {
-			hastime=1;
-			targ+=3;
-			tm.tm_hour = apr_atoi64(targ);
-			targ+=5;
-			tm.tm_min = apr_atoi64(targ);
-			targ+=5;
-			tm.tm_sec = apr_atoi64(targ);
-		}
-    } else {
-    	ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Request: %s",r->args);
-    	ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Invalid time format: %s",targ);
-		wmts_add_error(r,400,"InvalidParameterValue","TIME", "Invalid time format, must be YYYY-MM-DD or YYYY-MM-DDThh:mm:ssZ");
-    	return 0;
-    }
-	if ((tm.tm_year>0)&&(tm.tm_year<9999)&&(tm.tm_mon>0)&&(tm.tm_mon<13)&&(tm.tm_mday>0)&&(tm.tm_mday<32)) { // We do have a time stamp
-	  leap=(tm.tm_year%4)?0:((tm.tm_year%400)?((tm.tm_year%100)?1:0):1);
-	  tm.tm_yday=tm.tm_mday+moffset[tm.tm_mon-1]+((tm.tm_mon>2)?leap:0);
-
-	  if (hastime==1) {
-		  fnloc-=6;
-//		  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"time is %04d-%02d-%02dT%02d:%02d:%02d", tm.tm_year, tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-		  sprintf(fnloc,"%04d%03d%02d%02d%02d",tm.tm_year,tm.tm_yday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-		  *(fnloc+13)=old_char;
-	  } else {
-		  sprintf(fnloc,"%04d%03d",tm.tm_year,tm.tm_yday);
-		  *(fnloc+7)=old_char;
-	  }
+  apr_thread_mutex_lock(l->mutex);
+  if (--f->refs) {
+    apr_thread_mutex_unlock(l->mutex);
+    return;
+  }
+  free(f->data);
+  free(f->name);
+  if (l->nfree<FLIGHT_FREE) {
+    f->chain=l->free;
+    l->free=f;
+    l->nfree++;
+    f=0;
+  }
+  apr_thread_mutex_unlock(l->mutex);
+  free(f);
+}
 
-	  // Name change for Year
-	  if ((yearloc=ap_strstr(fn,year))) {
-		  old_char=*(yearloc+4);
-		  sprintf(yearloc,"%04d",tm.tm_year); // replace YYYY with actual year
-		  *(yearloc+4)=old_char;
-	  }
-	} else if (tm.tm_year>0) { // Needs to know if there is at least a time value somehow
-    	ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Invalid time format");
-		wmts_add_error(r,400,"InvalidParameterValue","TIME", "Invalid time format, must be YYYY-MM-DD or YYYY-MM-DDThh:mm:ssZ");
-    	return 0;
+static apr_status_t flight_release_cleanup(void *data)
+{
+  flight_release((flight *)data);
+  return APR_SUCCESS;
+}
+
+static apr_status_t flight_cleanup(void *data)
+{
+  flights.on=0;
+  return APR_SUCCESS;
+}
+
+static void flight_init(apr_pool_t *p, server_rec *s)
+{
+  int i;
+
+  if (!flight_on) return;
+  memset(&flights,0,sizeof(flights));
+  for (i=0;i<FLIGHT_LOCKS;i++)
+    if (APR_SUCCESS!=apr_thread_cond_create(&flights.locks[i].cond,p)
+      || APR_SUCCESS!=apr_thread_mutex_create(&flights.locks[i].mutex,APR_THREAD_MUTEX_DEFAULT,p)) {
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"Can't create request coalescing locks, coalescing disabled");
+      return;
     }
+  flights.on=1;
+  apr_pool_cleanup_register(p,0,flight_cleanup,apr_pool_cleanup_null);
+}
+
+//
+// Dates present on disk, for time stamped file names
+// Built by scanning the directories the first time a dated file is missing, so snapping
+// can skip the dates that don't exist instead of trying to open them.  The directories are
+// checked for changes every fd_cache_check seconds, same as the open files
+//
+
+typedef struct {
+  int dirlen;           // Length of the directory part, with the last slash
+  int year;             // Position of a YYYY directory, -1 if none
+  int run,runlen;       // Position and length of the time stamp, in the file name part
+  apr_int64_t *keys;    // Time stamps found, sorted, malloc'ed
+  int count;
+  time_t *mtimes;       // Modification times of the scanned directories
+  int *years;           // Year of each directory, the first one is the parent of the years
+  int ndirs;
+  apr_time_t checked;
+} avail_entry;
+
+static struct {
+  apr_thread_mutex_t *mutex;
+  apr_hash_t *hash;     // Keyed on the file name template
+} avail;
+
+static int cmp_int64(const void *a, const void *b)
+{
+  apr_int64_t x=*(const apr_int64_t *)a, y=*(const apr_int64_t *)b;
+  return x<y?-1:(x>y);
+}
+
+// Parses the digits of a time stamp, returns -1 if they aren't all digits
+static apr_int64_t avail_key(const char *s, int len)
+{
+  apr_int64_t key=0;
+  while (len--) {
+    if (!apr_isdigit(*s)) return -1;
+    key=key*10+(*s++-'0');
   }
+  return key;
+}
 
-  // Check if redirected from Mapserver for time snapping
-  char *layer = 0;
-  char *layers = 0;
-  char *prev_time = 0;
-  char *new_uri = 0;
-  int max_size = 0;
-  if (r->prev != 0) {
-  			if (r->prev->args && ap_strstr(r->prev->args, "&MAP=") != 0) {
-				layer = (char *) apr_table_get(r->prev->notes, "oems_clayer");
-				layers = (char *) apr_table_get(r->prev->notes, "oems_layers");
-				prev_time = (char *) apr_table_get(r->prev->notes, "oems_time");
-				max_size = strlen(r->prev->uri) + strlen(r->prev->args) + strlen(prev_time);
-				new_uri = (char*) apr_pcalloc(r->pool, max_size);
-				// Set notes for next request
-				if (prev_time != 0) {
-					apr_table_setn(r->notes, "oems_time", prev_time);
-				}
-				if (layer != 0) {
-					apr_table_setn(r->notes, "oems_clayer", layer);
-				}
-				if (layers != 0) {
-					apr_table_setn(r->notes, "oems_layers", layers);
-				}
-  			}
+// Sets up the entry for a template, returns 0 if the template can't be indexed
+static int avail_parse(const char *tmpl, avail_entry *e)
+{
+  const char *slash=strrchr(tmpl,'/');
+  const char *ts=ap_strstr_c(tmpl,"TTTTTTT_");
+  const char *yy=ap_strstr_c(tmpl,"YYYY");
+  const char *start;
+
+  if (!slash || !ts || ts<slash) return 0;
+  e->dirlen=slash-tmpl+1;
+  for (start=ts;start>tmpl+e->dirlen && 'T'==start[-1];start--);
+  e->run=start-tmpl;
+  e->runlen=ts+7-start;
+  if (e->runlen!=7 && e->runlen!=13) return 0;
+
+  // YYYY, if present, has to be a whole directory name, and the only one
+  e->year=-1;
+  if (yy) {
+    if (yy>slash || yy==tmpl || '/'!=yy[-1] || '/'!=yy[4] || ap_strstr_c(yy+4,"YYYY")) return 0;
+    e->year=yy-tmpl;
   }
+  return 1;
+}
 
-  // check if layer has multi-day period if file not found
-  if (0>(fd=open(fn,O_RDONLY))) 
-  {
-	  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"%s is not available",fn);
-	  if (!fnloc) {
-		  close(fd);
-		  return 0;
-	  }
-	  else {
-    		
-		  if (sizeof(time_period) > 0) {
-			// Fix request time (apache expects to see years since 1900 and zero-indexed months)
-			tm.tm_year -= 1900;
-			tm.tm_mon -= 1;
-		  	int i;
-   		    for (i=0;i<num_periods;i++) {
-	   		    ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Evaluating time period %s", time_period);
-	   		    if (!ap_strstr(time_period,"P")) {
-	   		    	ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"No duration detected in %s", time_period);
-	   		    	continue;
-	   		    }
-			  	long interval = evaluate_period(time_period);
-
-			  	// START OF DATE SNAPPING ROUTINE 
-			  	// First, parse the period start and end time strings, as well as the request.
-			  	// We're going to parse them into UNIX time integers (microseconds since 1970) for ease of working with them
-			  	apr_time_t start_epoch = parse_date_string(time_period);
-			  	if (time_period[10] == 'T') {
-			  		time_period += 21;
-			  	} else {
-			  		time_period += 11;
-			  	}
-			  	apr_time_t end_epoch = parse_date_string(time_period);
-			  	apr_time_t req_epoch;
-
-			  	// Can't use the Apache time struct for pre-1970 dates
-			  	if (tm.tm_year < 70) {
-			  		req_epoch = get_pre_1970_epoch(tm);
-			  	} else {
-					apr_time_exp_get(&req_epoch, &tm);
-			  	}
+// Adds the time stamps of the matching files in one directory
+static void avail_scan_dir(const char *tmpl, avail_entry *e, const char *dir, const char *year,
+  apr_int64_t **keys, int *count, int *size)
+{
+  const char *prefix=tmpl+e->dirlen;
+  int plen=e->run-e->dirlen;
+  const char *suffix=tmpl+e->run+e->runlen;
+  int slen=strlen(suffix);
+  struct dirent *de;
+  DIR *d;
+
+  if (!(d=opendir(dir))) return;
+  while ((de=readdir(d))) {
+    apr_int64_t key;
+    if (strlen(de->d_name)!=plen+e->runlen+slen || strncmp(de->d_name,prefix,plen)
+      || strcmp(de->d_name+plen+e->runlen,suffix)) continue;
+    if (0>(key=avail_key(de->d_name+plen,e->runlen))) continue;
+    // The year directory has to match the time stamp
+    if (year && strncmp(year,de->d_name+plen,4)) continue;
+    if (*count==*size) {
+      *size=*size?*size*2:256;
+      *keys=(apr_int64_t *)realloc(*keys,*size*sizeof(apr_int64_t));
+    }
+    (*keys)[(*count)++]=key;
+  }
+  closedir(d);
+}
 
-			  	// First, check if the request date is earlier than the start date of the period. (we don't snap forward)
-			  	if (req_epoch < start_epoch) {
-			  		// Move to next period
-			  		if (i == num_periods) {
-			  			break;
-			  		} else {
-				 		time_period+=strlen(time_period)+1;
-				 		continue;
-				 	}
-			  	}
+// Name of a scanned directory
+static void avail_dir(const char *tmpl, const avail_entry *e, int i, char *dir)
+{
+  memcpy(dir,tmpl,e->dirlen);
+  dir[e->dirlen]=0;
+  if (e->year<0) return;
+  if (!i) {
+    dir[e->year]=0;
+  } else {
+    sprintf(dir+e->year,"%04d",e->years[i]);
+    dir[e->year+4]='/'; // sprintf terminated it
+  }
+}
 
-			  	// Now we find the closest time before the requested time
-			  	// We do this by counting up intervals from the start date.
-			  	// Years and months aren't a fixed time interval so we process separately
-			  	apr_time_t snap_epoch = 0;
-			  	apr_time_t date_epoch;
-			  	apr_time_t prev_epoch = start_epoch;
-			  	char interval_char = get_interval_char(r->pool, time_period);
-			  	switch (interval_char) {
-			  		case 'Y':
-			  			for(;;) {
-			  				date_epoch = add_date_interval(prev_epoch, interval, "years");	
-			  				// If the new counter date is bigger than the request date, we've found the snap date
-			  				if (date_epoch > req_epoch) {
-			  					snap_epoch = prev_epoch;
-			  					break;
-			  				}
-			  				// Didn't snap yet, check if we're past the end date
-			  				if (date_epoch > end_epoch) {
-			  					break;
-			  				}
-			  				// If we made it this far, increment the date and try again
-			  				prev_epoch = date_epoch;
-			  				continue;
-			  			}
-			  			break;
-			  		case 'M':
-			  			for (;;) {
-			  				date_epoch = add_date_interval(prev_epoch, interval, "months");
-			  				// If the new counter date is bigger than the request date, we've found the snap date
-			  				if (date_epoch > req_epoch) {
-			  					snap_epoch = prev_epoch;
-			  					break;
-			  				}
-			  				// Didn't snap yet, check if we're past the end date
-			  				if (date_epoch > end_epoch) {
-			  					break;
-			  				}
-			  				// If we made it this far, increment the date and try again
-			  				prev_epoch = date_epoch;
-			  				continue;
-			  			}
-			  			break;
-			  		default:
-			  			// Not year or month. Since days and time intervals are fixed, we can treat them all as microsecond intervals
-			  			// Get interval in ms
-			  			switch (interval_char) {
-			  				case 'D':
-			  					interval = interval * 24 * 60 * 60 * 1000 * 1000;
-			  					break;
-			  				case 'H':
-			  					interval = interval * 60 * 60 * 1000 * 1000;
-			  					break;
-			  				case 'm':
-			  					interval = interval * 60 * 1000 * 1000;
-			  					break;
-			  				case 'S':
-			  					interval = interval * 1000 * 1000;
-			  					break;
-			  			}
-			  			apr_time_t closest_interval =  (((req_epoch - start_epoch) / interval) * interval) + start_epoch;
-			  			if (closest_interval <= end_epoch) {
-			  				// Closest date we can snap to is beyond end of the last allowable interval
-			  				snap_epoch = closest_interval;
-			  			}
-			  			break;
-			  	}
+// Reads the time stamps from disk, fills in keys and the directory times
+static void avail_scan(const char *tmpl, avail_entry *e)
+{
+  int size=0,nmt=1;
+  struct stat st;
+  char dir[e->dirlen+1];
+
+  e->keys=0; e->count=0; e->ndirs=1;
+  e->mtimes=(time_t *)malloc(sizeof(time_t));
+  e->years=(int *)malloc(sizeof(int));
+  e->years[0]=0;
+  avail_dir(tmpl,e,0,dir);
+  e->mtimes[0]=stat(dir,&st)?0:st.st_mtime;
+
+  if (e->year<0) {
+    avail_scan_dir(tmpl,e,dir,0,&e->keys,&e->count,&size);
+  } else { // One directory for each year
+    struct dirent *de;
+    DIR *d;
+    if ((d=opendir(dir))) {
+      while ((de=readdir(d))) {
+        char ydir[e->dirlen+1];
+        if (4!=strlen(de->d_name) || 0>avail_key(de->d_name,4)) continue;
+        if (e->ndirs==nmt) {
+          nmt*=2;
+          e->mtimes=(time_t *)realloc(e->mtimes,nmt*sizeof(time_t));
+          e->years=(int *)realloc(e->years,nmt*sizeof(int));
+        }
+        e->years[e->ndirs]=avail_key(de->d_name,4);
+        avail_dir(tmpl,e,e->ndirs,ydir);
+        e->mtimes[e->ndirs++]=stat(ydir,&st)?0:st.st_mtime;
+        avail_scan_dir(tmpl,e,ydir,de->d_name,&e->keys,&e->count,&size);
+      }
+      closedir(d);
+    }
+  }
+  qsort(e->keys,e->count,sizeof(apr_int64_t),cmp_int64);
+}
 
-			  	// Go to next time period if we still don't have a snap date
-			  	if (snap_epoch == 0) {
-			  		if (i == num_periods) {
-			  			break;
-			  		} else {
-				 		time_period+=strlen(time_period)+1;
-				 		continue;
-			  		}
-			  	}
+// Have any of the scanned directories changed?  A new year changes the parent
+static int avail_changed(const char *tmpl, const avail_entry *e)
+{
+  struct stat st;
+  char dir[e->dirlen+1];
+  int i;
 
-			  	// We have a snap date, time to build the filename (remember that tm_yday is zero-indexed)
-			  	apr_time_exp_t snap_date = {0};
-			  	apr_time_exp_gmt(&snap_date, snap_epoch);
+  for (i=0;i<e->ndirs;i++) {
+    avail_dir(tmpl,e,i,dir);
+    if (stat(dir,&st) || st.st_mtime!=e->mtimes[i]) return 1;
+  }
+  return 0;
+}
 
-			  	// Fix year part of file path
-					if(yearloc != NULL) {
-					char oldpath=*(yearloc+4);
-					sprintf(yearloc,"%04d",snap_date.tm_year + 1900);
-					*(yearloc+4)=oldpath;
-			  	}
+static void avail_free(avail_entry *e)
+{
+  free(e->keys);
+  free(e->mtimes);
+  free(e->years);
+  e->keys=0;
+  e->mtimes=0;
+  e->years=0;
+}
 
-			  	// Build rest of filename
-			  	if (hastime == 0) {
-					char old_char=*(fnloc+7);
-					sprintf(fnloc,"%04d%03d",snap_date.tm_year + 1900,snap_date.tm_yday + 1);
-				  	*(fnloc+7)=old_char;
-			  	} else {
-					char old_char=*(fnloc+13);
-					sprintf(fnloc,"%04d%03d%02d%02d%02d",snap_date.tm_year + 1900,snap_date.tm_yday + 1, snap_date.tm_hour, snap_date.tm_min, snap_date.tm_sec);
-					*(fnloc+13)=old_char;
-			  	}
-			  	// Now let's try the request with our new filename
-				ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Snapping to period in file %s",fn);
-                // ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Snapping to time %04d-%02d-%02dT%02d:%02d:%02d", snap_date.tm_year, snap_date.tm_mon, snap_date.tm_mday, snap_date.tm_hour, snap_date.tm_min, snap_date.tm_sec);
-			    if (0>(fd=open(fn,O_RDONLY))) {
-		  		    ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"No valid data exists for time period");
-					time_period+=strlen(time_period)+1; // try next period
-				} else {
-					if (r->prev != 0) {
+// Is the file name, made from the template, present on disk?
+// Returns 1 if it is, 0 if not, -1 if it's not known.  With build set, the template gets scanned
+// if it hasn't been yet, otherwise only templates already scanned are used
+static int avail_check(const char *tmpl, const char *fn, int build)
+{
+  avail_entry *e, fresh;
+  apr_time_t now;
+  apr_int64_t key;
+  int found=-1;
+  int leader;
+  flight *f;
+
+  if (!avail.mutex) return -1;
+  now=apr_time_now();
+  apr_thread_mutex_lock(avail.mutex);
+  e=(avail_entry *)apr_hash_get(avail.hash,tmpl,APR_HASH_KEY_STRING);
+  if (e && e->run<0) { // Can't be indexed
+    apr_thread_mutex_unlock(avail.mutex);
+    return -1;
+  }
+  if ((!e && !build) || (e && now-e->checked<apr_time_from_sec(fd_cache_check))) {
+    if (e && 0<=(key=avail_key(fn+e->run,e->runlen)))
+      found=NULL!=bsearch(&key,e->keys,e->count,sizeof(apr_int64_t),cmp_int64);
+    else if (e)
+      found=0;
+    apr_thread_mutex_unlock(avail.mutex);
+    return found;
+  }
+  apr_thread_mutex_unlock(avail.mutex);
+
+  // One thread scans, the others wait for it and use what it found
+  if ((f=flight_join(0,0,0,0,0,tmpl,&leader)) && !leader) {
+    flight_release(f);
+    return avail_check(tmpl,fn,build);
+  }
+
+  // Scan or check the directories without holding the lock
+  memset(&fresh,0,sizeof(fresh));
+  if (!avail_parse(tmpl,&fresh)) {
+    fresh.run=-1;
+  } else if (!e || avail_changed(tmpl,e)) {
+    avail_scan(tmpl,&fresh);
+  } else {
+    fresh.run=-2; // Still good
+  }
+
+  apr_thread_mutex_lock(avail.mutex);
+  if (!(e=(avail_entry *)apr_hash_get(avail.hash,tmpl,APR_HASH_KEY_STRING))) {
+    e=(avail_entry *)calloc(1,sizeof(avail_entry));
+    apr_hash_set(avail.hash,strdup(tmpl),APR_HASH_KEY_STRING,e);
+    e->run=-1;
+  }
+  if (-2!=fresh.run) {
+    avail_free(e);
+    *e=fresh;
+  }
+  e->checked=now;
+  if (e->run>=0) {
+    if (0<=(key=avail_key(fn+e->run,e->runlen)))
+      found=NULL!=bsearch(&key,e->keys,e->count,sizeof(apr_int64_t),cmp_int64);
+    else
+      found=0;
+  }
+  apr_thread_mutex_unlock(avail.mutex);
+  if (f) {
+    flight_land(f,found,0);
+    flight_release(f);
+  }
+  return found;
+}
+
+static apr_status_t avail_cleanup(void *data)
+{
+  apr_hash_index_t *hi;
+  for (hi=apr_hash_first(0,avail.hash);hi;hi=apr_hash_next(hi)) {
+    const void *key;
+    void *val;
+    apr_hash_this(hi,&key,0,&val);
+    avail_free((avail_entry *)val);
+    free(val);
+    free((void *)key);
+  }
+  avail.mutex=0;
+  return APR_SUCCESS;
+}
+
+// single shot, open fname file, read nbytes from location, close file.
+// Allocates memory form request pool, returns a pointer to the buffer
+static void *p_file_pread(apr_pool_t *p, const char *fname,
+                          apr_size_t nbytes, apr_off_t location)
+{
+  fd_entry *fe;
+
+  void *buffer;
+  apr_size_t readbytes;
+
+  if (!(buffer=apr_pcalloc(p,nbytes))) return 0;
+  if (!(fe=fd_open(fname))) return 0;
+
+  readbytes=pread64(fe->fd,buffer,nbytes,location);
+  fd_release(fe);
+
+  return (readbytes==nbytes)?buffer:0;
+}
+
+// Copies a file name into out, which has room for f->len+1, with the request time stamp
+// subdaily allows the time of day, for names that have the long marker
+// Returns 1 if the name got the time stamp, 0 if the name or the request have none, -1 if the
+// request time is not valid.  t gets the time, with hastime set only if it went in the name
+static int request_fname(request_rec *r, const oe_fname *f, int subdaily, char *out, oe_time *t)
+{
+  const wms_str *time=req_time(r);
+  int stamped=0;
+
+  memcpy(out,f->name,f->len+1);
+  if (f->day>=0 && 0<(stamped=oe_parse_time(time->s,time->len,t)))
+    t->hastime=oe_fname_stamp(f,out,t,t->hastime && subdaily);
+  return stamped;
+}
+
+// Get the filename with timestamp, without the time of day or snapping, into out
+static char *tstamp_fname(request_rec *r, const oe_fname *f, char *out)
+{
+  oe_time t;
+  request_fname(r,f,0,out,&t);
+  return out;
+}
+
+// Opens a file for a request, doing the time stamp part and the time period snapping
+// The caller has to fd_release the returned entry
+
+static fd_entry *r_file_open(request_rec *r, const oe_fname *fname,
+                          const wms_periods *periods, int zlevels)
+{
+  fd_entry *fe=0;
+  int hastime=0,stamped;
+  oe_time t;
+  char fn[fname->len+1]; // The name for this request, snapping changes the time stamp
+
+  // Name change for time variant file names
+  if (0>(stamped=request_fname(r,fname,0==zlevels,fn,&t))) {
+    const wms_str *time=req_time(r);
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Request: %s",r->args?r->args:r->uri);
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Invalid time format: %.*s",time->len,time->s);
+    wmts_add_error(r,400,"InvalidParameterValue","TIME", "Invalid time format, must be YYYY-MM-DD or YYYY-MM-DDThh:mm:ssZ");
+    return 0;
+  }
+  if (stamped && !(hastime=t.hastime)) // Sub-daily file names have the longer marker
+    t.hour=t.min=t.sec=0;
+
+  // Check if redirected from Mapserver for time snapping
+  char *layer = 0;
+  char *layers = 0;
+  char *prev_time = 0;
+  char *new_uri = 0;
+  int max_size = 0;
+  if (r->prev != 0) {
+  			if (r->prev->args && ap_strstr(r->prev->args, "&MAP=") != 0) {
+				layer = (char *) apr_table_get(r->prev->notes, "oems_clayer");
+				layers = (char *) apr_table_get(r->prev->notes, "oems_layers");
+				prev_time = (char *) apr_table_get(r->prev->notes, "oems_time");
+				max_size = strlen(r->prev->uri) + strlen(r->prev->args) + strlen(prev_time);
+				new_uri = (char*) apr_pcalloc(r->pool, max_size);
+				// Set notes for next request
+				if (prev_time != 0) {
+					apr_table_setn(r->notes, "oems_time", prev_time);
+				}
+				if (layer != 0) {
+					apr_table_setn(r->notes, "oems_clayer", layer);
+				}
+				if (layers != 0) {
+					apr_table_setn(r->notes, "oems_layers", layers);
+				}
+  			}
+  }
+
+  // check if layer has multi-day period if file not found
+  // Dates known to be missing don't get opened
+  if ((fname->day>=0 && !avail_check(fname->name,fn,0)) || !(fe=fd_open(fn)))
+  {
+	  ap_log_error(APLOG_MARK,APLOG_DEBUG,0,r->server,"%s is not available",fn);
+	  if (fname->day<0) {
+		  return 0;
+	  }
+	  else {
+    		
+		  if (stamped && periods && periods->count > 0) {
+		  	int i, n, found;
+		  	long long req_epoch = oe_epoch(&t);
+		  	int *cand;
+
+		  	// The periods the request can snap to, tried in configuration order
+		  	cand = (int *)apr_palloc(r->pool, periods->count*sizeof(int));
+		  	n = oe_periods_find(periods, req_epoch, cand);
+		  	found = 0;
+   		    for (i=0;i<n && !found;i++) {
+   		    	long long snap_epoch;
+	   		    ap_log_error(APLOG_MARK,APLOG_DEBUG,0,r->server,"Evaluating time period %d", cand[i]);
+			  	if (!oe_period_snap(&periods->p[cand[i]], req_epoch, &snap_epoch))
+			  		continue;
+
+			  	// We have a snap date, time to build the filename (remember that tm_yday is zero-indexed)
+			  	apr_time_exp_t snap_date = {0};
+			  	oe_time snap = {0};
+			  	apr_time_exp_gmt(&snap_date, snap_epoch);
+			  	snap.year = snap_date.tm_year + 1900;
+			  	snap.yday = snap_date.tm_yday + 1;
+			  	snap.hour = snap_date.tm_hour;
+			  	snap.min = snap_date.tm_min;
+			  	snap.sec = snap_date.tm_sec;
+			  	oe_fname_stamp(fname, fn, &snap, hastime);
+			  	// Now let's try the request with our new filename, if it's there
+				ap_log_error(APLOG_MARK,APLOG_DEBUG,0,r->server,"Snapping to period in file %s",fn);
+                // ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Snapping to time %04d-%02d-%02dT%02d:%02d:%02d", snap_date.tm_year, snap_date.tm_mon, snap_date.tm_mday, snap_date.tm_hour, snap_date.tm_min, snap_date.tm_sec);
+			    if (!avail_check(fname->name,fn,1) || !(fe=fd_open(fn))) {
+		  		    ap_log_error(APLOG_MARK,APLOG_DEBUG,0,r->server,"No valid data exists for time period");
+				} else {
+					found = 1;
+					get_req_ctx(r)->snapped = 1;
+					if (r->prev != 0) {
 						if (ap_strstr(r->prev->args, "&MAP=") != 0) {
 							char *layer_time = (char*)apr_pcalloc(r->pool, max_size);
 							char *layer_subdaily = (char*)apr_pcalloc(r->pool, max_size);
@@ -593,12 +1350,11 @@ static void *r_file_pread(request_rec *r, char *fname,
 							ap_internal_redirect(new_uri, r);
 						}
 					}
-					break;
 				}
    		    }
-			if (i==num_periods) {
+			if (!found) {
 				  // no data found within all periods
-				  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Data not found in %d periods", num_periods);
+				  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Data not found in %d periods", periods->count);
 				  if (r->prev != 0) {
 						if (ap_strstr(r->prev->args, "&MAP=") != 0) { // Don't include layer in Mapserver request if no time found
 							char *args_cpy = (char*)apr_pcalloc(r->pool, strlen(r->prev->args)+1);
@@ -631,156 +1387,1012 @@ static void *r_file_pread(request_rec *r, char *fname,
 			}
 	  }
   }
-
-  readbytes=pread64(fd,buffer,nbytes,location);
-//  if (readbytes!=nbytes) {
-//	  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Error reading from %s, read %ld instead of %ld, from %ld",fn,readbytes,nbytes,location);
-//  }
-  close(fd);
-  return (readbytes==nbytes)?buffer:0;
+
+  return fe; // Null if no file was found in any period
+}
+
+// Same as p_file_pread, but uses a request, and does the time stamp part
+
+static void *r_file_pread(request_rec *r, const oe_fname *fname,
+                          apr_size_t nbytes, apr_off_t location, const wms_periods *periods, int zlevels)
+{
+  fd_entry *fe;
+  void *buffer;
+  apr_size_t readbytes;
+
+//  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"r_file_pread file %s size %ld at %ld",fname,nbytes,location);
+
+  if (!(buffer=apr_pcalloc(r->pool,nbytes))) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
+      "Can't get memory for pread");
+    return 0;
+  }
+
+  if (!(fe=r_file_open(r,fname,periods,zlevels))) return 0;
+  readbytes=pread64(fe->fd,buffer,nbytes,location);
+//  if (readbytes!=nbytes) {
+//	  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Error reading from %s, read %ld instead of %ld, from %ld",fname,readbytes,nbytes,location);
+//  }
+  fd_release(fe);
+  return (readbytes==nbytes)?buffer:0;
+}
+
+static apr_status_t fd_release_cleanup(void *data)
+{
+  fd_release((fd_entry *)data);
+  return APR_SUCCESS;
+}
+
+// Sends part of a file as a file bucket, so the core can use sendfile
+// The descriptor is held until the request pool goes away, the bucket can outlive the handler
+static apr_status_t r_file_send(request_rec *r, fd_entry *fe, apr_off_t location, apr_size_t nbytes)
+{
+  apr_file_t *file=0;
+  apr_os_file_t fd=fe->fd;
+  apr_bucket_brigade *bb;
+  apr_status_t rv;
+
+  apr_pool_cleanup_register(r->pool,fe,fd_release_cleanup,apr_pool_cleanup_null);
+  // The apr_file_t doesn't own the descriptor, it is not closed with the pool
+  if (APR_SUCCESS!=(rv=apr_os_file_put(&file,&fd,APR_FOPEN_READ|APR_FOPEN_SENDFILE_ENABLED,r->pool)))
+    return rv;
+
+  bb=apr_brigade_create(r->pool,r->connection->bucket_alloc);
+  apr_brigade_insert_file(bb,file,location,nbytes,r->pool);
+  APR_BRIGADE_INSERT_TAIL(bb,apr_bucket_eos_create(r->connection->bucket_alloc));
+  return ap_pass_brigade(r->output_filters,bb);
+}
+
+//
+// Index block cache, one per child process, shared by all threads
+// Holds IC_PAGE byte pages of the index files, already in native byte order, so neighbouring
+// tiles don't each need a pread.  Keyed on the identity of the index file, with the mtime to the
+// nanosecond and the size, and the page number, so pages of a replaced file, or of one rewritten
+// in place, are never matched again and age out of the LRU list
+// Optionally, a miss also loads the pages holding the same columns in the rows above and below
+//
+
+#define IC_PAGE 4096
+#define IC_RECORDS (IC_PAGE/sizeof(index_s))
+
+typedef struct ic_page {
+  dev_t dev;    // Identity of the index file
+  ino_t ino;
+  time_t mtime;
+  long nsec;
+  apr_off_t size;
+  apr_off_t page;        // Page number in the file
+  int count;             // Records read, the last page of a file can be short
+  struct ic_page *chain; // Next in the hash bucket
+  struct ic_page *prev,*next; // LRU list, the head is the most recently used
+  index_s records[IC_RECORDS];
+} ic_page;
+
+static struct {
+  apr_thread_mutex_t *mutex;
+  ic_page **buckets;
+  apr_uint32_t mask;
+  ic_page *head,*tail;
+  int count;
+  apr_uint32_t hits,misses;
+} index_cache;
+
+static int index_cache_size=1024; // Pages per process, 0 disables the cache
+static int index_cache_rows=0;    // Rows above and below loaded on a miss
+
+static ic_page **ic_bucket(dev_t dev, ino_t ino, time_t mtime, apr_off_t page)
+{
+  apr_uint64_t h=(((apr_uint64_t)ino*31+dev)*31+mtime)*31+page;
+  h*=0x9E3779B97F4A7C15ULL;
+  return index_cache.buckets+((h>>32)&index_cache.mask);
+}
+
+// Needs the lock
+static ic_page *ic_find(const fd_entry *fe, apr_off_t page)
+{
+  ic_page *p=*ic_bucket(fe->dev,fe->ino,fe->mtime,page);
+  while (p && (p->page!=page || p->ino!=fe->ino || p->dev!=fe->dev || p->mtime!=fe->mtime
+    || p->nsec!=fe->nsec || p->size!=fe->size))
+    p=p->chain;
+  return p;
+}
+
+// Take a page out of the cache and free it, needs the lock
+static void ic_unlink(ic_page *p)
+{
+  ic_page **b=ic_bucket(p->dev,p->ino,p->mtime,p->page);
+  while (*b!=p) b=&(*b)->chain;
+  *b=p->chain;
+  if (p->prev) p->prev->next=p->next; else index_cache.head=p->next;
+  if (p->next) p->next->prev=p->prev; else index_cache.tail=p->prev;
+  index_cache.count--;
+  free(p);
+}
+
+// Move a page to the head of the LRU list, needs the lock
+static void ic_touch(ic_page *p)
+{
+  if (index_cache.head==p) return;
+  p->prev->next=p->next;
+  if (p->next) p->next->prev=p->prev; else index_cache.tail=p->prev;
+  p->prev=0;
+  p->next=index_cache.head;
+  index_cache.head->prev=p;
+  index_cache.head=p;
+}
+
+// Reads and decodes a page, without the lock.  Returns 0 if no record could be read
+static ic_page *ic_load(const fd_entry *fe, apr_off_t page)
+{
+  ic_page *p=(ic_page *)malloc(sizeof(ic_page));
+  ssize_t got;
+  int i;
+
+  if (!p) return 0;
+  got=pread64(fe->fd,p->records,IC_PAGE,page*IC_PAGE);
+  if (got<(ssize_t)sizeof(index_s)) {
+    free(p);
+    return 0;
+  }
+  p->dev=fe->dev;
+  p->ino=fe->ino;
+  p->mtime=fe->mtime;
+  p->nsec=fe->nsec;
+  p->size=fe->size;
+  p->page=page;
+  p->count=got/sizeof(index_s);
+  for (i=0;i<p->count;i++) oe_index_swap(p->records+i);
+  return p;
+}
+
+// Adds a page, replacing an older copy, needs the lock
+static void ic_insert(const fd_entry *fe, ic_page *p)
+{
+  ic_page *old=ic_find(fe,p->page);
+  ic_page **b;
+
+  if (old) ic_unlink(old);
+  b=ic_bucket(p->dev,p->ino,p->mtime,p->page);
+  p->chain=*b;
+  *b=p;
+  p->prev=0;
+  p->next=index_cache.head;
+  if (index_cache.head) index_cache.head->prev=p; else index_cache.tail=p;
+  index_cache.head=p;
+  index_cache.count++;
+  while (index_cache.count>index_cache_size)
+    ic_unlink(index_cache.tail);
+}
+
+// Loads the pages with the same columns in the nearby rows, if they are not cached yet
+static void ic_readahead(const fd_entry *fe, apr_off_t location, apr_off_t row)
+{
+  apr_off_t page=location/IC_PAGE,done[2]={page,page};
+  int k,d;
+
+  for (k=1;k<=index_cache_rows;k++)
+    for (d=0;d<2;d++) {
+      apr_off_t next=d?location+k*row:location-k*row;
+      ic_page *p;
+      if (next<0 || next>=fe->size || next/IC_PAGE==done[d]) continue;
+      done[d]=next/IC_PAGE;
+      apr_thread_mutex_lock(index_cache.mutex);
+      p=ic_find(fe,done[d]);
+      apr_thread_mutex_unlock(index_cache.mutex);
+      if (p || !(p=ic_load(fe,done[d]))) continue;
+      apr_thread_mutex_lock(index_cache.mutex);
+      ic_insert(fe,p);
+      apr_thread_mutex_unlock(index_cache.mutex);
+    }
+}
+
+// Reads the index record at location, in native byte order.  Returns 0 if it can't be read,
+// 1 if it came from the cache and 2 if it was read from the file
+// row is the size of a row of records, used for read ahead
+static int index_cache_read(const fd_entry *fe, apr_off_t location, apr_off_t row, index_s *record)
+{
+  apr_off_t page=location/IC_PAGE;
+  int i=(location%IC_PAGE)/sizeof(index_s);
+  ic_page *p;
+  int leader;
+  flight *f;
+
+  // Tiles the occupancy map knows are empty don't need the index
+  if (idm_empty(fe,location)) {
+    memset(record,0,sizeof(index_s));
+    return 1;
+  }
+
+  // Records are aligned in the file, anything else is read directly
+  if (!index_cache.mutex || location%sizeof(index_s)) {
+    if (sizeof(index_s)!=pread64(fe->fd,record,sizeof(index_s),location)) return 0;
+    oe_index_swap(record);
+    return 2;
+  }
+
+  apr_thread_mutex_lock(index_cache.mutex);
+  if ((p=ic_find(fe,page)) && i<p->count) {
+    ic_touch(p);
+    *record=p->records[i];
+    index_cache.hits++;
+    apr_thread_mutex_unlock(index_cache.mutex);
+    return 1;
+  }
+  index_cache.misses++;
+  apr_thread_mutex_unlock(index_cache.mutex);
+
+  // Threads missing the same page wait for the first one, then find the page in the cache
+  if ((f=flight_join(fe->dev,fe->ino,fe->mtime,page*IC_PAGE,IC_PAGE,0,&leader)) && !leader) {
+    flight_release(f);
+    apr_thread_mutex_lock(index_cache.mutex);
+    if ((p=ic_find(fe,page)) && i<p->count) {
+      ic_touch(p);
+      *record=p->records[i];
+    } else
+      p=0;
+    apr_thread_mutex_unlock(index_cache.mutex);
+    if (p) return 2;
+    f=0; // Already gone or short, read it here
+  }
+
+  // Read it outside of the lock, a short page is read again in case the file grew
+  if (!(p=ic_load(fe,page)) || i>=p->count) {
+    free(p);
+    p=0;
+  } else {
+    *record=p->records[i];
+    apr_thread_mutex_lock(index_cache.mutex);
+    ic_insert(fe,p);
+    apr_thread_mutex_unlock(index_cache.mutex);
+  }
+  if (f) {
+    flight_land(f,p!=0,0);
+    flight_release(f);
+  }
+  if (!p) return 0;
+
+  if (index_cache_rows>0 && row>0) ic_readahead(fe,location,row);
+  return 2;
+}
+
+// Same as r_file_pread for an index record, through the index cache
+static index_s *r_index_read(request_rec *r, const oe_fname *fname, apr_off_t location, apr_off_t row,
+                             const wms_periods *periods, int zlevels)
+{
+  index_s *record=(index_s *)apr_palloc(r->pool,sizeof(index_s));
+  fd_entry *fe;
+  int ok;
+
+  if (!(fe=r_file_open(r,fname,periods,zlevels))) return 0;
+  ok=index_cache_read(fe,location,row,record);
+  fd_release(fe);
+  if (2==ok) get_req_ctx(r)->index_miss=1;
+  return ok?record:0;
+}
+
+static apr_status_t index_cache_cleanup(void *data)
+{
+  while (index_cache.head) ic_unlink(index_cache.head);
+  index_cache.mutex=0;
+  return APR_SUCCESS;
+}
+
+// Per child, the number of buckets is the power of two at or above the page count
+static void index_cache_init(apr_pool_t *p, server_rec *s)
+{
+  apr_uint32_t n=1;
+  if (index_cache_size<=0) return;
+  while (n<(apr_uint32_t)index_cache_size && n<(1u<<30)) n<<=1;
+  index_cache.buckets=(ic_page **)apr_pcalloc(p,n*sizeof(ic_page *));
+  index_cache.mask=n-1;
+  index_cache.head=index_cache.tail=0;
+  index_cache.count=0;
+  if (APR_SUCCESS!=apr_thread_mutex_create(&index_cache.mutex,APR_THREAD_MUTEX_DEFAULT,p)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"Can't create index cache mutex, index cache disabled");
+    index_cache.mutex=0;
+    return;
+  }
+  apr_pool_cleanup_register(p,0,index_cache_cleanup,apr_pool_cleanup_null);
+}
+
+//
+// Read engine, one per thread, io_uring when the kernel has it, see oe_read.h
+//
+
+#define READ_DEPTH 64  // Reads in flight per thread
+
+static int read_uring=1;  // Set by WMSIoUring
+static const char read_engine_key[]="mod_onearth_read";
+
+static apr_status_t read_engine_cleanup(void *data)
+{
+  oe_read_destroy((oe_read_engine *)data);
+  return APR_SUCCESS;
+}
+
+// Returns 0 without a thread, the reads are then done with preadv
+static oe_read_engine *read_engine_get(request_rec *r)
+{
+  apr_thread_t *thd=r->connection->current_thread;
+  oe_read_engine *e=0;
+
+  if (!thd) return 0;
+  apr_thread_data_get((void **)&e,read_engine_key,thd);
+  if (!e && (e=oe_read_create(READ_DEPTH,read_uring))) {
+    apr_thread_data_set(e,read_engine_key,read_engine_cleanup,thd);
+    ap_log_error(APLOG_MARK,APLOG_DEBUG,0,r->server,"Read engine uses %s",oe_read_backend(e));
+  }
+  return e;
+}
+
+// Reads one tile through the read engine of the thread, 0 if it can't be read whole
+static int engine_pread(request_rec *r, int fd, void *buffer, apr_size_t nbytes, apr_off_t location)
+{
+  struct iovec iov;
+  oe_read_op op;
+
+  iov.iov_base=buffer;
+  iov.iov_len=nbytes;
+  op.fd=fd;
+  op.offset=location;
+  op.iov=&iov;
+  op.iovcnt=1;
+  return !oe_read_submit(read_engine_get(r),&op,1) && op.result==(ssize_t)nbytes;
+}
+
+//
+// Tile cache in shared memory, used by all the child processes
+// Set associative, a tile can go in any of the TC_WAYS slots of the set picked by the key hash
+// The key is the identity of the data file, the tile offset and size, so a replaced file
+// doesn't get served from the cache.  Each set has a CLOCK hand for eviction.
+// There are no locks, each slot has a sequence number which is odd while the slot is written
+// Readers copy the tile out and check that the sequence didn't change
+// With sendfile on, a tile that is not cached is only read into memory, and cached, when it
+// was missed recently.  The first miss sets a bit in a small filter and sends it from the file
+//
+
+#define TC_WAYS 8
+
+typedef struct {
+  volatile apr_uint32_t seq;  // Even when stable, odd while being written
+  volatile apr_uint32_t ref;  // CLOCK bit, set on hit
+  apr_uint32_t size;          // Tile size, 0 if the slot is empty
+  apr_uint32_t pad;
+  apr_uint64_t dev,ino;       // Data file identity
+  apr_int64_t mtime;
+  apr_int64_t offset;         // Tile offset in the data file
+} tc_slot;
+
+typedef struct {
+  apr_uint32_t nsets;
+  apr_uint32_t slot_size;     // Largest tile that fits
+  volatile apr_uint64_t hits,misses,inserts,evictions; // Since startup, they don't wrap
+  volatile apr_uint32_t aging; // Next filter word to clear
+  apr_uint32_t pad;
+} tc_header;
+
+#define TC_COUNT(c) __atomic_add_fetch(&tile_cache.header->c,1,__ATOMIC_RELAXED)
+
+static struct {
+  apr_size_t size;            // Shared memory size, 0 means no tile cache
+  apr_size_t slot_size;
+  apr_shm_t *shm;
+  tc_header *header;          // Start of the shared memory, only set when in use
+  volatile apr_uint32_t *hands; // CLOCK hand for each set
+  volatile apr_uint32_t *missed; // Filter of recent misses, one word for each set
+  tc_slot *slots;
+  char *data;
+} tile_cache={0,65536};
+
+// Bytes needed for a given number of sets, the slots start aligned
+static apr_size_t tile_cache_bytes(apr_size_t nsets)
+{
+  return APR_ALIGN_DEFAULT(sizeof(tc_header)+2*nsets*sizeof(apr_uint32_t))
+    +nsets*TC_WAYS*(sizeof(tc_slot)+tile_cache.slot_size);
+}
+
+// Carve up the shared memory, done once in the parent so the children inherit it
+static int tile_cache_init(apr_pool_t *p, server_rec *s)
+{
+  apr_size_t nsets;
+  apr_status_t rv;
+  char *base;
+
+  tile_cache.header=0;
+  if (!tile_cache.size) return OK;
+  nsets=tile_cache.size/(TC_WAYS*(sizeof(tc_slot)+tile_cache.slot_size)+2*sizeof(apr_uint32_t));
+  while (nsets && tile_cache_bytes(nsets)>tile_cache.size) nsets--;
+  if (!nsets) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"WMSTileCache is too small, tile cache disabled");
+    return OK;
+  }
+  if (APR_SUCCESS!=(rv=apr_shm_create(&tile_cache.shm,tile_cache_bytes(nsets),NULL,p))) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,rv,s,"Can't create tile cache shared memory, tile cache disabled");
+    return OK;
+  }
+  base=(char *)apr_shm_baseaddr_get(tile_cache.shm);
+  tile_cache.hands=(apr_uint32_t *)(base+sizeof(tc_header));
+  tile_cache.missed=tile_cache.hands+nsets;
+  tile_cache.slots=(tc_slot *)(base+APR_ALIGN_DEFAULT(sizeof(tc_header)+2*nsets*sizeof(apr_uint32_t)));
+  tile_cache.data=(char *)(tile_cache.slots+nsets*TC_WAYS);
+  memset(base,0,tile_cache.data-base);
+  tile_cache.header=(tc_header *)base;
+  tile_cache.header->nsets=nsets;
+  tile_cache.header->slot_size=tile_cache.slot_size;
+  ap_log_error(APLOG_MARK,APLOG_INFO,0,s,"Tile cache has %d slots of %d bytes",
+    (int)(nsets*TC_WAYS),(int)tile_cache.slot_size);
+  return OK;
+}
+
+static int tile_cache_fits(apr_off_t size)
+{
+  return tile_cache.header && size>0 && size<=tile_cache.header->slot_size;
+}
+
+static apr_uint64_t tile_cache_hash(const fd_entry *fe, apr_off_t offset)
+{
+  apr_uint64_t h=(apr_uint64_t)fe->ino*0x9E3779B97F4A7C15ULL;
+  h^=(apr_uint64_t)offset+0x9E3779B97F4A7C15ULL+(h<<6)+(h>>2);
+  h^=(apr_uint64_t)fe->dev+(apr_uint64_t)fe->mtime+(h<<6)+(h>>2);
+  h^=h>>29;
+  return h;
+}
+
+static apr_uint32_t tile_cache_set(const fd_entry *fe, apr_off_t offset)
+{
+  return (apr_uint32_t)(tile_cache_hash(fe,offset)%tile_cache.header->nsets);
+}
+
+static int tile_cache_match(const tc_slot *slot, const fd_entry *fe, apr_off_t offset, apr_size_t size)
+{
+  return slot->size==size && slot->offset==offset && slot->ino==(apr_uint64_t)fe->ino
+    && slot->dev==(apr_uint64_t)fe->dev && slot->mtime==(apr_int64_t)fe->mtime;
+}
+
+// Returns a copy of the tile in the request pool, or 0 if it is not cached
+static void *tile_cache_get(request_rec *r, const fd_entry *fe, apr_off_t offset, apr_size_t size)
+{
+  apr_uint32_t set=tile_cache_set(fe,offset);
+  int i;
+
+  for (i=0;i<TC_WAYS;i++) {
+    tc_slot *slot=tile_cache.slots+set*TC_WAYS+i;
+    apr_uint32_t seq=apr_atomic_add32(&slot->seq,0); // Also a barrier
+    void *buffer;
+    if ((seq&1) || !tile_cache_match(slot,fe,offset,size)) continue;
+    buffer=apr_palloc(r->pool,size);
+    memcpy(buffer,tile_cache.data+(apr_size_t)(set*TC_WAYS+i)*tile_cache.header->slot_size,size);
+    if (apr_atomic_add32(&slot->seq,0)!=seq) continue; // Overwritten while copying
+    if (!slot->ref) apr_atomic_set32(&slot->ref,1);
+    TC_COUNT(hits);
+    apr_table_setn(r->notes,"mod_onearth_tile_cache","hit");
+    return buffer;
+  }
+  TC_COUNT(misses);
+  apr_table_setn(r->notes,"mod_onearth_tile_cache","miss");
+  return 0;
+}
+
+// With sendfile, whether the tile should be read into memory: it is cached, or it was
+// missed recently and goes in the cache now.  Otherwise counts the miss, and the tile is
+// sent from the file.  Each miss also clears one filter word, so old misses are forgotten
+static int tile_cache_admit(request_rec *r, const fd_entry *fe, apr_off_t offset, apr_size_t size)
+{
+  apr_uint64_t h=tile_cache_hash(fe,offset);
+  apr_uint32_t set=(apr_uint32_t)(h%tile_cache.header->nsets);
+  apr_uint32_t bit=1u<<((h>>32)&31);
+  volatile apr_uint32_t *word=tile_cache.missed+(apr_uint32_t)((h>>37)%tile_cache.header->nsets);
+  int i;
+
+  for (i=0;i<TC_WAYS;i++) {
+    tc_slot *slot=tile_cache.slots+set*TC_WAYS+i;
+    if (!(apr_atomic_add32(&slot->seq,0)&1) && tile_cache_match(slot,fe,offset,size)) return 1;
+  }
+  if (__atomic_fetch_or(word,bit,__ATOMIC_RELAXED)&bit) return 1;
+  apr_atomic_set32(tile_cache.missed+apr_atomic_inc32(&tile_cache.header->aging)%tile_cache.header->nsets,0);
+  TC_COUNT(misses);
+  apr_table_setn(r->notes,"mod_onearth_tile_cache","miss");
+  return 0;
+}
+
+// Store a tile, replacing the first slot of the set that has not been used since the hand went by
+// Gives up if the slots are busy, the tile will be stored by a later request
+static void tile_cache_put(const fd_entry *fe, apr_off_t offset, const void *data, apr_size_t size)
+{
+  apr_uint32_t set=tile_cache_set(fe,offset);
+  int tries;
+
+  for (tries=0;tries<2*TC_WAYS;tries++) {
+    apr_uint32_t i=apr_atomic_inc32(tile_cache.hands+set)%TC_WAYS;
+    tc_slot *slot=tile_cache.slots+set*TC_WAYS+i;
+    apr_uint32_t seq=apr_atomic_add32(&slot->seq,0);
+    if (seq&1) continue; // Being written by someone else
+    if (apr_atomic_xchg32(&slot->ref,0)) continue; // Recently used, second chance
+    if (apr_atomic_cas32(&slot->seq,seq+1,seq)!=seq) continue; // Lost the race for it
+    if (slot->size) TC_COUNT(evictions);
+    slot->size=size;
+    slot->dev=fe->dev;
+    slot->ino=fe->ino;
+    slot->mtime=fe->mtime;
+    slot->offset=offset;
+    memcpy(tile_cache.data+(apr_size_t)(set*TC_WAYS+i)*tile_cache.header->slot_size,data,size);
+    apr_atomic_inc32(&slot->seq); // Stable again
+    TC_COUNT(inserts);
+    return;
+  }
+}
+
+// Reads a tile from an open data file with the read engine, going through the tile cache if the tile fits
+// Requests for a tile that is already being read wait for that read and share the buffer
+static void *tile_read(request_rec *r, fd_entry *fe, apr_off_t location, apr_size_t nbytes)
+{
+  void *buffer;
+  int cached=tile_cache_fits(nbytes);
+  int leader;
+  flight *f;
+
+  if (cached && (buffer=tile_cache_get(r,fe,location,nbytes)))
+    return buffer;
+  if ((f=flight_join(fe->dev,fe->ino,fe->mtime,location,nbytes,0,&leader))) {
+    // The buffer is used until the response is written
+    apr_pool_cleanup_register(r->pool,f,flight_release_cleanup,apr_pool_cleanup_null);
+    if (leader) {
+      int ok=(buffer=malloc(nbytes)) && engine_pread(r,fe->fd,buffer,nbytes,location);
+      flight_land(f,ok,buffer);
+      if (ok && cached) tile_cache_put(fe,location,buffer,nbytes);
+    }
+    return f->status?f->data:0;
+  }
+  if (!(buffer=apr_palloc(r->pool,nbytes))) return 0;
+  if (!engine_pread(r,fe->fd,buffer,nbytes,location)) return 0;
+  if (cached) tile_cache_put(fe,location,buffer,nbytes);
+  return buffer;
+}
+
+//
+// Validators, so clients and caches can revalidate tiles without getting them again
+// A tile ETag comes from the data file name and time, and the index record. It changes when
+// the file is replaced or the tile is rewritten, and it is the same on servers with copies
+// of the same files. Empty tiles get one ETag per layer and empty record.
+//
+
+static apr_uint32_t etag_hash(const char *s, apr_size_t len)
+{
+  apr_uint32_t h=2166136261u;
+  while (len--) {
+    h^=(unsigned char)*s++;
+    h*=16777619u;
+  }
+  return h;
+}
+
+// Sets the validators and checks the conditional request headers
+// Returns OK if the tile has to be sent, otherwise the status to return, like 304
+static int tile_conditions(request_rec *r, const char *etag, apr_time_t mtime)
+{
+  if (wmts_errors(r)) return OK; // Errors are never cached
+  apr_table_setn(r->headers_out,"ETag",etag);
+  if (mtime) {
+    ap_update_mtime(r,mtime);
+    ap_set_last_modified(r);
+  } else
+    apr_table_unset(r->headers_out,"Last-Modified");
+  return ap_meets_conditions(r);
+}
+
+static int tile_validate(request_rec *r, const fd_entry *fe, const index_s *record)
+{
+  const char *name=fe->fname?fe->fname:"";
+  return tile_conditions(r,apr_psprintf(r->pool,"\"%x-%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "\"",
+    etag_hash(name,strlen(name)),(apr_uint64_t)fe->mtime,(apr_uint64_t)record->offset,(apr_uint64_t)record->size),
+    apr_time_from_sec(fe->mtime));
+}
+
+static int empty_validate(request_rec *r, const char *pattern, const index_s *record)
+{
+  return tile_conditions(r,apr_psprintf(r->pool,"\"e%x-%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "\"",
+    etag_hash(pattern,strlen(pattern)),(apr_uint64_t)record->offset,(apr_uint64_t)record->size),0);
+}
+
+// The blank tile of the endpoint for the mime type, 0 if there is none
+static const wms_blank *blank_find(const wms_cfg *cfg, const char *mime_type)
+{
+  if (!cfg->blanks || !mime_type) return 0;
+  return (const wms_blank *)apr_hash_get(cfg->blanks,mime_type,APR_HASH_KEY_STRING);
+}
+
+// Sends a blank tile.  Missing tiles can show up later, so clients have to check again,
+// which the ETag makes cheap
+static int blank_send(request_rec *r, const wms_blank *b)
+{
+  int rc;
+  apr_table_setn(r->headers_out,"Cache-Control","no-cache");
+  if (OK!=(rc=tile_conditions(r,b->etag,0))) return rc;
+  ap_set_content_type(r,b->mime_type);
+  ap_set_content_length(r,b->size);
+  ap_rwrite(b->data,b->size,r);
+  return OK;
+}
+
+// Reads a blank tile into the configuration, returns 0 if the file can't be read
+// Relative names are in the endpoint directory, same as for the CGI
+static wms_blank *blank_load(apr_pool_t *p, wms_cfg *cfg, const char *dir,
+                             const char *mime_type, const char *fname)
+{
+  wms_blank *b;
+  apr_file_t *f;
+  apr_finfo_t fi;
+  apr_size_t got;
+
+  if ('/'!=*fname && dir) fname=apr_pstrcat(p,dir,"/",fname,NULL);
+  if (APR_SUCCESS!=apr_file_open(&f,fname,APR_READ|APR_BINARY,APR_OS_DEFAULT,p)) return 0;
+  b=(wms_blank *)apr_pcalloc(p,sizeof(wms_blank));
+  if (APR_SUCCESS!=apr_file_info_get(&fi,APR_FINFO_SIZE,f) || fi.size<=0
+    || !(b->data=apr_palloc(p,fi.size))
+    || APR_SUCCESS!=apr_file_read_full(f,b->data,(apr_size_t)fi.size,&got)) {
+    apr_file_close(f);
+    return 0;
+  }
+  apr_file_close(f);
+  b->size=got;
+  b->mime_type=apr_pstrdup(p,mime_type);
+  b->etag=apr_psprintf(p,"\"b%x-%" APR_SIZE_T_FMT "\"",etag_hash((const char *)b->data,b->size),b->size);
+  if (!cfg->blanks) cfg->blanks=apr_hash_make(p);
+  apr_hash_set(cfg->blanks,b->mime_type,APR_HASH_KEY_STRING,b);
+  return b;
+}
+
+char *get_keyword(request_rec *r) {
+	  char *keyword = apr_pcalloc(r->pool,24);
+	  wms_args *a = parse_args(r);
+	  const wms_str *time = req_time(r);
+	  oe_time t;
+
+	  // Assume keyword is time for granules
+	  if (1 == oe_parse_time(time->s, time->len, &t) && t.hastime) {
+			// Check if keyword should also include style
+	    	if (a->style.len >= 7 && !strncmp(a->style.s, "encoded", 7)) {
+	    		sprintf(keyword,"%04d%02d%02d%02d%02d%02d|encoded",t.year,t.mon,t.mday,t.hour,t.min,t.sec);
+	    	} else {
+	    		sprintf(keyword,"%04d%02d%02d%02d%02d%02d",t.year,t.mon,t.mday,t.hour,t.min,t.sec);
+	    	}
+	  } else if (a->style.len) {
+	    	// Keyword is the style, an empty or default style has none
+	    	apr_cpystrn(keyword, a->style.s, (a->style.len < 7 ? a->style.len : 7) + 1);
+	  }
+
+	  return keyword;
+}
+
+// Lookup the z index from ZDB file based on keyword
+// Open z-index databases, kept by each thread so the connections and statements get reused
+typedef struct {
+  char *fname;      // ZDB file name, malloc'ed, 0 if the slot is free
+  dev_t dev;        // Identity of the ZDB when it was opened
+  ino_t ino;
+  time_t mtime;
+  struct stat zdx;  // Identity of the .zdx when the ZDB was opened, st_ino is 0 if there was none
+  apr_time_t checked;
+  apr_time_t used;
+  sqlite3 *db;
+  sqlite3_stmt *by_key,*latest; // Prepared on first use
+  char *map;        // The compact table, if there is one
+  apr_size_t map_size;
+} zdb_handle;
+
+#define ZDB_HANDLES 8 // Per thread
+
+typedef struct {
+  zdb_handle h[ZDB_HANDLES];
+} zdb_thread;
+
+static const char zdb_thread_key[]="mod_onearth_zdb";
+
+static void zdb_close(zdb_handle *h)
+{
+  if (h->by_key) sqlite3_finalize(h->by_key);
+  if (h->latest) sqlite3_finalize(h->latest);
+  if (h->db) sqlite3_close(h->db);
+  if (h->map) munmap(h->map,h->map_size);
+  free(h->fname);
+  memset(h,0,sizeof(*h));
+}
+
+static apr_status_t zdb_thread_cleanup(void *data)
+{
+  zdb_thread *t=(zdb_thread *)data;
+  int i;
+  for (i=0;i<ZDB_HANDLES;i++) zdb_close(&t->h[i]);
+  free(t);
+  return APR_SUCCESS;
+}
+
+// Name of the .zdx table for a ZDB, fname has room for the ZDB name and 5 more characters
+static void zdx_fname(char *fname, const char *zidxfname)
+{
+  int len=strlen(zidxfname);
+  strcpy(fname,zidxfname);
+  if (len>4 && !strcmp(fname+len-4,".zdb")) fname[len-4]=0;
+  strcat(fname,".zdx");
+}
+
+// Is the .zdx the same file as when the handle was opened, or still missing
+static int zdx_same(const zdb_handle *h, const char *zidxfname)
+{
+  char fname[strlen(zidxfname)+5];
+  struct stat st;
+  zdx_fname(fname,zidxfname);
+  if (stat(fname,&st)) return !h->zdx.st_ino;
+  return st.st_ino==h->zdx.st_ino && st.st_dev==h->zdx.st_dev
+    && st.st_mtime==h->zdx.st_mtime && st.st_size==h->zdx.st_size;
+}
+
+// Maps the .zdx table for a ZDB, if there is a valid one at least as new as the ZDB
+// The identity of the .zdx, if there is one, goes in zdx
+static char *zdx_map(const char *zidxfname, const struct stat *zst, apr_size_t *size, struct stat *zdx)
+{
+  char fname[strlen(zidxfname)+5];
+  struct stat st;
+  zdx_header *hd;
+  zdx_record *rec;
+  char *map;
+  int f,i;
+
+  zdx_fname(fname,zidxfname);
+  if (0>(f=open(fname,O_RDONLY))) return 0;
+  if (fstat(f,&st)) {
+    close(f);
+    return 0;
+  }
+  *zdx=st;
+  if (st.st_mtime<zst->st_mtime || st.st_size<sizeof(zdx_header)) {
+    close(f);
+    return 0;
+  }
+  map=(char *)mmap(0,st.st_size,PROT_READ,MAP_SHARED,f,0);
+  close(f);
+  if (MAP_FAILED==map) return 0;
+
+  // Check it once, so the lookups don't have to
+  hd=(zdx_header *)map;
+  rec=(zdx_record *)(hd+1);
+  if (memcmp(hd->magic,ZDX_MAGIC,4) || hd->count<0 || hd->latest>=hd->count
+    || sizeof(zdx_header)+(apr_size_t)hd->count*sizeof(zdx_record)>st.st_size
+    || map[st.st_size-1]) {
+    munmap(map,st.st_size);
+    return 0;
+  }
+  for (i=0;i<hd->count;i++)
+    if (rec[i].key<=0 || rec[i].key>=st.st_size || rec[i].source_url<0 || rec[i].source_url>=st.st_size
+      || rec[i].scale<0 || rec[i].scale>=st.st_size || rec[i].offset<0 || rec[i].offset>=st.st_size
+      || rec[i].uom<0 || rec[i].uom>=st.st_size) {
+      munmap(map,st.st_size);
+      return 0;
+    }
+  *size=st.st_size;
+  return map;
+}
+
+// Opens the compact table if there is one, otherwise the ZDB itself
+static int zdb_open(zdb_handle *h, const char *zidxfname, const struct stat *st)
+{
+  memset(h,0,sizeof(*h));
+  h->dev=st->st_dev;
+  h->ino=st->st_ino;
+  h->mtime=st->st_mtime;
+  if (!(h->map=zdx_map(zidxfname,st,&h->map_size,&h->zdx))
+    && SQLITE_OK!=sqlite3_open_v2(zidxfname,&h->db,SQLITE_OPEN_READONLY,NULL)) {
+    zdb_close(h);
+    return 0;
+  }
+  h->fname=strdup(zidxfname);
+  return 1;
+}
+
+// Returns an open handle for the ZDB, from this thread's set if there is one
+// Without a thread set, tmp gets opened and the caller has to close it
+static zdb_handle *zdb_get(request_rec *r, const char *zidxfname, zdb_handle *tmp)
+{
+  apr_thread_t *thd=r->connection->current_thread;
+  zdb_thread *t=0;
+  zdb_handle *h=0;
+  struct stat st;
+  apr_time_t now=apr_time_now();
+  int i;
+
+  if (thd) {
+    apr_thread_data_get((void **)&t,zdb_thread_key,thd);
+    if (!t && (t=(zdb_thread *)calloc(1,sizeof(zdb_thread))))
+      apr_thread_data_set(t,zdb_thread_key,zdb_thread_cleanup,thd);
+  }
+
+  if (t) {
+    for (i=0;i<ZDB_HANDLES;i++)
+      if (t->h[i].fname && !strcmp(t->h[i].fname,zidxfname)) {
+        h=&t->h[i];
+        h->used=now;
+        if (now-h->checked<apr_time_from_sec(fd_cache_check)) return h;
+        // Check that the names still point to the same files
+        if (!stat(zidxfname,&st) && st.st_ino==h->ino && st.st_dev==h->dev && st.st_mtime==h->mtime
+          && zdx_same(h,zidxfname)) {
+          h->checked=now;
+          return h;
+        }
+        zdb_close(h);
+        break;
+      }
+    if (!h) { // Take a free slot, or the least recently used one
+      h=&t->h[0];
+      for (i=0;i<ZDB_HANDLES && h->fname;i++)
+        if (!t->h[i].fname || t->h[i].used<h->used) h=&t->h[i];
+      zdb_close(h);
+    }
+  } else
+    h=tmp;
+
+  if (stat(zidxfname,&st) || !zdb_open(h,zidxfname,&st)) return 0;
+  h->checked=h->used=now;
+  return h;
+}
+
+// Sets the response headers for a z-index record
+static void zdb_set_headers(request_rec *r, const char *key, const char *source_url,
+  const char *scale, const char *offset, const char *uom)
+{
+  if (key) apr_table_set(r->headers_out, "Source-Key", key);
+  if (source_url) apr_table_set(r->headers_out, "Source-Data", source_url);
+  if (scale) apr_table_set(r->headers_out, "Scale", scale);
+  if (offset) apr_table_set(r->headers_out, "Offset", offset);
+  if (uom) apr_table_set(r->headers_out, "UOM", uom);
+}
+
+// Finds the keyword in the compact table, returns 1 if found
+static int zdx_lookup(request_rec *r, zdb_handle *h, const char *keyword, int *z)
+{
+  zdx_header *hd=(zdx_header *)h->map;
+  zdx_record *rec=(zdx_record *)(hd+1);
+  int lo=0,hi=hd->count-1,i=-1;
+  char *m=h->map;
+
+  if (!keyword[0]) {
+    i=hd->latest;
+  } else while (lo<=hi) {
+    int mid=(lo+hi)/2;
+    int c=strcmp(m+rec[mid].key,keyword);
+    if (!c) { i=mid; break; }
+    if (c<0) lo=mid+1; else hi=mid-1;
+  }
+  if (i<0) return 0;
+
+  *z=rec[i].z;
+  zdb_set_headers(r, m+rec[i].key, rec[i].source_url?m+rec[i].source_url:0,
+    rec[i].scale?m+rec[i].scale:0, rec[i].offset?m+rec[i].offset:0, rec[i].uom?m+rec[i].uom:0);
+  return 1;
+}
+
+// Column text, if the column exists and has the expected name
+static const char *zdb_column(sqlite3_stmt *res, int col, const char *name)
+{
+  if (sqlite3_column_count(res)<=col || strcmp(sqlite3_column_name(res, col), name)) return 0;
+  return (const char *)sqlite3_column_text(res, col);
+}
+
+// Finds the keyword in the ZDB, returns 1 if found, 0 if not, -1 on error
+static int zdb_query(request_rec *r, zdb_handle *h, const char *keyword, int *z)
+{
+  sqlite3_stmt **res=keyword[0]?&h->by_key:&h->latest;
+  int rc;
+
+  if (!*res) {
+    char *sql = keyword[0] ? "SELECT * FROM ZINDEX WHERE key_str = ? LIMIT 1" :  "SELECT * FROM ZINDEX WHERE key_str NOT LIKE '%encoded%' ORDER BY key_str DESC LIMIT 1";
+    if (SQLITE_OK != sqlite3_prepare_v2(h->db, sql, -1, res, 0)) {
+      ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Failed to fetch data from %s", h->fname);
+      *res = 0;
+      return -1;
+    }
+  }
+  if (keyword[0])
+    sqlite3_bind_text(*res, 1, keyword, strlen(keyword), SQLITE_STATIC);
+
+  rc = sqlite3_step(*res);
+  if (rc == SQLITE_ROW) {
+    *z = apr_atoi64((char*)sqlite3_column_text(*res, 0));
+    // The optional columns go in the headers, when the table has them
+    zdb_set_headers(r, zdb_column(*res, 1, "key_str"), zdb_column(*res, 2, "source_url"),
+      sqlite3_column_count(*res) > 5 ? zdb_column(*res, 3, "scale") : 0,
+      sqlite3_column_count(*res) > 5 ? zdb_column(*res, 4, "offset") : 0,
+      sqlite3_column_count(*res) > 5 ? zdb_column(*res, 5, "uom") : 0);
+  }
+  sqlite3_reset(*res);
+  sqlite3_clear_bindings(*res);
+  return rc == SQLITE_ROW;
 }
 
-char *get_keyword(request_rec *r) {
-	  char *keyword = apr_pcalloc(r->pool,24);
+// The answer of a z-index lookup, z and the response headers, packed so other requests can use it
+static const char *zdb_fields[]={"Source-Key","Source-Data","Scale","Offset","UOM"};
 
-	  static char* timearg="time=";
-	  static char* stylearg="style=";
-	  char *targ=0;
-	  char *sarg=0;
-	  apr_time_exp_t tm; tm.tm_year=0; tm.tm_mon=0; tm.tm_mday=0; tm.tm_hour=0; tm.tm_min=0; tm.tm_sec=0;
+static void *zdb_pack(request_rec *r, int z)
+{
+  const char *v[5];
+  apr_size_t size=sizeof(int);
+  char *data,*d;
+  int i;
 
-	  // Assume keyword is time for granules
-	  if ((targ=ap_strcasestr(r->args,timearg))) {
-	    targ+=5; // Skip the time= part
-	    if (strlen(targ)==24) { // Make sure time is in correct length
-			tm.tm_year=apr_atoi64(targ);
-			targ+=5; // Skip the YYYY- part
-			tm.tm_mon=apr_atoi64(targ);
-			targ+=3; // Skip the MM- part
-			tm.tm_mday=apr_atoi64(targ);
-			if (strlen(targ)==16) {
-				targ+=3;
-				tm.tm_hour = apr_atoi64(targ);
-				targ+=5;
-				tm.tm_min = apr_atoi64(targ);
-				targ+=5;
-				tm.tm_sec = apr_atoi64(targ);
-			}
-			// Check if keyword should also include style
-	    	if ((sarg=ap_strcasestr(r->args,stylearg))) {
-	    		sarg+=6; // Skip the style= part
-	    		apr_cpystrn(keyword, sarg, 8);
-	    		if (ap_strstr(keyword,"encoded")) {
-	    			sprintf(keyword,"%04d%02d%02d%02d%02d%02d|encoded",tm.tm_year,tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-	    		} else {
-	    			sprintf(keyword,"%04d%02d%02d%02d%02d%02d",tm.tm_year,tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-	    		}
-	    	}
-	    	else {
-	    		sprintf(keyword,"%04d%02d%02d%02d%02d%02d",tm.tm_year,tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-	    	}
-	    } else {
-	    	// Check if keyword should be style
-	    	if ((sarg=ap_strcasestr(r->args,stylearg))) {
-	    		sarg+=6; // Skip the style= part
-	    		apr_cpystrn(keyword, sarg, 8);
-	    		if (ap_strstr(keyword,"&TILEMA")) { // handle default styling
-	    			sprintf(keyword,"");
-	    		}
-	    	}
-//	    	else if (strlen(targ)!=0) {
-//				ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Request: %s",r->args);
-//				ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Invalid time format: %s",targ);
-//				wmts_add_error(r,400,"InvalidParameterValue","TIME", "Invalid time format, granules must be YYYY-MM-DDThh:mm:ssZ");
-//				return 0;
-//	    	}
-	    }
-	  }
+  for (i=0;i<5;i++) {
+    v[i]=apr_table_get(r->headers_out,zdb_fields[i]);
+    size+=v[i]?strlen(v[i])+2:1;
+  }
+  if (!(data=(char *)malloc(size))) return 0;
+  memcpy(data,&z,sizeof(int));
+  d=data+sizeof(int);
+  for (i=0;i<5;i++) {
+    *d++=v[i]!=0;
+    if (v[i]) {
+      strcpy(d,v[i]);
+      d+=strlen(v[i])+1;
+    }
+  }
+  return data;
+}
 
-	  return keyword;
+// Sets z and the headers from a packed answer, returns 0 if there is none
+static int zdb_unpack(request_rec *r, const char *data, int *z)
+{
+  const char *v[5];
+  int i;
+
+  if (!data) return 0;
+  memcpy(z,data,sizeof(int));
+  data+=sizeof(int);
+  for (i=0;i<5;i++)
+    if (*data++) {
+      v[i]=data;
+      data+=strlen(data)+1;
+    } else
+      v[i]=0;
+  zdb_set_headers(r,v[0],v[1],v[2],v[3],v[4]);
+  return 1;
 }
 
-// Lookup the z index from ZDB file based on keyword
 static int get_zlevel(request_rec *r, char *zidxfname, char *keyword) {
 //	ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Get z-index from %s with keyword %s", zidxfname, keyword);
 
-    sqlite3 *db;
-    sqlite3_stmt *res;
-
+    zdb_handle tmp={0};
+    zdb_handle *h;
     int z = -1;
-    int rc = sqlite3_open_v2(zidxfname, &db, SQLITE_OPEN_READONLY, NULL);
+    int found;
+    int leader;
+    flight *f;
 
     if (keyword==0) { // Bail if keyword is an error code
     	return -1; 
     }
 
-    if (rc != SQLITE_OK) {
+    if (!(h=zdb_get(r, zidxfname, &tmp))) {
         ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Cannot get z-index from %s", zidxfname);
-        sqlite3_close(db);
-        return -1;
-    }
-
-    char *sql = strlen(keyword)!=0 ? "SELECT * FROM ZINDEX WHERE key_str = ? LIMIT 1" :  "SELECT * FROM ZINDEX WHERE key_str NOT LIKE '%encoded%' ORDER BY key_str DESC LIMIT 1";
-    rc = sqlite3_prepare_v2(db, sql, -1, &res, 0);
-
-    if (rc != SQLITE_OK) {
-    	ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"Failed to fetch data from %s", zidxfname);
-        sqlite3_close(db);
         return -1;
-    } else if (strlen(keyword)!=0) {
-        sqlite3_bind_text(res, 1, keyword, strlen(keyword), SQLITE_STATIC);
     }
 
-    rc = sqlite3_step(res);
-
-    if (rc == SQLITE_ROW) {
-    	z = apr_atoi64((char*)sqlite3_column_text(res, 0));
-    	if (sqlite3_column_count(res) > 1) { // Check if there is a key_str column
-    		if (strcmp(sqlite3_column_name(res, 1), "key_str") == 0) {
-				char *key = apr_pcalloc(r->pool,strlen(sqlite3_column_text(res, 1))+1);
-				apr_cpystrn(key, (char*)sqlite3_column_text(res, 1), strlen(sqlite3_column_text(res, 1))+1);
-				apr_table_setn(r->headers_out, "Source-Key", key);
-    		}
-    	}
-    	if (sqlite3_column_count(res) > 2) { // Check if there is a source_url column
-    		if (strcmp(sqlite3_column_name(res, 2), "source_url") == 0) {
-    			if (sqlite3_column_text(res, 2) != NULL) {
-					char *source_data = apr_pcalloc(r->pool,strlen(sqlite3_column_text(res, 2))+1);
-					apr_cpystrn(source_data, (char*)sqlite3_column_text(res, 2), strlen(sqlite3_column_text(res, 2))+1);
-					apr_table_setn(r->headers_out, "Source-Data", source_data);
-    			}
-    		}
-    	}
-    	if (sqlite3_column_count(res) > 5) { // Check if there are scale, offset, and uom columns
-    		if (strcmp(sqlite3_column_name(res, 3), "scale") == 0) {
-    			if (sqlite3_column_text(res, 3) != NULL) {
-					char *scale = apr_pcalloc(r->pool,strlen(sqlite3_column_text(res, 3))+1);
-					apr_cpystrn(scale, (char*)sqlite3_column_text(res, 3), strlen(sqlite3_column_text(res, 3))+1);
-					apr_table_setn(r->headers_out, "Scale", scale);
-    			}
-    		}
-    		if (strcmp(sqlite3_column_name(res, 4), "offset") == 0) {
-    			if (sqlite3_column_text(res, 4) != NULL) {
-    				char *offset = apr_pcalloc(r->pool,strlen(sqlite3_column_text(res, 4))+1);
-					apr_cpystrn(offset, (char*)sqlite3_column_text(res, 4), strlen(sqlite3_column_text(res, 4))+1);
-					apr_table_setn(r->headers_out, "Offset", offset);
-    			}
-    		}
-    		if (strcmp(sqlite3_column_name(res, 5), "uom") == 0) {
-    			if (sqlite3_column_text(res, 5) != NULL) {
-    				char *uom = apr_pcalloc(r->pool,strlen(sqlite3_column_text(res, 5))+1);
-					apr_cpystrn(uom, (char*)sqlite3_column_text(res, 5), strlen(sqlite3_column_text(res, 5))+1);
-					apr_table_setn(r->headers_out, "UOM", uom);
-    			}
-    		}
-    	}
+    if (h->map) {
+        found = zdx_lookup(r, h, keyword, &z);
+    } else if ((f=flight_join(h->dev, h->ino, h->mtime, 0, 0, keyword, &leader)) && !leader) {
+        // Another thread ran the same query, use its answer
+        found = f->status;
+        if (found > 0 && !zdb_unpack(r, (const char *)f->data, &z))
+            found = -1;
+        flight_release(f);
     } else {
+        found = zdb_query(r, h, keyword, &z);
+        if (f) {
+            flight_land(f, found, found > 0 ? zdb_pack(r, z) : 0);
+            flight_release(f);
+        }
+    }
+    if (!found) {
     	wmts_add_error(r,404,"ImageNotFound","TIME", "Image cannot be found for the requested date and time");
     }
 
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-
+    if (h==&tmp) zdb_close(&tmp);
 	return z;
 }
 
@@ -821,17 +2433,36 @@ static char postamble[]="</ServiceException></ServiceExceptionReport>" ;
     return OK; // Request handled
 }
 
+// Get the state of this request, creates it on first use
+static wms_req_ctx *get_req_ctx(request_rec *r)
+{
+	wms_req_ctx *ctx=(wms_req_ctx *)ap_get_module_config(r->request_config,&onearth_module);
+	if (!ctx) {
+		ctx=(wms_req_ctx *)apr_pcalloc(r->pool,sizeof(wms_req_ctx));
+		ap_set_module_config(r->request_config,&onearth_module,ctx);
+	}
+	return ctx;
+}
+
+// Number of WMTS errors recorded for this request
+static int wmts_errors(request_rec *r)
+{
+	wms_req_ctx *ctx=(wms_req_ctx *)ap_get_module_config(r->request_config,&onearth_module);
+	return ctx?ctx->nerrors:0;
+}
+
 static int wmts_add_error(request_rec *r, int status, char *exceptionCode, char *locator, char *exceptionText)
 {
+	wms_req_ctx *ctx=get_req_ctx(r);
 
-	wmts_error error;
-	error.status = status;
-	error.exceptionCode = exceptionCode;
-	error.locator = locator;
-	error.exceptionText = exceptionText;
+	if (ctx->nerrors>=MAX_WMTS_ERRORS) // Enough reported already
+		return OK;
 
-	wmts_errors[errors] = error;
-	errors++;
+	wmts_error *error=&ctx->errors[ctx->nerrors++];
+	error->status = status;
+	error->exceptionCode = exceptionCode;
+	error->locator = locator;
+	error->exceptionText = exceptionText;
 
     return OK; // Request handled
 }
@@ -847,10 +2478,11 @@ static int wmts_return_all_errors(request_rec *r)
 	ap_set_content_type(r,"text/xml");
 	ap_rputs(preamble, r);
 
+	wms_req_ctx *ctx=get_req_ctx(r);
 	int i;
-	for(i = 0; i < errors; i++)
+	for(i = 0; i < ctx->nerrors; i++)
 	{
-		wmts_error error = wmts_errors[i];
+		wmts_error error = ctx->errors[i];
 
 		static char preexception[]="\n<Exception exceptionCode=\"";
 		static char prelocator[]="\" locator=\"";
@@ -874,7 +2506,7 @@ static int wmts_return_all_errors(request_rec *r)
 	}
 
 	ap_rputs(postamble, r);
-	errors = 0;
+	ctx->nerrors = 0;
 
     return OK; // Request handled
 }
@@ -882,33 +2514,274 @@ static int wmts_return_all_errors(request_rec *r)
 // It should be done for each server independently
 // arg is the value of the WMSCache directive, this is the init function.
 
-static const char *cache_dir_set(cmd_parms *cmd,void *dconf, const char *arg)
+// Map a version 2 configuration file, read-only so all the processes share it
+// Returns the Caches record, 0 on error
+static Caches *cache_map(server_rec *server, wms_cfg *cfg, int f, const char *arg)
 {
-  static char msg_onlyone[]="Only one cache configuration allowed";
+  struct stat st;
+  apr_file_t *file;
+  apr_mmap_t *mm;
+  const cache_header *hd;
+  const char *msg;
+  Caches *caches;
+  apr_off_t size;
+
+  if (fstat(f,&st) || st.st_size<(off_t)(sizeof(cache_header)+sizeof(Caches))) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+		"Can't read from configuration file %s",arg);
+    return 0;
+  }
+  size=st.st_size;
 
-  server_rec *server=cmd->server;
-  wms_cfg *cfg=(wms_cfg *)dconf;
-  int f;
-  int readb;
-  int cachesize,count;
-  Caches *caches; // Pointer to where the cache config file is loaded
-  cfg->dir = cmd->path; // Need directory path to translate REST calls properly
+  // The map belongs to the configuration pool, it goes away when the configuration does
+  if (APR_SUCCESS!=apr_os_file_put(&file,&f,APR_FOPEN_READ,cfg->p)
+    || APR_SUCCESS!=apr_mmap_create(&mm,file,0,size,APR_MMAP_READ,cfg->p)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+		"Can't map configuration file %s",arg);
+    return 0;
+  }
 
-  // This should never happen
-  if (!cfg) {
-    ap_log_error(APLOG_MARK,APLOG_ERR,0,server, "Can't find module configuration");
+  hd=(const cache_header *)mm->mm;
+  caches=OE_CACHES(hd);
+  if ((msg=oe_config_check(hd,size))) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+		"Configuration file %s can't be used, %s",arg,msg);
     return 0;
   }
 
-  if (cfg->caches) return msg_onlyone;
+  cfg->key_masks=(cache_key_masks *)apr_pcalloc(cfg->p,sizeof(cache_key_masks));
+  if (oe_key_masks_load(cfg->key_masks,hd,caches)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+		"Configuration file %s can't be used, too many wildcard layer keys",arg);
+    return 0;
+  }
+  cfg->header=hd;
+  return caches;
+}
+
+//
+// Hot reload of the cache configurations, see WMSCacheReload
+// A thread in each child checks the WMSCache files and loads a changed one into a new
+// snapshot, in its own pool, which then replaces the current one.  Requests take a
+// reference to the current snapshot, the old one is freed when the last request using it
+// is done.  Until the first reload, requests use the configuration loaded at startup
+//
+
+typedef struct {
+  wms_cfg cfg;                // Loaded from the file, cfg.p is the snapshot pool
+  volatile apr_uint32_t refs; // Requests using it, plus one while it is current
+} wms_snapshot;
+
+typedef struct wms_reload {
+  const char *fname;         // The WMSCache file
+  struct stat st;            // Identity of the file last loaded
+  int pattern_memory;        // WMSPatternMemory of the directory, for the reloaded copies
+  wms_snapshot *current;     // Latest configuration, 0 for the one loaded at startup
+  apr_thread_mutex_t *mutex; // Protects current, per child
+  struct wms_reload *next;
+} wms_reload;
+
+static struct {
+  wms_reload *list;     // Every WMSCache, in the configuration pool
+  int interval;         // Seconds between checks, 0 disables reloading
+  server_rec *server;
+  apr_thread_t *thread;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  int stop;
+  volatile apr_uint32_t reloads; // Done by this process
+} cache_reload;
+
+//
+// Empty tiles, read when a configuration is loaded
+// Most levels of most layers use the same few empty tiles, often from the same data file.
+// Each distinct file, offset and size is read once, by a few threads, and tiles with the same
+// content are kept only once, in a pool shared by all the configurations
+//
+
+#define EMPTY_THREADS 8 // Most threads reading empty tiles
+
+// One empty tile read, for all the levels that use the same file, offset and size
+typedef struct {
+  const char *fname;
+  apr_off_t offset;
+  apr_size_t size;
+  void *data;        // malloc-ed by the reader, 0 if the read failed
+} empty_read;
+
+// A level that needs an empty tile
+typedef struct {
+  int cache,level;
+  int read;          // In the reads array
+} empty_use;
+
+typedef struct {
+  wms_cfg *cfg;
+  apr_pool_t *p;          // Temporary
+  apr_hash_t *by_source;  // Read number plus one, by file, offset and size
+  apr_array_header_t *reads,*uses;
+  volatile apr_uint32_t next; // Next read to do
+  apr_pool_t *tp;         // Where new empty tiles are kept
+  apr_hash_t *tiles;      // Empty tiles in tp, keyed by the content
+} empty_list;
+
+// Filled while reading the configuration, shared by all the WMSCache directives.  After
+// that it is only read, a reload keeps the tiles that are not here with its snapshot
+static struct {
+  apr_pool_t *p;      // Configuration lifetime, the empty tile data
+  apr_hash_t *tiles;  // The data, keyed by the content
+  int done;           // The configuration has been read
+} empty_tiles;
+
+static apr_status_t empty_tiles_cleanup(void *data)
+{
+  empty_tiles.p=0;
+  empty_tiles.tiles=0;
+  empty_tiles.done=0;
+  return APR_SUCCESS;
+}
+
+// The shared pool lives as long as the configuration pool
+static void empty_tiles_init(apr_pool_t *pconf)
+{
+  if (empty_tiles.p) return;
+  if (APR_SUCCESS!=apr_pool_create(&empty_tiles.p,pconf)) {
+    empty_tiles.p=0;
+    return;
+  }
+  empty_tiles.tiles=apr_hash_make(empty_tiles.p);
+  apr_pool_cleanup_register(empty_tiles.p,0,empty_tiles_cleanup,apr_pool_cleanup_null);
+}
+
+static void empty_list_init(empty_list *el, wms_cfg *cfg)
+{
+  el->cfg=cfg;
+  apr_pool_create(&el->p,cfg->p);
+  el->by_source=apr_hash_make(el->p);
+  el->reads=apr_array_make(el->p,16,sizeof(empty_read));
+  el->uses=apr_array_make(el->p,64,sizeof(empty_use));
+  el->next=0;
+  if (empty_tiles.p && !empty_tiles.done) {
+    el->tp=empty_tiles.p;
+    el->tiles=empty_tiles.tiles;
+  } else { // Not set up or a reload, keep them with this configuration
+    el->tp=cfg->p;
+    el->tiles=apr_hash_make(el->p);
+  }
+}
+
+// Adds the empty tile of a level
+static void empty_add(empty_list *el, int count, int lev_num)
+{
+  WMSCache *cache=GETCACHE(el->cfg->caches,count);
+  WMSlevel *level=GETLEVELS(cache)+lev_num;
+  const char *fname=level_fname(el->cfg,count,level,1)->name;
+  const char *key=apr_psprintf(el->p,"%s %" APR_INT64_T_FMT " %" APR_INT64_T_FMT,fname,
+    (apr_int64_t)level->empty_record.offset,(apr_int64_t)level->empty_record.size);
+  apr_uintptr_t n=(apr_uintptr_t)apr_hash_get(el->by_source,key,APR_HASH_KEY_STRING);
+  empty_use *use;
+
+  if (!n) {
+    empty_read *rd=(empty_read *)apr_array_push(el->reads);
+    rd->fname=fname;
+    rd->offset=level->empty_record.offset;
+    rd->size=level->empty_record.size;
+    rd->data=0;
+    n=el->reads->nelts;
+    apr_hash_set(el->by_source,key,APR_HASH_KEY_STRING,(void *)n);
+  }
+  use=(empty_use *)apr_array_push(el->uses);
+  use->cache=count;
+  use->level=lev_num;
+  use->read=n-1;
+}
+
+static void * APR_THREAD_FUNC empty_reader(apr_thread_t *thread, void *data)
+{
+  empty_list *el=(empty_list *)data;
+  empty_read *reads=(empty_read *)el->reads->elts;
+  apr_uint32_t i;
+
+  while ((i=apr_atomic_inc32(&el->next))<(apr_uint32_t)el->reads->nelts) {
+    empty_read *rd=reads+i;
+    int fd=open(rd->fname,O_RDONLY);
+    if (fd<0) continue;
+    if ((rd->data=malloc(rd->size)) && (ssize_t)rd->size!=pread64(fd,rd->data,rd->size,rd->offset)) {
+      free(rd->data);
+      rd->data=0;
+    }
+    close(fd);
+  }
+  if (thread) apr_thread_exit(thread,APR_SUCCESS);
+  return 0;
+}
+
+// Reads the empty tiles and hooks them up to the levels
+static void empty_load(server_rec *server, empty_list *el)
+{
+  wms_cfg *cfg=el->cfg;
+  empty_read *reads=(empty_read *)el->reads->elts;
+  empty_use *uses=(empty_use *)el->uses->elts;
+  apr_thread_t *threads[EMPTY_THREADS];
+  int i,n=0;
+
+  // A few threads, or just this one
+  for (i=0;i<EMPTY_THREADS && i<el->reads->nelts/4;i++)
+    if (APR_SUCCESS==apr_thread_create(threads+n,NULL,empty_reader,el,el->p)) n++;
+  empty_reader(0,el);
+  for (i=0;i<n;i++) {
+    apr_status_t rv;
+    apr_thread_join(&rv,threads[i]);
+  }
+
+  // Keep one copy of each content
+  for (i=0;i<el->reads->nelts;i++) {
+    void *data=0;
+    if (!reads[i].data) continue;
+    if (empty_tiles.tiles)
+      data=apr_hash_get(empty_tiles.tiles,reads[i].data,reads[i].size);
+    if (!data && !(data=apr_hash_get(el->tiles,reads[i].data,reads[i].size))) {
+      data=apr_pmemdup(el->tp,reads[i].data,reads[i].size);
+      apr_hash_set(el->tiles,data,reads[i].size,data);
+    }
+    free(reads[i].data);
+    reads[i].data=data;
+  }
+
+  for (i=0;i<el->uses->nelts;i++) {
+    wms_empty_record *empty=cfg->meta[uses[i].cache].empties+uses[i].level;
+    // If an error happened, report and mark it as unavailable to prevent crashes
+    if (!(empty->data=reads[uses[i].read].data)) {
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+        "Failed empty tile read for %s level %d, %d bytes at %d",
+        GETSTRING(cfg->caches,GETCACHE(cfg->caches,uses[i].cache)->pattern),uses[i].level,
+        (int) empty->index.size,(int) empty->index.offset);
+      empty->index.size=0;
+    }
+  }
+  ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server,
+    "%d empty tiles for %d levels, %d tiles kept",el->reads->nelts,el->uses->nelts,
+    (int)apr_hash_count(el->tiles));
+  apr_pool_destroy(el->p);
+}
+
+// Loads the cache configuration file arg into cfg, allocating from cfg->p
+// Returns 0 on success, -1 if the file can't be used
+static int cache_load(server_rec *server, wms_cfg *cfg, const char *arg)
+{
+  int f;
+  int readb;
+  int cachesize,count;
+  Caches *caches; // Pointer to where the cache config file is loaded
+  char *use_regex=0; // Version 2, caches that are not in the layer hash table
+  empty_list el;
 
   if (0>(f=open(arg,O_RDONLY))) { 
     ap_log_error(APLOG_MARK,APLOG_ERR,0,server, 
     		"MOD_ONEARTH: Can't open cache config file\n file %s: %s",arg,strerror(errno));
     cfg->caches=(Caches *)apr_pcalloc(cfg->p,sizeof(Caches));
     cfg->caches->size=0 ; cfg->caches->count=0;
-    close(f);
-    return 0;
+    return -1;
   }
 
   readb=read(f,&cachesize,sizeof(cachesize));
@@ -917,26 +2790,33 @@ static const char *cache_dir_set(cmd_parms *cmd,void *dconf, const char *arg)
     ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
 		"Can't read from configuration file");
     close(f);
-    return 0;
+    return -1;
   }
-  ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server, 
-  		"Cache file size is %d", cachesize);
 
-  if (!(caches=(Caches *)apr_pcalloc(cfg->p, cachesize))) {
-    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+  if (!memcmp(&cachesize,CACHE_MAGIC,sizeof(cachesize))) { // Version 2, map it
+    caches=cache_map(server,cfg,f,arg);
+    close(f);
+    if (!caches) return -1;
+  } else { // Version 1 starts with the size
+    ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server, 
+		"Cache file size is %d", cachesize);
+
+    if (!(caches=(Caches *)apr_pcalloc(cfg->p, cachesize))) {
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
 		"Can't get memory for cache configuration");
-    close(f); return 0;
-  }
+      close(f); return -1;
+    }
 
-  caches->size=cachesize;
-  // Read the rest of the cache file and close it
-  readb=read(f,&(caches->count),cachesize-sizeof(cachesize));
-  close(f);
-  if (cachesize-sizeof(cachesize)!=readb)
-  {
-    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+    caches->size=cachesize;
+    // Read the rest of the cache file and close it
+    readb=read(f,&(caches->count),cachesize-sizeof(cachesize));
+    close(f);
+    if (cachesize-sizeof(cachesize)!=readb)
+    {
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
 		"Can't read from configuration file");
-    return 0;
+      return -1;
+    }
   }
 
   // Hook it up
@@ -949,34 +2829,58 @@ static const char *cache_dir_set(cmd_parms *cmd,void *dconf, const char *arg)
 
   // Now prepare the regexps and mime types
   cfg->meta=(meta_cache *)apr_pcalloc(cfg->p,count*sizeof(meta_cache));
+  empty_list_init(&el,cfg);
+  cfg->layer_index=apr_hash_make(cfg->p);
+  if (!cfg->header)
+    cfg->key_masks=(cache_key_masks *)apr_pcalloc(cfg->p,sizeof(cache_key_masks));
+  cfg->fallback=apr_array_make(cfg->p,0,sizeof(int));
+
+  // Version 2 has the layer hash table, only the fallback caches need regexps
+  if (cfg->header) {
+    const int *fallback=(const int *)((char *)caches+cfg->header->fallback_offset);
+    int i;
+    use_regex=(char *)apr_pcalloc(cfg->p,count+1);
+    for (i=0;i<cfg->header->fallback_count;i++)
+      if (fallback[i]>=0 && fallback[i]<count) {
+        APR_ARRAY_PUSH(cfg->fallback,int)=fallback[i];
+        use_regex[fallback[i]]=1;
+      }
+  }
 
   while (count--) {
-    int i;
+    int i,indexed;
     char *pattern;
     WMSCache *cache;
 
     // Compile the regexp(s)
     cache=GETCACHE(caches,count);
 
-    // Adjust the relative pointers, by adding the start of the real storage area
-    cache->pattern+=(apr_off_t)caches;
-    cache->prefix+=(apr_off_t)caches;
-    cache->time_period+=(apr_off_t)caches;
-    cache->zidxfname+=(apr_off_t)caches;
+    // Parse the time periods once, for snapping
+    compile_periods(cfg->p,&cfg->meta[count].periods,GETSTRING(caches,cache->time_period),cache->num_periods);
+    if (cache->zidxfname)
+      oe_fname_init(&cfg->meta[count].zidx,cache_fname(cfg->p,cfg,cache->zidxfname));
 
     ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server,
       "Cache number %d at %llx, count %d, first string %s",count,(long long) cache,
-      cache->num_patterns,cache->pattern);
-
-    // Allocate the table for regexps
-    cfg->meta[count].regex=
-      (ap_regex_t**) apr_pcalloc(cfg->p, (cache->num_patterns)*sizeof(ap_regex_t *));
-    pattern=cache->pattern;
-    for (i=0;i<cache->num_patterns;i++) {
-      if (!(cfg->meta[count].regex[i]=ap_pregcomp(cfg->p,pattern,0)))
-	ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
-	  "Can't compile expression %s",pattern);
-      pattern+=strlen(pattern)+1; // Skip the zero at the end, ready for the next one
+      cache->num_patterns,GETSTRING(caches,cache->pattern));
+
+    pattern=GETSTRING(caches,cache->pattern);
+    if (!use_regex || use_regex[count]) {
+      // Allocate the table for regexps
+      cfg->meta[count].regex=
+        (ap_regex_t**) apr_pcalloc(cfg->p, (cache->num_patterns)*sizeof(ap_regex_t *));
+      indexed=1;
+      for (i=0;i<cache->num_patterns;i++) {
+        if (!(cfg->meta[count].regex[i]=ap_pregcomp(cfg->p,pattern,0)))
+	  ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
+	    "Can't compile expression %s",pattern);
+        // WMTS patterns with literal values go in the layer index, the rest are matched by regexp
+        if (!use_regex && !index_wmts_pattern(cfg,pattern,count))
+          indexed=0;
+        pattern+=strlen(pattern)+1; // Skip the zero at the end, ready for the next one
+      }
+      if (!indexed)
+        APR_ARRAY_PUSH(cfg->fallback,int)=count;
     }
 
     ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server,
@@ -985,83 +2889,225 @@ static const char *cache_dir_set(cmd_parms *cmd,void *dconf, const char *arg)
     if (cache->levels) {
       int lev_num;
       WMSlevel *levelt= GETLEVELS(cache); // Table of offsets
+      apr_size_t ixsize=oe_level_index_size(cache);
+      oe_level_index_build(&cfg->meta[count].levels,cache,apr_palloc(cfg->p,ixsize?ixsize:1));
+      char *prefix=GETSTRING(caches,cache->prefix);
       ap_log_error(APLOG_MARK,APLOG_DEBUG,0,server,
         "Cache has %d levels", cache->levels);
       // Set the type
-      if (ap_find_token(cfg->p,cache->prefix,"jpeg")) 
+      if (ap_find_token(cfg->p,prefix,"jpeg")) 
 	cfg->meta[count].mime_type=apr_pstrdup(cfg->p,"image/jpeg");
-      else if (ap_find_token(cfg->p,cache->prefix,"png")) 
+      else if (ap_find_token(cfg->p,prefix,"png")) 
 	cfg->meta[count].mime_type=apr_pstrdup(cfg->p,"image/png");
-      else if (ap_find_token(cfg->p,cache->prefix,"tiff"))
+      else if (ap_find_token(cfg->p,prefix,"tiff"))
  	cfg->meta[count].mime_type=apr_pstrdup(cfg->p,"image/tiff");
-      else if (ap_find_token(cfg->p,cache->prefix,"lerc"))
+      else if (ap_find_token(cfg->p,prefix,"lerc"))
  	cfg->meta[count].mime_type=apr_pstrdup(cfg->p,"image/lerc");
-      else if (ap_find_token(cfg->p,cache->prefix,"vnd.mapbox-vector-tile"))
+      else if (ap_find_token(cfg->p,prefix,"vnd.mapbox-vector-tile"))
  	cfg->meta[count].mime_type=apr_pstrdup(cfg->p,"application/vnd.mapbox-vector-tile");
       else {
 	ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
-	  "Type not found, using text/html for cache %s", cache->pattern);
+	  "Type not found, using text/html for cache %s", GETSTRING(caches,cache->pattern));
 	cfg->meta[count].mime_type=apr_pstrdup(cfg->p,"text/html");
       }
       cfg->meta[count].empties=apr_pcalloc(cfg->p, cache->levels*sizeof(wms_empty_record));
+      cfg->meta[count].fnames=apr_palloc(cfg->p, 2*cache->levels*sizeof(oe_fname));
 
-      // Initialize the empties and use this loop to adjust all the string name pointers 
+      // Initialize the file names and the empties, which get read once all the caches are known
       for (lev_num=0;lev_num<cache->levels;lev_num++,levelt++) {
-	WMSlevel *prev_level=levelt-1; // preceding level
-	// We might as well use this loop to adjust all the file name
-	// pointers
-	levelt->dfname+=(apr_off_t)caches;
-	levelt->ifname+=(apr_off_t)caches;
-
-	cfg->meta[count].empties[lev_num].data=0;
+	oe_fname_init(cfg->meta[count].fnames+2*lev_num,cache_fname(cfg->p,cfg,levelt->ifname));
+	oe_fname_init(cfg->meta[count].fnames+2*lev_num+1,cache_fname(cfg->p,cfg,levelt->dfname));
 	cfg->meta[count].empties[lev_num].index.size   = 
 	    levelt->empty_record.size;
 	cfg->meta[count].empties[lev_num].index.offset = 
 	    levelt->empty_record.offset;
-
-	// Read them, if available
-        if (levelt->empty_record.size) {
-	  //
-	  // To save space, since most levels of a cache use the same empty tile
-	  // Use the previous level if the information matches
-	  // The dfname is a direct pointer comparison
-	  //
-	  if ((lev_num>0) && 
-	      (prev_level->empty_record.size==levelt->empty_record.size) &&
-	      (prev_level->empty_record.offset==levelt->empty_record.offset) &&
-	      (prev_level->dfname==levelt->dfname)) { 
-	    // All match
-	    cfg->meta[count].empties[lev_num].data=
-		cfg->meta[count].empties[lev_num-1].data;
-	  } else { 
-	    // Try to read the record
-		  char *dfname;
-		  if (levelt->dfname[0] == '/') { // decide absolute or relative path from cachedir
-			  dfname = apr_pstrcat(cfg->p,levelt->dfname,0);
-		  } else {
-			  dfname = apr_pstrcat(cfg->p,cfg->cachedir,levelt->dfname,0);
-		  }
-		  cfg->meta[count].empties[lev_num].data=
-				  p_file_pread(cfg->p,dfname,
-						  levelt->empty_record.size,levelt->empty_record.offset);
-	  }
-
-	  // If an error happened, report and mark it as unavailable to prevent crashes
-	  if (!cfg->meta[count].empties[lev_num].data) {
-	    ap_log_error(APLOG_MARK,APLOG_ERR,0,server,
-		"Failed empty tile read for %s level %d, %d bytes at %d", 
-		cache->pattern, lev_num, 
-		(int) cfg->meta[count].empties[lev_num].index.size,
-		(int) cfg->meta[count].empties[lev_num].index.offset);
-	    cfg->meta[count].empties[lev_num].index.size=0;
-	  }
-        }
+	if (levelt->empty_record.size)
+	  empty_add(&el,count,lev_num);
       }
     }
   }
+
+  matcher_build(server,cfg);
+  empty_load(server,&el);
+  return 0;
+}
+
+static const char *cache_dir_set(cmd_parms *cmd,void *dconf, const char *arg)
+{
+  static char msg_onlyone[]="Only one cache configuration allowed";
+
+  server_rec *server=cmd->server;
+  wms_cfg *cfg=(wms_cfg *)dconf;
+  wms_reload *rl;
+
+  // This should never happen
+  if (!cfg) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,server, "Can't find module configuration");
+    return 0;
+  }
+  cfg->dir = cmd->path; // Need directory path to translate REST calls properly
+
+  if (cfg->caches) return msg_onlyone;
+
+  // Remember the file, so it can be reloaded when it changes
+  rl=(wms_reload *)apr_pcalloc(cfg->p,sizeof(wms_reload));
+  rl->fname=apr_pstrdup(cfg->p,arg);
+  rl->pattern_memory=cfg->pattern_memory;
+  stat(arg,&rl->st);
+  rl->next=cache_reload.list;
+  cache_reload.list=rl;
+  cfg->reload=rl;
+
+  // The blank tiles the CGI would send, unless WMSBlankTile named others
+  if (!blank_find(cfg,"image/jpeg"))
+    blank_load(cmd->pool,cfg,cmd->path,"image/jpeg","black.jpg");
+  if (!blank_find(cfg,"image/png"))
+    blank_load(cmd->pool,cfg,cmd->path,"image/png","transparent.png");
+
+  empty_tiles_init(cmd->pool);
+  cache_load(server,cfg,arg);
+  return 0;
+}
+
+static apr_status_t snapshot_release(void *data)
+{
+  wms_snapshot *snap=(wms_snapshot *)data;
+  if (!apr_atomic_dec32(&snap->refs)) apr_pool_destroy(snap->cfg.p);
+  return APR_SUCCESS;
+}
+
+// The configuration for this request
+// With reloading on, this is the configuration that was current when the request first
+// asked for it.  The request holds a reference to it until it is done, so a reload
+// doesn't free it from under the request
+static wms_cfg *get_cfg(request_rec *r)
+{
+  wms_cfg *cfg=(wms_cfg *)ap_get_module_config(r->per_dir_config,&onearth_module);
+  wms_reload *rl;
+  wms_snapshot *snap;
+  wms_req_ctx *ctx;
+
+  if (!cfg || !(rl=cfg->reload) || !rl->mutex) return cfg;
+  ctx=get_req_ctx(r);
+  if (ctx->cfg) return ctx->cfg;
+
+  apr_thread_mutex_lock(rl->mutex);
+  if ((snap=rl->current)) apr_atomic_inc32(&snap->refs);
+  apr_thread_mutex_unlock(rl->mutex);
+  if (!snap) return ctx->cfg=cfg; // Not reloaded yet
+
+  ctx->cfg=(wms_cfg *)apr_palloc(r->pool,sizeof(wms_cfg));
+  *ctx->cfg=snap->cfg;
+  // These come from the directory, not from the file
+  ctx->cfg->dir=cfg->dir;
+  ctx->cfg->sendfile=cfg->sendfile;
+  ctx->cfg->empty_vector=cfg->empty_vector;
+  ctx->cfg->blanks=cfg->blanks;
+  ctx->cfg->reload=rl;
+  apr_pool_cleanup_register(r->pool,snap,snapshot_release,apr_pool_cleanup_null);
+  return ctx->cfg;
+}
+
+// Loads the file again if it changed since the last check, then makes it current
+// Runs in the reload thread.  A file that can't be loaded leaves the current one in use
+static void cache_reload_check(wms_reload *rl)
+{
+  struct stat st;
+  apr_pool_t *p;
+  wms_snapshot *snap,*old;
+
+  if (stat(rl->fname,&st)) return; // Probably being replaced, try again later
+  if (st.st_dev==rl->st.st_dev && st.st_ino==rl->st.st_ino
+    && st.st_mtime==rl->st.st_mtime && st.st_size==rl->st.st_size) return;
+
+  // Its own pool and allocator, the last request using it might run in any thread
+  if (APR_SUCCESS!=apr_pool_create_unmanaged_ex(&p,NULL,NULL)) return;
+  snap=(wms_snapshot *)apr_pcalloc(p,sizeof(wms_snapshot));
+  snap->cfg.p=p;
+  snap->cfg.pattern_memory=rl->pattern_memory;
+  if (cache_load(cache_reload.server,&snap->cfg,rl->fname) || !snap->cfg.caches->count) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,cache_reload.server,
+      "Reload of %s failed, still using the previous configuration",rl->fname);
+    apr_pool_destroy(p);
+    return;
+  }
+  // Only now, a file that failed to load, maybe because it was still being written, is tried again
+  rl->st=st;
+  snap->refs=1; // The reference held while it is current
+
+  apr_thread_mutex_lock(rl->mutex);
+  old=rl->current;
+  rl->current=snap;
+  apr_thread_mutex_unlock(rl->mutex);
+  if (old) snapshot_release(old);
+
+  apr_atomic_inc32(&cache_reload.reloads);
+  ap_log_error(APLOG_MARK,APLOG_NOTICE,0,cache_reload.server,
+    "Reloaded %s, %d caches",rl->fname,snap->cfg.caches->count);
+}
+
+static void * APR_THREAD_FUNC cache_reload_thread(apr_thread_t *thread, void *data)
+{
+  apr_thread_mutex_lock(cache_reload.mutex);
+  while (!cache_reload.stop) {
+    wms_reload *rl;
+    apr_thread_cond_timedwait(cache_reload.cond,cache_reload.mutex,
+      apr_time_from_sec(cache_reload.interval));
+    if (cache_reload.stop) break;
+    apr_thread_mutex_unlock(cache_reload.mutex);
+    for (rl=cache_reload.list;rl;rl=rl->next)
+      cache_reload_check(rl);
+    apr_thread_mutex_lock(cache_reload.mutex);
+  }
+  apr_thread_mutex_unlock(cache_reload.mutex);
+  apr_thread_exit(thread,APR_SUCCESS);
   return 0;
 }
 
+static apr_status_t cache_reload_cleanup(void *data)
+{
+  apr_status_t rv;
+  wms_reload *rl;
+
+  apr_thread_mutex_lock(cache_reload.mutex);
+  cache_reload.stop=1;
+  apr_thread_cond_signal(cache_reload.cond);
+  apr_thread_mutex_unlock(cache_reload.mutex);
+  apr_thread_join(&rv,cache_reload.thread);
+
+  for (rl=cache_reload.list;rl;rl=rl->next) {
+    wms_snapshot *snap;
+    apr_thread_mutex_lock(rl->mutex);
+    snap=rl->current;
+    rl->current=0;
+    apr_thread_mutex_unlock(rl->mutex);
+    if (snap) snapshot_release(snap);
+  }
+  return APR_SUCCESS;
+}
+
+// Per child, starts the thread that watches the configuration files
+static void cache_reload_init(apr_pool_t *p, server_rec *s)
+{
+  wms_reload *rl;
+
+  if (cache_reload.interval<=0 || !cache_reload.list) return;
+  cache_reload.server=s;
+  cache_reload.stop=0;
+  for (rl=cache_reload.list;rl;rl=rl->next)
+    if (APR_SUCCESS!=apr_thread_mutex_create(&rl->mutex,APR_THREAD_MUTEX_DEFAULT,p)) {
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"Can't create reload mutex, reload disabled");
+      return;
+    }
+  if (APR_SUCCESS!=apr_thread_mutex_create(&cache_reload.mutex,APR_THREAD_MUTEX_DEFAULT,p)
+    || APR_SUCCESS!=apr_thread_cond_create(&cache_reload.cond,p)
+    || APR_SUCCESS!=apr_thread_create(&cache_reload.thread,NULL,cache_reload_thread,0,p)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"Can't start the reload thread, reload disabled");
+    return;
+  }
+  apr_pool_cleanup_register(p,0,cache_reload_cleanup,apr_pool_cleanup_null);
+}
+
 // find the string "bbox=", return a pointer after the equal sign
 // Might be faster to use regex, but this should be faster
 
@@ -1106,24 +3152,14 @@ static WMSlevel *wmts_get_matching_level(request_rec *r,
 		WMSCache *cache)
 {
 
-   unsigned char *args;
-   char *pszl;
-   int lcount,i;
+   wms_args *args=parse_args(r);
 
    //ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
    //   "In wmts_get_matching_level");
-   // Convert the whole input string to uppercase
-   args=(unsigned char *)apr_pstrdup(r->pool,r->args);
-   for (i=0;args[i]!=0;i++) args[i]=apr_toupper(args[i]);
-
-   if (!(pszl=ap_strstr(apr_pstrdup(r->pool,r->args),Matrix)))
+   if (WMS_REQ_WMTS!=args->type)
      return (WMSlevel *)1;
 
-   lcount=apr_atoi64(pszl+matrix_len);
-   if (lcount>=cache->levels)
-     return (WMSlevel *)0;
-  
-   return GETLEVELS(cache)+cache->levels-1-lcount;
+   return oe_wmts_level(cache,args->matrix);
 }
 
 // Find a level which matches
@@ -1131,15 +3167,12 @@ static WMSlevel *wmts_get_matching_level(request_rec *r,
 // Returns 1 if bbox is broken, can't be a real pointer
 // Returns 2 if bbox is too far from binary level
 static WMSlevel *wms_get_matching_level(request_rec *r,
-                WMSCache *cache, wms_wmsbbox *bb)
+                WMSCache *cache, const meta_cache *meta, wms_wmsbbox *bb)
 
 {
   char *bbstring;
+  double v[4];
 
-  double plevel;
-  int i;
-  WMSlevel *levelt;
-  
   if (!(bbstring=getbbox(r->args))) {
     ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
       "No bbox found");
@@ -1148,52 +3181,37 @@ static WMSlevel *wms_get_matching_level(request_rec *r,
 
   // only four floating point numbers allowed in bbox param
   // Five might mean a bad floating point separator
-  if (4!=sscanf(bbstring,"%lf,%lf,%lf,%lf,%lf",
-                &bb->x0,&bb->y0,&bb->x1,&bb->y1, &plevel))
+  if (!oe_parse_bbox(bbstring,v))
     return (WMSlevel *)1; // Error code, bad bbox
+  bb->x0=v[0]; bb->y0=v[1]; bb->x1=v[2]; bb->y1=v[3];
 
-  plevel=bb->x1-bb->x0; // Target level
-
-  levelt=GETLEVELS(cache);
-
-  for (i=cache->levels;i;i--,levelt++) 
-    if ( (plevel>levelt->levelx*0.965)&&
-         (plevel<levelt->levelx*1.035) ) break;
-
-  return i?levelt:0; // Zero is not found, othewise it returns a pointer
+  // The level with the tile width, zero if there is none
+  return oe_twms_level(cache,&meta->levels,bb->x1-bb->x0);
 }
 
 static apr_off_t wmts_get_index_offset(request_rec *r, WMSlevel *level)
 {
- char *args;
- char *pszx,*pszy;
+ wms_args *args=parse_args(r);
  // The tile indices are directly passed from the top-left
- int x,y,i;
+ int x,y;
  
  //ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
  //     "In wmts_get_index_offset");
 
- // Convert the whole input string to uppercase
- args=apr_pstrdup(r->pool,r->args);
- for (i=0;args[i]!=0;i++) args[i]=apr_toupper(args[i]);
-
- pszx=ap_strstr(args,"TILEROW=");
- pszy=ap_strstr(args,"TILECOL=");
-
- if ((0==pszx)||(0==pszy)) {
+ if (WMS_REQ_WMTS!=args->type) {
     ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Can't find TILEROW= or TILECOL= in %s",
-    	r->args);
+    	r->args?r->args:r->uri);
     return -1;
  }
 
- y=apr_atoi64(pszx+8);
- x=apr_atoi64(pszy+8);
+ y=args->row;
+ x=args->col;
  //ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
  //     "In wmts_get_index_offset col %d row %d",x,y);
 
  if (x<0 || x>=level->xcount || y<0 || y>=level->ycount ) {
     ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Col or Row overflow, max values are %d and %d, %s ",
-    	level->xcount-1, level->ycount-1, r->args);
+    	level->xcount-1, level->ycount-1, r->args?r->args:r->uri);
     if (x<0 || x>=level->xcount) {
     	char *tilecol_mes = apr_psprintf(r->pool, "TILECOL is out of range, maximum value is %d",level->xcount-1);
     	wmts_add_error(r,400,"TileOutOfRange","TILECOL", tilecol_mes);
@@ -1204,30 +3222,21 @@ static apr_off_t wmts_get_index_offset(request_rec *r, WMSlevel *level)
     }
     return -1;
  }
-// int level_int = level->index_add + sizeof(index_s) * (y*level->xcount+x);
-// ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "offset: %d, max values are %d and %d, x: %d, y: %d, index_add: %d",
-//		 level_int, level->xcount-1, level->ycount-1, x, y, level->index_add);
- return level->index_add + sizeof(index_s) * (y*level->xcount+x);
+// ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "max values are %d and %d, x: %d, y: %d, index_add: %d",
+//		 level->xcount-1, level->ycount-1, x, y, level->index_add);
+ return oe_index_offset(level,y,x,0,0);
  
 }
 
 static apr_off_t wmts_get_index_offset_z(request_rec *r, WMSlevel *level, long long z, long long zlevels)
 {
- char *args;
- char *pszx,*pszy;
+ wms_args *args=parse_args(r);
  // The tile indices are directly passed from the top-left
- long long x,y,i;
+ long long x,y;
 
- // Convert the whole input string to uppercase
- args=apr_pstrdup(r->pool,r->args);
- for (i=0;args[i]!=0;i++) args[i]=apr_toupper(args[i]);
-
- pszx=ap_strstr(args,"TILEROW=");
- pszy=ap_strstr(args,"TILECOL=");
-
- if ((0==pszx)||(0==pszy)) {
+ if (WMS_REQ_WMTS!=args->type) {
     ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Can't find TILEROW= or TILECOL= in %s",
-    	r->args);
+    	r->args?r->args:r->uri);
     return -1;
  }
 
@@ -1236,12 +3245,12 @@ static apr_off_t wmts_get_index_offset_z(request_rec *r, WMSlevel *level, long l
     return 0;
  }
 
- y=apr_atoi64(pszx+8);
- x=apr_atoi64(pszy+8);
+ y=args->row;
+ x=args->col;
 
  if (x<0 || x>=level->xcount || y<0 || y>=level->ycount ) {
     ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Col or Row overflow, max values are %d and %d, %s ",
-    	level->xcount-1, level->ycount-1, r->args);
+    	level->xcount-1, level->ycount-1, r->args?r->args:r->uri);
     if (x<0 || x>=level->xcount) {
     	char *tilecol_mes = apr_psprintf(r->pool, "TILECOL is out of range, maximum value is %d",level->xcount-1);
     	wmts_add_error(r,400,"TileOutOfRange","TILECOL", tilecol_mes);
@@ -1253,13 +3262,7 @@ static apr_off_t wmts_get_index_offset_z(request_rec *r, WMSlevel *level, long l
     return -1;
  }
 
- long long level_int = level->index_add + sizeof(index_s) * (y*level->xcount+x);
- long long level_z = (level->xcount*level->ycount*zlevels)*sizeof(index_s)/zlevels*z;
-
-// ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "offset: %d, max values are %d and %d, x: %d, y: %d, index_add: %d",
-//		 level_int+level_z, level->xcount-1, level->ycount-1, x, y, level->index_add);
-
- return level_int+level_z;
+ return oe_index_offset(level,y,x,z,zlevels);
 }
 
 
@@ -1532,13 +3535,10 @@ static int kml_handler (request_rec *r)
     "</LatLonBox></GroundOverlay></Document></kml>\n";
 
   // Get the configuration
-  cfg=(wms_cfg *) 
-    ap_get_module_config(r->per_dir_config,&onearth_module);
+  cfg=get_cfg(r);
 
   if ((0==cfg)||(0==cfg->caches)||(0==cfg->caches->count)) return DECLINED; // No caches
 
-  count=cfg->caches->count;
-
   // Look for a google-earth request type
   format_p=ap_strstr(r->args,kmltype);
   // Paranoid check, this is guaranteed by the caller
@@ -1551,34 +3551,15 @@ static int kml_handler (request_rec *r)
  
   // Try a png request first
   image_arg=apr_pstrcat(r->pool,r->args,"image%2Fpng",the_rest,0);
-
-  while (count--) {
-    int i;
-    cache=GETCACHE(cfg->caches,count);
-    i=cache->num_patterns;
-    while (i--)
-      if (!ap_regexec(cfg->meta[count].regex[i],image_arg,0,NULL,0)) 
-        break;
-    if (-1!=i) break; // Break out of this while also, we don't need the argument any more
-  }
+  count=find_cache(cfg,image_arg,0);
 
   if (-1==count) { // No match for the png, maybe a jpeg?
-    count=cfg->caches->count;
     image_arg=apr_pstrcat(r->pool,r->args,"image%2Fjpeg",the_rest,0);
-    while (count--) {
-      int i;
-      cache=GETCACHE(cfg->caches,count);
-      i=cache->num_patterns;
-      while (i--) {
-        if (!ap_regexec(cfg->meta[count].regex[i],image_arg,0,NULL,0)) 
-          break;
-      }
-      if (-1!=i) break; // Break out of this while also, we don't need the argument any more
-    } 
+    count=find_cache(cfg,image_arg,0);
 
     if (-1==count) { // No string match with a jpeg either, wrap the WMS in KML
       char *bbstring;
-      double w,s,e,n,dummy;
+      double v[4];
       static const char* kmlpreamble="<kml><Document>\n"
 	"<Region><LatLonAltBox>\n"
 	"<north>%12.10f</north><south>%12.10f</south><east>%12.10f</east><west>%12.10f</west>\n"
@@ -1596,9 +3577,9 @@ static int kml_handler (request_rec *r)
       *format_p=kmltype[0]; // Put the first letter back for the following KMLs
       if (!(bbstring=getbbox(r->args)))
 	return kml_return_error(r,"bbox: required parameter mising!");
-      if (4!=sscanf(bbstring,"%lf,%lf,%lf,%lf,%lf",
-		    &w,&s,&e,&n, &dummy))
+      if (!oe_parse_bbox(bbstring,v))
 	return kml_return_error(r,"bbox: values can't be parsed!");
+      w=v[0]; s=v[1]; e=v[2]; n=v[3];
 
       ap_set_content_type(r,kmltype);
       ap_rprintf(r,kmlpreamble,n,s<-90?-90:s,e>180?180:e,w);
@@ -1610,12 +3591,13 @@ static int kml_handler (request_rec *r)
     }
   } // OK, so we got a match, the image request is in image_arg
 
+  cache=GETCACHE(cfg->caches,count);
   *format_p=kmltype[0]; // Put the first letter back for the following KMLs
 
   if (!cache->levels) return kml_return_error(r,"No data found!"); // This is a block
 
   // Finds the level and parses the bbox at the same time
-  if (!(level=wms_get_matching_level(r, cache, &bbox))) { // Paranoid check
+  if (!(level=wms_get_matching_level(r, cache, cfg->meta+count, &bbox))) { // Paranoid check
     ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,
       "Unmatched level kml request %s",r->args);
     return DECLINED; // No level match
@@ -1694,163 +3676,268 @@ void getParam(char *args, char *Name, char *Value) {
 	return;
 }
 
-// function to order request arguments in the expected pattern
-char *order_args(request_rec *r) {
+// Parameter names and where they go in wms_args
+static const struct {
+  const char *name;
+  int len;
+  size_t offset;
+} wms_params[]={
+#define WMS_PARAM(N,F) {N,sizeof(N)-1,offsetof(wms_args,F)}
+  WMS_PARAM("service",service), WMS_PARAM("request",request), WMS_PARAM("version",version),
+  WMS_PARAM("format",format), WMS_PARAM("time",time), WMS_PARAM("zindex",zindex),
+  WMS_PARAM("layer",layer), WMS_PARAM("style",style), WMS_PARAM("tilematrixset",tilematrixset),
+  WMS_PARAM("tilematrix",tilematrix), WMS_PARAM("tilerow",tilerow), WMS_PARAM("tilecol",tilecol),
+  WMS_PARAM("tiles",tiles),
+  WMS_PARAM("layers",layers), WMS_PARAM("srs",srs), WMS_PARAM("styles",styles),
+  WMS_PARAM("width",width), WMS_PARAM("height",height), WMS_PARAM("bbox",bbox),
+  WMS_PARAM("transparent",transparent), WMS_PARAM("bgcolor",bgcolor),
+  WMS_PARAM("exceptions",exceptions), WMS_PARAM("elevation",elevation)
+#undef WMS_PARAM
+};
+
+// Case insensitive compare of a value with a string
+static int sv_is(const wms_str *v, const char *str)
+{
+  int len=strlen(str);
+  return v->len==len && !strncasecmp(v->s,str,len);
+}
+
+// Like apr_atoi64, on a string view
+static apr_int64_t sv_atoi64(const wms_str *v)
+{
+  apr_int64_t val=0;
+  int i=0,neg=0;
+  if (i<v->len && ('-'==v->s[i] || '+'==v->s[i])) neg=('-'==v->s[i++]);
+  for (;i<v->len && apr_isdigit(v->s[i]);i++) val=val*10+(v->s[i]-'0');
+  return neg?-val:val;
+}
+
+// Skips a separator in the TILES list, plain or escaped, returns 0 if it's not there
+static int tiles_sep(const char **p, const char *end, char c, const char *escaped)
+{
+  int len=strlen(escaped);
+  if (*p<end && c==**p) {
+    (*p)++;
+    return 1;
+  }
+  if (end-*p>=len && !strncasecmp(*p,escaped,len)) {
+    *p+=len;
+    return 1;
+  }
+  return 0;
+}
+
+// Splits the argument string in a single pass, the values are not copied
+// The result is kept with the request, it is only parsed again if r->args or its length changes
+static wms_args *parse_args(request_rec *r)
+{
+  wms_args *a=&get_req_ctx(r)->args;
+  const char *p=r->args;
+  size_t len=p?strlen(p):0;
+
+  if (a->rest || (a->src==r->args && a->srclen==len)) return a;
+  memset(a,0,sizeof(*a));
+  a->src=r->args;
+  a->srclen=len;
+
+  while (p && *p) {
+    const char *name=p;
+    const char *eq=0;
+    int i,nlen;
+    // Find the end of this parameter.  The name starts after a ?, if there is one
+    for (;*p && '&'!=*p;p++) {
+      if (eq) continue;
+      if ('='==*p) eq=p;
+      else if ('?'==*p) name=p+1;
+    }
+    if (eq) {
+      nlen=eq-name;
+      for (i=0;i<sizeof(wms_params)/sizeof(wms_params[0]);i++) {
+        wms_str *v=(wms_str *)((char *)a+wms_params[i].offset);
+        if (nlen!=wms_params[i].len || strncasecmp(name,wms_params[i].name,nlen)) continue;
+        if (!v->s) { // First one wins
+          v->s=eq+1;
+          v->len=p-v->s;
+        }
+        break;
+      }
+    }
+    if (*p) p++;
+  }
+
+  if (sv_is(&a->service,"WMTS") && sv_is(&a->request,"GetTiles")) {
+    // The first tile picks the cache and level, the same way a GetTile does
+    a->type=WMS_REQ_WMTS;
+    a->batch=1;
+    a->tilerow.s=a->tilecol.s=0;
+    a->tilerow.len=a->tilecol.len=0;
+    if (a->tiles.s) {
+      const char *t=a->tiles.s,*end=a->tiles.s+a->tiles.len;
+      a->tilerow.s=t;
+      while (t<end && apr_isdigit(*t)) t++;
+      a->tilerow.len=t-a->tilerow.s;
+      while (t<end && (apr_isdigit(*t) || '-'==*t)) t++;
+      if (tiles_sep(&t,end,',',"%2C")) {
+        a->tilecol.s=t;
+        while (t<end && apr_isdigit(*t)) t++;
+        a->tilecol.len=t-a->tilecol.s;
+      }
+    }
+  } else if (sv_is(&a->service,"WMTS") && sv_is(&a->request,"GetTile"))
+    a->type=WMS_REQ_WMTS;
+  else if (sv_is(&a->request,"GetMap"))
+    a->type=WMS_REQ_TWMS;
+  a->matrix=sv_atoi64(&a->tilematrix);
+  a->row=sv_atoi64(&a->tilerow);
+  a->col=sv_atoi64(&a->tilecol);
+  return a;
+}
+
+// The TIME value, empty if there is none, the same as in the ordered argument string
+static const wms_str *req_time(request_rec *r)
+{
+  static const wms_str none={"",0};
+  wms_args *a=parse_args(r);
+  return a->time.s?&a->time:&none;
+}
+
+// The WMTS field values in the order used by the layer index
+static void wmts_values(const wms_args *a, wms_str *v)
+{
+  v[WF_VERSION]=a->version; v[WF_LAYER]=a->layer; v[WF_STYLE]=a->style;
+  v[WF_TMS]=a->tilematrixset; v[WF_MATRIX]=a->tilematrix; v[WF_ROW]=a->tilerow;
+  v[WF_COL]=a->tilecol; v[WF_FORMAT]=a->format;
+}
 
-	char *args = r->args;
-	int max_chars;
-	//use size of request args to prevent memory errors
-	max_chars = strlen(r->args) + 1;
+// valid formats
+static const char *formats[]={"image%2Fpng","image%2Fjpeg","image%2Ftiff","image%2Flerc",
+  "application%2Fvnd.mapbox-vector-tile"};
 
-	// valid formats
-	char * formats [] = { "image%2Fpng", "image%2Fjpeg", "image%2Ftiff", "image%2Flerc", "application%2Fvnd.mapbox-vector-tile"};
+// Does the format value match the canonical one, either escaped or with a plain slash
+static int format_is(const wms_str *v, const char *canonical)
+{
+  int len=strlen(canonical);
+  int pre=strstr(canonical,"%2F")-canonical;
+  if (v->len==len)
+    return !strncasecmp(v->s,canonical,len);
+  return v->len==len-2 && !strncasecmp(v->s,canonical,pre) && '/'==v->s[pre]
+    && !strncasecmp(v->s+pre+1,canonical+pre+3,len-pre-3);
+}
 
-	// common args
-	char *service = apr_pcalloc(r->pool,max_chars);
-	char *request = apr_pcalloc(r->pool,max_chars);
-	char *version = apr_pcalloc(r->pool,max_chars);
-	char *format = apr_pcalloc(r->pool,max_chars);
-	char *time = apr_pcalloc(r->pool,max_chars);
+// Arguments for printing a view with %.*s, apr_psprintf would print (null) for an absent one
+#define SV(v) (v).len,((v).s?(v).s:"")
 
-	getParam(args,"service",service);
-	getParam(args,"request",request);
-	getParam(args,"version",version);
-	getParam(args,"format",format);
-	getParam(args,"time",time);
-
-	// fix format slash
-	ap_str_tolower(format);
-	if (ap_strstr(format, "%2f")) {
-		char *formatslash = ap_strstr(format, "%2f");
-		formatslash += 2;
-		*formatslash = 'F';
-	}
-	if (ap_strcasecmp_match(format, "image/png") == 0) {
-		strcpy(format,"image%2Fpng");
-	} else if (ap_strcasecmp_match(format, "image/jpeg") == 0) {
-		strcpy(format,"image%2Fjpeg");
-	} else if (ap_strcasecmp_match(format, "image/tiff") == 0) {
-		strcpy(format,"image%2Ftiff");
-	} else if (ap_strcasecmp_match(format, "image/lerc") == 0) {
-		strcpy(format,"image%2Flerc");
-	} else if (ap_strcasecmp_match(format, "application/vnd.mapbox-vector-tile") == 0) {
-		strcpy(format,"application%2Fvnd.mapbox-vector-tile");
-		ap_set_content_type(r,"application/vnd.mapbox-vector-tile");
-	} else if (ap_strcasecmp_match(format, "application%2Fvnd.mapbox-vector-tile") == 0) {
-		strcpy(format,"application%2Fvnd.mapbox-vector-tile");
-		ap_set_content_type(r,"application/vnd.mapbox-vector-tile");
-	}
+// function to order request arguments in the expected pattern
+char *order_args(request_rec *r) {
+
+	char *args = r->args;
+	wms_args *a = parse_args(r);
+	wms_str time = a->time;
 
-	// make sure there are no extra characters in format
-	if (format[0] != NULL) {
-		int formats_len = sizeof(formats)/sizeof(formats[0]);
+	// fix format, it becomes one of the valid ones
+	if (a->format.len) {
 		int f;
-		int f_match = 0;
-		for(f = 0; f < formats_len; ++f) {
-			if(!strcmp(formats[f], format)) {
-				f_match++;
+		for (f = 0; f < sizeof(formats)/sizeof(formats[0]); f++) {
+			if (format_is(&a->format, formats[f])) {
+				a->format.s = formats[f];
+				a->format.len = strlen(formats[f]);
+				break;
 			}
 		}
-		if (f_match == 0) {
+		if (f == sizeof(formats)/sizeof(formats[0])) {
 			wmts_add_error(r,400,"InvalidParameterValue","FORMAT", "FORMAT is invalid");
+		} else if (ap_strstr_c(a->format.s, "mapbox")) {
+			ap_set_content_type(r,"application/vnd.mapbox-vector-tile");
 		}
 	}
 
 	// handle colons
-	if (ap_strchr(time, ':') != 0) {
-		int i; i= 0;
-		char *times[3];
-		char *t;
-		char *last;
-		t = apr_strtok(time,":",&last);
-		while (t != NULL && i < 4) {
-			times[i++] = t;
-			t = apr_strtok(NULL,":",&last);
+	if (time.len && memchr(time.s, ':', time.len)) {
+		char *t = apr_palloc(r->pool, time.len*3+1);
+		int i, j;
+		for (i = j = 0; i < time.len; i++) {
+			if (time.s[i] == ':') {
+				strcpy(t+j, colon);
+				j += strlen(colon);
+			} else {
+				t[j++] = time.s[i];
+			}
 		}
-		time = apr_psprintf(r->pool, "%s%s%s%s%s", times[0],colon,times[1],colon,times[2]);
+		t[j] = 0;
+		time.s = t;
+		time.len = j;
 	}
 
 	// check if TWMS or WMTS
-	if ((ap_strcasecmp_match(service, "WMTS") == 0) && (ap_strcasecmp_match(request, "GetTile") == 0))  {
-		// WMTS specific args
-		char *layer = apr_pcalloc(r->pool,max_chars);
-		char *style = apr_pcalloc(r->pool,max_chars);
-		char *tilematrixset = apr_pcalloc(r->pool,max_chars);
-		char *tilematrix = apr_pcalloc(r->pool,max_chars);
-		char *tilerow = apr_pcalloc(r->pool,max_chars);
-		char *tilecol = apr_pcalloc(r->pool,max_chars);
-
-		getParam(args,"layer",layer);
-		getParam(args,"style",style);
-		getParam(args,"tilematrixset",tilematrixset);
-		getParam(args,"tilerow",tilerow);
-		getParam(args,"tilecol",tilecol);
-
-		// need to ignore occurrence of tilematrix in tilematrixset - replace only one char for optimal performance
-		if (tilematrixset[0]!='\0') {
-			char *pos1 = ap_strcasestr(args, "tilematrixset");
-			*pos1 = 1;
-			getParam(args,"tilematrix",tilematrix);
-			if (tilematrix[0]=='\0') { // return error if not exist
+	if (a->type == WMS_REQ_WMTS) {
+		if (a->tilematrixset.len) {
+			if (!a->tilematrix.len) { // return error if not exist
 				wmts_add_error(r,400,"MissingParameterValue","TILEMATRIX", "Missing TILEMATRIX parameter");
 			}
-			if (tilerow[0]=='\0') { // return error if not exist
-				wmts_add_error(r,400,"MissingParameterValue","TILEROW", "Missing TILEROW parameter");
-			}
-			if (tilecol[0]=='\0') { // return error if not exist
-				wmts_add_error(r,400,"MissingParameterValue","TILECOL", "Missing TILECOL parameter");
+			if (a->batch) {
+				if (!a->tiles.len) // return error if not exist
+					wmts_add_error(r,400,"MissingParameterValue","TILES", "Missing TILES parameter");
+				else if (!a->tilerow.len || !a->tilecol.len)
+					wmts_add_error(r,400,"InvalidParameterValue","TILES", "TILES is invalid");
+			} else {
+				if (!a->tilerow.len) { // return error if not exist
+					wmts_add_error(r,400,"MissingParameterValue","TILEROW", "Missing TILEROW parameter");
+				}
+				if (!a->tilecol.len) { // return error if not exist
+					wmts_add_error(r,400,"MissingParameterValue","TILECOL", "Missing TILECOL parameter");
+				}
 			}
 		}
 
 		// GIBS-273 handle style=default, treat as empty. We don't need this if done in the layer regex pattern.
-		if (ap_strcasecmp_match(style, "default") == 0) {
-			style[0] = '\0';
+		if (sv_is(&a->style, "default")) {
+			a->style.len = 0;
 		}
 
-		args = apr_psprintf(r->pool,"SERVICE=%s&REQUEST=%s&VERSION=%s&LAYER=%s&STYLE=%s&TILEMATRIXSET=%s&TILEMATRIX=%s&TILEROW=%s&TILECOL=%s&FORMAT=%s&TIME=%s","WMTS","GetTile",version,layer,style,tilematrixset,tilematrix,tilerow,tilecol,format,time);
-
-	} else if (ap_strcasecmp_match(request, "GetMap") == 0) { //assume WMS/TWMS
-		//WMS specific args
-		char *layers = apr_pcalloc(r->pool,max_chars);
-		char *srs = apr_pcalloc(r->pool,max_chars);
-		char *styles = apr_pcalloc(r->pool,max_chars);
-		char *width = apr_pcalloc(r->pool,max_chars);
-		char *height = apr_pcalloc(r->pool,max_chars);
-		char *bbox = apr_pcalloc(r->pool,max_chars);
-		char *transparent = apr_pcalloc(r->pool,max_chars);
-		char *bgcolor = apr_pcalloc(r->pool,max_chars);
-		char *exceptions = apr_pcalloc(r->pool,max_chars);
-		char *elevation = apr_pcalloc(r->pool,max_chars);
-
-		getParam(args,"layers",layers);
-		getParam(args,"srs",srs);
-		getParam(args,"styles",styles);
-		getParam(args,"width",width);
-		getParam(args,"height",height);
-		getParam(args,"bbox",bbox);
-		getParam(args,"transparent",transparent);
-		getParam(args,"bgcolor",bgcolor);
-		getParam(args,"exceptions",exceptions);
-		getParam(args,"elevation",elevation);
-
-		args = apr_psprintf(r->pool,"version=%s&request=%s&layers=%s&srs=%s&format=%s&styles=%s&width=%s&height=%s&bbox=%s&transparent=%s&bgcolor=%s&exceptions=%s&elevation=%s&time=%s",version,"GetMap",layers,srs,format,styles,width,height,bbox,transparent,bgcolor,exceptions,elevation,time);
-
-	} else if (ap_strcasecmp_match(request, "GetCapabilities") == 0) { // getCapabilities
+		args = apr_psprintf(r->pool,"SERVICE=%s&REQUEST=%s&VERSION=%.*s&LAYER=%.*s&STYLE=%.*s&TILEMATRIXSET=%.*s&TILEMATRIX=%.*s&TILEROW=%.*s&TILECOL=%.*s&FORMAT=%.*s&TIME=%.*s","WMTS","GetTile",SV(a->version),SV(a->layer),SV(a->style),SV(a->tilematrixset),SV(a->tilematrix),SV(a->tilerow),SV(a->tilecol),SV(a->format),SV(time));
+
+	} else if (a->type == WMS_REQ_TWMS) { //assume WMS/TWMS
+		args = apr_psprintf(r->pool,"version=%.*s&request=%s&layers=%.*s&srs=%.*s&format=%.*s&styles=%.*s&width=%.*s&height=%.*s&bbox=%.*s&transparent=%.*s&bgcolor=%.*s&exceptions=%.*s&elevation=%.*s&time=%.*s",SV(a->version),"GetMap",SV(a->layers),SV(a->srs),SV(a->format),SV(a->styles),SV(a->width),SV(a->height),SV(a->bbox),SV(a->transparent),SV(a->bgcolor),SV(a->exceptions),SV(a->elevation),SV(time));
+
+	} else if (sv_is(&a->request, "GetCapabilities")) { // getCapabilities
 		args = apr_psprintf(r->pool, "request=GetCapabilities&=WMTS"); // Add WMTS marker to bypass unnecessary check down the chain
-	} else if (ap_strcasecmp_match(request, "GetTileService") == 0) { // getTileService
+	} else if (sv_is(&a->request, "GetTileService")) { // getTileService
 		args = apr_psprintf(r->pool, "request=GetTileService");
-	} else if (ap_strcasecmp_match(request, "GetLegendGraphic") == 0) { // GetLegendGraphic is not supported
+	} else if (sv_is(&a->request, "GetLegendGraphic")) { // GetLegendGraphic is not supported
 		wmts_add_error(r,501,"OperationNotSupported","REQUEST", "The request type is not supported");
 	} else if ( ap_strcasestr(r->args,"layers") != 0) { // is KML
 //    	ap_log_error(APLOG_MARK,APLOG_NOTICE,0,r->server,"Requesting KML");
-	} else if (service[0]=='\0') { // missing WMTS service
+	} else if (!a->service.len) { // missing WMTS service
 		wmts_add_error(r,400,"MissingParameterValue","SERVICE", "Missing SERVICE parameter");
-	} else if (ap_strcasecmp_match(service, "WMTS") != 0) { // unrecognized service
+	} else if (!sv_is(&a->service, "WMTS")) { // unrecognized service
 		wmts_add_error(r,400,"InvalidParameterValue","SERVICE", "Unrecognized service");
 	} else { // invalid REQUEST value
 		wmts_add_error(r,400,"InvalidParameterValue","REQUEST", "Unrecognized request");
 	}
 
+	// The parsed values stay valid for the ordered string
+	a->time = time;
+	a->src = args;
+	a->srclen = args ? strlen(args) : 0;
+	return args;
+}
+
+// The argument string for a REST request, for when the layer has to be matched by regexp
+// and for the redirect to the CGI.  A range in the row or the column is a GetTiles
+static char *rest_args(request_rec *r, const wms_args *a)
+{
+	const char *tile;
+	char *args;
+	if (a->batch)
+		tile = apr_psprintf(r->pool,"TILES=%.*s,%.*s",SV(a->tilerow),SV(a->tilecol));
+	else
+		tile = apr_psprintf(r->pool,"TILEROW=%.*s&TILECOL=%.*s",SV(a->tilerow),SV(a->tilecol));
+	args = apr_psprintf(r->pool,"wmts.cgi?SERVICE=%s&REQUEST=%s&VERSION=%.*s&LAYER=%.*s&STYLE=%.*s&TILEMATRIXSET=%.*s&TILEMATRIX=%.*s&%s&FORMAT=%.*s",
+		"WMTS",a->batch?"GetTiles":"GetTile",SV(a->version),SV(a->layer),SV(a->style),SV(a->tilematrixset),SV(a->tilematrix),tile,SV(a->format));
+	if (a->time.s)
+		args = apr_psprintf(r->pool,"%s&TIME=%.*s",args,SV(a->time));
+	if (a->zindex.s)
+		args = apr_psprintf(r->pool,"%s&ZINDEX=%.*s",args,SV(a->zindex));
 	return args;
 }
 
@@ -1860,8 +3947,7 @@ static int specify_error(request_rec *r)
 	WMSCache *cache;
 
 	// Get the configuration
-	cfg=(wms_cfg *)
-	ap_get_module_config(r->per_dir_config,&onearth_module);
+	cfg=get_cfg(r);
 
 	// url params
 	const char *args_backup = apr_pstrdup(r->pool, r->args);
@@ -1925,11 +4011,11 @@ static int specify_error(request_rec *r)
 		cache=GETCACHE(cfg->caches,count);
 		i=cache->num_patterns;
 
-		getParam(cache->pattern,"layer",layer_reg);
-		getParam(cache->pattern,"version",version_reg);
-		getParam(cache->pattern,"style",style_reg);
-		getParam(cache->pattern,"format",format_reg);
-		getParam(cache->pattern,"tilematrixset",tilematrixset_reg);
+		getParam(GETSTRING(cfg->caches,cache->pattern),"layer",layer_reg);
+		getParam(GETSTRING(cfg->caches,cache->pattern),"version",version_reg);
+		getParam(GETSTRING(cfg->caches,cache->pattern),"style",style_reg);
+		getParam(GETSTRING(cfg->caches,cache->pattern),"format",format_reg);
+		getParam(GETSTRING(cfg->caches,cache->pattern),"tilematrixset",tilematrixset_reg);
 
 		if (ap_strcmp_match(layer, layer_reg) == 0) {
 			layer_match++;
@@ -2034,12 +4120,528 @@ static int specify_error(request_rec *r)
    return 1;
 }
 
-static int mrf_handler(request_rec *r)
+//
+// WMTS GetTiles, a batch of tiles from the same layer, time and level
+// TILES is a list of row,col pairs separated by semicolons.  A row or a column can also be a
+// range, so TILES=2-5,10-13 is the 4 by 4 rectangle.  The tiles are sent back as multipart/mixed,
+// in the order they were asked for, each part has X-Tile-Row and X-Tile-Col headers
+// The index records come through the index cache, then the tile data is read sorted by offset,
+// with the reads that are close merged into one preadv
+//
+
+#define WMTS_MAX_TILES 256 // Per batch
+#define BATCH_GAP 4096     // Pieces this close get read together, the gap is read and dropped
+#define BATCH_IOV 64       // Max buffers for one read
+
+typedef struct {
+  apr_off_t offset;
+  apr_size_t size;
+  void *buffer;     // Set to 0 if the read fails
+  int tile;         // Position in the batch
+} batch_io;
+
+// A number or a range, returns the position after it, 0 if it's malformed
+static const char *tiles_range(const char *p, const char *end, apr_int64_t *lo, apr_int64_t *hi)
+{
+  apr_int64_t *v=lo;
+  *lo=*hi=0;
+  while (1) {
+    if (p==end || !apr_isdigit(*p)) return 0;
+    while (p<end && apr_isdigit(*p)) {
+      *v=*v*10+(*p++-'0');
+      if (*v>INT_MAX) return 0;
+    }
+    if (v==hi || p==end || '-'!=*p) break;
+    p++;
+    v=hi;
+  }
+  if (v==lo) *hi=*lo;
+  return (*hi<*lo)?0:p;
+}
+
+// Expands TILES into rows and columns, returns the tile count, -1 if malformed or too many
+static int tiles_parse(const wms_str *v, apr_int64_t *rows, apr_int64_t *cols, int max)
+{
+  const char *p=v->s,*end=v->s+v->len;
+  int n=0;
+  while (p<end) {
+    apr_int64_t r0,r1,c0,c1,row,col;
+    if (!(p=tiles_range(p,end,&r0,&r1)) || !tiles_sep(&p,end,',',"%2C")
+      || !(p=tiles_range(p,end,&c0,&c1)))
+      return -1;
+    if (p<end && !tiles_sep(&p,end,';',"%3B")) return -1;
+    if ((r1-r0+1)*(c1-c0+1)>max-n) return -1;
+    for (row=r0;row<=r1;row++)
+      for (col=c0;col<=c1;col++) {
+        rows[n]=row;
+        cols[n++]=col;
+      }
+  }
+  return n;
+}
+
+static int batch_io_cmp(const void *a, const void *b)
+{
+  const batch_io *x=*(const batch_io **)a,*y=*(const batch_io **)b;
+  return (x->offset>y->offset)-(x->offset<y->offset);
+}
+
+// Reads the pieces, merging the ones that are close together
+// All the merged reads go to the read engine at once, so they are done with one system call
+// when io_uring is available.  Sorts the pointers by offset.  The buffer of a piece that
+// can't be read is set to 0
+static void batch_read(request_rec *r, int fd, batch_io **io, int n)
+{
+  struct iovec *iov=(struct iovec *)apr_palloc(r->pool,2*n*sizeof(struct iovec));
+  oe_read_op *ops=(oe_read_op *)apr_palloc(r->pool,n*sizeof(oe_read_op));
+  int *first=(int *)apr_palloc(r->pool,(n+1)*sizeof(int)); // First piece of each read
+  char *gap=0; // Receives the bytes between pieces
+  int i,j,k,nops=0,niov=0;
+
+  if (!n) return;
+  qsort(io,n,sizeof(batch_io *),batch_io_cmp);
+  for (i=0;i<n;i=j) {
+    apr_off_t end=io[i]->offset+io[i]->size;
+    oe_read_op *op=ops+nops;
+    op->fd=fd;
+    op->offset=io[i]->offset;
+    op->iov=iov+niov;
+    op->iovcnt=1;
+    iov[niov].iov_base=io[i]->buffer;
+    iov[niov++].iov_len=io[i]->size;
+    // Duplicate pieces, like tiles that point to the same data, don't get merged
+    for (j=i+1;j<n && op->iovcnt+2<=BATCH_IOV && io[j]->offset>=end && io[j]->offset-end<=BATCH_GAP;j++) {
+      if (io[j]->offset>end) {
+        if (!gap) gap=apr_palloc(r->pool,BATCH_GAP);
+        iov[niov].iov_base=gap;
+        iov[niov++].iov_len=io[j]->offset-end;
+        op->iovcnt++;
+      }
+      iov[niov].iov_base=io[j]->buffer;
+      iov[niov++].iov_len=io[j]->size;
+      op->iovcnt++;
+      end=io[j]->offset+io[j]->size;
+    }
+    first[nops++]=i;
+  }
+  first[nops]=n;
+
+  if (oe_read_submit(read_engine_get(r),ops,nops)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Tile read failed for %s",r->args?r->args:r->uri);
+    for (i=0;i<n;i++) io[i]->buffer=0;
+    return;
+  }
+  for (i=0;i<nops;i++) {
+    apr_off_t len=io[first[i+1]-1]->offset+io[first[i+1]-1]->size-ops[i].offset;
+    if (ops[i].result!=len)
+      for (k=first[i];k<first[i+1];k++) io[k]->buffer=0;
+  }
+}
+
+static int batch_handler(request_rec *r, wms_cfg *cfg, int count, WMSlevel *level, apr_off_t base)
+{
+  wms_args *args=parse_args(r);
+  WMSCache *cache=GETCACHE(cfg->caches,count);
+  meta_cache *meta=cfg->meta+count;
+  wms_empty_record *empty=meta->empties+(level-GETLEVELS(cache));
+  apr_int64_t rows[WMTS_MAX_TILES],cols[WMTS_MAX_TILES];
+  index_s *records;
+  void **data;
+  batch_io *io,**order;
+  fd_entry *fe;
+  const char *boundary,*encoding="";
+  void *empty_data=empty->data;
+  int n,i,nio;
+
+  if (0>(n=tiles_parse(&args->tiles,rows,cols,WMTS_MAX_TILES))) {
+    wmts_add_error(r,400,"InvalidParameterValue","TILES",
+      apr_psprintf(r->pool,"TILES is invalid or has more than %d tiles",WMTS_MAX_TILES));
+    return wmts_return_all_errors(r);
+  }
+  for (i=0;i<n;i++)
+    if (rows[i]>=level->ycount || cols[i]>=level->xcount) {
+      wmts_add_error(r,400,"TileOutOfRange","TILES",apr_psprintf(r->pool,
+        "Tile %" APR_INT64_T_FMT ",%" APR_INT64_T_FMT " is out of range, maximum values are %d and %d",
+        rows[i],cols[i],level->ycount-1,level->xcount-1));
+      return wmts_return_all_errors(r);
+    }
+
+  records=(index_s *)apr_pcalloc(r->pool,n*sizeof(index_s));
+  data=(void **)apr_pcalloc(r->pool,n*sizeof(void *));
+  io=(batch_io *)apr_palloc(r->pool,n*sizeof(batch_io));
+  order=(batch_io **)apr_palloc(r->pool,n*sizeof(batch_io *));
+
+  // The index records, through the index cache when there is one, the ones in the same row share pages
+  // Without the cache they are read together, the ones in the same row are next to each other
+  // Without an index for this time all the tiles are empty, same as for a single tile
+  if ((fe=r_file_open(r,level_fname(cfg,count,level,0),&meta->periods,cache->zlevels))) {
+    if (index_cache.mutex) {
+      for (i=0;i<n;i++)
+        if (!index_cache_read(fe,base+sizeof(index_s)*(rows[i]*level->xcount+cols[i]),
+            level->xcount*sizeof(index_s),records+i))
+          records[i].size=0;
+    } else {
+      for (nio=i=0;i<n;i++) {
+        apr_off_t location=base+sizeof(index_s)*(rows[i]*level->xcount+cols[i]);
+        if (idm_empty(fe,location)) continue; // Known empty, the record stays 0
+        io[nio].offset=location;
+        io[nio].size=sizeof(index_s);
+        io[nio].buffer=records+i;
+        io[nio].tile=i;
+        order[nio]=io+nio;
+        nio++;
+      }
+      batch_read(r,fe->fd,order,nio);
+      while (nio--) {
+        i=io[nio].tile;
+        if (io[nio].buffer) oe_index_swap(records+i);
+        else records[i].size=0;
+      }
+    }
+    fd_release(fe);
+  } else if (wmts_errors(r)>0)
+    return wmts_return_all_errors(r);
+
+  // Then the data, the cached tiles first
+  for (i=0;i<n && !records[i].size;i++);
+  if (i<n && (fe=r_file_open(r,level_fname(cfg,count,level,1),&meta->periods,cache->zlevels))) {
+    for (nio=i=0;i<n;i++) {
+      if (!records[i].size || !fd_covers(fe,records[i].offset+records[i].size)) continue;
+      if (tile_cache_fits(records[i].size)
+        && (data[i]=tile_cache_get(r,fe,records[i].offset,records[i].size)))
+        continue;
+      io[nio].offset=records[i].offset;
+      io[nio].size=records[i].size;
+      io[nio].buffer=apr_palloc(r->pool,records[i].size);
+      io[nio].tile=i;
+      order[nio]=io+nio;
+      nio++;
+    }
+    batch_read(r,fe->fd,order,nio);
+    // Pick up the results, a failed read leaves the tile empty
+    while (nio--) {
+      i=io[nio].tile;
+      if ((data[i]=io[nio].buffer) && tile_cache_fits(records[i].size))
+        tile_cache_put(fe,records[i].offset,data[i],records[i].size);
+    }
+    fd_release(fe);
+  }
+
+  // The empty tile, if it wasn't read at startup
+  if (!empty_data && empty->index.size)
+    empty_data=p_file_pread(r->pool,level_fname(cfg,count,level,1)->name,
+      empty->index.size,empty->index.offset);
+
+  if (apr_strnatcmp(meta->mime_type,"application/vnd.mapbox-vector-tile")==0)
+    encoding="Content-Encoding: gzip\r\n";
+  else if (apr_strnatcmp(meta->mime_type,"image/lerc")==0)
+    encoding="Content-Encoding: deflate\r\n";
+
+  boundary=apr_psprintf(r->pool,"onearth-tiles-%" APR_UINT64_T_HEX_FMT,(apr_uint64_t)apr_time_now());
+  ap_set_content_type(r,apr_psprintf(r->pool,"multipart/mixed; boundary=%s",boundary));
+  for (i=0;i<n;i++) {
+    void *tile=data[i];
+    apr_size_t size=records[i].size;
+    if (!tile) { // Missing or unreadable, send the empty tile, if there is one
+      tile=empty_data;
+      size=empty_data?empty->index.size:0;
+    }
+    ap_rprintf(r,"--%s\r\nContent-Type: %s\r\n%sX-Tile-Row: %" APR_INT64_T_FMT
+      "\r\nX-Tile-Col: %" APR_INT64_T_FMT "\r\nContent-Length: %" APR_SIZE_T_FMT "\r\n\r\n",
+      boundary,meta->mime_type,encoding,rows[i],cols[i],size);
+    if (size) ap_rwrite(tile,size,r);
+    ap_rputs("\r\n",r);
+  }
+  ap_rprintf(r,"--%s--\r\n",boundary);
+  return OK;
+}
+
+//
+// Request statistics for each layer, in shared memory, see oe_stats.h
+// Each thread claims its own shard the first time it records, and gives it back when it ends
+// The counts are published by the onearth-status handler
+//
+
+static struct {
+  int layers;       // Layer slots, 0 means no statistics
+  int shards;       // 0 for one per thread the MPM can start, plus the shared one
+  apr_shm_t *shm;
+  oe_stats *s;      // Only set when in use
+  volatile apr_uint32_t threads; // Thread numbers for the shard owner ids, per process
+} stats={0,0};
+
+static const char stats_key[]="mod_onearth_stats";
+
+typedef struct {
+  int shard;
+  apr_uint64_t id;
+} stats_owner;
+
+static const char *stats_phases[OE_PHASES]={"parse","match","index","data","write"};
+
+static const struct {
+  const char *name,*help;
+} stats_counters[OE_STATS]={
+  {"requests","Tile requests answered"},
+  {"tiles","Tiles sent from the data files"},
+  {"empty_tiles","Empty tiles sent in place of a missing tile"},
+  {"time_snaps","Requests with the time snapped to a period"},
+  {"index_misses","Index records not found in the index cache"},
+  {"bytes","Tile bytes sent"}
+};
+
+// Done once in the parent, the children inherit the shared memory
+static int stats_init(apr_pool_t *p, server_rec *s)
+{
+  apr_size_t size;
+  apr_status_t rv;
+  int shards=stats.shards;
+
+  stats.s=0;
+  if (stats.layers<=0) return OK;
+  if (shards<=0) {
+    int daemons=0,threads=0;
+    ap_mpm_query(AP_MPMQ_MAX_DAEMONS,&daemons);
+    ap_mpm_query(AP_MPMQ_MAX_THREADS,&threads);
+    shards=1+(daemons>0?daemons:1)*(threads>0?threads:1);
+  }
+  size=oe_stats_size(stats.layers,shards);
+  if (APR_SUCCESS!=(rv=apr_shm_create(&stats.shm,size,NULL,p))) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,rv,s,"Can't create statistics shared memory, statistics disabled");
+    return OK;
+  }
+  stats.s=oe_stats_init(apr_shm_baseaddr_get(stats.shm),stats.layers,shards);
+  ap_log_error(APLOG_MARK,APLOG_INFO,0,s,"Statistics for %d layers in %d shards, %d KB",
+    stats.layers,shards,(int)(size/1024));
+  return OK;
+}
+
+static apr_status_t stats_owner_cleanup(void *data)
+{
+  stats_owner *o=(stats_owner *)data;
+  if (stats.s) oe_stats_release(stats.s,o->shard,o->id);
+  free(o);
+  return APR_SUCCESS;
+}
+
+// Shard of the current thread, 0 is the shared one
+static int stats_shard(request_rec *r)
+{
+  apr_thread_t *thd=r->connection->current_thread;
+  stats_owner *o=0;
+
+  if (!thd) return 0;
+  apr_thread_data_get((void **)&o,stats_key,thd);
+  if (!o && (o=(stats_owner *)malloc(sizeof(stats_owner)))) {
+    o->id=((apr_uint64_t)getpid()<<32)|(apr_atomic_inc32(&stats.threads)+1);
+    o->shard=oe_stats_claim(stats.s,o->id);
+    apr_thread_data_set(o,stats_key,stats_owner_cleanup,thd);
+  }
+  return o?o->shard:0;
+}
+
+// Time since the previous mark goes to the phase, nothing is timed without statistics
+static void stats_mark(oe_stats_sample *x, int phase, apr_time_t *mark)
+{
+  apr_time_t now;
+  if (!*mark) return;
+  now=apr_time_now();
+  x->phase[phase]+=(unsigned)(now-*mark);
+  *mark=now;
+}
+
+// Adds the request to the layer statistics.  The layer slot is looked up by name once for
+// each cache, then kept in the cache run-time information
+static void stats_record(request_rec *r, meta_cache *meta, oe_stats_sample *x)
+{
+  wms_req_ctx *ctx;
+  const wms_str *name;
+  int layer;
+
+  if (!stats.s) return;
+  ctx=get_req_ctx(r);
+  if (!(layer=meta->stats_layer)) {
+    name=ctx->args.layer.len?&ctx->args.layer:&ctx->args.layers;
+    if (0>(layer=oe_stats_layer(stats.s,name->len?name->s:"-",name->len?name->len:1)))
+      return;
+    meta->stats_layer=++layer;
+  }
+  if (ctx->snapped) x->flags|=OE_SAMPLE_SNAP;
+  if (ctx->index_miss) x->flags|=OE_SAMPLE_INDEX_MISS;
+  oe_stats_record(stats.s,stats_shard(r),layer-1,x);
+}
+
+// Layer names come from requests, keep them safe inside a quoted label or a JSON string
+static const char *stats_quote(apr_pool_t *p, const char *name)
+{
+  char *q=(char *)apr_palloc(p,2*strlen(name)+1);
+  char *d=q;
+  for (;*name;name++) {
+    if ('"'==*name || '\\'==*name) *d++='\\';
+    *d++=((unsigned char)*name<0x20)?'?':*name;
+  }
+  *d=0;
+  return q;
+}
+
+static void stats_prometheus(request_rec *r, const char **names, const oe_stats_block *t, int n)
+{
+  int c,i,p,b;
+
+  ap_set_content_type(r,"text/plain; version=0.0.4");
+  for (c=0;c<OE_STATS;c++) {
+    ap_rprintf(r,"# HELP onearth_%s_total %s\n# TYPE onearth_%s_total counter\n",
+      stats_counters[c].name,stats_counters[c].help,stats_counters[c].name);
+    for (i=0;i<n;i++)
+      ap_rprintf(r,"onearth_%s_total{layer=\"%s\"} %" APR_UINT64_T_FMT "\n",
+        stats_counters[c].name,names[i],(apr_uint64_t)t[i].count[c]);
+  }
+
+  ap_rputs("# HELP onearth_level_requests_total Tile requests answered, by level\n"
+    "# TYPE onearth_level_requests_total counter\n",r);
+  for (i=0;i<n;i++)
+    for (b=0;b<OE_STATS_LEVELS;b++)
+      if (t[i].level[b])
+        ap_rprintf(r,"onearth_level_requests_total{layer=\"%s\",level=\"%d\"} %u\n",
+          names[i],b,t[i].level[b]);
+
+  // Only the bucket edges at powers of two, so the series stay the same between scrapes
+  ap_rputs("# HELP onearth_phase_seconds Time spent in each request phase\n"
+    "# TYPE onearth_phase_seconds histogram\n",r);
+  for (i=0;i<n;i++)
+    for (p=0;p<OE_PHASES;p++) {
+      apr_uint64_t cum=0;
+      for (b=0;b<OE_STATS_BUCKETS;b++) {
+        apr_uint64_t end=oe_stats_bucket_end(b);
+        cum+=t[i].hist[p][b];
+        if (b<OE_STATS_BUCKETS-1 && !(end&(end-1)))
+          ap_rprintf(r,"onearth_phase_seconds_bucket{layer=\"%s\",phase=\"%s\",le=\"%g\"} %"
+            APR_UINT64_T_FMT "\n",names[i],stats_phases[p],end/1e6,cum);
+      }
+      ap_rprintf(r,"onearth_phase_seconds_bucket{layer=\"%s\",phase=\"%s\",le=\"+Inf\"} %"
+        APR_UINT64_T_FMT "\n",names[i],stats_phases[p],cum);
+      ap_rprintf(r,"onearth_phase_seconds_sum{layer=\"%s\",phase=\"%s\"} %.6f\n",
+        names[i],stats_phases[p],t[i].sum[p]/1e6);
+      ap_rprintf(r,"onearth_phase_seconds_count{layer=\"%s\",phase=\"%s\"} %" APR_UINT64_T_FMT "\n",
+        names[i],stats_phases[p],cum);
+    }
+
+  ap_rprintf(r,"# HELP onearth_stats_overflow_total Requests not counted, too many layers\n"
+    "# TYPE onearth_stats_overflow_total counter\nonearth_stats_overflow_total %u\n",
+    stats.s->overflow);
+  if (tile_cache.header)
+    ap_rprintf(r,"# HELP onearth_tile_cache_total Tile cache operations\n"
+      "# TYPE onearth_tile_cache_total counter\n"
+      "onearth_tile_cache_total{op=\"hit\"} %" APR_UINT64_T_FMT "\n"
+      "onearth_tile_cache_total{op=\"miss\"} %" APR_UINT64_T_FMT "\n"
+      "onearth_tile_cache_total{op=\"insert\"} %" APR_UINT64_T_FMT "\n"
+      "onearth_tile_cache_total{op=\"eviction\"} %" APR_UINT64_T_FMT "\n",
+      tile_cache.header->hits,tile_cache.header->misses,
+      tile_cache.header->inserts,tile_cache.header->evictions);
+  if (cache_reload.interval)
+    ap_rprintf(r,"# HELP onearth_config_reloads_total Cache configurations reloaded by this process\n"
+      "# TYPE onearth_config_reloads_total counter\nonearth_config_reloads_total %u\n",
+      cache_reload.reloads);
+  if (flights.on)
+    ap_rprintf(r,"# HELP onearth_coalesce_total Reads started and requests that waited for one, by this process\n"
+      "# TYPE onearth_coalesce_total counter\n"
+      "onearth_coalesce_total{op=\"read\"} %u\nonearth_coalesce_total{op=\"joined\"} %u\n",
+      flights.flights,flights.joined);
+}
+
+static void stats_json(request_rec *r, const char **names, const oe_stats_block *t, int n)
+{
+  int c,i,p,b,last;
+
+  ap_set_content_type(r,"application/json");
+  ap_rputs("{\"layers\":[",r);
+  for (i=0;i<n;i++) {
+    ap_rprintf(r,"%s{\"name\":\"%s\"",i?",":"",names[i]);
+    for (c=0;c<OE_STATS;c++)
+      ap_rprintf(r,",\"%s\":%" APR_UINT64_T_FMT,stats_counters[c].name,(apr_uint64_t)t[i].count[c]);
+    for (last=OE_STATS_LEVELS;last>0 && !t[i].level[last-1];last--);
+    ap_rputs(",\"levels\":[",r);
+    for (b=0;b<last;b++)
+      ap_rprintf(r,"%s%u",b?",":"",t[i].level[b]);
+    ap_rputs("],\"phases\":{",r);
+    for (p=0;p<OE_PHASES;p++) {
+      const unsigned int *h=t[i].hist[p];
+      ap_rprintf(r,"%s\"%s\":{\"sum_us\":%" APR_UINT64_T_FMT ",\"p50_us\":%" APR_UINT64_T_FMT
+        ",\"p90_us\":%" APR_UINT64_T_FMT ",\"p99_us\":%" APR_UINT64_T_FMT ",\"p999_us\":%"
+        APR_UINT64_T_FMT "}",p?",":"",stats_phases[p],(apr_uint64_t)t[i].sum[p],
+        (apr_uint64_t)oe_stats_quantile(h,0.5),(apr_uint64_t)oe_stats_quantile(h,0.9),
+        (apr_uint64_t)oe_stats_quantile(h,0.99),(apr_uint64_t)oe_stats_quantile(h,0.999));
+    }
+    ap_rputs("}}",r);
+  }
+  ap_rprintf(r,"],\"overflow\":%u",stats.s->overflow);
+  if (tile_cache.header)
+    ap_rprintf(r,",\"tile_cache\":{\"hits\":%" APR_UINT64_T_FMT ",\"misses\":%" APR_UINT64_T_FMT
+      ",\"inserts\":%" APR_UINT64_T_FMT ",\"evictions\":%" APR_UINT64_T_FMT "}",
+      tile_cache.header->hits,tile_cache.header->misses,
+      tile_cache.header->inserts,tile_cache.header->evictions);
+  if (cache_reload.interval)
+    ap_rprintf(r,",\"reloads\":%u",cache_reload.reloads);
+  if (flights.on) // This process only
+    ap_rprintf(r,",\"coalesce\":{\"reads\":%u,\"joined\":%u}",flights.flights,flights.joined);
+  ap_rputs("}\n",r);
+}
 
+// SetHandler onearth-status, the totals of all the processes since Apache started
+// Prometheus text format, or JSON with ?json
+static int status_handler(request_rec *r)
 {
-  static int hit_count=1000;
-  static int miss_count=1000;
+  int *used;
+  const char **names;
+  oe_stats_block *totals;
+  int i,n=0;
+
+  if (!stats.s) {
+    ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"onearth-status needs WMSStats");
+    return HTTP_NOT_FOUND;
+  }
+  used=(int *)apr_palloc(r->pool,stats.s->layers*sizeof(int));
+  names=(const char **)apr_palloc(r->pool,stats.s->layers*sizeof(char *));
+  for (i=0;i<(int)stats.s->layers;i++) {
+    const char *name=oe_stats_name(stats.s,i);
+    if (!name) continue;
+    used[n]=i;
+    names[n++]=stats_quote(r->pool,name);
+  }
+  totals=(oe_stats_block *)apr_palloc(r->pool,(n?n:1)*sizeof(oe_stats_block));
+  for (i=0;i<n;i++)
+    oe_stats_sum(stats.s,used[i],totals+i);
+
+  apr_table_setn(r->headers_out,"Cache-Control","no-cache");
+  if (r->args && ap_strstr_c(r->args,"json"))
+    stats_json(r,names,totals,n);
+  else
+    stats_prometheus(r,names,totals,n);
+  return OK;
+}
+
+// For a tile that can't be sent, the blank tile of the endpoint.  DECLINED if there is none,
+// which leaves the request to the CGI
+static int blank_missing(request_rec *r, wms_cfg *cfg, int count, oe_stats_sample *st)
+{
+  const wms_blank *b=blank_find(cfg,cfg->meta[count].mime_type);
+  int rc;
+
+  if (!b) return DECLINED;
+  if (wmts_errors(r) > 0)
+    return wmts_return_all_errors(r);
+  rc=blank_send(r,b);
+  if (OK==rc || HTTP_NOT_MODIFIED==rc) {
+    st->flags|=OE_SAMPLE_EMPTY;
+    if (OK==rc) st->bytes=b->size;
+    stats_record(r,cfg->meta+count,st);
+  }
+  return rc;
+}
+
+static int mrf_handler(request_rec *r)
 
+{
   wms_cfg *cfg;
   int count;
   WMSlevel *level;
@@ -2048,12 +4650,16 @@ static int mrf_handler(request_rec *r)
   apr_off_t offset;
   index_s *this_record;
   void *this_data=0;
+  fd_entry *this_file=0;
   int default_idx;
+  int rc;
   int z = -1;
+  wms_args *args;
+  oe_stats_sample st={-1}; // Level not known yet
+  apr_time_t mark=0;       // End of the last phase, 0 without statistics
 
   // Get the configuration
-  cfg=(wms_cfg *) 
-    ap_get_module_config(r->per_dir_config,&onearth_module);
+  cfg=get_cfg(r);
 
 //  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Got config");
 
@@ -2067,17 +4673,29 @@ static int mrf_handler(request_rec *r)
       "No prepared regexps");
     return DECLINED;
   }
-
-  if (ap_strcasestr(r->args,"zindex=")) {
-	  char *zchar = apr_pcalloc(r->pool,strlen(r->args) + 1);
-	  getParam(r->args,"zindex",zchar);
-	  z = apr_atoi64(zchar);
-	  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"ZINDEX override: %d, %s", z, r->args);
+  if (stats.s) mark=apr_time_now();
+
+  args=parse_args(r);
+  if (args->rest) {
+    // Straight from the REST path to the layer index.  If the layer is not there, it has
+    // to be matched by regexp, which needs the argument string
+    wms_str v[WMTS_NFIELDS];
+    wmts_values(args,v);
+    if (0>(count=find_cache(cfg,0,v))) {
+      r->args=rest_args(r,args);
+      args->rest=0;
+      args=parse_args(r);
+    }
+  }
+  if (args->zindex.s) {
+	  z = sv_atoi64(&args->zindex);
+	  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"ZINDEX override: %d, %s", z, r->args?r->args:r->uri);
   }
 
   // DEBUG
   // ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "In WMS handler");
 
+  if (!args->rest) {
   // DEBUG
 //  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Request args: %s",r->args);
   r->args=order_args(r);
@@ -2085,18 +4703,22 @@ static int mrf_handler(request_rec *r)
 //  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Ordered args: %s",r->args);
 
   // short-circuit if there is already a problem
-  if (errors > 0) {
+  if (wmts_errors(r) > 0) {
 	  return wmts_return_all_errors(r);
   }
-
-  // Count is the number of caches
-  while (count--) {
-    int i;
-    cache=GETCACHE(cfg->caches,count);
-    i=cache->num_patterns;
-    while (i--) if (!ap_regexec(cfg->meta[count].regex[i],r->args,0,NULL,0)) break;
-    if (-1!=i) break; // Break out of this while also, we don't need the argument any more
   }
+  stats_mark(&st,OE_PHASE_PARSE,&mark);
+
+  // Pick the cache, from the layer index or by regexp
+  if (args->rest) {
+    // Found already
+  } else if (WMS_REQ_WMTS==args->type) {
+    wms_str v[WMTS_NFIELDS];
+    wmts_values(args,v);
+    count=find_cache(cfg,r->args,v);
+  } else
+    count=find_cache(cfg,r->args,0);
+  if (-1!=count) cache=GETCACHE(cfg->caches,count);
 
   // No match?
   if (-1==count) {
@@ -2141,14 +4763,14 @@ static int mrf_handler(request_rec *r)
 	}
 
     // if (r->connection->local_addr->port==80) {
-    	if (ap_strcasecmp_match(r->args, "request=GetCapabilities") == 0) {
+    	if (r->args && ap_strcasecmp_match(r->args, "request=GetCapabilities") == 0) {
         	ap_log_error(APLOG_MARK,APLOG_NOTICE,0,r->server,"Requesting getCapabilities");
     	} else {
 			int err_status = specify_error(r);
 			if (!err_status) return DECLINED;
-    		if (errors > 0) {
+    		if (wmts_errors(r) > 0) {
     			ap_log_error(APLOG_MARK,LOG_LEVEL,0,r->server,
-        			"Unhandled %s%s?%s",r->hostname,r->uri,r->args);
+        			"Unhandled %s%s?%s",r->hostname,r->uri,r->args?r->args:"");
             	return wmts_return_all_errors(r);
     		}
     	}
@@ -2166,26 +4788,20 @@ static int mrf_handler(request_rec *r)
 
   if (!cache->levels) {
     ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,
-      "Sending error message, no levels %s",r->args);
+      "Sending error message, no levels %s",r->args?r->args:r->uri);
     return wms_return_error(r,"No data found!"); // This is the block
   }
 
-  if (!ap_strstr(r->args,WMTS_marker))
+  if (!args->rest && !ap_strstr(r->args,WMTS_marker))
   { // Tiled WMS. Figure out where the index is, store it in offset
 
       // We got cache with levels, but do we have the data?
-      if (!(level=wms_get_matching_level(r, cache, &bbox))) {
+      if (!(level=wms_get_matching_level(r, cache, cfg->meta+count, &bbox))) {
 //	    ap_log_error(APLOG_MARK, APLOG_WARNING,0,r->server, "Unmatched level %s",r->args);
 	    if (r->prev != 0) {
 			if (ap_strstr(r->prev->args, "&MAP=") != 0) { // Redirected from Mapserver
 				level = GETLEVELS(cache);
-				char *ifname;
-				if (level->ifname[0] == '/') { // decide absolute or relative path from cachedir
-					  ifname = apr_pstrcat(r->pool,level->ifname,0);
-				} else {
-					  ifname = apr_pstrcat(r->pool,cfg->cachedir,level->ifname,0);
-				}
-				r_file_pread(r, ifname, sizeof(index_s),offset, cache->time_period, cache->num_periods, cache->zlevels);
+				r_file_pread(r, level_fname(cfg,count,level,0), sizeof(index_s),offset, &cfg->meta[count].periods, cache->zlevels);
 				return DECLINED;
 			} else {
 				return DECLINED;
@@ -2206,7 +4822,7 @@ static int mrf_handler(request_rec *r)
 
       if ((WMSlevel *)2==level) { // Too far from bin level
     	  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
-	      "Sending error, not cached %s",r->args);
+	      "Sending error, not cached %s",r->args?r->args:r->uri);
     	  return wms_return_error(r, "Resolution not cached. Please do not modify configuration!");
       }
 
@@ -2215,22 +4831,17 @@ static int mrf_handler(request_rec *r)
 		  	offset=get_index_offset(level,&bbox,cache->orientation,r);
 	  } else {
 		  if (!cache->zidxfname) {
-			  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"No z-index filename %s",r->args);
+			  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"No z-index filename %s",r->args?r->args:r->uri);
 			  offset = -1;
 		  } else {
-			  char *zidxfname;
+			  char zidxfname[cfg->meta[count].zidx.len+1];
 //			  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"z-index filename %s",cache->zidxfname);
-			  if (cache->zidxfname[0] == '/') { // decide absolute or relative path from cachedir
-				  zidxfname = apr_pstrcat(r->pool,cache->zidxfname,0);
-			  } else {
-				  zidxfname = apr_pstrcat(r->pool,cfg->cachedir,cache->zidxfname,0);
-			  }
 
 			  if (z<0) {
 				  // Lookup the z index from the ZDB file based on keyword
-				  z = get_zlevel(r,tstamp_fname(r,zidxfname),get_keyword(r));
+				  z = get_zlevel(r,tstamp_fname(r,&cfg->meta[count].zidx,zidxfname),get_keyword(r));
 				  if (z<0) {
-					  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"z index %d, %s", z, r->args);
+					  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"z index %d, %s", z, r->args?r->args:r->uri);
 				  }
 			  }
 			  if (z >= cache->zlevels) {
@@ -2249,7 +4860,7 @@ static int mrf_handler(request_rec *r)
 
       if (-1==offset) {
 	ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
-		    "Bogus index offset %s",r->args);
+		    "Bogus index offset %s",r->args?r->args:r->uri);
 	ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
 		    "ix %d, iy %d, count %d,%d",
 		    (int)((bbox.x0-level->X0)/level->levelx),
@@ -2262,7 +4873,7 @@ static int mrf_handler(request_rec *r)
 
       if (-2==offset) {
 	ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,
-		    "Bogus alignment %s",r->args);
+		    "Bogus alignment %s",r->args?r->args:r->uri);
 	return DECLINED;
       }
 
@@ -2270,7 +4881,7 @@ static int mrf_handler(request_rec *r)
   } else { // WMTS branch
     if (!(level=wmts_get_matching_level(r, cache))) {
 		ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,
-			"WMTS Unmatched level %s",r->args);
+			"WMTS Unmatched level %s",r->args?r->args:r->uri);
 //		return DECLINED; // No level match
 //		wmts_add_error(r,400,"InvalidParameterValue","TILEROW", "Unmatched TILEROW");
 //		wmts_add_error(r,400,"InvalidParameterValue","TILECOL", "Unmatched TILECOL");
@@ -2278,11 +4889,11 @@ static int mrf_handler(request_rec *r)
 
     if (level<(WMSlevel *) 2) {
 	ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,
-	  "Can't find TILEMATRIX %s",r->args);
+	  "Can't find TILEMATRIX %s",r->args?r->args:r->uri);
 		wmts_add_error(r,400,"InvalidParameterValue","TILEMATRIX", "Invalid TILEMATRIX");
     }
 
-    if (errors > 0) {
+    if (wmts_errors(r) > 0) {
     	return wmts_return_all_errors(r);
     }
 
@@ -2290,22 +4901,17 @@ static int mrf_handler(request_rec *r)
 		  offset=wmts_get_index_offset(r,level);
 	  } else {
 		  if (!cache->zidxfname) {
-			  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"No z-index filename %s",r->args);
+			  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"No z-index filename %s",r->args?r->args:r->uri);
 			  offset = -1;
 		  } else {
-			  char *zidxfname;
+			  char zidxfname[cfg->meta[count].zidx.len+1];
 //			  ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"z-index filename %s",cache->zidxfname);
-			  if (cache->zidxfname[0] == '/') { // decide absolute or relative path from cachedir
-				  zidxfname = apr_pstrcat(r->pool,cache->zidxfname,0);
-			  } else {
-				  zidxfname = apr_pstrcat(r->pool,cfg->cachedir,cache->zidxfname,0);
-			  }
 
 			  // Lookup the z index from the ZDB file based on keyword
 			  if (z<0) {
-			  	z = get_zlevel(r,tstamp_fname(r,zidxfname),get_keyword(r));
+			  	z = get_zlevel(r,tstamp_fname(r,&cfg->meta[count].zidx,zidxfname),get_keyword(r));
 			  	if (z<0) {
-				  	ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"z index %d, %s", z, r->args);
+				  	ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"z index %d, %s", z, r->args?r->args:r->uri);
 			  	}
 			  }
 			  if (z >= cache->zlevels) {
@@ -2315,35 +4921,39 @@ static int mrf_handler(request_rec *r)
 		  }
 	  }
 
-    if (0>offset || errors>0)
+    if (0>offset || wmts_errors(r)>0)
     	return wmts_return_all_errors(r);
+
+    // The offset is for the first tile, the others are in the same level
+    if (args->batch)
+      return batch_handler(r,cfg,count,level,offset-sizeof(index_s)*(args->row*level->xcount+args->col));
   }
 
 //   ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
 //              "record read prepared %s %d", cfg->cachedir, offset);
 
-  char *ifname;
-  if (level->ifname[0] == '/') { // decide absolute or relative path from cachedir
-  	  ifname = apr_pstrcat(r->pool,level->ifname,0);
-  } else {
-  	  ifname = apr_pstrcat(r->pool,cfg->cachedir,level->ifname,0);
-  }
+  stats_mark(&st,OE_PHASE_MATCH,&mark);
+  st.level=cache->levels-1-(level-GETLEVELS(cache)); // Same as TILEMATRIX, 0 is the top
+
+  const oe_fname *ifname=level_fname(cfg,count,level,0);
   default_idx = 0;
-  this_record = r_file_pread(r, ifname, sizeof(index_s),offset, cache->time_period, cache->num_periods, cache->zlevels);
+  this_record = r_index_read(r, ifname, offset, level->xcount*sizeof(index_s), &cfg->meta[count].periods, cache->zlevels);
 
 	if (!this_record) {
 		// try to read from 0,0 in static index
-		this_record = p_file_pread(r->pool, ifname, sizeof(index_s), 0);
+		this_record = p_file_pread(r->pool, ifname->name, sizeof(index_s), 0);
+		if (this_record) oe_index_swap(this_record);
 		default_idx = 1;
 	}
 	if (!this_record) {
 		// still no record
-		if (errors > 0)
+		if (wmts_errors(r) > 0)
 			return wmts_return_all_errors(r);
-		char *fname = tstamp_fname(r,ifname);
-		ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Can't get index record from %s Based on %s", fname,r->args);
+		char fname[ifname->len+1];
+		tstamp_fname(r,ifname,fname);
+		ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Can't get index record from %s Based on %s", fname,r->args?r->args:r->uri);
 //		perror("Index read error: ");
-		return DECLINED;
+		return blank_missing(r,cfg,count,&st);
 
 //		// code to return error when time is out of range (includes blank tile for +1 day slack)
 //		// safe to assume invalid date?
@@ -2375,63 +4985,67 @@ static int mrf_handler(request_rec *r)
 //		} else {
 //			wmts_add_error(r,400,"InvalidParameterValue","TIME", "TIME is out of range for layer");
 //		}
-//		if (errors > 0) {
+//		if (wmts_errors(r) > 0) {
 //			return wmts_return_all_errors(r);
 //		} else {
 //			return DECLINED;
 //		}
 	}
 
-//
-// This is the only endian dependent part
-// Linux defines __LITTLE_ENDIAN
-// Could use the internal macros, but this is simpler
-//
-#if defined(__LITTLE_ENDIAN)
-  {
-    apr_size_t temp_size_t;
-    char *source,*dest;
-    int i;
-
-    source=(char *) &this_record->size;
-    dest=(char *) &temp_size_t;
-    for (i=0;i<8;i++) dest[i]=source[7-i];
-    this_record->size=temp_size_t;
-
-    source=(char *) &this_record->offset;
-    dest=(char *) &temp_size_t;
-    for (i=0;i<8;i++) dest[i]=source[7-i];
-    this_record->offset=temp_size_t;
-  }
-#endif
+  stats_mark(&st,OE_PHASE_INDEX,&mark);
 
   // Check for tile not in the cache
 //  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Try to read tile from %ld, size %ld",this_record->offset,this_record->size);
 	
-  char *dfname;
-  if (level->dfname[0] == '/') { // decide absolute or relative path from cachedir
-	  dfname = apr_pstrcat(r->pool,level->dfname,0);
-  } else {
-	  dfname = apr_pstrcat(r->pool,cfg->cachedir,level->dfname,0);
-  }
+  const oe_fname *dfname=level_fname(cfg,count,level,1);
   if (this_record->size && default_idx==0) {
-	  this_data=r_file_pread(r, dfname, this_record->size,this_record->offset, cache->time_period, cache->num_periods, cache->zlevels);
+	  this_file=r_file_open(r, dfname, &cfg->meta[count].periods, cache->zlevels);
+	  // A short file is treated like a failed read
+	  if (this_file && !fd_covers(this_file,this_record->offset+this_record->size)) {
+		  fd_release(this_file);
+		  this_file=0;
+	  }
+	  // Answer conditional requests before reading anything
+	  if (this_file && OK!=(rc=tile_validate(r,this_file,this_record))) {
+		  fd_release(this_file);
+		  if (HTTP_NOT_MODIFIED==rc) stats_record(r,cfg->meta+count,&st);
+		  return rc;
+	  }
+	  // Tiles in the tile cache, or going in it, are served from memory, the rest are sent
+	  // straight from the file after the headers are set, unless sendfile is off
+	  if (this_file && (!cfg->sendfile || (tile_cache_fits(this_record->size)
+	      && tile_cache_admit(r, this_file, this_record->offset, this_record->size)))) {
+		  this_data=tile_read(r, this_file, this_record->offset, this_record->size);
+		  fd_release(this_file);
+		  this_file=0;
+	  }
   }
-  if (!this_data) { // get empty tile
+  if (!this_data && !this_file) { // get empty tile
     int lc=level-GETLEVELS(cache);
+    st.flags|=OE_SAMPLE_EMPTY;
+    // Vector layers can answer with just the status
+    if (cfg->empty_vector && !apr_strnatcmp(cfg->meta[count].mime_type, "application/vnd.mapbox-vector-tile")) {
+      if (wmts_errors(r) > 0)
+        return wmts_return_all_errors(r);
+      stats_record(r,cfg->meta+count,&st);
+      r->status=cfg->empty_vector;
+      if (HTTP_NO_CONTENT!=r->status) ap_set_content_length(r,0);
+      return OK;
+    }
     if ((cfg->meta[count].empties[lc].index.size)&& (cfg->meta[count].empties[lc].data)) {
         this_record->size=cfg->meta[count].empties[lc].index.size;
         this_data=cfg->meta[count].empties[lc].data;
-    } else { // This might be first time, we need to read the empty page
+    } else { // Not read at startup, read the empty page for this request only
+      // The configuration pool is shared by all threads, so it can't be used here
       if (cfg->meta[count].empties[lc].index.size) {
         this_record->size=cfg->meta[count].empties[lc].index.size;
         this_record->offset=cfg->meta[count].empties[lc].index.offset;
-        ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "INITIALIZING EMPTY FOR: %s",r->args);
-        this_data=cfg->meta[count].empties[lc].data=p_file_pread(cfg->p,
-        		dfname, this_record->size, this_record->offset);
+        ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "READING EMPTY FOR: %s",r->args?r->args:r->uri);
+        this_data=p_file_pread(r->pool,
+        		dfname->name, this_record->size, this_record->offset);
       }
       if (!this_data) { // No empty tile provided, let it pass
-    	  miss_count--;
+    	  apr_atomic_inc32(&miss_count);
     	  if (apr_strnatcmp(cfg->meta[count].mime_type, "application/vnd.mapbox-vector-tile") == 0) {
     		  // return default message with vector tiles
     		  static char empty_json[]="{\"message\":\"Tile does not exist\"}";
@@ -2440,28 +5054,37 @@ static int mrf_handler(request_rec *r)
     		  r->status = 404;
     		  return HTTP_NOT_FOUND;
     	  } else {
-    		  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Record not present %s",r->args);
-        	  return DECLINED;
+    		  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Record not present %s",r->args?r->args:r->uri);
+        	  return blank_missing(r,cfg,count,&st);
     	  }
       }
     }
+    // Same ETag for all the empty tiles of the layer
+    if (OK!=(rc=empty_validate(r,GETSTRING(cfg->caches,cache->pattern),&cfg->meta[count].empties[lc].index))) {
+      if (HTTP_NOT_MODIFIED==rc) stats_record(r,cfg->meta+count,&st);
+      return rc;
+    }
   }
 
-  if (!this_data) {
+  if (!this_data && !this_file) {
     ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
-       "Data read error from file %s size %ld offset %ld",level->dfname,this_record->size, this_record->offset);
-    ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Request args: %s",r->args);
+       "Data read error from file %s size %ld offset %ld",dfname->name,this_record->size, this_record->offset);
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,"Request args: %s",r->args?r->args:r->uri);
+    if (DECLINED!=(rc=blank_missing(r,cfg,count,&st))) return rc;
     apr_table_set(r->notes, "mod_onearth_failed", "true");
     return DECLINED; // Can't read the data for some reason
   }
 
-  if (errors > 0) {
+  if (wmts_errors(r) > 0) {
+  	if (this_file) fd_release(this_file);
   	return wmts_return_all_errors(r);
   }
 
   // DEBUG
 //  ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server, "Got data at %x",this_data);
 
+  stats_mark(&st,OE_PHASE_DATA,&mark);
+
   // Set gzip encoding if output is mvt
   if (apr_strnatcmp(cfg->meta[count].mime_type, "application/vnd.mapbox-vector-tile") == 0) {
   	apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
@@ -2472,13 +5095,35 @@ static int mrf_handler(request_rec *r)
   	apr_table_setn(r->headers_out, "Content-Encoding", "deflate");
   }
   ap_set_content_length(r,this_record->size);
-  ap_rwrite(this_data,this_record->size,r);
+  if (this_file) {
+    apr_status_t rv=r_file_send(r,this_file,this_record->offset,this_record->size);
+    if (APR_SUCCESS!=rv)
+      ap_log_error(APLOG_MARK,APLOG_DEBUG,rv,r->server,"Can't send tile from %s",dfname->name);
+  } else
+    ap_rwrite(this_data,this_record->size,r);
+
+  stats_mark(&st,OE_PHASE_WRITE,&mark);
+  if (!(st.flags&OE_SAMPLE_EMPTY)) st.flags|=OE_SAMPLE_TILE;
+  st.bytes=this_record->size;
+  stats_record(r,cfg->meta+count,&st);
 
   // Got a hit, do we log anything?
-  if (!hit_count--) {
+  if (!((apr_atomic_inc32(&hit_count)+1)%1000)) {
     ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
-      "MISS_MARK %d", 1000-miss_count);
-    miss_count=hit_count=1000;
+      "MISS_MARK %u", apr_atomic_xchg32(&miss_count,0));
+    if (tile_cache.header) // Totals for all processes, since startup
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
+        "TILE_CACHE hits %" APR_UINT64_T_FMT " misses %" APR_UINT64_T_FMT " inserts %" APR_UINT64_T_FMT
+        " evictions %" APR_UINT64_T_FMT,
+        tile_cache.header->hits,tile_cache.header->misses,
+        tile_cache.header->inserts,tile_cache.header->evictions);
+    if (index_cache.mutex) // This process only
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
+        "INDEX_CACHE hits %u misses %u pages %d",
+        index_cache.hits,index_cache.misses,index_cache.count);
+    if (flights.on) // This process only
+      ap_log_error(APLOG_MARK,APLOG_ERR,0,r->server,
+        "COALESCE reads %u joined %u",flights.flights,flights.joined);
   }
 
   // DEBUG
@@ -2502,7 +5147,10 @@ int rewrite_rest_uri(request_rec *r) {
 	char *p;
 	char *params[16];
 	char *last;
-	char *format = apr_pcalloc(r->pool,45);
+	char *uri = r->uri;
+	char *path = apr_pstrdup(r->pool,r->uri); // The tokens split r->uri
+	oe_rest t;
+	wms_args a;
 
 	i = 0;
 	p = apr_strtok(r->uri,"/",&last);
@@ -2529,29 +5177,62 @@ int rewrite_rest_uri(request_rec *r) {
 	if (length < 7 || length > 9)
 		return -1;
 
-	i = i-1; // step back to split on "."
-	p = apr_strtok(params[i],".",&last);
-	while (p != NULL) {
-		params[i++] = p;
-		p = apr_strtok(NULL, ".",&last);
-	}
+	// Split the rest of the path, the segments point into the copy
+	p = path + (params[d+1] - uri);
+	if (!oe_rest_parse(p, strlen(p), &t))
+		return -1;
+
+	// The request, straight from the path segments
+	memset(&a, 0, sizeof(a));
+	a.type = WMS_REQ_WMTS;
+	a.service.s = "WMTS"; a.service.len = 4;
+	a.request.s = "GetTile"; a.request.len = 7;
+	a.version.s = "1.0.0"; a.version.len = 5;
+	a.layer = t.layer;
+	a.style = t.style;
+	// GIBS-273 handle style=default, treat as empty
+	if (sv_is(&a.style, "default"))
+		a.style.len = 0;
+	a.tilematrixset = t.tms;
+	a.tilematrix = t.matrix;
+	a.tilerow = t.row;
+	a.tilecol = t.col;
+	if (t.time.len) a.time = t.time;
+	if (t.zindex.len) a.zindex = t.zindex;
+	a.matrix = sv_atoi64(&a.tilematrix);
+	a.row = sv_atoi64(&a.tilerow);
+	a.col = sv_atoi64(&a.tilecol);
+
+	// The extension picks one of the valid formats
+	if (sv_is(&t.ext,"mvt"))
+		a.format.s = formats[4];
+	else if (sv_is(&t.ext,"jpg"))
+		a.format.s = formats[1];
+	else
+		a.format.s = apr_psprintf(r->pool,"image%%2F%.*s",SV(t.ext));
+	a.format.len = strlen(a.format.s);
+	for (j = 0; j < sizeof(formats)/sizeof(formats[0]) && !format_is(&a.format,formats[j]); j++);
 
-	if (ap_strcasecmp_match(params[length+d],"mvt") == 0) {
-		sprintf(format,"application%%2Fvnd.mapbox-vector-tile");
-	} else if (ap_strcasecmp_match(params[length+d],"jpg") == 0) {
-		sprintf(format,"image%%2Fjpeg");
+	// A range in the row or the column is a batch of tiles, same as TILES=row,col
+	a.batch = memchr(t.row.s,'-',t.row.len) || memchr(t.col.s,'-',t.col.len);
+
+	if (a.batch || j == sizeof(formats)/sizeof(formats[0])) {
+		// Through the argument string, which reports the errors
+		r->args = rest_args(r,&a);
 	} else {
-		sprintf(format,"image%%2F%s", params[length+d]);
+		wms_req_ctx *ctx = get_req_ctx(r);
+		a.format.s = formats[j];
+		a.format.len = strlen(formats[j]);
+		if (4 == j)
+			ap_set_content_type(r,"application/vnd.mapbox-vector-tile");
+		a.rest = 1;
+		ctx->args = a;
 	}
 
-	if (length == 7)
-		r->args = apr_psprintf(r->pool,"wmts.cgi?SERVICE=%s&REQUEST=%s&VERSION=%s&LAYER=%s&STYLE=%s&TILEMATRIXSET=%s&TILEMATRIX=%s&TILEROW=%s&TILECOL=%s&FORMAT=%s","WMTS","GetTile","1.0.0",params[1+d],params[2+d],params[3+d],params[4+d],params[5+d],params[6+d],format);
-	if (length == 8)
-		r->args = apr_psprintf(r->pool,"wmts.cgi?SERVICE=%s&REQUEST=%s&VERSION=%s&LAYER=%s&STYLE=%s&TILEMATRIXSET=%s&TILEMATRIX=%s&TILEROW=%s&TILECOL=%s&FORMAT=%s&TIME=%s","WMTS","GetTile","1.0.0",params[1+d],params[2+d],params[4+d],params[5+d],params[6+d],params[7+d],format,params[3+d]);
-	if (length == 9)
-		r->args = apr_psprintf(r->pool,"wmts.cgi?SERVICE=%s&REQUEST=%s&VERSION=%s&LAYER=%s&STYLE=%s&TILEMATRIXSET=%s&TILEMATRIX=%s&TILEROW=%s&TILECOL=%s&FORMAT=%s&TIME=%s&ZINDEX=%s","WMTS","GetTile","1.0.0",params[1+d],params[2+d],params[4+d],params[5+d],params[6+d],params[7+d],format,params[3+d],params[8+d]);
 	// Try to get image, otherwise redirect to cgi to handle error
 	if (mrf_handler(r) < 0) {
+		if (!r->args)
+			r->args = rest_args(r,parse_args(r));
 //		ap_log_error(APLOG_MARK,APLOG_WARNING,0,r->server,"REST redirect -> %s/wmts.cgi?%s",r->uri,r->args);
 		apr_table_set(r->notes, "mod_onearth_handled", "true");
 		ap_internal_redirect(apr_psprintf(r->pool,"%s/wmts.cgi?%s",r->uri,r->args),r);
@@ -2562,6 +5243,7 @@ int rewrite_rest_uri(request_rec *r) {
 static int handler(request_rec *r) {
   // Easy cases first, Has to be a get with arguments
   if (r->method_number != M_GET) return DECLINED;
+  if (r->handler && !strcmp(r->handler,"onearth-status")) return status_handler(r);
   if (r->prev && apr_table_get(r->prev->notes, "mod_onearth_handled")) return DECLINED;
   if (!(r->args)) {
 	  if(strlen(r->uri) > 4 && (!strcmp(r->uri + strlen(r->uri) - 4, ".png") || !strcmp(r->uri + strlen(r->uri) - 4, ".jpg") || !strcmp(r->uri + strlen(r->uri) - 5, ".jpeg") || !strcmp(r->uri + strlen(r->uri) - 4, ".tif") || !strcmp(r->uri + strlen(r->uri) - 5, ".tiff") || !strcmp(r->uri + strlen(r->uri) - 5, ".lerc") || !strcmp(r->uri + strlen(r->uri) - 4, ".mvt") )) {
@@ -2580,10 +5262,182 @@ static int handler(request_rec *r) {
   return mrf_handler(r);
 }
 
+// The date index, it doesn't depend on the descriptor cache, only on its check interval
+static void avail_init(apr_pool_t *p, server_rec *s)
+{
+  avail.hash=apr_hash_make(p);
+  if (APR_SUCCESS!=apr_thread_mutex_create(&avail.mutex,APR_THREAD_MUTEX_DEFAULT,p)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"Can't create date index mutex, date index disabled");
+    avail.mutex=0;
+    return;
+  }
+  apr_pool_cleanup_register(p,0,avail_cleanup,apr_pool_cleanup_null);
+}
+
+// Per child initialization, sets up the index and descriptor caches
+static void child_init(apr_pool_t *p, server_rec *s)
+{
+  index_cache_init(p,s);
+  flight_init(p,s);
+  cache_reload_init(p,s);
+  avail_init(p,s);
+  if (fd_cache_size<=0) return;
+  fd_cache.hash=apr_hash_make(p);
+  fd_cache.head=fd_cache.tail=0;
+  fd_cache.count=0;
+  if (APR_SUCCESS!=apr_thread_mutex_create(&fd_cache.mutex,APR_THREAD_MUTEX_DEFAULT,p)) {
+    ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"Can't create file cache mutex, file cache disabled");
+    fd_cache.mutex=0;
+    return;
+  }
+  apr_pool_cleanup_register(p,0,fd_cache_cleanup,apr_pool_cleanup_null);
+}
+
+// The configuration is read more than once, the reload list starts over each time
+static int pre_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+  cache_reload.list=0;
+  return OK;
+}
+
+static int post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+  empty_tiles.done=1;
+  stats_init(p,s);
+  return tile_cache_init(p,s);
+}
+
 static void register_hooks(apr_pool_t *p)
 
 {
+  ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_handler(handler, NULL, NULL, APR_HOOK_FIRST);
+  ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+// Size of the open file cache, and optionally the seconds between file identity checks
+static const char *file_cache_set(cmd_parms *cmd, void *dconf, const char *size, const char *check)
+{
+  fd_cache_size=apr_atoi64(size);
+  if (fd_cache_size<0)
+    return "WMSFileCache size has to be zero or positive";
+  if (check) {
+    fd_cache_check=apr_atoi64(check);
+    if (fd_cache_check<0)
+      return "WMSFileCache check interval has to be zero or positive";
+  }
+  return 0;
+}
+
+// Seconds between checks for a changed WMSCache file, 0 disables reloading
+static const char *cache_reload_set(cmd_parms *cmd, void *dconf, const char *interval)
+{
+  cache_reload.interval=apr_atoi64(interval);
+  if (cache_reload.interval<0)
+    return "WMSCacheReload interval has to be zero or positive";
+  return 0;
+}
+
+// Tile sent instead of an error when a tile or date is missing, one per MIME type
+static const char *blank_tile_set(cmd_parms *cmd, void *dconf, const char *mime_type, const char *fname)
+{
+  if (!blank_load(cmd->pool,(wms_cfg *)dconf,cmd->path,mime_type,fname))
+    return apr_psprintf(cmd->pool,"Can't read blank tile %s",fname);
+  return 0;
+}
+
+// What to send for vector tiles with no data
+static const char *empty_vector_set(cmd_parms *cmd, void *dconf, const char *arg)
+{
+  wms_cfg *cfg=(wms_cfg *)dconf;
+  if (!strcasecmp(arg,"Tile"))
+    cfg->empty_vector=0;
+  else if (!strcmp(arg,"204"))
+    cfg->empty_vector=HTTP_NO_CONTENT;
+  else if (!strcmp(arg,"404"))
+    cfg->empty_vector=HTTP_NOT_FOUND;
+  else
+    return "WMSEmptyVector has to be Tile, 204 or 404";
+  return 0;
+}
+
+// Layer slots for the request statistics, and optionally the number of shards
+static const char *stats_set(cmd_parms *cmd, void *dconf, const char *layers, const char *shards)
+{
+  stats.layers=apr_atoi64(layers);
+  if (stats.layers<0)
+    return "WMSStats layers have to be zero or positive";
+  if (shards) {
+    stats.shards=apr_atoi64(shards);
+    if (stats.shards<=0)
+      return "WMSStats shards have to be positive";
+  }
+  return 0;
+}
+
+// Megabytes for the DFA of the pattern matcher of the WMSCache, 0 to match each pattern by itself
+static const char *pattern_memory_set(cmd_parms *cmd, void *dconf, const char *mb)
+{
+  wms_cfg *cfg=(wms_cfg *)dconf;
+  int i;
+
+  cfg->pattern_memory=apr_atoi64(mb);
+  if (cfg->pattern_memory<0)
+    return "WMSPatternMemory has to be zero or positive";
+  if (cfg->reload) cfg->reload->pattern_memory=cfg->pattern_memory;
+
+  // After the WMSCache, build its matcher again with the new size
+  if (cfg->caches && cfg->meta && cfg->fallback) {
+    int *fallback=(int *)cfg->fallback->elts;
+    if (cfg->matcher) apr_pool_cleanup_run(cfg->p,cfg->matcher,matcher_cleanup);
+    cfg->matcher=0;
+    for (i=0;i<cfg->fallback->nelts;i++) cfg->meta[fallback[i]].matched=0;
+    matcher_build(cmd->server,cfg);
+  }
+  return 0;
+}
+
+static const char *coalesce_set(cmd_parms *cmd, void *dconf, int flag)
+{
+  flight_on=flag;
+  return 0;
+}
+
+static const char *io_uring_set(cmd_parms *cmd, void *dconf, int flag)
+{
+  read_uring=flag;
+  return 0;
+}
+
+// Index cache pages per process, and optionally the rows above and below read ahead on a miss
+static const char *index_cache_set(cmd_parms *cmd, void *dconf, const char *size, const char *rows)
+{
+  index_cache_size=apr_atoi64(size);
+  if (index_cache_size<0)
+    return "WMSIndexCache size has to be zero or positive";
+  if (rows) {
+    index_cache_rows=apr_atoi64(rows);
+    if (index_cache_rows<0)
+      return "WMSIndexCache read ahead rows have to be zero or positive";
+  }
+  return 0;
+}
+
+// Size of the shared tile cache in MB, and optionally the largest tile it holds, in KB
+static const char *tile_cache_conf(cmd_parms *cmd, void *dconf, const char *size, const char *tile)
+{
+  apr_int64_t mb=apr_atoi64(size);
+  if (mb<0)
+    return "WMSTileCache size has to be zero or positive";
+  tile_cache.size=(apr_size_t)mb*1024*1024;
+  if (tile) {
+    apr_int64_t kb=apr_atoi64(tile);
+    if (kb<=0)
+      return "WMSTileCache tile size has to be positive";
+    tile_cache.slot_size=APR_ALIGN_DEFAULT((apr_size_t)kb*1024);
+  }
+  return 0;
 }
 
 // Configuration options that go in the httpd.conf
@@ -2596,6 +5450,83 @@ static const command_rec cmds[] =
     ACCESS_CONF, /* where available */
     "Cache directive - points to the configuration file" /* help string */
   ),
+  AP_INIT_TAKE1(
+    "WMSCacheReload",
+    cache_reload_set,
+    NULL,
+    RSRC_CONF,
+    "Seconds between checks for changed cache configuration files, 0 to never reload them"
+  ),
+  AP_INIT_TAKE12(
+    "WMSFileCache",
+    file_cache_set,
+    NULL,
+    RSRC_CONF,
+    "Number of open data and index files kept per process, and seconds between file change checks"
+  ),
+  AP_INIT_TAKE12(
+    "WMSIndexCache",
+    index_cache_set,
+    NULL,
+    RSRC_CONF,
+    "Number of 4KB index pages cached per process, and rows above and below read ahead on a miss"
+  ),
+  AP_INIT_TAKE12(
+    "WMSTileCache",
+    tile_cache_conf,
+    NULL,
+    RSRC_CONF,
+    "Megabytes of shared memory for caching tiles, and the largest tile cached, in KB"
+  ),
+  AP_INIT_TAKE12(
+    "WMSStats",
+    stats_set,
+    NULL,
+    RSRC_CONF,
+    "Number of layers with request statistics, and the number of shards, about one per thread"
+  ),
+  AP_INIT_TAKE1(
+    "WMSPatternMemory",
+    pattern_memory_set,
+    NULL,
+    ACCESS_CONF,
+    "Megabytes for matching all the regexp patterns of a cache configuration at once, 0 to not do it"
+  ),
+  AP_INIT_FLAG(
+    "WMSIoUring",
+    io_uring_set,
+    NULL,
+    RSRC_CONF,
+    "On to use io_uring for batch tile reads when the kernel supports it, Off for preadv"
+  ),
+  AP_INIT_FLAG(
+    "WMSCoalesce",
+    coalesce_set,
+    NULL,
+    RSRC_CONF,
+    "On to have concurrent requests for the same tile share one read, Off to read it for each"
+  ),
+  AP_INIT_TAKE2(
+    "WMSBlankTile",
+    blank_tile_set,
+    NULL,
+    ACCESS_CONF,
+    "Mime type and file of the tile sent when a tile is missing and the layer has no empty tile"
+  ),
+  AP_INIT_TAKE1(
+    "WMSEmptyVector",
+    empty_vector_set,
+    NULL,
+    ACCESS_CONF,
+    "Tile to send the empty tile for vector tiles with no data, 204 or 404 to send only the status"
+  ),
+  AP_INIT_FLAG(
+    "WMSSendFile",
+    ap_set_flag_slot,
+    (void *)APR_OFFSETOF(wms_cfg,sendfile),
+    ACCESS_CONF,
+    "On to send tiles directly from the data files, Off to read them into memory first"
+  ),
   {NULL}
 };
 
@@ -2608,6 +5539,8 @@ static void *create_dir_config(apr_pool_t *p, char *dummy)
   cfg->p=p;
   // Not initialized yet
   cfg->caches=0;
+  cfg->sendfile=1;
+  cfg->pattern_memory=32;
   return (void *)cfg;
 }
 
@@ -40,7 +40,10 @@
 #include "stdafx.h"
 #include "cache.h"
 #include <algorithm>
+#include <map>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
 
 #if defined(LINUX)
 #include "oe_create_cache_config.h"
@@ -54,11 +57,15 @@ void PrintUsage() {
         "   MODE can be one of:\n"
         "       h : Help (default)\n"
         "       c : Configuration\n"
-        "       p : TiledWMSPattern\n\n"
+        "       p : TiledWMSPattern\n"
+        "       z : ZIndex table, converts INPUT .zdb to the compact OUTPUT .zdx\n"
+        "       o : Occupancy map, of the tiles with data in the INPUT .idx, to the OUTPUT .idm\n\n"
         "\n\n"
         "   Options:\n\n"
         "   x : With mode c, generate XML\n"
-        "   b : With mode c, generate binary\n"
+        "   b : With mode c, generate binary, version 2\n"
+        "   a DIR : With b, store relative file names as DIR/name\n"
+        "       DIR is where the server reads the configuration from\n"
         "       x and b are mutually exclusive\n"
         "\n"
         "   INPUT and OUTPUT default to stdin and stdout respectively\n"
@@ -117,8 +124,11 @@ struct server_config {
     vector<WMSCache> caches;
     vector<string>  strings;
     vector<int>  s_off;
+    vector<vector<string> > patterns; // For the layer hash table
+    string basedir; // Relative file names are taken from here, if set
     int string_add(string &s);
     int string_insert(string &s);
+    string file_name(const string &fname);
     void dump(ostream &ofname);
 };
 
@@ -169,20 +179,125 @@ int server_config::string_insert(string &s) {
     else return string_add(s);
 }
 
-/*\brief generates the binary configuration file, including adjusting the necessary pointers
+/*\brief file name as stored in the configuration, absolute if the output directory is known
+*/
+string server_config::file_name(const string &fname) {
+    if (basedir.empty() || fname.empty() || fname[0]=='/') return fname;
+    return basedir+fname;
+}
+
+// The canonical WMTS pattern, same as in mod_onearth
+static const char wmts_prefix[]="SERVICE=WMTS&REQUEST=GetTile&VERSION=";
+static const char *wmts_fields[]={"&LAYER=","&STYLE=","&TILEMATRIXSET=",
+    "&TILEMATRIX=","&TILEROW=","&TILECOL=","&FORMAT="};
+
+/*\brief key value for a pattern field, the dots are wildcards, see cache_key_value
+* Returns false if the field has other regexp syntax
+*/
+static bool key_value(const string &s, string &out) {
+    out.resize(s.size());
+    int len=cache_key_value(s.data(),s.size(),&out[0]);
+    if (len<0) return false;
+    out.resize(len);
+    return true;
+}
+
+/*\brief layer hash keys for a pattern, the same ones index_wmts_pattern in mod_onearth uses
+* Returns false if the cache has to be matched by regexp
+*/
+static bool wmts_keys(const string &patt, vector<string> &keys, cache_key_masks &masks) {
+    vector<string> v;
+    size_t pos=sizeof(wmts_prefix)-1;
+    if (patt.compare(0,pos,wmts_prefix)) return false;
+    for (int i=0;i<8;i++) {
+        if (i) {
+            size_t len=strlen(wmts_fields[i-1]);
+            if (patt.compare(pos,len,wmts_fields[i-1])) return false;
+            pos+=len;
+        }
+        size_t end=patt.find('&',pos);
+        if (end==string::npos) end=patt.size();
+        v.push_back(patt.substr(pos,end-pos));
+        pos=end;
+    }
+    if (pos!=patt.size()) return false;
+    // VERSION LAYER STYLE TILEMATRIXSET TILEMATRIX TILEROW TILECOL FORMAT
+    for (int i=4;i<=6;i++)
+        if (v[i]!="[0-9]*") return false;
+    string version,layer,tms,format;
+    if (!key_value(v[0],version) || !key_value(v[1],layer) || !key_value(v[3],tms)
+        || !key_value(v[7],format))
+        return false;
+
+    // The style is a literal or an optional literal, like (default)?
+    string style=v[2];
+    vector<string> styles(1);
+    if (style.size()>3 && style[0]=='(' && !style.compare(style.size()-2,2,")?")) {
+        style=style.substr(1,style.size()-3);
+        styles.push_back("");
+    }
+    if (!key_value(style,styles[0])) return false;
+
+    vector<string> k;
+    for (int i=0;i<styles.size();i++) {
+        string key=version+"&"+layer+"&"+styles[i]+"&"+tms+"&"+format;
+        if (key.size()>=1024) return false; // The module doesn't build longer keys
+        if (cache_key_masks_add(&masks,key.data(),key.size())) return false;
+        k.push_back(key);
+    }
+    keys.insert(keys.end(),k.begin(),k.end());
+    return true;
+}
+
+/*\brief generates the version 2 binary configuration file, with the layer hash table
 */
 void server_config::dump(ostream &ofname) {
-    total_size+=sizeof(Caches)+strings_size;
-    // size and count in the first two ints
+    // Hash keys and the caches left for regexp matching, from the highest cache down,
+    // so the highest numbered cache wins, same as the regexp scan
+    map<string,int> keys;
+    vector<int> fallback;
+    cache_key_masks masks={0};
+    for (int i=count-1;i>=0;i--) {
+        bool hashed=true;
+        for (int j=0;j<patterns[i].size();j++) {
+            vector<string> k;
+            if (!wmts_keys(patterns[i][j],k,masks)) hashed=false;
+            for (int n=0;n<k.size();n++)
+                if (!keys.count(k[n])) keys[k[n]]=i;
+        }
+        if (!hashed) fallback.push_back(i);
+    }
 
-    //.write method requires pointer value.
-    //typecasting into char array pointer
+    cache_header hd;
+    memcpy(hd.magic,CACHE_MAGIC,4);
+    hd.version=CACHE_VERSION;
+    // At most half full
+    for (hd.hash_size=2;hd.hash_size<2*keys.size();hd.hash_size*=2);
+    hd.hash_offset=sizeof(Caches) + count*sizeof(WMSCache) + levels.size()*sizeof(WMSlevel);
+    hd.fallback_count=fallback.size();
+    hd.fallback_offset=hd.hash_offset + hd.hash_size*sizeof(cache_hash_entry);
+
+    // String offset from the Caches record, the keys go after the other strings
+    int string_offset=hd.fallback_offset + fallback.size()*sizeof(int);
+    int key_offset=string_offset+strings_size;
+    vector<cache_hash_entry> table(hd.hash_size);
+    for (int i=0;i<hd.hash_size;i++)
+        table[i].key=table[i].len=table[i].cache=0;
+    for (map<string,int>::iterator i=keys.begin();i!=keys.end();i++) {
+        unsigned int slot=cache_key_hash(i->first.c_str(),i->first.size())&(hd.hash_size-1);
+        while (table[slot].key)
+            slot=(slot+1)&(hd.hash_size-1);
+        table[slot].key=key_offset;
+        table[slot].len=i->first.size();
+        table[slot].cache=i->second;
+        key_offset+=i->first.size();
+    }
+
+    total_size=key_offset;
+    ofname.write((char *)&hd,sizeof(hd));
     ofname.write((char *)&total_size,sizeof(total_size));
     ofname.write((char *)&count,sizeof(count));
 
-    // String offset from base pointer
-    int string_offset= sizeof(Caches) + count*sizeof(WMSCache) + levels.size()*sizeof(WMSlevel);
-
     // Adjust the offsets and write each cache in sequence
     for (int i=0;i<count;i++) {
         caches[i].pattern+=string_offset;
@@ -194,15 +309,21 @@ void server_config::dump(ostream &ofname) {
         ofname.write((char *)&caches[i],sizeof(WMSCache));
     }
 
-    // Adjust the pointers and write each level in sequence
+    // Adjust the offsets and write each level in sequence
     for (int i=0;i<levels.size();i++) {
         levels[i].dfname+=string_offset;
         levels[i].ifname+=string_offset;
         ofname.write((char *)&levels[i],sizeof(WMSlevel));
     }
 
+    ofname.write((char *)&table[0],table.size()*sizeof(cache_hash_entry));
+    if (!fallback.empty())
+        ofname.write((char *)&fallback[0],fallback.size()*sizeof(int));
+
     for (int i=0;i<strings.size();i++)
         ofname.write(strings[i].c_str(),strings[i].size()+1);
+    for (map<string,int>::iterator i=keys.begin();i!=keys.end();i++)
+        ofname.write(i->first.data(),i->first.size());
 }
 
 /*\brief add the current mrf to the server config
@@ -228,6 +349,7 @@ void mrf_data::mrf2cacheb(server_config &cfg, bool verbose) {
         cfg.string_add(patt[i]);
         c.num_patterns++;
     }
+    cfg.patterns.push_back(vector<string>(patt.begin(),patt.end()));
 
     c.levels=levels;
     // levelt is the offset between the cache pointer and the first level belonging to this cache
@@ -237,7 +359,8 @@ void mrf_data::mrf2cacheb(server_config &cfg, bool verbose) {
     c.prefix += cfg.string_insert( h_format.append("\n\n") );
 
     c.zlevels=zlevels;
-    c.zidxfname += cfg.string_insert(zidx_fname);
+    string zname=cfg.file_name(zidx_fname);
+    c.zidxfname += cfg.string_insert(zname);
 
     c.orientation=orientation;
     c.signature=sig;
@@ -249,6 +372,8 @@ void mrf_data::mrf2cacheb(server_config &cfg, bool verbose) {
         c.num_periods++;
     }
 
+    string dname=cfg.file_name(data_fname);
+    string iname=cfg.file_name(idx_fname);
     long long offset=0;
     // Use a zero levels mrf for blocking access
     for (int i=0;i<levels;i++) {
@@ -268,8 +393,8 @@ void mrf_data::mrf2cacheb(server_config &cfg, bool verbose) {
         level.ycount=(whole_size_y - 1) / (tile_size_y * pow(scale,i)) + 1;
         level.index_add=offset;
         // These two are string pointers, will be adjusted later
-        level.dfname+=cfg.string_insert(data_fname);
-        level.ifname+=cfg.string_insert(idx_fname);
+        level.dfname+=cfg.string_insert(dname);
+        level.ifname+=cfg.string_insert(iname);
 
         cfg.levels.push_back(level);
         cfg.total_size+=sizeof(WMSlevel);
@@ -609,7 +734,7 @@ void mrf_data::mrf2patterns(const char *ofname) {
     CPLDestroyXMLNode(GTS_patterns);
 }
 
-typedef enum {CONF, PATTERN} md;
+typedef enum {CONF, PATTERN, ZTABLE, OCCUPANCY} md;
 
 struct opts{
     string ofname;
@@ -617,6 +742,7 @@ struct opts{
     bool binary;
     md mode;
     bool directory;
+    string absdir;
 };
 
 void mrf2cache(vector<mrf_data> &in, opts &o) {
@@ -645,6 +771,16 @@ void mrf2cache(vector<mrf_data> &in, opts &o) {
         CPLDestroyXMLNode(cache);
     } else if (o.binary) {
         server_config cfg={0};
+        // The server looks for relative names in its configuration directory, -a resolves them here
+        if (!o.absdir.empty()) {
+            if (o.absdir[0]!='/') {
+                char cwd[PATH_MAX];
+                if (getcwd(cwd,sizeof(cwd)))
+                    cfg.basedir=string(cwd)+"/";
+            }
+            cfg.basedir+=o.absdir;
+            if (cfg.basedir[cfg.basedir.size()-1]!='/') cfg.basedir+='/';
+        }
         for (vector<mrf_data>::iterator i=in.begin();i!=in.end();i++)
             i->mrf2cacheb(cfg);
         cfg.dump(*out);
@@ -656,17 +792,209 @@ void mrf2cache(vector<mrf_data> &in, opts &o) {
     }
 }
 
+// One ZINDEX row, the optional columns are empty if not present or null
+struct zdx_row {
+    int z;
+    string source_url, scale, offset, uom;
+    bool has_url, has_scale, has_offset, has_uom;
+};
+
+static bool zdb_text(sqlite3_stmt *res, int col, const char *name, string &value) {
+    if (sqlite3_column_count(res)<=col || strcmp(sqlite3_column_name(res,col),name)
+        || !sqlite3_column_text(res,col))
+        return false;
+    value=(const char *)sqlite3_column_text(res,col);
+    return true;
+}
+
+// Writes the compact z-index table used by mod_onearth in place of the ZDB
+// The first row for each key is kept, same as the module query does
+int zdb2zdx(const char *ifname, const char *ofname) {
+    sqlite3 *db;
+    sqlite3_stmt *res;
+    map<string, zdx_row> rows;
+    string latest;
+    bool has_latest=false;
+
+    if (SQLITE_OK!=sqlite3_open_v2(ifname,&db,SQLITE_OPEN_READONLY,NULL)) {
+        cerr << "Can't open z-index " << ifname << endl;
+        sqlite3_close(db);
+        return 1;
+    }
+    if (SQLITE_OK!=sqlite3_prepare_v2(db,"SELECT * FROM ZINDEX",-1,&res,0)) {
+        cerr << "Can't read ZINDEX table from " << ifname << endl;
+        sqlite3_close(db);
+        return 1;
+    }
+    while (SQLITE_ROW==sqlite3_step(res)) {
+        string key;
+        zdx_row row;
+        if (!zdb_text(res,1,"key_str",key) || rows.count(key))
+            continue;
+        row.z=atoi((const char *)sqlite3_column_text(res,0));
+        row.has_url=zdb_text(res,2,"source_url",row.source_url);
+        bool extra=sqlite3_column_count(res)>5;
+        row.has_scale=extra && zdb_text(res,3,"scale",row.scale);
+        row.has_offset=extra && zdb_text(res,4,"offset",row.offset);
+        row.has_uom=extra && zdb_text(res,5,"uom",row.uom);
+        rows[key]=row;
+    }
+    sqlite3_finalize(res);
+
+    // The record for requests without a key
+    if (SQLITE_OK==sqlite3_prepare_v2(db,"SELECT key_str FROM ZINDEX WHERE key_str NOT LIKE '%encoded%' ORDER BY key_str DESC LIMIT 1",-1,&res,0)) {
+        if (SQLITE_ROW==sqlite3_step(res) && sqlite3_column_text(res,0)) {
+            latest=(const char *)sqlite3_column_text(res,0);
+            has_latest=true;
+        }
+        sqlite3_finalize(res);
+    }
+    sqlite3_close(db);
+
+    // Strings follow the records, so no string is at offset 0
+    zdx_header hd;
+    vector<zdx_record> recs;
+    string strings;
+    int base=sizeof(zdx_header)+rows.size()*sizeof(zdx_record);
+    memcpy(hd.magic,ZDX_MAGIC,4);
+    hd.count=rows.size();
+    hd.latest=-1;
+    hd.reserved=0;
+    for (map<string, zdx_row>::iterator i=rows.begin();i!=rows.end();i++) {
+        zdx_record rec={0};
+        if (has_latest && i->first==latest) hd.latest=recs.size();
+        rec.z=i->second.z;
+        rec.key=base+strings.size();
+        strings.append(i->first.c_str(),i->first.size()+1);
+        if (i->second.has_url) {
+            rec.source_url=base+strings.size();
+            strings.append(i->second.source_url.c_str(),i->second.source_url.size()+1);
+        }
+        if (i->second.has_scale) {
+            rec.scale=base+strings.size();
+            strings.append(i->second.scale.c_str(),i->second.scale.size()+1);
+        }
+        if (i->second.has_offset) {
+            rec.offset=base+strings.size();
+            strings.append(i->second.offset.c_str(),i->second.offset.size()+1);
+        }
+        if (i->second.has_uom) {
+            rec.uom=base+strings.size();
+            strings.append(i->second.uom.c_str(),i->second.uom.size()+1);
+        }
+        recs.push_back(rec);
+    }
+
+    ofstream of(ofname, ios::binary);
+    if (!of.is_open()) {
+        cerr << "Can't open output file " << ofname << endl;
+        return 1;
+    }
+    of.write((char *)&hd,sizeof(hd));
+    if (!recs.empty())
+        of.write((char *)&recs[0],recs.size()*sizeof(zdx_record));
+    of.write(strings.data(),strings.size());
+    return of.good()?0:1;
+}
+
+// Writes the occupancy map of an index file, used by mod_onearth to skip reading empty records
+// The index is big endian, a record has data if the size is not zero in any byte order
+// The map records the size and time of the index, which can't change while it is read
+int idx2idm(const char *ifname, const char *ofname) {
+    ifstream in(ifname, ios::binary);
+    vector<index_s> recs(IDM_CHUNK);
+    vector<idm_chunk> chunks;
+    string data;
+    long long records=0;
+    struct stat before,after;
+
+    if (!in.is_open() || stat(ifname,&before)) {
+        cerr << "Can't open index " << ifname << endl;
+        return 1;
+    }
+    for (;;) {
+        in.read((char *)&recs[0],IDM_CHUNK*sizeof(index_s));
+        size_t n=in.gcount()/sizeof(index_s);
+        if (!n) break;
+        records+=n;
+
+        vector<unsigned short> set;
+        string bits(IDM_CHUNK/8,'\0');
+        for (size_t i=0;i<n;i++)
+            if (recs[i].size) {
+                set.push_back(i);
+                bits[i>>3]|=1<<(i&7);
+            }
+
+        // Offsets are from the start of the data for now
+        idm_chunk c={IDM_EMPTY,(int)set.size(),0};
+        if (set.empty()) {
+            c.type=IDM_EMPTY;
+        } else if (set.size()==n) {
+            c.type=IDM_FULL;
+        } else if (set.size()>IDM_ARRAY_MAX) {
+            c.type=IDM_BITMAP;
+            c.offset=data.size();
+            data+=bits;
+        } else {
+            c.type=IDM_ARRAY;
+            c.offset=data.size();
+            data.append((char *)&set[0],set.size()*sizeof(unsigned short));
+        }
+        chunks.push_back(c);
+        if (n<IDM_CHUNK) break;
+    }
+    if (in.bad()) {
+        cerr << "Can't read index " << ifname << endl;
+        return 1;
+    }
+    if (stat(ifname,&after) || after.st_size!=before.st_size || after.st_ino!=before.st_ino
+        || after.st_mtim.tv_sec!=before.st_mtim.tv_sec || after.st_mtim.tv_nsec!=before.st_mtim.tv_nsec) {
+        cerr << "Index " << ifname << " changed while it was read" << endl;
+        return 1;
+    }
+
+    idm_header hd;
+    long long base=sizeof(idm_header)+chunks.size()*sizeof(idm_chunk);
+    memcpy(hd.magic,IDM_MAGIC,4);
+    hd.chunks=chunks.size();
+    hd.records=records;
+    hd.index_size=before.st_size;
+    hd.index_mtime=before.st_mtim.tv_sec;
+    hd.index_nsec=before.st_mtim.tv_nsec;
+    for (vector<idm_chunk>::iterator i=chunks.begin();i!=chunks.end();i++)
+        if (i->type==IDM_ARRAY || i->type==IDM_BITMAP)
+            i->offset+=base;
+
+    ofstream of(ofname, ios::binary);
+    if (!of.is_open()) {
+        cerr << "Can't open output file " << ofname << endl;
+        return 1;
+    }
+    of.write((char *)&hd,sizeof(hd));
+    if (!chunks.empty())
+        of.write((char *)&chunks[0],chunks.size()*sizeof(idm_chunk));
+    of.write(data.data(),data.size());
+    return of.good()?0:1;
+}
+
 int main(int argc, char* argv[])
 {
     opts o={"-",false,CONF};
 
     int opt;
 
-    while ((opt=getopt(argc, argv,"pchxbd")) != -1) {
+    while ((opt=getopt(argc, argv,"pchxbdzoa:")) != -1) {
         switch(opt) {
         case 'p' :
             o.mode=PATTERN;
             break;
+        case 'z' :
+            o.mode=ZTABLE;
+            break;
+        case 'o' :
+            o.mode=OCCUPANCY;
+            break;
         case 'c' :
             o.mode=CONF;
             break;
@@ -681,6 +1009,9 @@ int main(int argc, char* argv[])
             o.xml=false;
             o.binary=true;
             break;
+        case 'a' :
+            o.absdir=optarg;
+            break;
         case 'h' :
         case '?' :
             PrintUsage();
@@ -693,6 +1024,24 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    if (o.mode==ZTABLE) {
+        if (optind!=argc-2) {
+            cerr << "The z option needs the input .zdb and the output .zdx file names\n";
+            PrintUsage();
+            exit(1);
+        }
+        return zdb2zdx(argv[optind],argv[optind+1]);
+    }
+
+    if (o.mode==OCCUPANCY) {
+        if (optind!=argc-2) {
+            cerr << "The o option needs the input .idx and the output .idm file names\n";
+            PrintUsage();
+            exit(1);
+        }
+        return idx2idm(argv[optind],argv[optind+1]);
+    }
+
     vector<mrf_data> input;
     if (optind==argc)
         input.push_back(mrf_data("-"));
@@ -0,0 +1,221 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_layer_bench - WMTS layer dispatch, one regexec per cache pattern and the layer hash table
+// Makes the patterns oe_configure_layer writes for WMTS layers, with the (default)? style,
+// and a version 2 layer hash table from them, the way oe_create_cache_config -b does.  Then
+// times finding the cache for random tile requests, some of them for no layer at all, by
+// scanning the patterns from the highest one and with oe_layer_find.  Both have to find the
+// same cache, and the hash table time should not grow with the number of layers
+//
+// oe_layer_bench [-n requests] [-l layers]
+// Without -l it runs with 100, 1000 and 10000 layers
+//
+
+#include "oe_tile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <regex.h>
+
+static const char wmts_prefix[]="SERVICE=WMTS&REQUEST=GetTile&VERSION=";
+static const char *sets[]={"EPSG4326_250m","EPSG4326_2km","EPSG4326_16km"};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+// The values of a canonical request, VERSION LAYER STYLE TILEMATRIXSET and FORMAT, like
+// wmts_split in mod_onearth.  Returns 0 if the request doesn't have the canonical form
+static int split(const char *s, oe_str *v)
+{
+  static const char *fields[]={"&LAYER=","&STYLE=","&TILEMATRIXSET=",
+    "&TILEMATRIX=","&TILEROW=","&TILECOL=","&FORMAT="};
+  static const int keep[]={0,1,2,3,-1,-1,-1,4};
+  int i;
+  if (strncmp(s,wmts_prefix,sizeof(wmts_prefix)-1)) return 0;
+  s+=sizeof(wmts_prefix)-1;
+  for (i=0;i<8;i++) {
+    const char *start;
+    if (i) {
+      int len=strlen(fields[i-1]);
+      if (strncmp(s,fields[i-1],len)) return 0;
+      s+=len;
+    }
+    for (start=s;*s && '&'!=*s;s++);
+    if (keep[i]>=0) {
+      v[keep[i]].s=start;
+      v[keep[i]].len=s-start;
+    }
+  }
+  return 1;
+}
+
+static int find(const cache_header *hd, const Caches *caches, const cache_key_masks *m, const char *s)
+{
+  oe_str v[5];
+  char key[1024];
+  int len;
+  if (!split(s,v) || 0>(len=oe_wmts_key(key,sizeof(key),v,v+1,v+2,v+3,v+4))) return -1;
+  return oe_layer_find(hd,caches,m,key,len);
+}
+
+// The highest numbered match, checking the highest first, like mod_onearth did
+static int regex_max(const regex_t *regex, int layers, const char *s)
+{
+  int i;
+  for (i=layers-1;i>=0;i--)
+    if (!regexec(regex+i,s,0,NULL,0)) return i;
+  return -1;
+}
+
+// Layer hash table, keys for the named and the empty style of each layer
+static char *make_table(int layers, cache_header *hd, cache_key_masks *m)
+{
+  int nkeys=2*layers,i,j,key_offset;
+  char *mem;
+  cache_hash_entry *table;
+
+  memset(hd,0,sizeof(*hd));
+  memset(m,0,sizeof(*m));
+  for (hd->hash_size=2;hd->hash_size<2*nkeys;hd->hash_size*=2);
+  hd->hash_offset=sizeof(Caches);
+  key_offset=hd->hash_offset+hd->hash_size*sizeof(cache_hash_entry);
+  mem=calloc(1,key_offset+(size_t)nkeys*128);
+  table=(cache_hash_entry *)(mem+hd->hash_offset);
+  for (i=0;i<layers;i++)
+    for (j=0;j<2;j++) {
+      char *key=mem+key_offset;
+      unsigned int slot;
+      // The dots of the version are wildcards in the pattern
+      int len=cache_key_value("1.0.0",5,key);
+      len+=snprintf(key+len,128-len,"&Layer_%d&%s&%s&image%%2Fjpeg",i,j?"default":"",sets[i%3]);
+      cache_key_masks_add(m,key,len);
+      for (slot=cache_key_hash(key,len)&(hd->hash_size-1);table[slot].key;slot=(slot+1)&(hd->hash_size-1));
+      table[slot].key=key_offset;
+      table[slot].len=len;
+      table[slot].cache=i;
+      key_offset+=len;
+    }
+  ((Caches *)mem)->size=key_offset;
+  return mem;
+}
+
+static int run(int layers, int n)
+{
+  regex_t *regex=malloc(layers*sizeof(regex_t));
+  char (*req)[256]=malloc((size_t)n*sizeof(*req));
+  char p[512];
+  cache_header hd;
+  cache_key_masks m;
+  char *mem;
+  long long check=0;
+  int i,r,rounds;
+  double t,build,regex_ns,table_ns;
+
+  srand(layers);
+  for (i=0;i<n;i++) {
+    int l=rand()%layers;
+    if (!(rand()%8)) l+=layers; // No such layer
+    snprintf(req[i],sizeof(req[i]),"%s1.0.0&LAYER=Layer_%d&STYLE=%s&TILEMATRIXSET=%s"
+      "&TILEMATRIX=%d&TILEROW=%d&TILECOL=%d&FORMAT=image%%2Fjpeg",
+      wmts_prefix,l,(rand()%2)?"default":"",sets[l%3],rand()%10,rand()%512,rand()%1024);
+  }
+
+  for (i=0;i<layers;i++) {
+    snprintf(p,sizeof(p),"%s1.0.0&LAYER=Layer_%d&STYLE=(default)?&TILEMATRIXSET=%s"
+      "&TILEMATRIX=[0-9]*&TILEROW=[0-9]*&TILECOL=[0-9]*&FORMAT=image%%2Fjpeg",wmts_prefix,i,sets[i%3]);
+    if (regcomp(regex+i,p,REG_EXTENDED|REG_NOSUB)) {
+      fprintf(stderr,"Can't compile %s\n",p);
+      return 1;
+    }
+  }
+  t=now();
+  mem=make_table(layers,&hd,&m);
+  build=now()-t;
+
+  for (i=0;i<n && i<100;i++) {
+    int a=regex_max(regex,layers,req[i]),b=find(&hd,(Caches *)mem,&m,req[i]);
+    if (a!=b) {
+      printf("Mismatch for %s: %d and %d\n",req[i],a,b);
+      return 1;
+    }
+  }
+
+  t=now();
+  for (i=0;i<n;i++) check+=regex_max(regex,layers,req[i]);
+  regex_ns=(now()-t)/n;
+  // The table is fast, go over the requests enough times for the clock
+  rounds=1+1000000/n;
+  t=now();
+  for (r=0;r<rounds;r++)
+    for (i=0;i<n;i++) check-=find(&hd,(Caches *)mem,&m,req[i]);
+  table_ns=(now()-t)/n/rounds;
+
+  printf("%d layers, %d requests\n",layers,n);
+  printf("  layer hash table build: %.1f ms\n",build/1e6);
+  printf("  regexec loop: %.1f ns per request\n",regex_ns);
+  printf("  layer hash table: %.1f ns per request\n",table_ns);
+
+  for (i=0;i<layers;i++) regfree(regex+i);
+  free(regex);
+  free(req);
+  free(mem);
+  return check==0x7fffffffffffffffLL;
+}
+
+int main(int argc, char **argv)
+{
+  int n=200,layers=0,c;
+
+  while (-1!=(c=getopt(argc,argv,"n:l:")))
+    switch (c) {
+      case 'n': n=atoi(optarg); break;
+      case 'l': layers=atoi(optarg); break;
+      default:
+        fprintf(stderr,"Usage: %s [-n requests] [-l layers]\n",argv[0]);
+        return 1;
+    }
+  if (n<1 || layers<0) {
+    fprintf(stderr,"Requests and layers have to be positive\n");
+    return 1;
+  }
+  if (layers) return run(layers,n);
+  return run(100,n) || run(1000,n) || run(10000,n);
+}
@@ -0,0 +1,933 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Multi-pattern matcher, see oe_match.h
+// The patterns become one Thompson NFA.  Their literal prefixes go in a trie, so patterns that
+// start the same share the nodes, and the restart at each position of the string only adds
+// the few distinct first characters.  The DFA is built lazily, from sets of NFA nodes, with
+// transitions on byte classes.  A search holds a read lock and follows the built transitions,
+// it takes the write lock to add a state.  When the states would take more than the memory
+// limit they are all dropped and the search starts over, like RE2 does
+//
+
+#include "oe_match.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+enum {N_CHAR,N_SET,N_SPLIT,N_BOL,N_EOL,N_MATCH};
+
+#define MAX_REPEAT 100   // Largest count in {n,m}
+#define MAX_NODES (1<<26)
+
+typedef struct {
+  unsigned char type;
+  unsigned char c;  // N_CHAR
+  int arg;          // N_SET, the set number.  N_MATCH, the pattern id
+  int out,out1;     // Next nodes, -1 for none.  Only N_SPLIT uses out1
+} nfa_node;
+
+typedef struct {
+  unsigned char bits[32];
+} byte_set;
+
+typedef struct dfa_state {
+  struct dfa_state *chain;  // Hash bucket
+  unsigned int hash;
+  int match;                // Highest id matched when reaching this state, -1 if none
+  int end_match;            // Same, if the string ends here, for the $ anchors
+  int count;                // NFA nodes
+  int *nodes;               // Sorted, only the ones that read a byte, match or wait for the end
+  struct dfa_state *next[1]; // By byte class, 0 until built.  The nodes follow
+} dfa_state;
+
+typedef struct {
+  int *v;
+  int n,size;
+} int_list;
+
+struct oe_matcher {
+  nfa_node *nodes;
+  int nnodes,anodes;
+  byte_set *sets;
+  int nsets,asets;
+  int root;                   // Trie root, where every pattern starts
+  int max_id;
+
+  // Trie children, by parent node and character, open addressing
+  long long *trie_keys;
+  int *trie_vals;
+  size_t trie_size,trie_count;
+
+  // Built by oe_matcher_compile
+  int compiled;
+  unsigned char classes[256]; // Byte class of each byte
+  unsigned char reps[256];    // A byte of each class
+  int nclasses;
+  int_list restart;           // Nodes added at each position, the root closure without ^
+
+  pthread_rwlock_t lock;
+  unsigned int generation;    // Changes when the states are dropped
+  size_t max_mem,mem;
+  dfa_state *start;
+  dfa_state **buckets;
+  size_t nbuckets,nstates;
+
+  // Scratch, used with the write lock
+  unsigned int *marks;
+  unsigned int mark;
+  int_list work,list;
+};
+
+static int list_push(int_list *l, int v)
+{
+  if (l->n==l->size) {
+    int size=l->size?2*l->size:64;
+    int *v2=(int *)realloc(l->v,size*sizeof(int));
+    if (!v2) return 0;
+    l->v=v2;
+    l->size=size;
+  }
+  l->v[l->n++]=v;
+  return 1;
+}
+
+//
+// NFA construction
+//
+
+static int node_new(oe_matcher *m, int type)
+{
+  nfa_node *n;
+  if (m->nnodes==m->anodes) {
+    int size=m->anodes?2*m->anodes:256;
+    nfa_node *n2;
+    if (size>MAX_NODES || !(n2=(nfa_node *)realloc(m->nodes,size*sizeof(nfa_node)))) return -1;
+    m->nodes=n2;
+    m->anodes=size;
+  }
+  n=m->nodes+m->nnodes;
+  memset(n,0,sizeof(*n));
+  n->type=type;
+  n->out=n->out1=-1;
+  return m->nnodes++;
+}
+
+static int set_add(oe_matcher *m, const byte_set *s)
+{
+  int i;
+  for (i=0;i<m->nsets;i++)
+    if (!memcmp(m->sets+i,s,sizeof(*s))) return i;
+  if (m->nsets==m->asets) {
+    int size=m->asets?2*m->asets:16;
+    byte_set *s2=(byte_set *)realloc(m->sets,size*sizeof(byte_set));
+    if (!s2) return -1;
+    m->sets=s2;
+    m->asets=size;
+  }
+  m->sets[m->nsets]=*s;
+  return m->nsets++;
+}
+
+#define SET_HAS(S,C) ((S)->bits[(unsigned char)(C)>>3]&(1<<((C)&7)))
+#define SET_ADD(S,C) ((S)->bits[(unsigned char)(C)>>3]|=(1<<((C)&7)))
+
+static void set_range(byte_set *s, int from, int to)
+{
+  for (;from<=to;from++) SET_ADD(s,from);
+}
+
+static void set_invert(byte_set *s)
+{
+  int i;
+  for (i=0;i<32;i++) s->bits[i]=~s->bits[i];
+}
+
+// A piece of the NFA, the end is a split node with no outs yet
+typedef struct {
+  int start,end;
+} frag;
+
+typedef struct {
+  oe_matcher *m;
+  const char *p,*end;
+  int err;
+} parser;
+
+static frag frag_fail(parser *P)
+{
+  frag f={-1,-1};
+  P->err=1;
+  return f;
+}
+
+static frag frag_eps(parser *P)
+{
+  frag f;
+  if (0>(f.start=f.end=node_new(P->m,N_SPLIT))) return frag_fail(P);
+  return f;
+}
+
+static frag frag_node(parser *P, int type, int c, int arg)
+{
+  frag f;
+  int n=node_new(P->m,type),e=node_new(P->m,N_SPLIT);
+  if (n<0 || e<0) return frag_fail(P);
+  P->m->nodes[n].c=c;
+  P->m->nodes[n].arg=arg;
+  P->m->nodes[n].out=e;
+  f.start=n;
+  f.end=e;
+  return f;
+}
+
+static frag frag_set(parser *P, const byte_set *s)
+{
+  int i=set_add(P->m,s);
+  if (i<0) return frag_fail(P);
+  return frag_node(P,N_SET,0,i);
+}
+
+static frag concat(parser *P, frag a, frag b)
+{
+  if (P->err) return a;
+  P->m->nodes[a.end].out=b.start;
+  a.end=b.end;
+  return a;
+}
+
+// a* is a split, to a or past it, and a back to the split.  a+ is a then a*
+static frag star(parser *P, frag a, int plus)
+{
+  frag f;
+  int s,e;
+  if (P->err) return a;
+  if (0>(s=node_new(P->m,N_SPLIT)) || 0>(e=node_new(P->m,N_SPLIT))) return frag_fail(P);
+  P->m->nodes[s].out=a.start;
+  P->m->nodes[s].out1=e;
+  P->m->nodes[a.end].out=s;
+  f.start=plus?a.start:s;
+  f.end=e;
+  return f;
+}
+
+static frag quest(parser *P, frag a)
+{
+  int s;
+  if (P->err) return a;
+  if (0>(s=node_new(P->m,N_SPLIT))) return frag_fail(P);
+  P->m->nodes[s].out=a.start;
+  P->m->nodes[s].out1=a.end;
+  a.start=s;
+  return a;
+}
+
+static frag alternation(parser *P);
+
+// The \d \w \s classes and their negations, returns 0 if c is not one of them
+static int class_escape(int c, byte_set *s)
+{
+  byte_set t;
+  memset(&t,0,sizeof(t));
+  switch (c|0x20) {
+  case 'd':
+    set_range(&t,'0','9');
+    break;
+  case 'w':
+    set_range(&t,'0','9');
+    set_range(&t,'a','z');
+    set_range(&t,'A','Z');
+    SET_ADD(&t,'_');
+    break;
+  case 's':
+    SET_ADD(&t,' ');
+    set_range(&t,'\t','\r');
+    break;
+  default:
+    return 0;
+  }
+  if (c>='A' && c<='Z') set_invert(&t);
+  for (c=0;c<32;c++) s->bits[c]|=t.bits[c];
+  return 1;
+}
+
+// A character escape, the character after the backslash is at p
+// Returns the byte, or -1 if it's not a single character
+static int char_escape(parser *P)
+{
+  int c=(unsigned char)*P->p++;
+  static const char controls[]="n\nt\tr\rf\fv\ve\033a\007";
+  const char *k;
+  if (!((c|0x20)>='a' && (c|0x20)<='z') && !(c>='0' && c<='9')) return c; // Punctuation
+  for (k=controls;*k;k+=2)
+    if (c==*k) return (unsigned char)k[1];
+  if ('x'==c && P->end-P->p>=2) {
+    int i,v=0;
+    for (i=0;i<2;i++) {
+      int h=(unsigned char)*P->p++;
+      if (h>='0' && h<='9') v=v*16+h-'0';
+      else if ((h|0x20)>='a' && (h|0x20)<='f') v=v*16+(h|0x20)-'a'+10;
+      else return -1;
+    }
+    return v;
+  }
+  return -1;
+}
+
+// Bracket expression, after the [
+static frag bracket(parser *P)
+{
+  byte_set s;
+  int negate=0,first=1;
+  memset(&s,0,sizeof(s));
+  if (P->p<P->end && '^'==*P->p) {
+    negate=1;
+    P->p++;
+  }
+  while (1) {
+    int lo,hi;
+    if (P->p>=P->end) return frag_fail(P);
+    if (']'==*P->p && !first) {
+      P->p++;
+      break;
+    }
+    first=0;
+    if ('['==*P->p && P->p+1<P->end && (':'==P->p[1] || '='==P->p[1] || '.'==P->p[1]))
+      return frag_fail(P); // POSIX classes are not handled
+    if ('\\'==*P->p) {
+      P->p++;
+      if (P->p>=P->end) return frag_fail(P);
+      if (class_escape(*P->p,&s)) {
+        P->p++;
+        continue;
+      }
+      if ('b'==*P->p) { // Backspace in a class
+        P->p++;
+        lo=8;
+      } else if (0>(lo=char_escape(P))) return frag_fail(P);
+    } else
+      lo=(unsigned char)*P->p++;
+    hi=lo;
+    if (P->p+1<P->end && '-'==*P->p && ']'!=P->p[1]) { // A range
+      P->p++;
+      if ('\\'==*P->p) {
+        P->p++;
+        if (P->p>=P->end || 0>(hi=char_escape(P))) return frag_fail(P);
+      } else
+        hi=(unsigned char)*P->p++;
+      if (hi<lo) return frag_fail(P);
+    }
+    set_range(&s,lo,hi);
+  }
+  if (negate) set_invert(&s);
+  return frag_set(P,&s);
+}
+
+static frag atom(parser *P)
+{
+  int c=(unsigned char)*P->p++;
+  byte_set s;
+  frag f;
+
+  switch (c) {
+  case '(':
+    if (P->p<P->end && '?'==*P->p) { // Only (?: is handled
+      if (P->p+1>=P->end || ':'!=P->p[1]) return frag_fail(P);
+      P->p+=2;
+    }
+    f=alternation(P);
+    if (P->err || P->p>=P->end || ')'!=*P->p) return frag_fail(P);
+    P->p++;
+    return f;
+  case '[':
+    return bracket(P);
+  case '.': // Anything but a newline
+    memset(&s,0xff,sizeof(s));
+    s.bits['\n'>>3]&=~(1<<('\n'&7));
+    return frag_set(P,&s);
+  case '^':
+    return frag_node(P,N_BOL,0,0);
+  case '$':
+    return frag_node(P,N_EOL,0,0);
+  case '*': case '+': case '?': case ')': case '|':
+    return frag_fail(P);
+  case '\\':
+    if (P->p>=P->end) return frag_fail(P);
+    memset(&s,0,sizeof(s));
+    if (class_escape(*P->p,&s)) {
+      P->p++;
+      return frag_set(P,&s);
+    }
+    if (0>(c=char_escape(P))) return frag_fail(P);
+    return frag_node(P,N_CHAR,c,0);
+  default:
+    return frag_node(P,N_CHAR,c,0);
+  }
+}
+
+// A {n}, {n,} or {n,m} count, max is -1 for no limit.  Returns 0 if it's not a count
+static int count(parser *P, int *min, int *max)
+{
+  const char *p=P->p+1;
+  int n=0,m;
+  if (p>=P->end || *p<'0' || *p>'9') return 0;
+  while (p<P->end && *p>='0' && *p<='9' && n<=MAX_REPEAT) n=n*10+*p++-'0';
+  m=n;
+  if (p<P->end && ','==*p) {
+    p++;
+    m=-1;
+    if (p<P->end && *p>='0' && *p<='9')
+      for (m=0;p<P->end && *p>='0' && *p<='9' && m<=MAX_REPEAT;) m=m*10+*p++-'0';
+  }
+  if (p>=P->end || '}'!=*p) return 0;
+  P->p=p+1;
+  *min=n;
+  *max=m;
+  return 1;
+}
+
+// An atom and its quantifier.  The atom is parsed again for each copy a count needs
+static frag repeat(parser *P)
+{
+  const char *s=P->p,*e;
+  frag a=atom(P);
+  int min,max;
+
+  if (P->err || P->p>=P->end) return a;
+  e=P->p;
+  switch (*P->p) {
+  case '*':
+    P->p++;
+    a=star(P,a,0);
+    break;
+  case '+':
+    P->p++;
+    a=star(P,a,1);
+    break;
+  case '?':
+    P->p++;
+    a=quest(P,a);
+    break;
+  case '{':
+    if (!count(P,&min,&max)) return a; // A literal {
+    if (min>MAX_REPEAT || max>MAX_REPEAT || (max>=0 && max<min)) return frag_fail(P);
+    {
+      frag r=frag_eps(P);
+      const char *after=P->p;
+      int i;
+      for (i=0;!P->err && i<(max<0?min+1:max);i++) {
+        frag c=a;
+        if (i) { // Another copy
+          P->p=s;
+          c=atom(P);
+          if (P->p!=e) P->err=1;
+        }
+        if (i>=min) c=(max<0)?star(P,c,0):quest(P,c);
+        r=concat(P,r,c);
+      }
+      P->p=after;
+      a=r;
+    }
+    break;
+  default:
+    return a;
+  }
+  // A lazy quantifier finds the same matches, a possessive one might not
+  if (P->p<P->end && '?'==*P->p) P->p++;
+  else if (P->p<P->end && '+'==*P->p) return frag_fail(P);
+  return a;
+}
+
+static frag sequence(parser *P)
+{
+  frag f=frag_eps(P);
+  while (!P->err && P->p<P->end && '|'!=*P->p && ')'!=*P->p)
+    f=concat(P,f,repeat(P));
+  return f;
+}
+
+static frag alternation(parser *P)
+{
+  frag f=sequence(P);
+  while (!P->err && P->p<P->end && '|'==*P->p) {
+    frag b,r;
+    int s;
+    P->p++;
+    b=sequence(P);
+    if (P->err) break;
+    r=frag_eps(P);
+    if (0>(s=node_new(P->m,N_SPLIT))) return frag_fail(P);
+    P->m->nodes[s].out=f.start;
+    P->m->nodes[s].out1=b.start;
+    P->m->nodes[f.end].out=r.start;
+    P->m->nodes[b.end].out=r.start;
+    f.start=s;
+    f.end=r.end;
+  }
+  return f;
+}
+
+// Length of the literal prefix of a pattern, the characters that go in the trie
+// Stops before anything that is not a plain character, or a character with a quantifier
+static int literal_prefix(const char *p)
+{
+  int depth=0,n=0;
+  const char *q;
+
+  // No prefix if there is an alternation at the top
+  for (q=p;*q;q++) {
+    if ('\\'==*q && q[1]) q++;
+    else if ('['==*q) { // Skip the class, a ] right after the [ or [^ is part of it
+      q++;
+      if ('^'==*q) q++;
+      if (']'==*q) q++;
+      while (*q && ']'!=*q) {
+        if ('\\'==*q && q[1]) q++;
+        q++;
+      }
+      if (!*q) return 0;
+    }
+    else if ('('==*q) depth++;
+    else if (')'==*q) depth--;
+    else if ('|'==*q && !depth) return 0;
+  }
+
+  while (p[n] && !strchr(".[]()|^$\\*+?{",p[n])) n++;
+  // The last one belongs to a quantifier
+  if (n && p[n] && strchr("*+?{",p[n])) n--;
+  return n;
+}
+
+// The trie node under parent for character c, made if create is set.  -1 if there is none
+static int trie_child(oe_matcher *m, int parent, int c, int create)
+{
+  long long key=((long long)parent<<8)|c;
+  size_t i;
+  int n,t;
+
+  if (m->trie_count*2>=m->trie_size) { // Grow
+    size_t size=m->trie_size?2*m->trie_size:1024,k;
+    long long *keys=(long long *)malloc(size*sizeof(long long));
+    int *vals=(int *)malloc(size*sizeof(int));
+    if (!keys || !vals) {
+      free(keys);
+      free(vals);
+      return -1;
+    }
+    for (k=0;k<size;k++) keys[k]=-1;
+    for (k=0;k<m->trie_size;k++) {
+      if (m->trie_keys[k]<0) continue;
+      for (i=(size_t)(m->trie_keys[k]*0x9E3779B97F4A7C15ULL>>20)&(size-1);keys[i]>=0;i=(i+1)&(size-1));
+      keys[i]=m->trie_keys[k];
+      vals[i]=m->trie_vals[k];
+    }
+    free(m->trie_keys);
+    free(m->trie_vals);
+    m->trie_keys=keys;
+    m->trie_vals=vals;
+    m->trie_size=size;
+  }
+
+  for (i=(size_t)(key*0x9E3779B97F4A7C15ULL>>20)&(m->trie_size-1);m->trie_keys[i]>=0;i=(i+1)&(m->trie_size-1))
+    if (m->trie_keys[i]==key) return m->trie_vals[i];
+  if (!create) return -1;
+
+  // A character node, followed by the child, which is an empty split
+  if (0>(n=node_new(m,N_CHAR)) || 0>(t=node_new(m,N_SPLIT))) return -1;
+  m->nodes[n].c=c;
+  m->nodes[n].out=t;
+  if (0>(c=node_new(m,N_SPLIT))) return -1;
+  // The parent branches to the new one and to what it had
+  m->nodes[c].out=m->nodes[parent].out;
+  m->nodes[c].out1=n;
+  m->nodes[parent].out=c;
+  m->trie_keys[i]=key;
+  m->trie_vals[i]=t;
+  m->trie_count++;
+  return t;
+}
+
+oe_matcher *oe_matcher_create(size_t max_mem)
+{
+  oe_matcher *m=(oe_matcher *)calloc(1,sizeof(oe_matcher));
+  if (!m) return 0;
+  m->max_mem=max_mem;
+  m->max_id=-1;
+  if (0>(m->root=node_new(m,N_SPLIT)) || pthread_rwlock_init(&m->lock,0)) {
+    free(m->nodes);
+    free(m);
+    return 0;
+  }
+  return m;
+}
+
+int oe_matcher_add(oe_matcher *m, const char *pattern, int id)
+{
+  parser P;
+  frag f,match;
+  int nnodes=m->nnodes,nsets=m->nsets;
+  int i,n=literal_prefix(pattern),t;
+
+  if (m->compiled || id<0) return 0;
+  P.m=m;
+  P.p=pattern+n;
+  P.end=pattern+strlen(pattern);
+  P.err=0;
+  f=alternation(&P);
+  match=frag_node(&P,N_MATCH,0,id);
+  f=concat(&P,f,match);
+  if (P.err || P.p!=P.end) {
+    m->nnodes=nnodes; // Drop what was made
+    m->nsets=nsets;
+    return 0;
+  }
+
+  // The prefix goes in the trie, the rest hangs from the last trie node
+  for (t=m->root,i=0;i<n && t>=0;i++)
+    t=trie_child(m,t,(unsigned char)pattern[i],1);
+  if (t<0) return 0;
+  if (m->nodes[t].out<0) m->nodes[t].out=f.start;
+  else {
+    int s=node_new(m,N_SPLIT);
+    if (s<0) return 0;
+    m->nodes[s].out=m->nodes[t].out;
+    m->nodes[s].out1=f.start;
+    m->nodes[t].out=s;
+  }
+  if (id>m->max_id) m->max_id=id;
+  return 1;
+}
+
+//
+// DFA
+//
+
+static int cmp_int(const void *a, const void *b)
+{
+  int x=*(const int *)a,y=*(const int *)b;
+  return (x>y)-(x<y);
+}
+
+// Follows the empty transitions from the nodes in work, adding the nodes that read, match
+// or wait for the end to list.  ^ is passed at the start of the string, $ at the end
+static int closure(oe_matcher *m, int bol, int eol)
+{
+  while (m->work.n) {
+    int i=m->work.v[--m->work.n];
+    nfa_node *n;
+    if (i<0 || m->marks[i]==m->mark) continue;
+    m->marks[i]=m->mark;
+    n=m->nodes+i;
+    switch (n->type) {
+    case N_SPLIT:
+      if (!list_push(&m->work,n->out) || !list_push(&m->work,n->out1)) return 0;
+      break;
+    case N_BOL:
+      if (bol && !list_push(&m->work,n->out)) return 0;
+      break;
+    case N_EOL: // Kept if not at the end, it waits for it
+      if (!list_push(eol?&m->work:&m->list,eol?n->out:i)) return 0;
+      break;
+    default:
+      if (!list_push(&m->list,i)) return 0;
+    }
+  }
+  return 1;
+}
+
+static void new_mark(oe_matcher *m)
+{
+  if (!++m->mark) { // Wrapped around
+    memset(m->marks,0,m->anodes*sizeof(unsigned int));
+    m->mark=1;
+  }
+}
+
+static void free_states(oe_matcher *m)
+{
+  size_t i;
+  for (i=0;i<m->nbuckets;i++)
+    while (m->buckets[i]) {
+      dfa_state *s=m->buckets[i];
+      m->buckets[i]=s->chain;
+      free(s);
+    }
+  m->nstates=0;
+  m->mem=0;
+  m->start=0;
+}
+
+// The state for the node set in m->list, made if it's not there
+// Returns 0 if it can't be made within the memory limit
+static dfa_state *state_for(oe_matcher *m)
+{
+  unsigned int h=2166136261u;
+  size_t size;
+  dfa_state *s;
+  int i,k;
+
+  qsort(m->list.v,m->list.n,sizeof(int),cmp_int);
+  for (i=0;i<m->list.n;i++) {
+    h^=(unsigned int)m->list.v[i];
+    h*=16777619u;
+  }
+  for (s=m->buckets[h&(m->nbuckets-1)];s;s=s->chain)
+    if (s->hash==h && s->count==m->list.n && !memcmp(s->nodes,m->list.v,m->list.n*sizeof(int)))
+      return s;
+
+  size=sizeof(dfa_state)+(m->nclasses-1)*sizeof(dfa_state *)+m->list.n*sizeof(int);
+  if (m->mem+size>m->max_mem || !(s=(dfa_state *)calloc(1,size))) return 0;
+  m->mem+=size;
+  s->hash=h;
+  s->count=m->list.n;
+  s->nodes=(int *)(s->next+m->nclasses);
+  memcpy(s->nodes,m->list.v,m->list.n*sizeof(int));
+  s->match=s->end_match=-1;
+  for (i=0;i<s->count;i++)
+    if (N_MATCH==m->nodes[s->nodes[i]].type && m->nodes[s->nodes[i]].arg>s->match)
+      s->match=m->nodes[s->nodes[i]].arg;
+
+  // What matches if the string ends here, past the $ nodes
+  s->end_match=s->match;
+  new_mark(m);
+  m->list.n=0;
+  for (i=0;i<s->count;i++)
+    if (N_EOL==m->nodes[s->nodes[i]].type && !list_push(&m->work,m->nodes[s->nodes[i]].out)) {
+      free(s);
+      m->mem-=size;
+      return 0;
+    }
+  if (!closure(m,0,1)) {
+    free(s);
+    m->mem-=size;
+    return 0;
+  }
+  for (k=0;k<m->list.n;k++)
+    if (N_MATCH==m->nodes[m->list.v[k]].type && m->nodes[m->list.v[k]].arg>s->end_match)
+      s->end_match=m->nodes[m->list.v[k]].arg;
+
+  s->chain=m->buckets[h&(m->nbuckets-1)];
+  m->buckets[h&(m->nbuckets-1)]=s;
+  m->nstates++;
+  return s;
+}
+
+// The state at the start of the string, needs the write lock
+static dfa_state *start_state(oe_matcher *m)
+{
+  if (m->start) return m->start;
+  new_mark(m);
+  m->work.n=m->list.n=0;
+  if (!list_push(&m->work,m->root) || !closure(m,1,0)) return 0;
+  return m->start=state_for(m);
+}
+
+// The state after s reads a byte of class c, needs the write lock
+static dfa_state *next_state(oe_matcher *m, dfa_state *s, int c)
+{
+  unsigned char b=m->reps[c];
+  int i;
+
+  new_mark(m);
+  m->work.n=m->list.n=0;
+  for (i=0;i<s->count;i++) {
+    nfa_node *n=m->nodes+s->nodes[i];
+    if ((N_CHAR==n->type && n->c==b) || (N_SET==n->type && SET_HAS(m->sets+n->arg,b)))
+      if (!list_push(&m->work,n->out)) return 0;
+  }
+  // A match can start at the next byte too
+  for (i=0;i<m->restart.n;i++)
+    if (!list_push(&m->work,m->restart.v[i])) return 0;
+  if (!closure(m,0,0)) return 0;
+  return state_for(m);
+}
+
+// Splits the byte classes so the bytes of s are in classes of their own
+static void refine(oe_matcher *m, const byte_set *s)
+{
+  int map[512],i,n=0;
+  unsigned char old[256];
+  memcpy(old,m->classes,sizeof(old));
+  for (i=0;i<512;i++) map[i]=-1;
+  // New class numbers, for each old class and whether the byte is in s
+  for (i=0;i<256;i++) {
+    int k=old[i]*2+(SET_HAS(s,i)?1:0);
+    if (map[k]<0) map[k]=n++;
+    m->classes[i]=map[k];
+  }
+  m->nclasses=n;
+}
+
+int oe_matcher_compile(oe_matcher *m)
+{
+  int i,c;
+  char seen[256];
+
+  if (m->compiled) return 1;
+  memset(m->classes,0,sizeof(m->classes));
+  m->nclasses=1;
+  memset(seen,0,sizeof(seen));
+  for (i=0;i<m->nnodes;i++)
+    if (N_CHAR==m->nodes[i].type && !seen[m->nodes[i].c]) {
+      byte_set s;
+      memset(&s,0,sizeof(s));
+      SET_ADD(&s,m->nodes[i].c);
+      seen[m->nodes[i].c]=1;
+      refine(m,&s);
+    }
+  for (i=0;i<m->nsets;i++)
+    refine(m,m->sets+i);
+  for (c=255;c>=0;c--)
+    m->reps[m->classes[c]]=c;
+
+  m->nbuckets=1024;
+  if (!(m->buckets=(dfa_state **)calloc(m->nbuckets,sizeof(dfa_state *)))
+    || !(m->marks=(unsigned int *)calloc(m->anodes,sizeof(unsigned int))))
+    return 0;
+
+  // The root closure, without passing ^
+  new_mark(m);
+  m->work.n=m->list.n=0;
+  if (!list_push(&m->work,m->root) || !closure(m,0,0)) return 0;
+  for (i=0;i<m->list.n;i++)
+    if (!list_push(&m->restart,m->list.v[i])) return 0;
+
+  // The trie lookup is not needed anymore
+  free(m->trie_keys);
+  free(m->trie_vals);
+  m->trie_keys=0;
+  m->trie_vals=0;
+  m->compiled=1;
+  return 1;
+}
+
+// More buckets as the states add up, needs the write lock
+static void grow_buckets(oe_matcher *m)
+{
+  size_t size=2*m->nbuckets,i;
+  dfa_state **b;
+  if (m->nstates<2*m->nbuckets || !(b=(dfa_state **)calloc(size,sizeof(dfa_state *)))) return;
+  for (i=0;i<m->nbuckets;i++)
+    while (m->buckets[i]) {
+      dfa_state *s=m->buckets[i];
+      m->buckets[i]=s->chain;
+      s->chain=b[s->hash&(size-1)];
+      b[s->hash&(size-1)]=s;
+    }
+  free(m->buckets);
+  m->buckets=b;
+  m->nbuckets=size;
+}
+
+int oe_matcher_max(oe_matcher *m, const char *str, size_t len)
+{
+  const unsigned char *s=(const unsigned char *)str;
+  dfa_state *st,*nx;
+  unsigned int gen;
+  int best,resets=0;
+  size_t i;
+
+  if (!m->compiled) return -2;
+  if (m->max_id<0) return -1;
+  pthread_rwlock_rdlock(&m->lock);
+
+restart:
+  if (!(st=__atomic_load_n(&m->start,__ATOMIC_ACQUIRE))) {
+    pthread_rwlock_unlock(&m->lock);
+    pthread_rwlock_wrlock(&m->lock);
+    st=start_state(m);
+    pthread_rwlock_unlock(&m->lock);
+    if (!st) return -2;
+    pthread_rwlock_rdlock(&m->lock);
+    goto restart; // Dropped meanwhile, maybe
+  }
+  best=st->match;
+
+  for (i=0;i<len && best<m->max_id;i++) {
+    int c=m->classes[s[i]];
+    if (!(nx=__atomic_load_n(st->next+c,__ATOMIC_ACQUIRE))) {
+      // Build it with the write lock.  If the states get dropped meanwhile, start over
+      gen=m->generation;
+      pthread_rwlock_unlock(&m->lock);
+      pthread_rwlock_wrlock(&m->lock);
+      if (gen!=m->generation) {
+        pthread_rwlock_unlock(&m->lock);
+        pthread_rwlock_rdlock(&m->lock);
+        goto restart;
+      }
+      if (!(nx=st->next[c]) && !(nx=next_state(m,st,c))) {
+        // Out of memory, drop all the states and try again, once
+        free_states(m);
+        m->generation++;
+        pthread_rwlock_unlock(&m->lock);
+        if (++resets>1) return -2;
+        pthread_rwlock_rdlock(&m->lock);
+        goto restart;
+      }
+      __atomic_store_n(st->next+c,nx,__ATOMIC_RELEASE);
+      grow_buckets(m);
+      gen=m->generation;
+      pthread_rwlock_unlock(&m->lock);
+      pthread_rwlock_rdlock(&m->lock);
+      if (gen!=m->generation) goto restart;
+    }
+    st=nx;
+    if (st->match>best) best=st->match;
+  }
+  if (i==len && st->end_match>best) best=st->end_match;
+  pthread_rwlock_unlock(&m->lock);
+  return best;
+}
+
+size_t oe_matcher_memory(const oe_matcher *m)
+{
+  return m->mem;
+}
+
+void oe_matcher_free(oe_matcher *m)
+{
+  if (!m) return;
+  if (m->buckets) free_states(m);
+  free(m->buckets);
+  free(m->marks);
+  free(m->nodes);
+  free(m->sets);
+  free(m->trie_keys);
+  free(m->trie_vals);
+  free(m->restart.v);
+  free(m->work.v);
+  free(m->list.v);
+  pthread_rwlock_destroy(&m->lock);
+  free(m);
+}
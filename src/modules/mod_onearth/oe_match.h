@@ -0,0 +1,72 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Multi-pattern matcher for the cache patterns that can't go in the layer index
+// All the patterns are compiled into one automaton, which finds the highest id of the patterns
+// matching anywhere in a string in a single pass, like a loop of unanchored regexec calls would
+// The DFA states are built the first time a string needs them and kept, up to a memory limit.
+// Searches share a read lock and follow the states already built, new ones are added with the
+// write lock
+// Handles the usual regular expression syntax: literals, ., bracket classes, \d \w \s,
+// * + ? {n,m}, groups and alternation, ^ and $.  Back references, look around and other
+// extensions are not, patterns using them have to be matched some other way
+// Plain C, no Apache or APR, so the benchmark can use it
+//
+
+#ifndef OE_MATCH_H
+#define OE_MATCH_H
+
+#include <stddef.h>
+
+typedef struct oe_matcher oe_matcher;
+
+// A new matcher, the DFA can take up to max_mem bytes
+oe_matcher *oe_matcher_create(size_t max_mem);
+
+// Adds a pattern, id is zero or more.  Returns 0 if the pattern syntax is not handled
+int oe_matcher_add(oe_matcher *m, const char *pattern, int id);
+
+// Call once all the patterns are added, before matching.  Returns 0 if it fails
+int oe_matcher_compile(oe_matcher *m);
+
+// The highest id of the patterns matching s, -1 if none
+// -2 if the DFA is out of memory, the string has to be matched some other way
+int oe_matcher_max(oe_matcher *m, const char *s, size_t len);
+
+// Bytes taken by the DFA states so far
+size_t oe_matcher_memory(const oe_matcher *m);
+
+void oe_matcher_free(oe_matcher *m);
+
+#endif
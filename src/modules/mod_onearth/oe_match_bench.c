@@ -0,0 +1,249 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_match_bench - Cache pattern matching, one regexec per pattern and the combined matcher
+// Makes WMTS and Tiled WMS patterns like the ones oe_create_cache_config writes for layers
+// that can't go in the layer index, with STYLE, FORMAT and TIME alternations, then times
+// finding the highest numbered matching pattern for random requests, most of them for a
+// layer and some for no layer at all.  Both have to find the same pattern
+//
+// oe_match_bench [-n requests] [-t threads] [-p patterns] [-m MB]
+// Without -p it runs with 100, 1000 and 10000 patterns
+//
+
+#include "oe_match.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <regex.h>
+#include <pthread.h>
+
+static const char *sets[]={"EPSG4326_250m","EPSG4326_2km","EPSG4326_16km"};
+
+typedef struct {
+  regex_t *regex;
+  oe_matcher *m;
+  char (*req)[256];
+  int patterns,n,first,step;
+  int fail;
+  long long check;
+} bench;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static void make_pattern(char *s, size_t size, int i)
+{
+  if (i%4) // WMTS
+    snprintf(s,size,"SERVICE=WMTS&REQUEST=GetTile&VERSION=1.0.0&LAYER=Layer_%d&STYLE=(default|encoded)?"
+      "&TILEMATRIXSET=%s&TILEMATRIX=[0-9]*&TILEROW=[0-9]*&TILECOL=[0-9]*&FORMAT=image%%2F(jpeg|png)",
+      i,sets[i%3]);
+  else // Tiled WMS
+    snprintf(s,size,"request=GetMap&layers=Layer_%d&srs=EPSG:4326&format=image%%2Fjpeg&styles=&"
+      "(time=[-0-9]*&)?width=512&height=512&bbox=[-,\\.0-9+Ee]*",i);
+}
+
+static void make_request(char *s, size_t size, int patterns)
+{
+  int i=rand()%patterns;
+  if (!(rand()%8)) i+=patterns; // No such layer
+  if (i%4)
+    snprintf(s,size,"SERVICE=WMTS&REQUEST=GetTile&VERSION=1.0.0&LAYER=Layer_%d&STYLE=%s"
+      "&TILEMATRIXSET=%s&TILEMATRIX=%d&TILEROW=%d&TILECOL=%d&FORMAT=image%%2F%s",
+      i,(rand()%2)?"default":"",sets[i%3],rand()%10,rand()%512,rand()%1024,(rand()%2)?"jpeg":"png");
+  else
+    snprintf(s,size,"request=GetMap&layers=Layer_%d&srs=EPSG:4326&format=image%%2Fjpeg&styles=&"
+      "time=2016-%02d-%02d&width=512&height=512&bbox=%d,%d,%d,%d",
+      i,1+rand()%12,1+rand()%28,-180+rand()%360,-90+rand()%180,10,10);
+}
+
+// The highest numbered match, checking the highest first, like mod_onearth did
+static int regex_max(const bench *b, const char *s)
+{
+  int i;
+  for (i=b->patterns-1;i>=0;i--)
+    if (!regexec(b->regex+i,s,0,NULL,0)) return i;
+  return -1;
+}
+
+static void *run_regex(void *arg)
+{
+  bench *b=(bench *)arg;
+  int i;
+  for (i=b->first;i<b->n;i+=b->step) b->check+=regex_max(b,b->req[i]);
+  return 0;
+}
+
+static void *run_matcher(void *arg)
+{
+  bench *b=(bench *)arg;
+  int i;
+  for (i=b->first;i<b->n;i+=b->step) {
+    int m=oe_matcher_max(b->m,b->req[i],strlen(b->req[i]));
+    if (m<-1) b->fail++;
+    b->check+=m;
+  }
+  return 0;
+}
+
+// Runs f on the requests from all the threads, returns ns per request
+static double timed(bench *b, int threads, void *(*f)(void *), long long *check, int *fail)
+{
+  pthread_t *tid=malloc(threads*sizeof(pthread_t));
+  bench *tb=malloc(threads*sizeof(bench));
+  double t=now();
+  int i;
+  for (i=0;i<threads;i++) {
+    tb[i]=*b;
+    tb[i].first=i;
+    tb[i].step=threads;
+    tb[i].check=0;
+    tb[i].fail=0;
+    pthread_create(tid+i,0,f,tb+i);
+  }
+  for (i=0;i<threads;i++) {
+    pthread_join(tid[i],0);
+    *check+=tb[i].check;
+    *fail+=tb[i].fail;
+  }
+  t=now()-t;
+  free(tid);
+  free(tb);
+  return t/b->n;
+}
+
+static int run(int patterns, int n, int threads, size_t mem)
+{
+  bench b;
+  char p[512];
+  long long check=0;
+  int i,fail=0;
+  double t,build,regex_ns,cold_ns,warm_ns;
+
+  memset(&b,0,sizeof(b));
+  b.patterns=patterns;
+  b.n=n;
+  b.regex=malloc(patterns*sizeof(regex_t));
+  b.req=malloc((size_t)n*sizeof(*b.req));
+  srand(patterns);
+  for (i=0;i<n;i++) make_request(b.req[i],sizeof(b.req[i]),patterns);
+
+  t=now();
+  for (i=0;i<patterns;i++) {
+    make_pattern(p,sizeof(p),i);
+    if (regcomp(b.regex+i,p,REG_EXTENDED|REG_NOSUB)) {
+      fprintf(stderr,"Can't compile %s\n",p);
+      return 1;
+    }
+  }
+  build=now()-t;
+  printf("%d patterns, %d requests, %d threads\n",patterns,n,threads);
+  printf("  regcomp: %.1f ms\n",build/1e6);
+
+  t=now();
+  b.m=oe_matcher_create(mem);
+  for (i=0;i<patterns;i++) {
+    make_pattern(p,sizeof(p),i);
+    if (!oe_matcher_add(b.m,p,i)) {
+      fprintf(stderr,"Matcher can't take %s\n",p);
+      return 1;
+    }
+  }
+  if (!oe_matcher_compile(b.m)) {
+    fprintf(stderr,"Can't compile the matcher\n");
+    return 1;
+  }
+  printf("  matcher build: %.1f ms\n",(now()-t)/1e6);
+
+  for (i=0;i<n && i<1000;i++) {
+    int r=regex_max(&b,b.req[i]),m=oe_matcher_max(b.m,b.req[i],strlen(b.req[i]));
+    if (r!=m) {
+      printf("Mismatch for %s: %d and %d\n",b.req[i],r,m);
+      return 1;
+    }
+  }
+  oe_matcher_free(b.m);
+  b.m=oe_matcher_create(mem);
+  for (i=0;i<patterns;i++) {
+    make_pattern(p,sizeof(p),i);
+    oe_matcher_add(b.m,p,i);
+  }
+  oe_matcher_compile(b.m);
+
+  regex_ns=timed(&b,threads,run_regex,&check,&fail);
+  // The first pass builds the DFA states, the second one finds them built
+  cold_ns=timed(&b,threads,run_matcher,&check,&fail);
+  warm_ns=timed(&b,threads,run_matcher,&check,&fail);
+  check*=1; // Only there so the loops are not optimized out
+  printf("  regexec loop: %.1f ns per request\n",regex_ns);
+  printf("  matcher, first pass: %.1f ns per request\n",cold_ns);
+  printf("  matcher: %.1f ns per request, %zu KB of states",warm_ns,oe_matcher_memory(b.m)/1024);
+  if (fail) printf(", %d out of memory",fail);
+  printf("\n");
+
+  for (i=0;i<patterns;i++) regfree(b.regex+i);
+  free(b.regex);
+  free(b.req);
+  oe_matcher_free(b.m);
+  return check==0x7fffffffffffffffLL;
+}
+
+int main(int argc, char **argv)
+{
+  int n=2000,threads=1,patterns=0,mb=32,c;
+
+  while (-1!=(c=getopt(argc,argv,"n:t:p:m:")))
+    switch (c) {
+      case 'n': n=atoi(optarg); break;
+      case 't': threads=atoi(optarg); break;
+      case 'p': patterns=atoi(optarg); break;
+      case 'm': mb=atoi(optarg); break;
+      default:
+        fprintf(stderr,"Usage: %s [-n requests] [-t threads] [-p patterns] [-m MB]\n",argv[0]);
+        return 1;
+    }
+  if (n<1 || threads<1 || patterns<0 || mb<1) {
+    fprintf(stderr,"Requests, threads and memory have to be positive\n");
+    return 1;
+  }
+  if (patterns) return run(patterns,n,threads,(size_t)mb<<20);
+  return run(100,n,threads,(size_t)mb<<20) || run(1000,n,threads,(size_t)mb<<20)
+    || run(10000,n,threads,(size_t)mb<<20);
+}
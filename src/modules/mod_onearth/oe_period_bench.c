@@ -0,0 +1,215 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_period_bench - Time period snapping, the way it was done and the way it is done
+// Makes the periods of a 20 year daily archive, a 20 year monthly one and a daily one with
+// many gaps, then times snapping random request dates.  The old way parses the period strings
+// for each request and counts month and year steps one by one from the start.  The new one
+// uses the periods parsed once, a binary search for the ones that can reach the date and a
+// closed form for the steps.  Both have to find the same date
+//
+// oe_period_bench [-n requests]
+//
+
+#include "oe_tile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+// The old parse_date_string
+static long long old_date(const char *s)
+{
+  struct tm t;
+  memset(&t,0,sizeof(t));
+  t.tm_year=atoi(s)-1900;
+  t.tm_mon=atoi(s+5)-1;
+  t.tm_mday=atoi(s+8);
+  if ('T'==s[10]) {
+    t.tm_hour=atoi(s+11);
+    t.tm_min=atoi(s+14);
+    t.tm_sec=atoi(s+17);
+  }
+  return (long long)timegm(&t)*1000000;
+}
+
+// The old add_date_interval
+static long long old_add(long long date, long interval, char unit)
+{
+  time_t secs=date/1000000;
+  struct tm t;
+  gmtime_r(&secs,&t);
+  if ('M'==unit) {
+    t.tm_mon+=interval;
+    t.tm_year+=t.tm_mon/12;
+    t.tm_mon%=12;
+  } else
+    t.tm_year+=interval;
+  return (long long)timegm(&t)*1000000;
+}
+
+// Parses every period string for the request, in order, and steps from the start
+static int old_snap(const char *periods, int count, long long req, long long *snap)
+{
+  int i;
+  for (i=0;i<count;i++,periods+=strlen(periods)+1) {
+    size_t len=strlen(periods);
+    long interval=1;
+    long long start,end,date,next;
+    char unit=periods[len-1];
+    if (!strchr(periods,'P')) continue;
+    if (len>43) {
+      if ('T'==periods[43]) interval=atol(periods+44);
+    } else if ('P'==periods[22])
+      interval=atol(periods+23);
+    start=old_date(periods);
+    end=old_date(periods+(('T'==periods[10])?21:11));
+    if (req<start) continue;
+    if ('Y'==unit || 'M'==unit) {
+      for (date=start;;date=next) {
+        next=old_add(date,interval,unit);
+        if (next>req) {
+          *snap=date;
+          return 1;
+        }
+        if (next>end) break;
+      }
+    } else {
+      long long step=interval*24LL*60*60*1000000; // Days only here
+      *snap=(req-start)/step*step+start;
+      if (*snap<=end) return 1;
+    }
+  }
+  return 0;
+}
+
+static int new_snap(const oe_periods *wp, int *cand, long long req, long long *snap)
+{
+  int i,n=oe_periods_find(wp,req,cand);
+  for (i=0;i<n;i++)
+    if (oe_period_snap(wp->p+cand[i],req,snap)) return 1;
+  return 0;
+}
+
+static int run(const char *name, const char *periods, int count, int n)
+{
+  oe_periods wp;
+  int *cand=malloc(count*sizeof(int));
+  long long *req=malloc(n*sizeof(long long));
+  long long check=0,snap;
+  const char *s=periods;
+  double t,old_ns,new_ns;
+  int i;
+
+  wp.p=malloc(count*sizeof(oe_period));
+  wp.by_start=malloc(count*sizeof(int));
+  wp.reach=malloc(count*sizeof(long long));
+  oe_periods_parse(&wp,s,count);
+
+  // Dates from 1997 to 2018, a bit before and after the archives
+  srand(count);
+  for (i=0;i<n;i++)
+    req[i]=(852076800LL+(long long)(rand()%(22*365))*86400)*1000000;
+
+  for (i=0;i<n;i++) {
+    long long a=-1,b=-1;
+    if (!old_snap(periods,count,req[i],&a)) a=-1;
+    if (!new_snap(&wp,cand,req[i],&b)) b=-1;
+    if (a!=b) {
+      printf("Mismatch for %s at %lld: %lld and %lld\n",name,req[i],a,b);
+      return 1;
+    }
+  }
+
+  t=now();
+  for (i=0;i<n;i++) if (old_snap(periods,count,req[i],&snap)) check+=snap;
+  old_ns=(now()-t)/n;
+  t=now();
+  for (i=0;i<n;i++) if (new_snap(&wp,cand,req[i],&snap)) check-=snap;
+  new_ns=(now()-t)/n;
+
+  printf("%s, %d periods, %d requests\n",name,count,n);
+  printf("  parse and step: %.1f ns per request\n",old_ns);
+  printf("  parsed periods: %.1f ns per request\n",new_ns);
+  free(wp.p);
+  free(wp.by_start);
+  free(wp.reach);
+  free(cand);
+  free(req);
+  return check!=0;
+}
+
+int main(int argc, char **argv)
+{
+  int n=100000,c,i,len=0;
+  char *gaps;
+
+  while (-1!=(c=getopt(argc,argv,"n:")))
+    switch (c) {
+      case 'n': n=atoi(optarg); break;
+      default:
+        fprintf(stderr,"Usage: %s [-n requests]\n",argv[0]);
+        return 1;
+    }
+  if (n<1) {
+    fprintf(stderr,"Requests have to be positive\n");
+    return 1;
+  }
+
+  // A daily archive with a gap every 10 days, 730 periods over 20 years
+  gaps=malloc(730*32);
+  for (i=0;i<730;i++) {
+    char p[32];
+    time_t start=883612800+(time_t)i*10*86400,end=start+8*86400;
+    struct tm a,b;
+    gmtime_r(&start,&a);
+    gmtime_r(&end,&b);
+    strftime(p,sizeof(p),"%Y-%m-%d/",&a);
+    strftime(p+11,sizeof(p)-11,"%Y-%m-%d/P1D",&b);
+    memcpy(gaps+len,p,strlen(p)+1);
+    len+=strlen(p)+1;
+  }
+
+  return run("20 years daily","1998-01-01/2017-12-31/P1D",1,n)
+    || run("20 years monthly","1998-01-01/2017-12-01/P1M",1,n)
+    || run("20 years daily with gaps",gaps,730,n);
+}
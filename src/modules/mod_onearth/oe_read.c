@@ -0,0 +1,227 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Read engine, see oe_read.h
+// The io_uring part uses the system calls directly, so it doesn't need liburing
+//
+
+#include "oe_read.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define OE_IO_URING
+#endif
+#endif
+
+#if defined(OE_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+struct oe_read_engine {
+  int ring_fd;      // -1 when using preadv
+#if defined(OE_IO_URING)
+  unsigned entries;
+  void *sq_ptr,*cq_ptr;
+  size_t sq_len,cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+  unsigned *cq_head,*cq_tail,*cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+static int preadv_all(oe_read_op *ops, int n)
+{
+  int i;
+  for (i=0;i<n;i++) {
+    ops[i].result=preadv(ops[i].fd,ops[i].iov,ops[i].iovcnt,ops[i].offset);
+    if (ops[i].result<0) ops[i].result=-errno;
+  }
+  return 0;
+}
+
+#if defined(OE_IO_URING)
+
+static int uring_setup(oe_read_engine *e, unsigned depth)
+{
+  struct io_uring_params p;
+  memset(&p,0,sizeof(p));
+  // Fails with ENOSYS or EPERM on old kernels and in some containers
+  if (0>(e->ring_fd=syscall(__NR_io_uring_setup,depth,&p))) return -1;
+  e->entries=p.sq_entries;
+
+  e->sq_len=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  e->cq_len=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features&IORING_FEAT_SINGLE_MMAP && e->cq_len>e->sq_len) e->sq_len=e->cq_len;
+  e->sq_ptr=mmap(0,e->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,e->ring_fd,IORING_OFF_SQ_RING);
+  if (MAP_FAILED==e->sq_ptr) return -1;
+  if (p.features&IORING_FEAT_SINGLE_MMAP) {
+    e->cq_ptr=e->sq_ptr;
+    e->cq_len=0;
+  } else {
+    e->cq_ptr=mmap(0,e->cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,e->ring_fd,IORING_OFF_CQ_RING);
+    if (MAP_FAILED==e->cq_ptr) return -1;
+  }
+  e->sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+  e->sqes=mmap(0,e->sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,e->ring_fd,IORING_OFF_SQES);
+  if (MAP_FAILED==e->sqes) return -1;
+
+  e->sq_head=(unsigned *)((char *)e->sq_ptr+p.sq_off.head);
+  e->sq_tail=(unsigned *)((char *)e->sq_ptr+p.sq_off.tail);
+  e->sq_mask=(unsigned *)((char *)e->sq_ptr+p.sq_off.ring_mask);
+  e->sq_array=(unsigned *)((char *)e->sq_ptr+p.sq_off.array);
+  e->cq_head=(unsigned *)((char *)e->cq_ptr+p.cq_off.head);
+  e->cq_tail=(unsigned *)((char *)e->cq_ptr+p.cq_off.tail);
+  e->cq_mask=(unsigned *)((char *)e->cq_ptr+p.cq_off.ring_mask);
+  e->cqes=(struct io_uring_cqe *)((char *)e->cq_ptr+p.cq_off.cqes);
+  return 0;
+}
+
+static void uring_free(oe_read_engine *e)
+{
+  if (e->sqes && MAP_FAILED!=e->sqes) munmap(e->sqes,e->sqes_len);
+  if (e->cq_len && e->cq_ptr && MAP_FAILED!=e->cq_ptr) munmap(e->cq_ptr,e->cq_len);
+  if (e->sq_ptr && MAP_FAILED!=e->sq_ptr) munmap(e->sq_ptr,e->sq_len);
+  if (e->ring_fd>=0) close(e->ring_fd);
+  e->ring_fd=-1;
+}
+
+// Queues up to the free space in the ring, returns the number queued
+static int uring_queue(oe_read_engine *e, oe_read_op *ops, int first, int n)
+{
+  unsigned tail=*e->sq_tail,head=__atomic_load_n(e->sq_head,__ATOMIC_ACQUIRE);
+  int i;
+  for (i=first;i<n && tail-head<e->entries;i++,tail++) {
+    unsigned idx=tail&*e->sq_mask;
+    struct io_uring_sqe *sqe=e->sqes+idx;
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode=IORING_OP_READV;
+    sqe->fd=ops[i].fd;
+    sqe->off=ops[i].offset;
+    sqe->addr=(unsigned long)ops[i].iov;
+    sqe->len=ops[i].iovcnt;
+    sqe->user_data=i;
+    e->sq_array[idx]=idx;
+  }
+  __atomic_store_n(e->sq_tail,tail,__ATOMIC_RELEASE);
+  return i-first;
+}
+
+// Collects the completions, returns how many were found
+static int uring_reap(oe_read_engine *e, oe_read_op *ops)
+{
+  unsigned head=*e->cq_head,tail=__atomic_load_n(e->cq_tail,__ATOMIC_ACQUIRE);
+  int done=0;
+  for (;head!=tail;head++,done++) {
+    struct io_uring_cqe *cqe=e->cqes+(head&*e->cq_mask);
+    ops[cqe->user_data].result=cqe->res;
+  }
+  __atomic_store_n(e->cq_head,head,__ATOMIC_RELEASE);
+  return done;
+}
+
+static int uring_submit(oe_read_engine *e, oe_read_op *ops, int n)
+{
+  int queued=0,done=0,i;
+
+  for (i=0;i<n;i++) ops[i].result=-EINPROGRESS;
+  while (done<n) {
+    unsigned waiting;
+    queued+=uring_queue(e,ops,queued,n);
+    // Submits the ones the kernel hasn't taken yet and waits for at least one completion
+    waiting=*e->sq_tail-__atomic_load_n(e->sq_head,__ATOMIC_ACQUIRE);
+    if (0>syscall(__NR_io_uring_enter,e->ring_fd,waiting,1,IORING_ENTER_GETEVENTS,NULL,0)
+        && EINTR!=errno) {
+      int inflight;
+      // Take back the entries not submitted, wait for the others, then finish with preadv
+      waiting=*e->sq_tail-__atomic_load_n(e->sq_head,__ATOMIC_ACQUIRE);
+      __atomic_store_n(e->sq_tail,*e->sq_tail-waiting,__ATOMIC_RELEASE);
+      inflight=queued-waiting-done;
+      while (inflight>0) {
+        if (0>syscall(__NR_io_uring_enter,e->ring_fd,0,1,IORING_ENTER_GETEVENTS,NULL,0)
+            && EINTR!=errno)
+          return -errno; // Reads still in flight, the buffers can't be reused
+        inflight-=uring_reap(e,ops);
+      }
+      for (i=0;i<n;i++)
+        if (-EINPROGRESS==ops[i].result) preadv_all(ops+i,1);
+      return 0;
+    }
+    done+=uring_reap(e,ops);
+  }
+  return 0;
+}
+
+#endif
+
+oe_read_engine *oe_read_create(unsigned depth, int use_uring)
+{
+  oe_read_engine *e=(oe_read_engine *)calloc(1,sizeof(oe_read_engine));
+  if (!e) return 0;
+  e->ring_fd=-1;
+#if defined(OE_IO_URING)
+  if (use_uring && depth && uring_setup(e,depth)) uring_free(e);
+#endif
+  return e;
+}
+
+void oe_read_destroy(oe_read_engine *e)
+{
+  if (!e) return;
+#if defined(OE_IO_URING)
+  uring_free(e);
+#endif
+  free(e);
+}
+
+const char *oe_read_backend(const oe_read_engine *e)
+{
+  return (e && e->ring_fd>=0)?"io_uring":"preadv";
+}
+
+int oe_read_submit(oe_read_engine *e, oe_read_op *ops, int n)
+{
+#if defined(OE_IO_URING)
+  // A single read doesn't gain anything from the ring
+  if (e && e->ring_fd>=0 && n>1) return uring_submit(e,ops,n);
+#endif
+  return preadv_all(ops,n);
+}
@@ -0,0 +1,69 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Read engine for the tile files
+// Runs a list of reads with a single system call, using io_uring when the kernel allows it,
+// and one preadv for each read otherwise.  Plain C, no Apache or APR, so the tools
+// can use it too.  An engine is not thread safe, use one per thread
+//
+
+#ifndef OE_READ_H
+#define OE_READ_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct {
+  int fd;
+  off_t offset;
+  const struct iovec *iov;
+  int iovcnt;
+  ssize_t result;   // Set by oe_read_submit, bytes read or -errno
+} oe_read_op;
+
+typedef struct oe_read_engine oe_read_engine;
+
+// Makes an engine that can have up to depth reads in flight
+// Uses preadv if io_uring is not available, or if use_uring is 0
+oe_read_engine *oe_read_create(unsigned depth, int use_uring);
+void oe_read_destroy(oe_read_engine *e);
+
+// "io_uring" or "preadv"
+const char *oe_read_backend(const oe_read_engine *e);
+
+// Runs the reads and waits for all of them, each result is set.  A null engine uses preadv
+// Returns 0, or -errno if the reads couldn't be submitted
+int oe_read_submit(oe_read_engine *e, oe_read_op *ops, int n);
+
+#endif
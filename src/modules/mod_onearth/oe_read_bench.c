@@ -0,0 +1,180 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_read_bench - Compares the tile read paths on an MRF index and data file pair
+// Each thread reads batches of random tiles: the index records, then the tile data.
+// The data is read once with a pread per tile, and once through the read engine, the way
+// GetTile and GetTiles do it.  With -b 1 each batch is a single tile, as for GetTile
+// Prints the p50 and p99 latency of a batch for both
+//
+// oe_read_bench [-t threads] [-n batches] [-b tiles per batch] file.idx file.dat
+//
+
+#include "oe_read.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+typedef struct {
+  long long offset;
+  long long size;
+} idx_rec;
+
+static int threads=8,batches=2000,batch=16;
+static int ifd,dfd;
+static long long nrecords;
+
+typedef struct {
+  unsigned seed;
+  int engine;      // 0 for pread, 1 for the read engine
+  double *lat;     // Microseconds, one per batch
+  pthread_t tid;
+} worker;
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e6+ts.tv_nsec/1e3;
+}
+
+static void *run(void *arg)
+{
+  worker *w=(worker *)arg;
+  oe_read_engine *e=w->engine?oe_read_create(batch,1):0;
+  oe_read_op *ops=(oe_read_op *)calloc(batch,sizeof(oe_read_op));
+  struct iovec *iov=(struct iovec *)calloc(batch,sizeof(struct iovec));
+  idx_rec *rec=(idx_rec *)calloc(batch,sizeof(idx_rec));
+  int i,k;
+
+  for (k=0;k<batches;k++) {
+    double t0=now_us();
+    for (i=0;i<batch;i++) {
+      long long n=rand_r(&w->seed)%nrecords;
+      if (sizeof(idx_rec)!=pread(ifd,rec+i,sizeof(idx_rec),n*sizeof(idx_rec)))
+        rec[i].size=0;
+      rec[i].offset=be64toh(rec[i].offset);
+      rec[i].size=be64toh(rec[i].size);
+      if (rec[i].size<0 || rec[i].size>(1<<24)) rec[i].size=0;
+      iov[i].iov_base=malloc(rec[i].size?rec[i].size:1);
+      iov[i].iov_len=rec[i].size;
+      ops[i].fd=dfd;
+      ops[i].offset=rec[i].offset;
+      ops[i].iov=iov+i;
+      ops[i].iovcnt=1;
+    }
+    if (w->engine)
+      oe_read_submit(e,ops,batch);
+    else
+      for (i=0;i<batch;i++)
+        ops[i].result=pread(dfd,iov[i].iov_base,iov[i].iov_len,ops[i].offset);
+    w->lat[k]=now_us()-t0;
+    for (i=0;i<batch;i++) free(iov[i].iov_base);
+  }
+  oe_read_destroy(e);
+  free(ops);
+  free(iov);
+  free(rec);
+  return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x=*(const double *)a,y=*(const double *)b;
+  return (x>y)-(x<y);
+}
+
+static void measure(int engine, const char *name)
+{
+  worker *w=(worker *)calloc(threads,sizeof(worker));
+  double *all=(double *)malloc(sizeof(double)*threads*batches);
+  double t0=now_us(),elapsed;
+  int i,total=threads*batches;
+
+  for (i=0;i<threads;i++) {
+    w[i].seed=i*7919+1;
+    w[i].engine=engine;
+    w[i].lat=all+i*batches;
+    pthread_create(&w[i].tid,0,run,w+i);
+  }
+  for (i=0;i<threads;i++) pthread_join(w[i].tid,0);
+  elapsed=now_us()-t0;
+  qsort(all,total,sizeof(double),cmp_double);
+  printf("%-10s p50 %8.1f us  p99 %8.1f us  %8.0f tiles/s\n",name,
+    all[total/2],all[(int)(total*0.99)],(double)total*batch/elapsed*1e6);
+  free(all);
+  free(w);
+}
+
+int main(int argc, char **argv)
+{
+  struct stat st;
+  oe_read_engine *e;
+  int c;
+
+  while (-1!=(c=getopt(argc,argv,"t:n:b:")))
+    switch (c) {
+      case 't': threads=atoi(optarg); break;
+      case 'n': batches=atoi(optarg); break;
+      case 'b': batch=atoi(optarg); break;
+      default:
+        fprintf(stderr,"Usage: %s [-t threads] [-n batches] [-b tiles per batch] file.idx file.dat\n",argv[0]);
+        return 1;
+    }
+  if (argc-optind!=2 || threads<1 || batches<1 || batch<1) {
+    fprintf(stderr,"Usage: %s [-t threads] [-n batches] [-b tiles per batch] file.idx file.dat\n",argv[0]);
+    return 1;
+  }
+  if (0>(ifd=open(argv[optind],O_RDONLY)) || fstat(ifd,&st) || 0>(dfd=open(argv[optind+1],O_RDONLY))) {
+    perror("Can't open input");
+    return 1;
+  }
+  if (!(nrecords=st.st_size/sizeof(idx_rec))) {
+    fprintf(stderr,"Empty index file\n");
+    return 1;
+  }
+
+  e=oe_read_create(batch,1);
+  printf("%d threads, %d batches of %d tiles, read engine uses %s\n",threads,batches,batch,oe_read_backend(e));
+  oe_read_destroy(e);
+  measure(0,"pread");
+  measure(1,"engine");
+  return 0;
+}
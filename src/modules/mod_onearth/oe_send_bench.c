@@ -0,0 +1,206 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_send_bench - Compares the two ways mod_onearth sends a tile, on an MRF index and data file pair
+// Each thread sends random tiles with data over a local socket, drained by another thread.
+// The copy path is the one used with WMSSendFile Off: a zero filled buffer, a pread into it
+// and a write of it.  The sendfile path is what the core does with a file bucket.
+// Prints the throughput of both
+//
+// oe_send_bench [-t threads] [-n tiles] file.idx file.dat
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+typedef struct {
+  long long offset;
+  long long size;
+} idx_rec;
+
+static int threads=4,tiles=20000;
+static int ifd,dfd;
+static long long nrecords;
+
+typedef struct {
+  unsigned seed;
+  int sendfile;    // 0 for the copy, 1 for sendfile
+  int sock[2];     // Tiles go in 0, the drain reads 1
+  long long sent,bytes; // Tiles and tile bytes sent
+  long long drained;
+  pthread_t tid,drain;
+} worker;
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e6+ts.tv_nsec/1e3;
+}
+
+static void *drain(void *arg)
+{
+  worker *w=(worker *)arg;
+  static __thread char buf[1<<16];
+  ssize_t got;
+  while (0<(got=read(w->sock[1],buf,sizeof(buf)))) w->drained+=got;
+  return 0;
+}
+
+// A random record with data, 0 if there is none after a few tries
+static int pick(worker *w, idx_rec *rec)
+{
+  int tries;
+  for (tries=0;tries<100;tries++) {
+    long long n=rand_r(&w->seed)%nrecords;
+    if (sizeof(idx_rec)!=pread(ifd,rec,sizeof(idx_rec),n*sizeof(idx_rec))) continue;
+    rec->offset=be64toh(rec->offset);
+    rec->size=be64toh(rec->size);
+    if (rec->size>0 && rec->size<=(1<<24)) return 1;
+  }
+  return 0;
+}
+
+static void *run(void *arg)
+{
+  worker *w=(worker *)arg;
+  idx_rec rec;
+  int k;
+
+  for (k=0;k<tiles;k++) {
+    if (!pick(w,&rec)) break;
+    if (w->sendfile) {
+      off_t off=rec.offset;
+      long long left=rec.size;
+      while (left>0) {
+        ssize_t sent=sendfile(w->sock[0],dfd,&off,left);
+        if (sent<=0) break;
+        left-=sent;
+      }
+    } else {
+      char *buf=(char *)calloc(1,rec.size);
+      char *p=buf;
+      long long left=pread(dfd,buf,rec.size,rec.offset);
+      while (left>0) {
+        ssize_t sent=write(w->sock[0],p,left);
+        if (sent<=0) break;
+        left-=sent;
+        p+=sent;
+      }
+      free(buf);
+    }
+    w->sent++;
+    w->bytes+=rec.size;
+  }
+  shutdown(w->sock[0],SHUT_WR);
+  return 0;
+}
+
+static int measure(int use_sendfile, const char *name)
+{
+  worker *w=(worker *)calloc(threads,sizeof(worker));
+  double t0,elapsed;
+  long long sent=0,bytes=0,drained=0;
+  int i;
+
+  for (i=0;i<threads;i++) {
+    w[i].seed=i*7919+1;
+    w[i].sendfile=use_sendfile;
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,w[i].sock)) {
+      perror("socketpair");
+      return 1;
+    }
+  }
+  t0=now_us();
+  for (i=0;i<threads;i++) {
+    pthread_create(&w[i].drain,0,drain,w+i);
+    pthread_create(&w[i].tid,0,run,w+i);
+  }
+  for (i=0;i<threads;i++) {
+    pthread_join(w[i].tid,0);
+    pthread_join(w[i].drain,0);
+    sent+=w[i].sent;
+    bytes+=w[i].bytes;
+    drained+=w[i].drained;
+    close(w[i].sock[0]);
+    close(w[i].sock[1]);
+  }
+  elapsed=now_us()-t0;
+  printf("%-10s %8.0f tiles/s  %8.1f MB/s\n",name,sent/elapsed*1e6,bytes/elapsed);
+  free(w);
+  if (bytes!=drained) {
+    printf("Sent %lld bytes, received %lld\n",bytes,drained);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct stat st;
+  int c;
+
+  while (-1!=(c=getopt(argc,argv,"t:n:")))
+    switch (c) {
+      case 't': threads=atoi(optarg); break;
+      case 'n': tiles=atoi(optarg); break;
+      default:
+        fprintf(stderr,"Usage: %s [-t threads] [-n tiles] file.idx file.dat\n",argv[0]);
+        return 1;
+    }
+  if (argc-optind!=2 || threads<1 || tiles<1) {
+    fprintf(stderr,"Usage: %s [-t threads] [-n tiles] file.idx file.dat\n",argv[0]);
+    return 1;
+  }
+  if (0>(ifd=open(argv[optind],O_RDONLY)) || fstat(ifd,&st) || 0>(dfd=open(argv[optind+1],O_RDONLY))) {
+    perror("Can't open input");
+    return 1;
+  }
+  if (!(nrecords=st.st_size/sizeof(idx_rec))) {
+    fprintf(stderr,"Empty index file\n");
+    return 1;
+  }
+
+  printf("%d threads, %d tiles each\n",threads,tiles);
+  return measure(0,"copy") || measure(1,"sendfile");
+}
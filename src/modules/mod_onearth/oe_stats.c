@@ -0,0 +1,229 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Request statistics, see oe_stats.h
+// Shared memory layout: the oe_stats header, the layer table, the shard owners, then for
+// each shard one block per layer.  Blocks start on a cache line
+//
+
+#include "oe_stats.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#define LINE 64
+#define ALIGN(X) (((X)+LINE-1)&~(size_t)(LINE-1))
+#define SPINS 100000 // Wait for a layer being claimed, in case its process died meanwhile
+
+#define ADD(P,V) __atomic_fetch_add((P),(V),__ATOMIC_RELAXED)
+// Owned shards have a single writer, the store only has to be whole for the readers
+#define OWN_ADD(P,V) __atomic_store_n((P),__atomic_load_n((P),__ATOMIC_RELAXED)+(V),__ATOMIC_RELAXED)
+
+static oe_stats_slot *layer_table(const oe_stats *s)
+{
+  return (oe_stats_slot *)(s+1);
+}
+
+static unsigned long long *owners(const oe_stats *s)
+{
+  return (unsigned long long *)((char *)s+ALIGN(sizeof(oe_stats)+s->layers*sizeof(oe_stats_slot)));
+}
+
+static size_t blocks_offset(unsigned layers, unsigned shards)
+{
+  return ALIGN(ALIGN(sizeof(oe_stats)+layers*sizeof(oe_stats_slot))+shards*sizeof(unsigned long long));
+}
+
+static oe_stats_block *block(const oe_stats *s, unsigned shard, int layer)
+{
+  return (oe_stats_block *)((char *)s+blocks_offset(s->layers,s->shards)
+    +((size_t)shard*s->layers+layer)*ALIGN(sizeof(oe_stats_block)));
+}
+
+size_t oe_stats_size(unsigned layers, unsigned shards)
+{
+  return blocks_offset(layers,shards)+(size_t)layers*shards*ALIGN(sizeof(oe_stats_block));
+}
+
+oe_stats *oe_stats_init(void *base, unsigned layers, unsigned shards)
+{
+  oe_stats *s=(oe_stats *)base;
+  memset(base,0,oe_stats_size(layers,shards));
+  s->layers=layers;
+  s->shards=shards;
+  return s;
+}
+
+int oe_stats_layer(oe_stats *s, const char *name, int len)
+{
+  oe_stats_slot *t=layer_table(s);
+  unsigned int h=2166136261u; // FNV-1a
+  unsigned i,n;
+  int k;
+
+  if (len>OE_STATS_NAME-1) len=OE_STATS_NAME-1;
+  for (k=0;k<len;k++) {
+    h^=(unsigned char)name[k];
+    h*=16777619u;
+  }
+
+  for (n=0,i=h%s->layers;n<s->layers;n++,i=(i+1)%s->layers) {
+    oe_stats_slot *l=t+i;
+    unsigned int state=__atomic_load_n(&l->state,__ATOMIC_ACQUIRE);
+    int spins=SPINS;
+    if (!state) {
+      unsigned int free=0;
+      if (__atomic_compare_exchange_n(&l->state,&free,1,0,__ATOMIC_ACQUIRE,__ATOMIC_ACQUIRE)) {
+        memcpy(l->name,name,len);
+        l->name[len]=0;
+        l->hash=h;
+        __atomic_store_n(&l->state,2,__ATOMIC_RELEASE);
+        return i;
+      }
+      state=free;
+    }
+    while (1==state && spins--)
+      state=__atomic_load_n(&l->state,__ATOMIC_ACQUIRE);
+    if (2==state && l->hash==h && !strncmp(l->name,name,len) && !l->name[len])
+      return i;
+  }
+  ADD(&s->overflow,1);
+  return -1;
+}
+
+const char *oe_stats_name(const oe_stats *s, int layer)
+{
+  const oe_stats_slot *l=layer_table(s)+layer;
+  return 2==__atomic_load_n(&l->state,__ATOMIC_ACQUIRE)?l->name:0;
+}
+
+unsigned oe_stats_bucket(unsigned us)
+{
+  unsigned e;
+  if (us<4) return us;
+  e=31-__builtin_clz(us); // Power of two, 2 or more
+  if (e>23) return OE_STATS_BUCKETS-1;
+  return 4*(e-1)+((us>>(e-2))&3);
+}
+
+unsigned long long oe_stats_bucket_end(unsigned b)
+{
+  if (b<4) return b+1;
+  return (unsigned long long)(4+b%4+1)<<(b/4-1);
+}
+
+int oe_stats_claim(oe_stats *s, unsigned long long id)
+{
+  unsigned long long *owner=owners(s);
+  unsigned i;
+
+  for (i=1;i<s->shards;i++) {
+    unsigned long long free=0;
+    if (__atomic_compare_exchange_n(owner+i,&free,id,0,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED))
+      return i;
+  }
+  // None free, look for one left behind by a process that died
+  for (i=1;i<s->shards;i++) {
+    unsigned long long old=__atomic_load_n(owner+i,__ATOMIC_RELAXED);
+    if (old && kill((pid_t)(old>>32),0) && ESRCH==errno
+      && __atomic_compare_exchange_n(owner+i,&old,id,0,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED))
+      return i;
+  }
+  return 0;
+}
+
+void oe_stats_release(oe_stats *s, int shard, unsigned long long id)
+{
+  if (shard>0)
+    __atomic_compare_exchange_n(owners(s)+shard,&id,0,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+}
+
+// Adds a request to a block, shared is constant in each call so the branches fold
+static inline void record(oe_stats_block *b, const oe_stats_sample *x, int shared)
+{
+#define BUMP(P,V) do { if (shared) ADD(P,V); else OWN_ADD(P,V); } while (0)
+  int p;
+
+  BUMP(&b->count[OE_STAT_REQUESTS],1);
+  if (x->flags&OE_SAMPLE_TILE) BUMP(&b->count[OE_STAT_TILES],1);
+  if (x->flags&OE_SAMPLE_EMPTY) BUMP(&b->count[OE_STAT_EMPTIES],1);
+  if (x->flags&OE_SAMPLE_SNAP) BUMP(&b->count[OE_STAT_SNAPS],1);
+  if (x->flags&OE_SAMPLE_INDEX_MISS) BUMP(&b->count[OE_STAT_INDEX_MISSES],1);
+  if (x->bytes) BUMP(&b->count[OE_STAT_BYTES],x->bytes);
+  if (x->level>=0) BUMP(&b->level[x->level<OE_STATS_LEVELS?x->level:OE_STATS_LEVELS-1],1);
+  for (p=0;p<OE_PHASES;p++) {
+    BUMP(&b->sum[p],x->phase[p]);
+    BUMP(&b->hist[p][oe_stats_bucket(x->phase[p])],1);
+  }
+#undef BUMP
+}
+
+void oe_stats_record(oe_stats *s, int shard, int layer, const oe_stats_sample *x)
+{
+  if (shard<=0 || (unsigned)shard>=s->shards)
+    record(block(s,0,layer),x,1);
+  else
+    record(block(s,shard,layer),x,0);
+}
+
+void oe_stats_sum(const oe_stats *s, int layer, oe_stats_block *total)
+{
+  unsigned shard;
+  int i,p;
+
+  memset(total,0,sizeof(*total));
+  for (shard=0;shard<s->shards;shard++) {
+    const oe_stats_block *b=block(s,shard,layer);
+    for (i=0;i<OE_STATS;i++) total->count[i]+=b->count[i];
+    for (i=0;i<OE_STATS_LEVELS;i++) total->level[i]+=b->level[i];
+    for (p=0;p<OE_PHASES;p++) {
+      total->sum[p]+=b->sum[p];
+      for (i=0;i<OE_STATS_BUCKETS;i++) total->hist[p][i]+=b->hist[p][i];
+    }
+  }
+}
+
+unsigned long long oe_stats_quantile(const unsigned int *hist, double q)
+{
+  unsigned long long n=0,seen=0,want;
+  int i;
+
+  for (i=0;i<OE_STATS_BUCKETS;i++) n+=hist[i];
+  if (!n) return 0;
+  want=(unsigned long long)(q*n+0.5);
+  if (!want) want=1;
+  for (i=0;i<OE_STATS_BUCKETS;i++)
+    if ((seen+=hist[i])>=want) break;
+  return oe_stats_bucket_end(i<OE_STATS_BUCKETS?i:OE_STATS_BUCKETS-1);
+}
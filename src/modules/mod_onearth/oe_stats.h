@@ -0,0 +1,126 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Request statistics, kept in shared memory so all the processes add to the same totals
+// Counters, requests per level and latency histograms for each layer, split in shards which
+// a reader sums.  A thread claims a shard for itself and records with plain stores, no locks
+// and no atomic adds.  Threads that don't get a shard share shard 0, with atomic adds
+// A shard keeps its counts when it is released, so the totals survive process restarts
+// Plain C, no Apache or APR, so the benchmark can use it
+//
+
+#ifndef OE_STATS_H
+#define OE_STATS_H
+
+#include <stddef.h>
+
+#define OE_STATS_NAME 64     // Longest layer name, with the terminating zero
+#define OE_STATS_LEVELS 32   // Levels counted one by one, deeper levels count in the last one
+#define OE_STATS_BUCKETS 92  // Latency buckets, from 1us to 16s, see oe_stats_bucket
+
+// Request phases, each has a latency histogram
+enum {OE_PHASE_PARSE,OE_PHASE_MATCH,OE_PHASE_INDEX,OE_PHASE_DATA,OE_PHASE_WRITE,OE_PHASES};
+
+// Counters
+enum {OE_STAT_REQUESTS,OE_STAT_TILES,OE_STAT_EMPTIES,OE_STAT_SNAPS,OE_STAT_INDEX_MISSES,
+  OE_STAT_BYTES,OE_STATS};
+
+// Flags of a sample, which counters to add one to
+#define OE_SAMPLE_TILE 1        // Tile read from the data file
+#define OE_SAMPLE_EMPTY 2       // Empty tile sent instead
+#define OE_SAMPLE_SNAP 4        // Time snapped to a period
+#define OE_SAMPLE_INDEX_MISS 8  // Index record not in the index cache
+
+// Totals for one layer, in one shard or summed over all
+typedef struct {
+  unsigned long long count[OE_STATS];
+  unsigned long long sum[OE_PHASES];  // Microseconds
+  unsigned int level[OE_STATS_LEVELS];
+  unsigned int hist[OE_PHASES][OE_STATS_BUCKETS];
+} oe_stats_block;
+
+// One served request
+typedef struct {
+  int level;          // Level number, -1 if not known
+  unsigned flags;
+  unsigned long long bytes;
+  unsigned phase[OE_PHASES]; // Microseconds
+} oe_stats_sample;
+
+typedef struct {
+  volatile unsigned int state;  // 0 free, 1 being claimed, 2 in use
+  unsigned int hash;
+  char name[OE_STATS_NAME];
+} oe_stats_slot;
+
+// Start of the shared memory, followed by the layer table, the shard owners and the shards
+typedef struct {
+  unsigned int layers;           // Slots in the layer table
+  unsigned int shards;
+  volatile unsigned int overflow; // Requests not counted, the layer table was full
+  unsigned int pad;
+} oe_stats;
+
+// Bytes needed for the given number of layers and shards
+size_t oe_stats_size(unsigned layers, unsigned shards);
+
+// Sets up the statistics in the memory at base, which has oe_stats_size bytes
+oe_stats *oe_stats_init(void *base, unsigned layers, unsigned shards);
+
+// Slot of the layer, added if it isn't there yet.  -1 if the table is full
+int oe_stats_layer(oe_stats *s, const char *name, int len);
+
+// Layer table entry, 0 if the slot is not in use
+const char *oe_stats_name(const oe_stats *s, int layer);
+
+// Claims a shard for the calling thread, id is not zero and has the process id in the top
+// 32 bits.  Shards of processes that are gone are taken back.  Returns 0 if none is free
+int oe_stats_claim(oe_stats *s, unsigned long long id);
+void oe_stats_release(oe_stats *s, int shard, unsigned long long id);
+
+// Adds a request to a layer, in a shard from oe_stats_claim
+void oe_stats_record(oe_stats *s, int shard, int layer, const oe_stats_sample *x);
+
+// Sums the shards of a layer
+void oe_stats_sum(const oe_stats *s, int layer, oe_stats_block *total);
+
+// Histogram bucket for a latency in microseconds, and the latency at the end of a bucket
+// Four buckets per power of two, so the end of a bucket is within 25% of any value in it
+unsigned oe_stats_bucket(unsigned us);
+unsigned long long oe_stats_bucket_end(unsigned b);
+
+// Latency below which a fraction q of the counts in a histogram fall, in microseconds
+unsigned long long oe_stats_quantile(const unsigned int *hist, double q);
+
+#endif
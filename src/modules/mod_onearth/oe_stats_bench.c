@@ -0,0 +1,162 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_stats_bench - Cost of recording a request in the statistics
+// Each thread claims a shard and records samples with random latencies for a few layers,
+// the way the Apache threads do.  Threads that don't get a shard share shard 0, -s 1 makes
+// them all share it.  Prints the time per record and checks the totals
+//
+// oe_stats_bench [-t threads] [-n records per thread] [-s shards] [-l layers]
+//
+
+#include "oe_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static int threads=8,records=2000000,shards=0,layers=16;
+static oe_stats *stats;
+
+typedef struct {
+  unsigned seed;
+  int shard;
+  double ns;        // Per record
+  pthread_t tid;
+} worker;
+
+static worker *workers;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+  return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static void *run(void *arg)
+{
+  worker *w=(worker *)arg;
+  oe_stats_sample *x=(oe_stats_sample *)malloc(1024*sizeof(oe_stats_sample));
+  int *layer=(int *)malloc(1024*sizeof(int));
+  double start;
+  int i,p;
+
+  // Samples made ahead of time, so only the recording is timed
+  for (i=0;i<1024;i++) {
+    char name[32];
+    snprintf(name,sizeof(name),"layer_%d",rand_r(&w->seed)%layers);
+    layer[i]=oe_stats_layer(stats,name,strlen(name));
+    x[i].level=rand_r(&w->seed)%12;
+    x[i].flags=rand_r(&w->seed)%2?OE_SAMPLE_TILE:OE_SAMPLE_EMPTY;
+    x[i].bytes=rand_r(&w->seed)%65536;
+    for (p=0;p<OE_PHASES;p++) x[i].phase[p]=rand_r(&w->seed)%(1<<(rand_r(&w->seed)%16));
+  }
+
+  w->shard=oe_stats_claim(stats,((unsigned long long)getpid()<<32)|(w-workers+1));
+  start=now();
+  for (i=0;i<records;i++)
+    oe_stats_record(stats,w->shard,layer[i&1023],x+(i&1023));
+  w->ns=(now()-start)/records;
+  oe_stats_release(stats,w->shard,((unsigned long long)getpid()<<32)|(w-workers+1));
+  free(x);
+  free(layer);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  worker *w;
+  oe_stats_block total;
+  int shared=0;
+  unsigned long long requests=0;
+  double worst=0,sum=0;
+  size_t size;
+  void *mem;
+  int c,i;
+
+  while (-1!=(c=getopt(argc,argv,"t:n:s:l:")))
+    switch (c) {
+      case 't': threads=atoi(optarg); break;
+      case 'n': records=atoi(optarg); break;
+      case 's': shards=atoi(optarg); break;
+      case 'l': layers=atoi(optarg); break;
+      default:
+        fprintf(stderr,"Usage: %s [-t threads] [-n records per thread] [-s shards] [-l layers]\n",argv[0]);
+        return 1;
+    }
+  if (threads<1 || records<1 || layers<1 || shards<0) {
+    fprintf(stderr,"Threads, records and layers have to be positive\n");
+    return 1;
+  }
+  if (!shards) shards=threads+1; // Shard 0 is shared
+
+  // Shared like in Apache, twice the layers so the table doesn't fill
+  size=oe_stats_size(2*layers,shards);
+  mem=mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+  if (MAP_FAILED==mem) {
+    perror("mmap");
+    return 1;
+  }
+  stats=oe_stats_init(mem,2*layers,shards);
+
+  w=workers=(worker *)calloc(threads,sizeof(worker));
+  for (i=0;i<threads;i++) {
+    w[i].seed=i+1;
+    pthread_create(&w[i].tid,0,run,w+i);
+  }
+  for (i=0;i<threads;i++) {
+    pthread_join(w[i].tid,0);
+    if (!w[i].shard) shared++;
+    sum+=w[i].ns;
+    if (w[i].ns>worst) worst=w[i].ns;
+  }
+
+  for (i=0;i<2*layers;i++)
+    if (oe_stats_name(stats,i)) {
+      oe_stats_sum(stats,i,&total);
+      requests+=total.count[OE_STAT_REQUESTS];
+    }
+
+  printf("%d threads, %d in the shared shard, %d layers, %.1f MB\n",threads,shared,layers,size/1048576.0);
+  printf("record: %.1f ns average, %.1f ns slowest thread\n",sum/threads,worst);
+  if (requests!=(unsigned long long)threads*records) {
+    printf("Counted %llu requests, expected %llu\n",requests,(unsigned long long)threads*records);
+    return 1;
+  }
+  return 0;
+}
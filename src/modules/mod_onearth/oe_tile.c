@@ -0,0 +1,727 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Tile lookup, see oe_tile.h
+//
+
+#include "oe_tile.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <locale.h>
+
+static const int moffset[12]={0,31,59,90,120,151,181,212,243,273,304,334};
+
+const char *oe_config_check(const void *map, size_t size)
+{
+  const cache_header *hd=(const cache_header *)map;
+  const Caches *caches=OE_CACHES(map);
+
+  if (size<sizeof(cache_header)+sizeof(Caches) || memcmp(hd->magic,CACHE_MAGIC,4))
+    return "not a version 2 configuration";
+  if (CACHE_VERSION!=hd->version)
+    return "unsupported configuration version";
+  if (caches->size!=(long long)(size-sizeof(cache_header)) || caches->count<0
+    || hd->hash_size<=0 || (hd->hash_size&(hd->hash_size-1))
+    || hd->hash_offset+(long long)hd->hash_size*sizeof(cache_hash_entry)>(size_t)caches->size
+    || hd->fallback_count<0
+    || hd->fallback_offset+(long long)hd->fallback_count*sizeof(int)>(size_t)caches->size)
+    return "configuration is damaged";
+  return 0;
+}
+
+int oe_layer_lookup(const cache_header *hd, const Caches *caches, const char *key, int len)
+{
+  const cache_hash_entry *table=(const cache_hash_entry *)((const char *)caches+hd->hash_offset);
+  unsigned int mask=hd->hash_size-1;
+  unsigned int slot=cache_key_hash(key,len)&mask;
+  for (;table[slot].key;slot=(slot+1)&mask)
+    if (table[slot].len==len && !memcmp((const char *)caches+table[slot].key,key,len))
+      return table[slot].cache;
+  return -1;
+}
+
+int oe_key_masks_load(cache_key_masks *m, const cache_header *hd, const Caches *caches)
+{
+  const cache_hash_entry *table=(const cache_hash_entry *)((const char *)caches+hd->hash_offset);
+  int i;
+  m->count=0;
+  for (i=0;i<hd->hash_size;i++) {
+    if (!table[i].key) continue;
+    if (table[i].key<0 || table[i].len<0 || table[i].key+(long long)table[i].len>caches->size
+      || cache_key_masks_add(m,(const char *)caches+table[i].key,table[i].len))
+      return -1;
+  }
+  return 0;
+}
+
+int oe_key_lookup(const cache_key_masks *m, const char *key, int len, oe_key_probe probe, void *data)
+{
+  char buf[1024];
+  int start[CACHE_KEY_FIELDS],flen[CACHE_KEY_FIELDS];
+  int i,f=0,best=-1;
+
+  // Requests can't have the wildcard character, it would match
+  if (len>(int)sizeof(buf) || memchr(key,CACHE_KEY_WILD,len)) return -1;
+  start[0]=0;
+  for (i=0;i<len;i++)
+    if ('&'==key[i]) {
+      if (++f==CACHE_KEY_FIELDS) return -1;
+      flen[f-1]=i-start[f-1];
+      start[f]=i+1;
+    }
+  if (CACHE_KEY_FIELDS-1!=f) return -1;
+  flen[f]=len-start[f];
+
+  for (i=0;i<m->count;i++) {
+    const unsigned long long *mask=m->mask[i];
+    int c;
+    for (f=0;f<CACHE_KEY_FIELDS && !mask[f];f++);
+    if (CACHE_KEY_FIELDS==f)
+      c=probe(data,key,len);
+    else {
+      memcpy(buf,key,len);
+      for (f=0;f<CACHE_KEY_FIELDS;f++) {
+        unsigned long long bits=mask[f];
+        int pos;
+        // A value shorter than the last wildcard doesn't match these keys
+        if (flen[f]<64 && bits>>flen[f]) break;
+        for (pos=start[f];bits;pos++,bits>>=1)
+          if (bits&1) buf[pos]=CACHE_KEY_WILD;
+      }
+      if (f<CACHE_KEY_FIELDS) continue;
+      c=probe(data,buf,len);
+    }
+    if (c>best) best=c;
+  }
+  return best;
+}
+
+typedef struct {
+  const cache_header *hd;
+  const Caches *caches;
+} layer_table;
+
+static int layer_probe(void *data, const char *key, int len)
+{
+  layer_table *t=(layer_table *)data;
+  return oe_layer_lookup(t->hd,t->caches,key,len);
+}
+
+int oe_layer_find(const cache_header *hd, const Caches *caches, const cache_key_masks *m,
+                  const char *key, int len)
+{
+  layer_table t;
+  t.hd=hd;
+  t.caches=caches;
+  return oe_key_lookup(m,key,len,layer_probe,&t);
+}
+
+int oe_wmts_key(char *key, int size, const oe_str *version, const oe_str *layer,
+                const oe_str *style, const oe_str *tms, const oe_str *format)
+{
+  const oe_str *f[]={version,layer,style,tms,format};
+  int i,len=0;
+  for (i=0;i<5;i++) {
+    // An absent value has no string, it is the same as an empty one
+    if (len+f[i]->len+1>size) return -1;
+    if (f[i]->len) memcpy(key+len,f[i]->s,f[i]->len);
+    len+=f[i]->len;
+    key[len++]=(i<4)?'&':0;
+  }
+  return len-1;
+}
+
+WMSlevel *oe_wmts_level(WMSCache *cache, long long matrix)
+{
+  if (matrix<0 || matrix>=cache->levels) return 0;
+  return GETLEVELS(cache)+cache->levels-1-matrix;
+}
+
+long long oe_index_offset(const WMSlevel *level, long long row, long long col, long long z, long long zlevels)
+{
+  long long offset;
+  if (col<0 || col>=level->xcount || row<0 || row>=level->ycount) return -1;
+  offset=level->index_add+sizeof(index_s)*(row*level->xcount+col);
+  // Each z level holds a full copy of the level
+  if (zlevels>0)
+    offset+=(level->xcount*level->ycount*zlevels)*sizeof(index_s)/zlevels*z;
+  return offset;
+}
+
+// Power of two of a positive double, read from the exponent bits so it doesn't need libm
+static int exponent(double v)
+{
+  unsigned long long bits;
+  memcpy(&bits,&v,sizeof(bits));
+  return (int)((bits>>52)&0x7ff)-1023;
+}
+
+// The range of powers of two the width tolerance of the levels reach
+static void level_span(const WMSCache *cache, int *emin, int *emax)
+{
+  const WMSlevel *level=GETLEVELS(cache);
+  int i;
+  *emin=1;
+  *emax=0;
+  for (i=0;i<cache->levels;i++,level++) {
+    int lo,hi;
+    if (!(level->levelx>0)) continue;
+    lo=exponent(level->levelx*0.965);
+    hi=exponent(level->levelx*1.035);
+    if (*emin>*emax) {
+      *emin=lo;
+      *emax=hi;
+    }
+    if (lo<*emin) *emin=lo;
+    if (hi>*emax) *emax=hi;
+  }
+}
+
+size_t oe_level_index_size(const WMSCache *cache)
+{
+  int emin,emax;
+  level_span(cache,&emin,&emax);
+  return emin>emax?0:(emax-emin+1)*sizeof(short[2]);
+}
+
+void oe_level_index_build(oe_level_index *ix, const WMSCache *cache, void *mem)
+{
+  const WMSlevel *level=GETLEVELS(cache);
+  int emax,i,e;
+
+  level_span(cache,&ix->emin,&emax);
+  ix->count=ix->emin>emax?0:emax-ix->emin+1;
+  ix->slots=(short (*)[2])mem;
+  for (e=0;e<ix->count;e++)
+    ix->slots[e][0]=ix->slots[e][1]=-1;
+
+  for (i=0;i<cache->levels;i++,level++) {
+    if (!(level->levelx>0)) continue;
+    for (e=exponent(level->levelx*0.965);e<=exponent(level->levelx*1.035);e++) {
+      short *slot=ix->slots[e-ix->emin];
+      if (-1==slot[0]) slot[0]=i;
+      else if (-1==slot[1] && -2!=slot[0]) slot[1]=i;
+      else slot[0]=-2; // Crowded, these widths get a full scan
+    }
+  }
+}
+
+// The width test of a level, same as the scan that was used before the index
+static int width_fits(const WMSlevel *level, double width)
+{
+  return width>level->levelx*0.965 && width<level->levelx*1.035;
+}
+
+WMSlevel *oe_twms_level(WMSCache *cache, const oe_level_index *ix, double width)
+{
+  WMSlevel *levels=GETLEVELS(cache);
+  const short *slot;
+  int e,i;
+
+  if (!(width>0)) return 0;
+  e=exponent(width)-ix->emin;
+  if (e<0 || e>=ix->count) return 0;
+  slot=ix->slots[e];
+  if (-2==slot[0]) {
+    for (i=0;i<cache->levels;i++)
+      if (width_fits(levels+i,width)) return levels+i;
+    return 0;
+  }
+  for (i=0;i<2 && slot[i]>=0;i++)
+    if (width_fits(levels+slot[i],width)) return levels+slot[i];
+  return 0;
+}
+
+// Powers of ten that are exact in a double
+static const double exact10[23]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+  1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+
+// One number, [+-]digits[.digits][e[+-]digits].  Returns the end, or 0 if there is no number
+// When the digits and the exponent are small enough the value is exact with a single
+// multiplication or division, which covers the usual coordinates.  Anything else goes to strtod
+static const char *number(const char *s, double *v)
+{
+  const char *p=s;
+  unsigned long long m=0;
+  int neg=0,nd=0,scale=0,exp=0,eneg=0;
+
+  if ('+'==*p || '-'==*p) neg=('-'==*p++);
+  for (;isdigit((unsigned char)*p);p++,nd++)
+    if (nd<19) m=m*10+(*p-'0'); else scale++;
+  if ('.'==*p)
+    for (p++;isdigit((unsigned char)*p);p++,nd++)
+      if (nd<19) { m=m*10+(*p-'0'); scale--; }
+  if (!nd) return 0;
+  if ('e'==*p || 'E'==*p) {
+    const char *q=p+1;
+    if ('+'==*q || '-'==*q) eneg=('-'==*q++);
+    if (isdigit((unsigned char)*q)) {
+      for (;isdigit((unsigned char)*q);q++)
+        if (exp<10000) exp=exp*10+(*q-'0');
+      p=q;
+    }
+  }
+  scale+=eneg?-exp:exp;
+
+  if (nd<=19 && m<(1ULL<<53) && scale>=-22 && scale<=22) {
+    *v=(double)m;
+    if (scale<0) *v/=exact10[-scale]; else *v*=exact10[scale];
+  } else { // Rare, use the C library on a copy with a '.' the locale can't get wrong
+    char buf[64];
+    char *end;
+    struct lconv *lc=localeconv();
+    size_t len=p-s;
+    if (len>=sizeof(buf)) return 0;
+    memcpy(buf,s,len);
+    buf[len]=0;
+    if (lc->decimal_point[0]!='.' && (end=strchr(buf,'.'))) *end=lc->decimal_point[0];
+    *v=strtod(buf,&end);
+    return p;
+  }
+  if (neg) *v=-*v;
+  return p;
+}
+
+int oe_parse_bbox(const char *s, double *v)
+{
+  double extra;
+  int i;
+
+  for (i=0;i<4;i++) {
+    if (i && ','!=*s++) return 0;
+    if (!(s=number(s,v+i))) return 0;
+  }
+  // A fifth number means a bad separator somewhere
+  return !(','==s[0] && number(s+1,&extra));
+}
+
+//
+// This is the only endian dependent part
+// Linux defines __LITTLE_ENDIAN
+// Could use the internal macros, but this is simpler
+//
+void oe_index_swap(index_s *record)
+{
+#if defined(__LITTLE_ENDIAN)
+  long long temp;
+  char *source,*dest;
+  int i;
+
+  source=(char *) &record->size;
+  dest=(char *) &temp;
+  for (i=0;i<8;i++) dest[i]=source[7-i];
+  record->size=temp;
+
+  source=(char *) &record->offset;
+  dest=(char *) &temp;
+  for (i=0;i<8;i++) dest[i]=source[7-i];
+  record->offset=temp;
+#endif
+}
+
+int oe_tile_record(const WMSlevel *level, index_s *record)
+{
+  int empty=!record->size;
+  if (empty) *record=level->empty_record;
+  if (record->size<=0 || record->offset<0) return -1;
+  return empty;
+}
+
+int oe_yday(int year, int mon, int mday)
+{
+  int leap=(year%4)?0:((year%400)?((year%100)?1:0):1);
+  return mday+moffset[mon-1]+((mon>2)?leap:0);
+}
+
+// Reads exactly n digits
+static int digits(const char **p, const char *end, int n, int *v)
+{
+  *v=0;
+  if (end-*p<n) return 0;
+  while (n--) {
+    if (!isdigit((unsigned char)**p)) return 0;
+    *v=*v*10+(*(*p)++-'0');
+  }
+  return 1;
+}
+
+// Skips a separator, plain or escaped
+static int sep(const char **p, const char *end, char c, const char *escaped)
+{
+  int len=strlen(escaped);
+  if (*p<end && c==**p) {
+    (*p)++;
+    return 1;
+  }
+  if (escaped[0] && end-*p>=len && !strncasecmp(*p,escaped,len)) {
+    *p+=len;
+    return 1;
+  }
+  return 0;
+}
+
+int oe_parse_time(const char *s, int len, oe_time *t)
+{
+  const char *end=s+len;
+  memset(t,0,sizeof(*t));
+  if (!len || (7==len && !strncasecmp(s,"default",7))) return 0;
+  if (!digits(&s,end,4,&t->year) || !sep(&s,end,'-',"") || !digits(&s,end,2,&t->mon)
+    || !sep(&s,end,'-',"") || !digits(&s,end,2,&t->mday))
+    return -1;
+  if (s<end) {
+    if (!sep(&s,end,'T',"") || !digits(&s,end,2,&t->hour) || !sep(&s,end,':',"%3A")
+      || !digits(&s,end,2,&t->min) || !sep(&s,end,':',"%3A") || !digits(&s,end,2,&t->sec)
+      || !sep(&s,end,'Z',"") || s!=end)
+      return -1;
+    t->hastime=1;
+  }
+  if (t->year<=0 || t->mon<1 || t->mon>12 || t->mday<1 || t->mday>31
+    || t->hour>23 || t->min>59 || t->sec>60)
+    return -1;
+  t->yday=oe_yday(t->year,t->mon,t->mday);
+  return 1;
+}
+
+// Days from 1970-01-01 to a date, mday can go past the end of the month
+static long long days_from_civil(long long y, int mon, int mday)
+{
+  long long era;
+  unsigned yoe,doy,doe;
+  y-=mon<=2;
+  era=(y>=0?y:y-399)/400;
+  yoe=(unsigned)(y-era*400);
+  doy=(153*(mon+(mon>2?-3:9))+2)/5+mday-1;
+  doe=yoe*365+yoe/4-yoe/100+doy;
+  return era*146097+(long long)doe-719468;
+}
+
+long long oe_epoch(const oe_time *t)
+{
+  return ((days_from_civil(t->year,t->mon,t->mday)*24+t->hour)*60*60+t->min*60+t->sec)*1000000LL;
+}
+
+void oe_gmtime(long long usec, oe_time *t)
+{
+  long long secs=usec/1000000-(usec%1000000<0);
+  long long days=secs/86400-(secs%86400<0);
+  long long era;
+  unsigned doe,yoe,doy,mp;
+  int rem=(int)(secs-days*86400);
+
+  memset(t,0,sizeof(*t));
+  t->hour=rem/3600;
+  t->min=rem/60%60;
+  t->sec=rem%60;
+  days+=719468;
+  era=(days>=0?days:days-146096)/146097;
+  doe=(unsigned)(days-era*146097);
+  yoe=(doe-doe/1460+doe/36524-doe/146096)/365;
+  doy=doe-(365*yoe+yoe/4-yoe/100);
+  mp=(5*doy+2)/153;
+  t->mday=doy-(153*mp+2)/5+1;
+  t->mon=mp<10?mp+3:mp-9;
+  t->year=(int)(yoe+era*400+(t->mon<=2));
+  t->yday=oe_yday(t->year,t->mon,t->mday);
+  t->hastime=1;
+}
+
+// Adds months to a date, the day of the month stays and can go past the end of the month
+static void add_months(oe_time *t, long long months)
+{
+  months+=t->mon-1;
+  t->year+=months/12;
+  t->mon=months%12+1;
+}
+
+// Date from YYYY-MM-DD or YYYY-MM-DDThh:mm:ss, the numbers are read as far as they go
+static long long period_date(const char *s)
+{
+  oe_time t;
+  memset(&t,0,sizeof(t));
+  t.year=atoi(s);
+  t.mon=atoi(s+5);
+  t.mday=atoi(s+8);
+  if ('T'==s[10]) {
+    t.hour=atoi(s+11);
+    t.min=atoi(s+14);
+    t.sec=atoi(s+17);
+  }
+  if (t.mon<1 || t.mon>12) t.mon=1;
+  return oe_epoch(&t);
+}
+
+// One month or year step from a date, the old way of snapping
+static long long period_next(const oe_period *p, long long date)
+{
+  oe_time t;
+  oe_gmtime(date,&t);
+  add_months(&t,p->interval*(('Y'==p->unit)?12:1));
+  return oe_epoch(&t);
+}
+
+// Month or year steps from the start, same as stepping one by one for start days up to the 28th
+static long long period_step(const oe_period *p, long long k)
+{
+  oe_time t=p->start_date;
+  add_months(&t,k*p->interval*(('Y'==p->unit)?12:1));
+  return oe_epoch(&t);
+}
+
+// Number of whole steps from the start to t, or -1 if the steps have to be counted one by one
+// Later days normalize into the next month, so the steps don't add up
+static long long period_steps(const oe_period *p, long long t)
+{
+  oe_time date;
+  long long k;
+  if (p->start_date.mday>28) return -1;
+  oe_gmtime(t,&date);
+  k=(date.year-p->start_date.year)*12LL+date.mon-p->start_date.mon;
+  k/=p->interval*(('Y'==p->unit)?12:1);
+  if (k>0 && period_step(p,k)>t) k--;
+  return k<0?0:k;
+}
+
+int oe_period_parse(const char *s, oe_period *p)
+{
+  const char *slash=strrchr(s,'/');
+  size_t len=strlen(s);
+  long long interval=1;
+  char c;
+
+  if (!strchr(s,'P') || len<22) return 0;
+  // The interval is after the P, where it is for a date or a date and time period
+  if (len>43) {
+    if ('T'==s[43]) interval=atoll(s+44);
+  } else if ('P'==s[22])
+    interval=atoll(s+23);
+  if (interval<=0) return 0;
+
+  memset(p,0,sizeof(*p));
+  p->start=period_date(s);
+  p->end=period_date(s+(('T'==s[10])?21:11));
+  oe_gmtime(p->start,&p->start_date);
+
+  // Last character of the interval, lowercase m for minutes
+  c=s[len-1];
+  if ('M'==c && slash && strstr(slash,"PT")) c='m';
+  switch (c) {
+    case 'Y':
+    case 'M':
+      p->unit=c;
+      p->interval=interval;
+      break;
+    case 'D':
+      p->interval=interval*24*60*60*1000000;
+      break;
+    case 'H':
+      p->interval=interval*60*60*1000000;
+      break;
+    case 'm':
+      p->interval=interval*60*1000000;
+      break;
+    case 'S':
+      p->interval=interval*1000000;
+      break;
+    default:
+      p->interval=interval;
+  }
+
+  // The first date after the last period
+  if (!p->unit) {
+    p->reach=(p->end<p->start)?p->start:((p->end-p->start)/p->interval+1)*p->interval+p->start;
+  } else {
+    long long k=(p->end<p->start)?0:period_steps(p,p->end);
+    if (k>=0)
+      p->reach=period_step(p,k+1);
+    else { // Count them
+      long long date=p->start;
+      while ((p->reach=period_next(p,date))<=p->end)
+        date=p->reach;
+    }
+  }
+  return 1;
+}
+
+int oe_period_snap(const oe_period *p, long long req, long long *snap)
+{
+  long long k,date,next;
+
+  if (req<p->start || req>=p->reach) return 0;
+  if (!p->unit) {
+    *snap=((req-p->start)/p->interval)*p->interval+p->start;
+    return *snap<=p->end;
+  }
+
+  if ((k=period_steps(p,req))>=0) {
+    date=period_step(p,k);
+    if (k>0 && date>p->end) return 0;
+    *snap=date;
+    return 1;
+  }
+
+  // Count the steps, from one date to the next
+  for (date=p->start;;date=next) {
+    next=period_next(p,date);
+    if (next>req) {
+      *snap=date;
+      return 1;
+    }
+    if (next>p->end) return 0;
+  }
+}
+
+static const oe_period *sort_base; // qsort context, only used when loading a configuration
+static int start_cmp(const void *a, const void *b)
+{
+  const oe_period *pa=sort_base+*(const int *)a;
+  const oe_period *pb=sort_base+*(const int *)b;
+  if (pa->start!=pb->start) return pa->start<pb->start?-1:1;
+  return *(const int *)a-*(const int *)b;
+}
+
+void oe_periods_sort(oe_periods *wp)
+{
+  int i;
+  for (i=0;i<wp->count;i++) wp->by_start[i]=i;
+  sort_base=wp->p;
+  qsort(wp->by_start,wp->count,sizeof(int),start_cmp);
+  for (i=0;i<wp->count;i++) {
+    long long reach=wp->p[wp->by_start[i]].reach;
+    wp->reach[i]=(i && wp->reach[i-1]>reach)?wp->reach[i-1]:reach;
+  }
+}
+
+void oe_periods_parse(oe_periods *wp, const char *s, int num)
+{
+  int i;
+  for (wp->count=i=0;i<num;i++,s+=strlen(s)+1)
+    if (oe_period_parse(s,wp->p+wp->count)) wp->count++;
+  oe_periods_sort(wp);
+}
+
+int oe_periods_find(const oe_periods *wp, long long req, int *cand)
+{
+  int lo=0,hi=wp->count,n=0,i,j;
+
+  // Binary search for the periods that start at or before the request
+  while (lo<hi) {
+    int mid=(lo+hi)/2;
+    if (wp->p[wp->by_start[mid]].start<=req) lo=mid+1; else hi=mid;
+  }
+  // Then walk back while some period can still reach the request
+  for (i=lo-1;i>=0 && wp->reach[i]>req;i--)
+    if (wp->p[wp->by_start[i]].reach>req) {
+      // Insert, keeping the configuration order
+      for (j=n++;j>0 && cand[j-1]>wp->by_start[i];j--)
+        cand[j]=cand[j-1];
+      cand[j]=wp->by_start[i];
+    }
+  return n;
+}
+
+void oe_fname_init(oe_fname *f, const char *name)
+{
+  const char *day=strstr(name,"TTTTTTT_");
+  const char *second=strstr(name,"TTTTTTTTTTTTT_");
+  const char *year=strstr(name,"YYYY");
+  f->name=name;
+  f->len=strlen(name);
+  f->day=day?day-name:-1;
+  f->second=second?second-name:-1;
+  f->year=year?year-name:-1;
+}
+
+// n digits of v, with leading zeros
+static void put_digits(char *s, int n, int v)
+{
+  while (n--) {
+    s[n]='0'+v%10;
+    v/=10;
+  }
+}
+
+int oe_fname_stamp(const oe_fname *f, char *out, const oe_time *t, int hastime)
+{
+  char *s;
+  hastime=hastime && f->second>=0;
+  if (f->day<0) return 0;
+  s=out+(hastime?f->second:f->day);
+  put_digits(s,4,t->year);
+  put_digits(s+4,3,t->yday);
+  if (hastime) {
+    put_digits(s+7,2,t->hour);
+    put_digits(s+9,2,t->min);
+    put_digits(s+11,2,t->sec);
+  }
+  if (f->year>=0) put_digits(out+f->year,4,t->year);
+  return hastime;
+}
+
+int oe_rest_parse(const char *path, int len, oe_rest *t)
+{
+  oe_str seg[9];
+  const char *end=path+len,*dot;
+  int n=0;
+
+  memset(t,0,sizeof(*t));
+  while (path<end && '/'==*path) path++;
+  while (path<end) {
+    const char *s=path;
+    while (path<end && '/'!=*path) path++;
+    if (n==8 || path==s) return 0;
+    seg[n].s=s;
+    seg[n++].len=path-s;
+    if (path<end) path++;
+  }
+  if (n<6) return 0;
+
+  // The file name has the extension
+  for (dot=seg[n-1].s+seg[n-1].len-1;dot>seg[n-1].s && '.'!=*dot;dot--);
+  if (dot==seg[n-1].s) return 0;
+  t->ext.s=dot+1;
+  t->ext.len=seg[n-1].s+seg[n-1].len-t->ext.s;
+  seg[n-1].len=dot-seg[n-1].s;
+
+  t->layer=seg[0];
+  t->style=seg[1];
+  if (8==n) t->zindex=seg[--n];
+  if (7==n) t->time=seg[2];
+  t->tms=seg[n-4];
+  t->matrix=seg[n-3];
+  t->row=seg[n-2];
+  t->col=seg[n-1];
+  return 1;
+}
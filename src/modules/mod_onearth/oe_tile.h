@@ -0,0 +1,200 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Tile lookup, shared by mod_onearth and oe_tile_server
+// Works on the version 2 binary configuration made by oe_create_cache_config -b
+// Plain C, no Apache or APR
+//
+
+#ifndef OE_TILE_H
+#define OE_TILE_H
+
+#include <stddef.h>
+#include "cache.h"
+
+// Pointer and length into a string, not null terminated
+typedef struct {
+  const char *s;
+  int len;
+} oe_str;
+
+// A request date, from YYYY-MM-DD or YYYY-MM-DDThh:mm:ssZ
+typedef struct {
+  int year,mon,mday; // mon and mday start at 1
+  int yday;          // Day of the year, starts at 1
+  int hour,min,sec;
+  int hastime;       // The time of day was given
+} oe_time;
+
+// A time period from the cache configuration, parsed once.  Times are microseconds since 1970
+typedef struct {
+  long long start,end;  // The first date and the first date of the last period
+  long long reach;      // Requests from here on don't snap to this period
+  long long interval;   // Microseconds, or a number of months or years
+  oe_time start_date;   // For month and year steps
+  char unit;            // Y or M for calendar steps, 0 for fixed intervals
+} oe_period;
+
+// The periods of a cache
+typedef struct {
+  oe_period *p;         // In configuration order, which is the order they are tried
+  int count;
+  int *by_start;        // Period numbers, sorted by start
+  long long *reach;     // Highest reach of the periods up to here, in by_start order
+} oe_periods;
+
+// The parts of a REST tile request, the time and z index are optional
+typedef struct {
+  oe_str layer,style,time,tms,matrix,row,col,zindex,ext;
+} oe_rest;
+
+// File name with time stamp markers, parsed once when the configuration is loaded
+// TTTTTTT_ takes the year and the day of the year, TTTTTTTTTTTTT_ also the time of day, and a
+// YYYY directory the year.  A name for a request is then a copy with digits written in place
+typedef struct {
+  const char *name;  // Null terminated, with the markers
+  int len;
+  int day;           // Position of the TTTTTTT_ marker, -1 if none
+  int second;        // Position of the TTTTTTTTTTTTT_ marker, -1 if none
+  int year;          // Position of the YYYY marker, -1 if none
+} oe_fname;
+
+// Checks a version 2 configuration held in memory, returns 0 if it can be used, or a message
+const char *oe_config_check(const void *map, size_t size);
+
+// The Caches record of a version 2 configuration
+#define OE_CACHES(M) ((Caches *)((const cache_header *)(M)+1))
+
+// Cache number for a layer key, -1 if it's not in the layer hash table
+int oe_layer_lookup(const cache_header *hd, const Caches *caches, const char *key, int len);
+
+// Collects the wildcard positions of the keys in the layer hash table
+// Returns -1 if there are more than CACHE_KEY_MASKS sets, or the table is damaged
+int oe_key_masks_load(cache_key_masks *m, const cache_header *hd, const Caches *caches);
+
+// Looks up a layer key made from a request, once for each set of wildcard positions in m
+// The probe returns the cache number for a key, -1 if it's not there.  Returns the highest one
+typedef int (*oe_key_probe)(void *data, const char *key, int len);
+int oe_key_lookup(const cache_key_masks *m, const char *key, int len, oe_key_probe probe, void *data);
+
+// Cache number for a request layer key in the layer hash table, -1 if none matches
+int oe_layer_find(const cache_header *hd, const Caches *caches, const cache_key_masks *m,
+                  const char *key, int len);
+
+// Layer key, VERSION&LAYER&STYLE&TILEMATRIXSET&FORMAT, returns the length, -1 if it doesn't fit
+// A value with no string is taken as empty
+int oe_wmts_key(char *key, int size, const oe_str *version, const oe_str *layer,
+                const oe_str *style, const oe_str *tms, const oe_str *format);
+
+// The level for a TILEMATRIX, 0 if there is no such level
+WMSlevel *oe_wmts_level(WMSCache *cache, long long matrix);
+
+// Tiled WMS level lookup by tile width.  For each power of two of the width, the levels
+// whose width is within the 3.5% tolerance of it, at most two, in level order
+typedef struct {
+  int emin,count;     // Powers of two covered
+  short (*slots)[2];  // Level numbers, -1 for none.  -2 first if more than two levels fit
+} oe_level_index;
+
+// Bytes needed for the slots of a cache
+size_t oe_level_index_size(const WMSCache *cache);
+
+// Fills the level index of a cache, mem has oe_level_index_size bytes
+void oe_level_index_build(oe_level_index *ix, const WMSCache *cache, void *mem);
+
+// The first level with a width within 3.5% of the given one, 0 if there is none
+WMSlevel *oe_twms_level(WMSCache *cache, const oe_level_index *ix, double width);
+
+// Parses the BBOX value, four numbers separated by commas, in C number syntax whatever
+// the locale.  Returns 1 if it has four numbers and no fifth
+int oe_parse_bbox(const char *s, double *v);
+
+// Index file offset of the record for a tile, -1 if the row or the column is out of range
+// z is the z level, for caches with zlevels
+long long oe_index_offset(const WMSlevel *level, long long row, long long col, long long z, long long zlevels);
+
+// Index records are stored big endian
+void oe_index_swap(index_s *record);
+
+// The record to send for a tile, from its index record, already swapped
+// A tile that is not in the index gets the empty tile of the level, which is read from the
+// default data file, the one without a time stamp.  Returns 1 for the empty tile, 0 for the
+// tile itself and -1 if there is nothing to send
+int oe_tile_record(const WMSlevel *level, index_s *record);
+
+// Day of the year, starting at 1
+int oe_yday(int year, int mon, int mday);
+
+// Parses a TIME value, the colons can be escaped as %3A
+// Returns 1 for a date, 0 if the value is empty or "default", -1 if it's not valid
+int oe_parse_time(const char *s, int len, oe_time *t);
+
+// Microseconds since 1970 for a date in UTC, without the day of the year.  The day of the
+// month can go past the end of the month, like with timegm
+long long oe_epoch(const oe_time *t);
+
+// The date in UTC for microseconds since 1970, with the day of the year
+void oe_gmtime(long long usec, oe_time *t);
+
+// Parses a time period, start/end/Pinterval, returns 0 if it can't be used for snapping
+int oe_period_parse(const char *s, oe_period *p);
+
+// Snap date for a request in a period, returns 0 if there is none
+// Snaps to the closest date at or before the request, the last one can't be after the end
+int oe_period_snap(const oe_period *p, long long req, long long *snap);
+
+// Fills by_start and reach, which have room for count periods
+void oe_periods_sort(oe_periods *wp);
+
+// Parses num periods, strings one after the other, and sorts them.  p, by_start and reach
+// have room for num periods.  The ones that can't be used for snapping are left out
+void oe_periods_parse(oe_periods *wp, const char *s, int num);
+
+// Finds the periods a request could snap to, returns how many, in configuration order
+// cand has room for count periods
+int oe_periods_find(const oe_periods *wp, long long req, int *cand);
+
+// Finds the markers of a file name, which has to stay around as long as the template
+void oe_fname_init(oe_fname *f, const char *name);
+
+// Writes the time stamp over the markers in out, a copy of the name.  With hastime set, the time
+// of day goes in the long marker if the name has one, then it returns 1, otherwise 0
+int oe_fname_stamp(const oe_fname *f, char *out, const oe_time *t, int hastime);
+
+// Splits the path of a REST request, relative to the endpoint,
+// layer/style/[time/]tms/matrix/row/col.ext or layer/style/time/tms/matrix/row/col/zindex.ext
+// Returns 1 if it has the right shape
+int oe_rest_parse(const char *path, int len, oe_rest *t);
+
+#endif
@@ -0,0 +1,665 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_tile_server - Standalone WMTS tile server
+// Serves GetTile, as KVP or REST, straight from the MRF files, using the same binary
+// configuration as mod_onearth, made by oe_create_cache_config -b
+// One event loop per thread, each with its own listening socket on the same port (SO_REUSEPORT),
+// so the kernel spreads the connections.  Each thread keeps its own open files, no locks
+//
+// The layer lookup, the file names, the time snapping and the empty tiles come from oe_tile.c,
+// same as in mod_onearth, and the tiles are read with the read engine of oe_read.c
+// Z index lookups and the KML and TWMS requests are left to mod_onearth
+//
+// oe_tile_server -c cache.config [-p port] [-r REST prefix] [-t threads]
+//
+
+#define _GNU_SOURCE
+#include "oe_tile.h"
+#include "oe_read.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define IN_SIZE 8192      // Largest request head
+#define MAX_EVENTS 256
+#define FILES 64          // Open files per thread
+#define FILE_CHECK 1      // Seconds between file identity checks
+#define MAX_TILE (64<<20) // Larger records are taken as damaged
+
+static const cache_header *header;
+static Caches *caches;
+static cache_key_masks key_masks; // Wildcard positions in the layer keys
+static char cachedir[PATH_MAX];   // For relative file names
+static oe_fname **fnames;         // By cache, the index and data file names of each level
+static oe_periods *periods;       // By cache, for time snapping
+static const char *rest_prefix="/";
+static int port=8080;
+
+// An open file, the name is checked every FILE_CHECK seconds, so replaced files get picked up
+typedef struct {
+  char name[PATH_MAX];
+  int fd;               // -1 when not open
+  dev_t dev;
+  ino_t ino;
+  time_t mtime,checked;
+} open_file;
+
+typedef struct {
+  int fd;
+  char in[IN_SIZE];
+  int inlen;
+  char *out;            // Response being sent
+  size_t outlen,sent;
+  int close_after;      // Close once the response is sent
+} conn;
+
+typedef struct {
+  pthread_t tid;
+  open_file files[FILES];
+  oe_read_engine *engine;
+  int spare;            // Closed to accept a connection when out of descriptors
+} worker;
+
+static int file_get(worker *w, const char *name)
+{
+  unsigned h=cache_key_hash(name,strlen(name))%FILES;
+  open_file *f=w->files+h;
+  time_t now=time(0);
+  struct stat st;
+
+  if (f->fd>=0 && !strcmp(f->name,name)) {
+    if (now-f->checked<FILE_CHECK) return f->fd;
+    if (!stat(name,&st) && st.st_ino==f->ino && st.st_dev==f->dev && st.st_mtime==f->mtime) {
+      f->checked=now;
+      return f->fd;
+    }
+  }
+  if (f->fd>=0) close(f->fd);
+  f->fd=-1;
+  if (strlen(name)>=sizeof(f->name)) return -1;
+  if (0>(f->fd=open(name,O_RDONLY)) || fstat(f->fd,&st)) {
+    if (f->fd>=0) close(f->fd);
+    f->fd=-1;
+    return -1;
+  }
+  strcpy(f->name,name);
+  f->dev=st.st_dev;
+  f->ino=st.st_ino;
+  f->mtime=st.st_mtime;
+  f->checked=now;
+  return f->fd;
+}
+
+// Full name for a file name string in the configuration
+static const char *full_name(const char *name)
+{
+  char *s;
+  if ('/'==*name) return name;
+  s=(char *)malloc(strlen(cachedir)+strlen(name)+1);
+  strcpy(s,cachedir);
+  return strcat(s,name);
+}
+
+// Parses the file names of all the levels and the time periods, once
+static void load_names(void)
+{
+  int i,k;
+  fnames=(oe_fname **)calloc(caches->count,sizeof(oe_fname *));
+  periods=(oe_periods *)calloc(caches->count,sizeof(oe_periods));
+  for (i=0;i<caches->count;i++) {
+    WMSCache *cache=GETCACHE(caches,i);
+    WMSlevel *level=GETLEVELS(cache);
+    int n=cache->num_periods+1;
+    periods[i].p=(oe_period *)calloc(n,sizeof(oe_period));
+    periods[i].by_start=(int *)calloc(n,sizeof(int));
+    periods[i].reach=(long long *)calloc(n,sizeof(long long));
+    oe_periods_parse(periods+i,GETSTRING(caches,cache->time_period),cache->num_periods);
+    fnames[i]=(oe_fname *)calloc(2*cache->levels+1,sizeof(oe_fname));
+    for (k=0;k<cache->levels;k++,level++) {
+      oe_fname_init(fnames[i]+2*k,full_name(GETSTRING(caches,level->ifname)));
+      oe_fname_init(fnames[i]+2*k+1,full_name(GETSTRING(caches,level->dfname)));
+    }
+  }
+}
+
+// File name for a request, with the time stamp if needed
+// Returns 0 if the time is not valid
+static int file_name(char *out, size_t size, const oe_fname *f, const oe_str *time, int zlevels)
+{
+  oe_time t;
+
+  if ((size_t)f->len>=size) return 0;
+  memcpy(out,f->name,f->len+1);
+  if (f->day<0) return 1;
+  switch (oe_parse_time(time->s,time->len,&t)) {
+    case -1: return 0;
+    case 0: return 1; // No time, the file name with the marker is the default
+  }
+  // Sub-daily file names have the longer marker
+  oe_fname_stamp(f,out,&t,t.hastime && !zlevels);
+  return 1;
+}
+
+// Opens the index for a date that has no files, snapping it to the layer periods as mod_onearth
+// does.  iname and dname get the names of the date it snapped to.  Returns -1 if there is none
+static int snap_index(worker *w, int count, const oe_fname *names, const oe_str *time, int zlevels,
+                      char *iname, char *dname)
+{
+  const oe_periods *wp=periods+count;
+  oe_time t,snap;
+  long long req,when;
+  int i,n,fd,hastime;
+
+  if (names->day<0 || !wp->count || oe_parse_time(time->s,time->len,&t)<=0) return -1;
+  hastime=t.hastime && !zlevels;
+  if (!t.hastime) t.hour=t.min=t.sec=0;
+  req=oe_epoch(&t);
+  {
+    int cand[wp->count];
+    n=oe_periods_find(wp,req,cand);
+    for (i=0;i<n;i++) {
+      if (!oe_period_snap(wp->p+cand[i],req,&when)) continue;
+      oe_gmtime(when,&snap);
+      oe_fname_stamp(names,iname,&snap,hastime);
+      if (0<=(fd=file_get(w,iname))) {
+        oe_fname_stamp(names+1,dname,&snap,hastime);
+        return fd;
+      }
+    }
+  }
+  return -1;
+}
+
+// Decodes the %XX escapes of a value into out, which has room for it, same as Apache does
+// for the arguments mod_onearth gets.  Values without escapes are left where they are
+static void unescape(oe_str *v, char *out)
+{
+  int i,n=0;
+  if (!memchr(v->s,'%',v->len)) return;
+  for (i=0;i<v->len;i++)
+    if ('%'==v->s[i] && i+2<v->len && isxdigit((unsigned char)v->s[i+1]) && isxdigit((unsigned char)v->s[i+2])) {
+      char hex[3]={v->s[i+1],v->s[i+2],0};
+      out[n++]=(char)strtol(hex,0,16);
+      i+=2;
+    } else
+      out[n++]=v->s[i];
+  v->s=out;
+  v->len=n;
+}
+
+static const char *mime_type(const WMSCache *cache)
+{
+  const char *prefix=GETSTRING(caches,cache->prefix);
+  if (strstr(prefix,"jpeg")) return "image/jpeg";
+  if (strstr(prefix,"png")) return "image/png";
+  if (strstr(prefix,"tiff")) return "image/tiff";
+  if (strstr(prefix,"lerc")) return "image/lerc";
+  if (strstr(prefix,"vnd.mapbox-vector-tile")) return "application/vnd.mapbox-vector-tile";
+  return "text/html";
+}
+
+static void respond(conn *c, int status, const char *reason, const char *type,
+                    const char *extra, const void *body, size_t len, int head)
+{
+  char hdr[512];
+  int n=snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d %s\r\nServer: oe_tile_server\r\n"
+    "Content-Type: %s\r\nContent-Length: %zu\r\n%s%s\r\n",
+    status,reason,type,len,extra?extra:"",c->close_after?"Connection: close\r\n":"");
+  if (head) len=0;
+  if (!(c->out=(char *)malloc(n+len))) { // Drop the connection
+    c->close_after=1;
+    return;
+  }
+  memcpy(c->out,hdr,n);
+  if (len) memcpy(c->out+n,body,len);
+  c->outlen=n+len;
+  c->sent=0;
+}
+
+static int fail(conn *c, int status, const char *reason, const char *text, int head)
+{
+  respond(c,status,reason,"text/plain",0,text,strlen(text),head);
+  return 0;
+}
+
+// Value of a KVP parameter, case insensitive name
+static int kvp(const char *q, int qlen, const char *name, oe_str *v)
+{
+  const char *end=q+qlen;
+  int nlen=strlen(name);
+  while (q<end) {
+    const char *amp=memchr(q,'&',end-q);
+    if (!amp) amp=end;
+    if (amp-q>nlen && '='==q[nlen] && !strncasecmp(q,name,nlen)) {
+      v->s=q+nlen+1;
+      v->len=amp-v->s;
+      return 1;
+    }
+    q=amp+1;
+  }
+  v->s="";
+  v->len=0;
+  return 0;
+}
+
+static int to_ll(const oe_str *v, long long *out)
+{
+  int i;
+  if (!v->len || v->len>15) return 0;
+  for (*out=0,i=0;i<v->len;i++) {
+    if (!isdigit((unsigned char)v->s[i])) return 0;
+    *out=*out*10+v->s[i]-'0';
+  }
+  return 1;
+}
+
+static int find_cache(const oe_str *version, const oe_str *layer, const oe_str *style,
+                      const oe_str *tms, const oe_str *format)
+{
+  static const oe_str def={"default",7},none={"",0};
+  char key[1024];
+  int len=oe_wmts_key(key,sizeof(key),version,layer,style,tms,format),count;
+  if (len<0) return -1;
+  if (0<=(count=oe_layer_find(header,caches,&key_masks,key,len))) return count;
+  // The default style can be left out
+  if (!style->len) style=&def;
+  else if (7==style->len && !strncasecmp(style->s,"default",7)) style=&none;
+  else return -1;
+  len=oe_wmts_key(key,sizeof(key),version,layer,style,tms,format);
+  return (len<0)?-1:oe_layer_find(header,caches,&key_masks,key,len);
+}
+
+static int get_tile(worker *w, conn *c, const char *target, int tlen, int head)
+{
+  const char *q=memchr(target,'?',tlen);
+  oe_str version={"1.0.0",5},layer,style,tms,format,matrix,row,col,time={"",0},zindex={"",0};
+  oe_str *decode[]={&version,&layer,&style,&tms,&matrix,&row,&col,&format,&time,&zindex};
+  char fmt[64],iname[PATH_MAX],dname[PATH_MAX],values[IN_SIZE],*v;
+  long long m,y,x,z=0,offset;
+  const char *extra=0;
+  index_s record;
+  WMSCache *cache;
+  WMSlevel *level;
+  const oe_fname *names;
+  oe_str service,request;
+  int count,ifd,dfd,empty,i;
+  struct iovec iov;
+  oe_read_op op;
+  char *body;
+
+  if (q && kvp(q+1,target+tlen-q-1,"service",&service) && kvp(q+1,target+tlen-q-1,"request",&request)) {
+    int ql=target+tlen-q-1;
+    if (4!=service.len || strncasecmp(service.s,"WMTS",4) || 7!=request.len || strncasecmp(request.s,"GetTile",7))
+      return fail(c,501,"Not Implemented","Only WMTS GetTile is supported\n",head);
+    kvp(q+1,ql,"version",&version);
+    kvp(q+1,ql,"layer",&layer);
+    kvp(q+1,ql,"style",&style);
+    kvp(q+1,ql,"tilematrixset",&tms);
+    kvp(q+1,ql,"tilematrix",&matrix);
+    kvp(q+1,ql,"tilerow",&row);
+    kvp(q+1,ql,"tilecol",&col);
+    kvp(q+1,ql,"format",&format);
+    kvp(q+1,ql,"time",&time);
+    kvp(q+1,ql,"zindex",&zindex);
+    // The values are decoded one after the other in values, which is as long as the request
+    for (v=values,i=0;i<(int)(sizeof(decode)/sizeof(decode[0]));i++) {
+      unescape(decode[i],v);
+      if (decode[i]->s==v) v+=decode[i]->len;
+    }
+    // The layer keys have the slash escaped
+    if (format.len<(int)sizeof(fmt)/3) {
+      int i,n=0;
+      for (i=0;i<format.len;i++)
+        if ('/'==format.s[i]) n+=sprintf(fmt+n,"%%2F");
+        else fmt[n++]=format.s[i];
+      format.s=fmt;
+      format.len=n;
+    }
+  } else {
+    int plen=strlen(rest_prefix);
+    oe_str path;
+    oe_rest t;
+    if (q) tlen=q-target;
+    if (tlen<plen || strncmp(target,rest_prefix,plen))
+      return fail(c,404,"Not Found","Not a tile request\n",head);
+    path.s=target+plen;
+    path.len=tlen-plen;
+    unescape(&path,values);
+    if (!oe_rest_parse(path.s,path.len,&t))
+      return fail(c,404,"Not Found","Not a tile request\n",head);
+    layer=t.layer; style=t.style; tms=t.tms; matrix=t.matrix; row=t.row; col=t.col;
+    time=t.time; zindex=t.zindex;
+    if ((3==t.ext.len && !strncasecmp(t.ext.s,"jpg",3)) || (4==t.ext.len && !strncasecmp(t.ext.s,"jpeg",4)))
+      format.s="image%2Fjpeg";
+    else if (3==t.ext.len && !strncasecmp(t.ext.s,"mvt",3))
+      format.s="application%2Fvnd.mapbox-vector-tile";
+    else {
+      snprintf(fmt,sizeof(fmt),"image%%2F%.*s",t.ext.len,t.ext.s);
+      format.s=fmt;
+    }
+    format.len=strlen(format.s);
+  }
+
+  if (!to_ll(&matrix,&m) || !to_ll(&row,&y) || !to_ll(&col,&x) || (zindex.len && !to_ll(&zindex,&z)))
+    return fail(c,400,"Bad Request","TILEMATRIX, TILEROW and TILECOL have to be numbers\n",head);
+  if (0>(count=find_cache(&version,&layer,&style,&tms,&format)))
+    return fail(c,404,"Not Found","No such layer\n",head);
+  cache=GETCACHE(caches,count);
+  if (!(level=oe_wmts_level(cache,m)))
+    return fail(c,400,"Bad Request","Invalid TILEMATRIX\n",head);
+  if (cache->zlevels && (!zindex.len || z>=cache->zlevels))
+    return fail(c,404,"Not Found","Layer needs a valid ZINDEX\n",head);
+  if (0>(offset=oe_index_offset(level,y,x,z,cache->zlevels)))
+    return fail(c,400,"Bad Request","Tile is out of range\n",head);
+  names=fnames[count]+2*(level-GETLEVELS(cache));
+  if (!file_name(iname,sizeof(iname),names,&time,cache->zlevels)
+    || !file_name(dname,sizeof(dname),names+1,&time,cache->zlevels))
+    return fail(c,400,"Bad Request","Invalid TIME\n",head);
+  // A date with no files snaps to the periods of the layer.  Without an index for the time
+  // the tile is empty, as in mod_onearth
+  if (0>(ifd=file_get(w,iname)))
+    ifd=snap_index(w,count,names,&time,cache->zlevels,iname,dname);
+  if (0>ifd || sizeof(record)!=pread(ifd,&record,sizeof(record),offset))
+    memset(&record,0,sizeof(record));
+  else
+    oe_index_swap(&record);
+  if (0>(empty=oe_tile_record(level,&record)) || record.size>MAX_TILE)
+    return fail(c,404,"Not Found","Tile does not exist\n",head);
+  if (0>(dfd=file_get(w,empty?names[1].name:dname)))
+    return fail(c,404,"Not Found","No data for this time\n",head);
+
+  if (!strcmp(mime_type(cache),"application/vnd.mapbox-vector-tile"))
+    extra="Content-Encoding: gzip\r\n";
+  else if (!strcmp(mime_type(cache),"image/lerc"))
+    extra="Content-Encoding: deflate\r\n";
+  if (!(body=(char *)malloc(record.size)))
+    return fail(c,500,"Internal Server Error","Out of memory\n",head);
+  iov.iov_base=body;
+  iov.iov_len=record.size;
+  op.fd=dfd;
+  op.offset=record.offset;
+  op.iov=&iov;
+  op.iovcnt=1;
+  if (oe_read_submit(w->engine,&op,1) || record.size!=op.result) {
+    free(body);
+    return fail(c,500,"Internal Server Error","Tile read failed\n",head);
+  }
+  respond(c,200,"OK",mime_type(cache),extra,body,record.size,head);
+  free(body);
+  return 1;
+}
+
+// Parses one request from the input, returns 0 if it's not complete yet
+static int handle(worker *w, conn *c)
+{
+  char *end=memmem(c->in,c->inlen,"\r\n\r\n",4),*sp1,*sp2,*line_end;
+  int used,head;
+
+  if (!end) {
+    if (c->inlen==IN_SIZE) {
+      c->close_after=1;
+      fail(c,431,"Request Header Fields Too Large","Request is too large\n",0);
+      c->inlen=0;
+      return 1;
+    }
+    return 0;
+  }
+  used=end+4-c->in;
+  line_end=memchr(c->in,'\r',used);
+  sp1=memchr(c->in,' ',line_end-c->in);
+  sp2=sp1?memchr(sp1+1,' ',line_end-sp1-1):0;
+  // HTTP/1.1 keeps the connection by default, 1.0 closes it
+  c->close_after=!sp2 || strncmp(sp2+1,"HTTP/1.1",8)
+    || memmem(c->in,used,"\r\nConnection: close",19) || memmem(c->in,used,"\r\nconnection: close",19);
+  head=sp1 && 4==sp1-c->in && !strncmp(c->in,"HEAD",4);
+  if (!sp2)
+    fail(c,400,"Bad Request","Bad request line\n",0);
+  else if (!head && !(3==sp1-c->in && !strncmp(c->in,"GET",3)))
+    fail(c,405,"Method Not Allowed","Only GET and HEAD\n",0);
+  else
+    get_tile(w,c,sp1+1,sp2-sp1-1,head);
+  memmove(c->in,c->in+used,c->inlen-used);
+  c->inlen-=used;
+  return 1;
+}
+
+// Sends what it can, returns -1 on error, 1 when all is sent
+static int flush(conn *c)
+{
+  while (c->sent<c->outlen) {
+    ssize_t n=send(c->fd,c->out+c->sent,c->outlen-c->sent,MSG_NOSIGNAL);
+    if (n<0) return (EAGAIN==errno || EWOULDBLOCK==errno)?0:-1;
+    c->sent+=n;
+  }
+  free(c->out);
+  c->out=0;
+  return 1;
+}
+
+static void drop(int ep, conn *c)
+{
+  epoll_ctl(ep,EPOLL_CTL_DEL,c->fd,0);
+  close(c->fd);
+  free(c->out);
+  free(c);
+}
+
+// Reads, answers the complete requests and sends, until it would block
+static void serve(worker *w, int ep, conn *c)
+{
+  struct epoll_event ev;
+  int rc;
+
+  for (;;) {
+    if (c->out) {
+      if (0>(rc=flush(c))) {
+        drop(ep,c);
+        return;
+      }
+      if (!rc) break;
+      if (c->close_after) {
+        drop(ep,c);
+        return;
+      }
+    }
+    if (handle(w,c)) {
+      if (!c->out && c->close_after) { // No memory for the response
+        drop(ep,c);
+        return;
+      }
+      continue;
+    }
+    rc=recv(c->fd,c->in+c->inlen,IN_SIZE-c->inlen,0);
+    if (!rc || (0>rc && EAGAIN!=errno && EWOULDBLOCK!=errno)) {
+      drop(ep,c);
+      return;
+    }
+    if (0>rc) break;
+    c->inlen+=rc;
+  }
+  // Waiting for the socket
+  ev.events=c->out?EPOLLOUT:EPOLLIN;
+  ev.data.ptr=c;
+  if (epoll_ctl(ep,EPOLL_CTL_MOD,c->fd,&ev)) drop(ep,c);
+}
+
+// Accepts all the new connections.  Out of descriptors, the pending ones are accepted with
+// the spare descriptor and closed, otherwise the listening socket stays readable and the
+// event loops spin
+static void accept_all(worker *w, int ep, int ls)
+{
+  struct epoll_event ev;
+  int one=1;
+
+  for (;;) {
+    conn *c;
+    int fd=accept4(ls,0,0,SOCK_NONBLOCK);
+    if (0>fd) {
+      if (EINTR==errno || ECONNABORTED==errno) continue;
+      if ((EMFILE==errno || ENFILE==errno) && w->spare>=0) {
+        close(w->spare);
+        if (0<=(fd=accept4(ls,0,0,0))) close(fd);
+        w->spare=open("/dev/null",O_RDONLY);
+        if (0<=fd) continue;
+      }
+      return;
+    }
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    if (!(c=(conn *)calloc(1,sizeof(conn)))) {
+      close(fd);
+      continue;
+    }
+    c->fd=fd;
+    ev.events=EPOLLIN;
+    ev.data.ptr=c;
+    if (epoll_ctl(ep,EPOLL_CTL_ADD,fd,&ev)) {
+      close(fd);
+      free(c);
+    }
+  }
+}
+
+static void *run(void *arg)
+{
+  worker *w=(worker *)arg;
+  struct epoll_event ev,events[MAX_EVENTS];
+  struct sockaddr_in6 addr;
+  int one=1,ls,ep,i,n;
+
+  if (0>(ls=socket(AF_INET6,SOCK_STREAM|SOCK_NONBLOCK,0))
+    || setsockopt(ls,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one))
+    || setsockopt(ls,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one))) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&addr,0,sizeof(addr));
+  addr.sin6_family=AF_INET6;
+  addr.sin6_addr=in6addr_any;
+  addr.sin6_port=htons(port);
+  if (bind(ls,(struct sockaddr *)&addr,sizeof(addr)) || listen(ls,1024)) {
+    perror("bind");
+    exit(1);
+  }
+  ev.events=EPOLLIN;
+  ev.data.ptr=0; // The listening socket
+  if (0>(ep=epoll_create1(0)) || epoll_ctl(ep,EPOLL_CTL_ADD,ls,&ev)) {
+    perror("epoll");
+    exit(1);
+  }
+  w->engine=oe_read_create(1,1);
+  w->spare=open("/dev/null",O_RDONLY);
+
+  for (;;) {
+    n=epoll_wait(ep,events,MAX_EVENTS,-1);
+    for (i=0;i<n;i++) {
+      conn *c=(conn *)events[i].data.ptr;
+      if (c)
+        serve(w,ep,c);
+      else
+        accept_all(w,ep,ls);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *config=0,*msg;
+  int threads=sysconf(_SC_NPROCESSORS_ONLN),fd,c,i,k;
+  struct stat st;
+  void *map;
+  worker *w;
+
+  while (-1!=(c=getopt(argc,argv,"c:p:r:t:")))
+    switch (c) {
+      case 'c': config=optarg; break;
+      case 'p': port=atoi(optarg); break;
+      case 'r': rest_prefix=optarg; break;
+      case 't': threads=atoi(optarg); break;
+      default: config=0; optind=argc; break;
+    }
+  if (!config || threads<1) {
+    fprintf(stderr,"Usage: %s -c cache.config [-p port] [-r REST prefix] [-t threads]\n",argv[0]);
+    return 1;
+  }
+
+  if (0>(fd=open(config,O_RDONLY)) || fstat(fd,&st)
+    || MAP_FAILED==(map=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0))) {
+    perror(config);
+    return 1;
+  }
+  if ((msg=oe_config_check(map,st.st_size))) {
+    fprintf(stderr,"%s: %s, make it with oe_create_cache_config -b\n",config,msg);
+    return 1;
+  }
+  header=(const cache_header *)map;
+  caches=OE_CACHES(map);
+  if (oe_key_masks_load(&key_masks,header,caches)) {
+    fprintf(stderr,"%s: too many wildcard layer keys\n",config);
+    return 1;
+  }
+  // Relative file names are from the configuration directory
+  snprintf(cachedir,sizeof(cachedir),"%s",config);
+  if (strrchr(cachedir,'/')) strrchr(cachedir,'/')[1]=0;
+  else cachedir[0]=0;
+  load_names();
+
+  signal(SIGPIPE,SIG_IGN);
+  fprintf(stderr,"Serving %d caches on port %d with %d threads\n",caches->count,port,threads);
+  if (!(w=(worker *)calloc(threads,sizeof(worker)))) {
+    perror("calloc");
+    return 1;
+  }
+  for (i=0;i<threads;i++)
+    for (k=0;k<FILES;k++) w[i].files[k].fd=-1;
+  for (i=1;i<threads;i++) pthread_create(&w[i].tid,0,run,w+i);
+  run(w);
+  return 0;
+}
@@ -0,0 +1,156 @@
+/*
+* Copyright (c) 2002-2016, California Institute of Technology.
+* All rights reserved.  Based on Government Sponsored Research under contracts NAS7-1407 and/or NAS7-03001.
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+*   1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright notice,
+*      this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+*   3. Neither the name of the California Institute of Technology (Caltech), its operating division the Jet Propulsion Laboratory (JPL),
+*      the National Aeronautics and Space Administration (NASA), nor the names of its contributors may be used to
+*      endorse or promote products derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE CALIFORNIA INSTITUTE OF TECHNOLOGY BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+* EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+* EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// oe_twms_bench - Tiled WMS level and tile lookup, the way it was done and the way it is done
+// Makes a cache with the levels of a typical EPSG:4326 layer, then times the lookup of random
+// tile requests with BBOX values written the way KML and WorldWind clients write them.
+// The old path is sscanf and a scan of all the levels, the new one is oe_parse_bbox and the
+// level index.  Both have to find the same tile
+//
+// oe_twms_bench [-n requests] [-l levels]
+//
+
+#include "oe_tile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+// Tile index, the same arithmetic as get_index_offset in mod_onearth, -1 if it doesn't line up
+static long long tile_index(const WMSlevel *level, const double *bb)
+{
+  long long ix,iy;
+  double x,y;
+  ix=0.5+(x=((bb[0]-level->X0)/level->levelx));
+  iy=0.5+(y=((level->Y1-bb[3])/level->levely));
+  if ((x-ix)>0.01 || (ix-x)>0.01 || (y-iy)>0.01 || (iy-y)>0.01) return -1;
+  if (ix<0 || ix>=level->xcount || iy<0 || iy>=level->ycount) return -1;
+  return iy*level->xcount+ix;
+}
+
+static long long old_lookup(WMSCache *cache, const char *bbox)
+{
+  double bb[4],extra,width;
+  WMSlevel *level=GETLEVELS(cache);
+  int i;
+  if (4!=sscanf(bbox,"%lf,%lf,%lf,%lf,%lf",bb,bb+1,bb+2,bb+3,&extra)) return -1;
+  width=bb[2]-bb[0];
+  for (i=cache->levels;i;i--,level++)
+    if (width>level->levelx*0.965 && width<level->levelx*1.035) break;
+  if (!i) return -1;
+  return (level-GETLEVELS(cache))*1000000000LL+tile_index(level,bb);
+}
+
+static long long new_lookup(WMSCache *cache, const oe_level_index *ix, const char *bbox)
+{
+  double bb[4];
+  WMSlevel *level;
+  if (!oe_parse_bbox(bbox,bb) || !(level=oe_twms_level(cache,ix,bb[2]-bb[0]))) return -1;
+  return (level-GETLEVELS(cache))*1000000000LL+tile_index(level,bb);
+}
+
+int main(int argc, char **argv)
+{
+  int n=1000000,levels=12,c,i;
+  WMSCache *cache;
+  WMSlevel *level;
+  oe_level_index ix;
+  char (*req)[128];
+  long long check=0;
+  double t,old_ns,new_ns;
+
+  while (-1!=(c=getopt(argc,argv,"n:l:")))
+    switch (c) {
+      case 'n': n=atoi(optarg); break;
+      case 'l': levels=atoi(optarg); break;
+      default:
+        fprintf(stderr,"Usage: %s [-n requests] [-l levels]\n",argv[0]);
+        return 1;
+    }
+  if (n<1 || levels<1 || levels>20) {
+    fprintf(stderr,"Requests have to be positive, levels from 1 to 20\n");
+    return 1;
+  }
+
+  // Level 0 is two 512 pixel tiles of 180 degrees, each next level halves the tile size
+  cache=(WMSCache *)calloc(1,sizeof(WMSCache)+levels*sizeof(WMSlevel));
+  cache->levels=levels;
+  cache->levelt_offset=sizeof(WMSCache);
+  for (i=0,level=GETLEVELS(cache);i<levels;i++,level++) {
+    level->psizex=level->psizey=512;
+    level->X0=-180; level->Y0=-90; level->X1=180; level->Y1=90;
+    level->levelx=level->levely=180.0/(1<<i);
+    level->xcount=2<<i;
+    level->ycount=1<<i;
+  }
+  ix.slots=malloc(oe_level_index_size(cache));
+  oe_level_index_build(&ix,cache,ix.slots);
+
+  req=malloc((size_t)n*sizeof(*req));
+  srand(1);
+  for (i=0;i<n;i++) {
+    const WMSlevel *l=GETLEVELS(cache)+rand()%levels;
+    int col=rand()%l->xcount,row=rand()%l->ycount;
+    double w=l->X0+col*l->levelx,nn=l->Y1-row*l->levely;
+    snprintf(req[i],sizeof(req[i]),"%.10g,%.10g,%.10g,%.10g",w,nn-l->levely,w+l->levelx,nn);
+  }
+
+  for (i=0;i<n;i++) {
+    long long a=old_lookup(cache,req[i]),b=new_lookup(cache,&ix,req[i]);
+    if (a!=b || a<0) {
+      printf("Mismatch for %s: %lld and %lld\n",req[i],a,b);
+      return 1;
+    }
+  }
+
+  t=now();
+  for (i=0;i<n;i++) check+=old_lookup(cache,req[i]);
+  old_ns=(now()-t)/n;
+  t=now();
+  for (i=0;i<n;i++) check-=new_lookup(cache,&ix,req[i]);
+  new_ns=(now()-t)/n;
+
+  printf("%d requests, %d levels\n",n,levels);
+  printf("sscanf and level scan: %.1f ns per request\n",old_ns);
+  printf("oe_parse_bbox and level index: %.1f ns per request\n",new_ns);
+  return check!=0;
+}
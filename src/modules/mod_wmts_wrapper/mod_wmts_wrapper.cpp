@@ -41,6 +41,8 @@
 #include <apr_tables.h>
 #include <apr_strings.h>
 #include <apr_lib.h>
+#include <apr_hash.h>
+#include <apr_file_io.h>
 
 #include "mod_wmts_wrapper.h"
 #include "mod_reproject.h"
@@ -211,7 +213,7 @@ static const char *remove_date_from_uri(apr_pool_t *p, apr_array_header_t *token
     return out_uri;
 }
 
-static const char *get_blank_tile_filename(request_rec *r)
+static const char *get_blank_tile_name(request_rec *r)
 {
     const char *blank_tile_filename;
     const char *uri = r->uri;
@@ -228,9 +230,77 @@ static const char *get_blank_tile_filename(request_rec *r)
     } else {
         return NULL;
     }
+    return blank_tile_filename;
+}
+
+static const char *get_blank_tile_filename(request_rec *r)
+{
+    const char *blank_tile_filename = get_blank_tile_name(r);
+    if (!blank_tile_filename) return NULL;
     return apr_psprintf(r->pool, "%s/%s", get_base_uri(r), blank_tile_filename);
 }
 
+// ETag of a blank tile, from its content, the same one mod_onearth uses for WMSBlankTile
+static const char *blank_tile_etag(apr_pool_t *p, const char *data, apr_size_t size)
+{
+    apr_uint32_t h = 2166136261u;
+    for (apr_size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return apr_psprintf(p, "\"b%x-%" APR_SIZE_T_FMT "\"", h, size);
+}
+
+// Reads the blank tiles of the root directory when the configuration is loaded, so they
+// don't need an internal redirect for each missing tile.  Missing files are skipped
+static void load_blank_tiles(apr_pool_t *p, wmts_wrapper_conf *cfg, const char *dir)
+{
+    static const char *names[][2] = {
+        {"black.jpg", "image/jpeg"},
+        {"transparent.png", "image/png"},
+        {"empty.mvt", "application/vnd.mapbox-vector-tile"}
+    };
+    unsigned int i;
+    if (!dir) return;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        apr_file_t *f;
+        apr_finfo_t finfo;
+        apr_size_t got;
+        const char *fname = apr_pstrcat(p, dir, "/", names[i][0], NULL);
+        if (apr_file_open(&f, fname, APR_READ | APR_BINARY, APR_OS_DEFAULT, p) != APR_SUCCESS) continue;
+        if (apr_file_info_get(&finfo, APR_FINFO_SIZE, f) == APR_SUCCESS && finfo.size > 0) {
+            wmts_blank_tile *tile = (wmts_blank_tile *)apr_pcalloc(p, sizeof(wmts_blank_tile));
+            char *data = (char *)apr_palloc(p, finfo.size);
+            if (apr_file_read_full(f, data, (apr_size_t)finfo.size, &got) == APR_SUCCESS) {
+                tile->mime_type = names[i][1];
+                tile->data = data;
+                tile->size = got;
+                tile->etag = blank_tile_etag(p, data, got);
+                if (!cfg->blank_tiles) cfg->blank_tiles = apr_hash_make(p);
+                apr_hash_set(cfg->blank_tiles, names[i][0], APR_HASH_KEY_STRING, tile);
+            }
+        }
+        apr_file_close(f);
+    }
+}
+
+// Sends a blank tile from memory.  It can be replaced by a real tile later, so clients
+// have to check again
+static int send_blank_tile(request_rec *r, const wmts_blank_tile *tile)
+{
+    apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+    apr_table_setn(r->headers_out, "ETag", tile->etag);
+    // Only the ETag validates a blank tile, a Last-Modified left over from the request could
+    // match If-Modified-Since and answer 304 for a tile the client never had
+    apr_table_unset(r->headers_out, "Last-Modified");
+    int status = ap_meets_conditions(r);
+    if (status != OK) return status;
+    ap_set_content_type(r, tile->mime_type);
+    ap_set_content_length(r, tile->size);
+    ap_rwrite(tile->data, tile->size, r);
+    return OK;
+}
+
 static int handleKvP(request_rec *r) 
 {
     wmts_error wmts_errors[10];
@@ -536,6 +606,11 @@ static int post_hook(request_rec *r)
     if (!apr_strnatcasecmp(cfg->role, "root")) {
         // If mod_onearth has handled and failed this request, we serve up the appropriate blank tile (if it exists)
         if (apr_table_get(r->notes, "mod_onearth_failed")) {
+            const char *blank_tile_name = get_blank_tile_name(r);
+            if (blank_tile_name && cfg->blank_tiles) {
+                const wmts_blank_tile *tile = (const wmts_blank_tile *)apr_hash_get(cfg->blank_tiles, blank_tile_name, APR_HASH_KEY_STRING);
+                if (tile) return send_blank_tile(r, tile);
+            }
             if (const char *blank_tile_url = get_blank_tile_filename(r)) {
                 ap_internal_redirect(blank_tile_url, r);
             }
@@ -571,6 +646,7 @@ static const char *set_module(cmd_parms *cmd, void *dconf, const char *role)
 {
     wmts_wrapper_conf *cfg = (wmts_wrapper_conf *)dconf;
     cfg->role = apr_pstrdup(cmd->pool, role);
+    if (!apr_strnatcasecmp(cfg->role, "root")) load_blank_tiles(cmd->pool, cfg, cmd->path);
     const char *pattern = "^\\d{4}-\\d{2}-\\d{2}$|^\\d{4}-\\d{2}-\\d{2}T\\d{2}:\\d{2}:\\d{2}Z$";
     cfg->date_regexp = (ap_regex_t *)apr_palloc(cmd->pool, sizeof(ap_regex_t));
     if (ap_regcomp(cfg->date_regexp, pattern, 0)) {
@@ -606,6 +682,7 @@ static void* merge_dir_conf(apr_pool_t *p, void *BASE, void *ADD) {
     cfg->time = ( add->time == NULL ) ? base->time : add->time;
     cfg->date_regexp = ( add->date_regexp == NULL ) ? base->date_regexp : add->date_regexp;
     cfg->mime_type = ( add->mime_type == NULL ) ? base->mime_type : add->mime_type;
+    cfg->blank_tiles = ( add->blank_tiles == NULL ) ? base->blank_tiles : add->blank_tiles;
     return cfg;
 }
 
@@ -33,11 +33,20 @@
 
 #if !defined(MOD_WMTS_WRAPPER_H)
 
+// Blank tile, sent from memory when mod_onearth can't find a tile
+typedef struct {
+    const char *mime_type;
+    const char *etag;
+    const char *data;
+    apr_size_t size;
+} wmts_blank_tile;
+
 typedef struct {
     const char *role;
     int time;
     ap_regex_t *date_regexp;
     const char *mime_type;
+    apr_hash_t *blank_tiles; // wmts_blank_tile by file name, read with WMTSWrapperRole root
 } wmts_wrapper_conf;
 
 // WMTS error handling
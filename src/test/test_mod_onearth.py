@@ -41,12 +41,16 @@ import unittest2 as unittest
 import random
 import xmlrunner
 import xml.dom.minidom
-from shutil import rmtree
+from shutil import rmtree, copyfile
 from optparse import OptionParser
 import datetime
+import time
 from xml.etree import cElementTree as ElementTree
 import urllib2
-from oe_test_utils import check_tile_request, restart_apache, check_response_code, test_snap_request, file_text_replace, make_dir_tree, run_command, get_url, XmlDictConfig, check_dicts, check_valid_mvt
+import threading
+import json
+import struct
+from oe_test_utils import check_tile_request, restart_apache, check_response_code, test_snap_request, file_text_replace, make_dir_tree, run_command, get_url, XmlDictConfig, check_dicts, check_valid_mvt, check_apache_running, get_file_hash
 
 DEBUG = False
 
@@ -634,6 +638,18 @@ class TestModOnEarth(unittest.TestCase):
         check_result = check_tile_request(req_url, ref_hash)
         self.assertTrue(check_result, 'TWMS Z-Level no date and time JPEG Tile request does not match what\'s expected. URL: ' + req_url)
 
+    def test_request_wmts_style_nodate_year_zlevel(self):
+        """
+        17D. Request tile with a style and no date and time (z-level) from "year" layer via WMTS, the style doesn't pick the z-level
+        """
+        ref_hash = '36bb79a33dbbe6173990103a8d6b67cb'
+        req_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_zindex_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=image%2Fjpeg&Style=default&TileMatrix=0&TileCol=0&TileRow=0'
+        if DEBUG:
+            print '\nTesting: Request tile with a style and no date and time (z-level) from "year" layer via WMTS'
+            print 'URL: ' + req_url
+        check_result = check_tile_request(req_url, ref_hash)
+        self.assertTrue(check_result, 'WMTS Z-Level JPG Tile Request with a style does not match what\'s expected. URL: ' + req_url)
+
     def test_request_wmts_static_notime(self):
         """
         18. Request tile from static layer with no time via WMTS
@@ -914,6 +930,18 @@ class TestModOnEarth(unittest.TestCase):
             check_result = check_tile_request(req_url, ref_hash)
             self.assertTrue(check_result, 'URL parameter case insensitivity request does not match what\'s expected. URL: ' + req_url)
 
+    def test_url_parameter_version_wildcard(self):
+        """
+        28B. The dots in the VERSION of the cache patterns match any character, as the regexps did
+        """
+        ref_hash = '3f84501587adfe3006dcbf59e67cd0a3'
+        req_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_weekly_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1x0-0&Format=image%2Fjpeg&TileMatrix=0&TileCol=0&TileRow=0'
+        if DEBUG:
+            print '\nTesting: Pattern dots match any character'
+            print 'URL: ' + req_url
+        check_result = check_tile_request(req_url, ref_hash)
+        self.assertTrue(check_result, 'Request with other characters in place of the VERSION dots does not match what\'s expected. URL: ' + req_url)
+
     def test_wmts_error_handling(self):
         """
         29. WMTS Error handling
@@ -1235,6 +1263,101 @@ class TestModOnEarth(unittest.TestCase):
             error = 'The Invalid Format response does not match what\'s expected. URL: {0}'.format(req_url)
             self.assertTrue(check_str, error)
 
+    def test_concurrent_error_isolation(self):
+        """
+        31B. Concurrent good and bad WMTS requests don't share error state
+        """
+        good_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_weekly_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=image%2Fjpeg&TileMatrix=0&TileCol=0&TileRow=0'
+        good_hash = '3f84501587adfe3006dcbf59e67cd0a3'
+        # Each bad request should get back exactly its own errors
+        bad_requests = (
+            (good_url.replace('TileRow=0', 'TileRow=50'), [('TileOutOfRange', 'TILEROW')]),
+            (good_url.replace('TileCol=0', 'TileCol=50'), [('TileOutOfRange', 'TILECOL')]),
+            (good_url.replace('TileMatrix=0', 'TileMatrix=20'), [('InvalidParameterValue', 'TILEMATRIX')]),
+            (good_url.replace('Format=image%2Fjpeg', 'Format=image%2Fbad'), [('InvalidParameterValue', 'FORMAT')])
+        )
+        if DEBUG:
+            print '\nTesting concurrent WMTS requests for error leakage'
+        check_apache_running()
+        failures = []
+
+        def worker(seed):
+            rnd = random.Random(seed)
+            for i in range(50):
+                if rnd.random() < 0.5:
+                    tile = get_url(good_url)
+                    if get_file_hash(tile) != good_hash:
+                        failures.append('Bad tile for ' + good_url)
+                    continue
+                req_url, expected = rnd.choice(bad_requests)
+                try:
+                    response = urllib2.urlopen(req_url)
+                except urllib2.HTTPError as e:
+                    response = e
+                try:
+                    XMLroot = ElementTree.XML(response.read())
+                except:
+                    failures.append('Invalid XML for ' + req_url)
+                    continue
+                found = [(ex.get('exceptionCode'), ex.get('locator')) for ex in XMLroot.findall('{http://www.opengis.net/ows/1.1}Exception')]
+                if found != expected:
+                    failures.append('Expected {0}, got {1} for {2}'.format(expected, found, req_url))
+
+        threads = [threading.Thread(target=worker, args=(n,)) for n in range(16)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual([], failures, 'Errors leaked between concurrent requests:\n' + '\n'.join(failures[:10]))
+
+    def test_concurrent_same_tile(self):
+        """
+        31C. Many concurrent requests for the same tiles, as when a new day of imagery appears, all get the right tile, and the tile is read from the data file far fewer times than it is requested
+        """
+        tile_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_weekly_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=image%2Fjpeg&TileMatrix=0&TileCol=0&TileRow=0'
+        tile_hash = '3f84501587adfe3006dcbf59e67cd0a3'
+        status_url = 'http://localhost/onearth-status?json'
+        cache_conf = '/etc/httpd/conf.d/oe_test_tile_cache.conf'
+        if DEBUG:
+            print '\nTesting concurrent WMTS requests for the same tile'
+        # Only the tiles read by mod_onearth are shared, the ones in the tile cache
+        with open(cache_conf, 'w') as f:
+            f.write('WMSTileCache 16\n')
+        restart_apache()
+        check_apache_running()
+        failures = []
+        start = threading.Event()
+
+        def worker():
+            start.wait()
+            for i in range(10):
+                tile = get_url(tile_url)
+                if get_file_hash(tile) != tile_hash:
+                    failures.append('Bad tile for ' + tile_url)
+
+        try:
+            # A tile missed once is sent from the file, it only goes in the cache when it is missed again
+            self.assertEqual(get_file_hash(get_url(tile_url)), tile_hash, 'Bad tile for ' + tile_url)
+            tile_cache = json.loads(get_url(status_url).read())['tile_cache']
+            self.assertEqual((tile_cache['misses'], tile_cache['inserts']), (1, 0), 'Tile missed once was cached. URL: ' + status_url)
+
+            threads = [threading.Thread(target=worker) for n in range(32)]
+            for thread in threads:
+                thread.start()
+            start.set()
+            for thread in threads:
+                thread.join()
+            self.assertEqual([], failures, 'Concurrent requests for the same tile failed:\n' + '\n'.join(failures[:10]))
+            # Each read from the data file is stored in the tile cache once, the requests that
+            # joined a read or found the tile cached didn't read it
+            tile_cache = json.loads(get_url(status_url).read())['tile_cache']
+            requests = len(threads) * 10 + 1
+            self.assertEqual(tile_cache['hits'] + tile_cache['misses'], requests, 'Tile cache lookups do not match the requests. URL: ' + status_url)
+            self.assertLess(tile_cache['inserts'], requests / 4, 'Concurrent reads of the same tile were not merged. URL: ' + status_url)
+        finally:
+            os.remove(cache_conf)
+            restart_apache()
+
     # DATE/TIME SNAPPING REQUESTS
 
     def test_snapping_1a(self):
@@ -1616,6 +1739,242 @@ class TestModOnEarth(unittest.TestCase):
         mvt_tile = get_url(req_url)
         self.assertTrue(check_valid_mvt(mvt_tile), 'Output tile for MVT test layer is not a valid MVT tile.')
 
+    def test_request_wmts_etag_not_modified(self):
+        """
+        32. Request a tile, then request it again with its ETag. The second response has to be a 304.
+        """
+        req_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_weekly_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=image%2Fjpeg&TileMatrix=0&TileCol=0&TileRow=0'
+        if DEBUG:
+            print '\nTesting: ETag and If-None-Match'
+            print 'URL: ' + req_url
+        etag = get_url(req_url).info().getheader('ETag')
+        self.assertTrue(etag, 'Tile response has no ETag. URL: ' + req_url)
+        request = urllib2.Request(req_url, headers={'If-None-Match': etag})
+        try:
+            urllib2.urlopen(request)
+            r_code = 200
+        except urllib2.HTTPError as e:
+            r_code = e.code
+        self.assertEqual(r_code, 304, 'Request with a matching ETag returned {0} instead of 304. URL: {1}'.format(r_code, req_url))
+
+    def test_request_wmts_get_tiles(self):
+        """
+        33. Request a block of tiles with GetTiles. Each part of the multipart response has to match the same tile requested with GetTile.
+        """
+        base_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_weekly_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Version=1.0.0&Format=image%2Fjpeg&TileMatrix=1'
+        req_url = base_url + '&Request=GetTiles&Tiles=0-1,0-1'
+        if DEBUG:
+            print '\nTesting: Request multiple tiles with GetTiles'
+            print 'URL: ' + req_url
+        response = get_url(req_url)
+        content_type = response.info().getheader('Content-Type')
+        self.assertTrue(content_type.startswith('multipart/mixed; boundary='), 'GetTiles returned {0} instead of multipart/mixed. URL: {1}'.format(content_type, req_url))
+        boundary = '--' + content_type.split('boundary=')[1]
+        parts = response.read().split(boundary)[1:-1]
+        self.assertEqual(len(parts), 4, 'GetTiles returned {0} tiles instead of 4. URL: {1}'.format(len(parts), req_url))
+        for part in parts:
+            head, body = part[2:-2].split('\r\n\r\n', 1)
+            headers = dict(line.split(': ', 1) for line in head.split('\r\n'))
+            tile_url = base_url + '&Request=GetTile&TileRow={0}&TileCol={1}'.format(headers['X-Tile-Row'], headers['X-Tile-Col'])
+            self.assertEqual(body, get_url(tile_url).read(), 'GetTiles part does not match GetTile. URL: ' + tile_url)
+
+    def test_onearth_status(self):
+        """
+        34. Request tiles from the top two levels, then check that their layer and levels show up in the statistics, in JSON and in Prometheus text. Levels are counted by TILEMATRIX.
+        """
+        tile_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_weekly_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=image%2Fjpeg&TileMatrix={0}&TileCol=0&TileRow=0'
+        status_url = 'http://localhost/onearth-status'
+        if DEBUG:
+            print '\nTesting: Request statistics from the status handler'
+            print 'URL: ' + status_url
+        get_url(tile_url.format(0)).read()
+        get_url(tile_url.format(1)).read()
+        stats = json.loads(get_url(status_url + '?json').read())
+        layers = dict((layer['name'], layer) for layer in stats['layers'])
+        self.assertIn('test_weekly_jpg', layers, 'Layer missing from the statistics. URL: ' + status_url + '?json')
+        layer = layers['test_weekly_jpg']
+        self.assertGreaterEqual(layer['requests'], 1, 'No requests counted for the layer. URL: ' + status_url + '?json')
+        self.assertGreaterEqual(len(layer['levels']), 2, 'Levels missing from the statistics. URL: ' + status_url + '?json')
+        self.assertGreaterEqual(layer['levels'][0], 1, 'No requests counted for TileMatrix 0. URL: ' + status_url + '?json')
+        self.assertGreaterEqual(layer['levels'][1], 1, 'No requests counted for TileMatrix 1. URL: ' + status_url + '?json')
+        self.assertEqual(sorted(layer['phases'].keys()), ['data', 'index', 'match', 'parse', 'write'], 'Wrong phases. URL: ' + status_url + '?json')
+        text = get_url(status_url).read()
+        self.assertIn('onearth_requests_total{layer="test_weekly_jpg"}', text, 'Layer missing from the Prometheus text. URL: ' + status_url)
+        self.assertIn('onearth_phase_seconds_bucket{layer="test_weekly_jpg",phase="data",le="+Inf"}', text, 'Histogram missing from the Prometheus text. URL: ' + status_url)
+
+    def test_cache_reload(self):
+        """
+        35. With WMSCacheReload on, a cache configuration that can't be loaded leaves the previous one in use, and is loaded once it can be read, even if the file looks the same.
+        """
+        reload_conf = '/etc/httpd/conf.d/oe_test_reload.conf'
+        cache_config = os.path.join(self.image_files_path, 'cache_all_wmts.config')
+        temp_config = cache_config + '.tmp'
+        ref_hash = '3f84501587adfe3006dcbf59e67cd0a3'
+        req_url = 'http://localhost/onearth/test/wmts/wmts.cgi?layer=test_weekly_jpg&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=image%2Fjpeg&TileMatrix=0&TileCol=0&TileRow=0'
+        status_url = 'http://localhost/onearth-status?json'
+        if DEBUG:
+            print '\nTesting: Reloading a cache configuration that first fails to load'
+            print 'URL: ' + req_url
+        with open(reload_conf, 'w') as f:
+            f.write('WMSCacheReload 1\n')
+        restart_apache()
+        try:
+            # A new file the Apache processes can't read, the reload fails
+            copyfile(cache_config, temp_config)
+            stat = os.stat(cache_config)
+            os.utime(temp_config, (stat.st_atime, stat.st_mtime + 10))
+            os.chmod(temp_config, 0)
+            os.rename(temp_config, cache_config)
+            time.sleep(3)
+            self.assertTrue(check_tile_request(req_url, ref_hash), 'Tile wrong after a failed reload. URL: ' + req_url)
+            self.assertEqual(json.loads(get_url(status_url).read())['reloads'], 0, 'Unreadable configuration counted as reloaded. URL: ' + status_url)
+            # Same file, now readable, it has to be loaded
+            os.chmod(cache_config, 0644)
+            time.sleep(3)
+            self.assertGreaterEqual(json.loads(get_url(status_url).read())['reloads'], 1, 'Configuration not reloaded after the failed load. URL: ' + status_url)
+            self.assertTrue(check_tile_request(req_url, ref_hash), 'Tile wrong after the reload. URL: ' + req_url)
+        finally:
+            os.chmod(cache_config, 0644)
+            os.remove(reload_conf)
+            restart_apache()
+
+    def test_occupancy_map(self):
+        """
+        36. oe_create_cache_config -o writes the occupancy map of an index, with the size and modification time of the index, and the records that have data.
+        """
+        idx = os.path.join(self.image_files_path, 'mvt_test/2012/mvt_test2012001_.idx')
+        sparse_idx = os.path.join(self.staging_path, 'sparse.idx')
+        sparse_idm = os.path.join(self.staging_path, 'sparse.idm')
+        if DEBUG:
+            print '\nTesting: Occupancy map of an index file'
+        with open(idx, 'rb') as f:
+            records = [struct.unpack('>qq', f.read(16)) for n in range(os.path.getsize(idx) / 16)]
+        empty = (0, 5, len(records) - 1)
+        with open(sparse_idx, 'wb') as f:
+            for n, record in enumerate(records):
+                f.write(struct.pack('>qq', 0, 0) if n in empty else struct.pack('>qq', *record))
+        try:
+            run_command('oe_create_cache_config -o {0} {1}'.format(sparse_idx, sparse_idm))
+            stat = os.stat(sparse_idx)
+            with open(sparse_idm, 'rb') as f:
+                data = f.read()
+            magic, chunks, count, index_size, index_mtime, index_nsec = struct.unpack('=4siqqqq', data[:40])
+            self.assertEqual(magic, 'IDM2', 'Wrong occupancy map magic ' + magic)
+            self.assertEqual((chunks, count), (1, len(records)), 'Wrong number of chunks or records in the occupancy map')
+            self.assertEqual(index_size, stat.st_size, 'Occupancy map has the wrong index size')
+            self.assertEqual(index_mtime, int(stat.st_mtime), 'Occupancy map has the wrong index time')
+            # A few set records are stored as their sorted list
+            chunk_type, chunk_count, chunk_offset = struct.unpack('=iiq', data[40:56])
+            self.assertEqual((chunk_type, chunk_count), (2, len(records) - len(empty)), 'Wrong occupancy map chunk')
+            listed = struct.unpack('={0}H'.format(chunk_count), data[chunk_offset:chunk_offset + 2 * chunk_count])
+            self.assertEqual(list(listed), [n for n in range(len(records)) if n not in empty], 'Wrong records in the occupancy map')
+        finally:
+            for name in (sparse_idx, sparse_idm):
+                if os.path.exists(name):
+                    os.remove(name)
+
+    def test_empty_vector(self):
+        """
+        37. WMSEmptyVector 204 answers vector tiles with no data with only the status, with and without an occupancy map, and an occupancy map made from a previous version of the index is not used.
+        """
+        idx = os.path.join(self.image_files_path, 'mvt_test/2012/mvt_test2012001_.idx')
+        idm = idx[:-4] + '.idm'
+        saved_idx = os.path.join(self.staging_path, 'mvt_test2012001_.idx.saved')
+        endpoint = os.path.join(os.path.dirname(self.image_files_path), 'wmts_empty_vector_endpoint')
+        endpoint_conf = '/etc/httpd/conf.d/oe_test_empty_vector.conf'
+        req_url = 'http://localhost/onearth/test/wmts_empty_vector/wmts.cgi?layer=mvt_test&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=application%2Fvnd.mapbox-vector-tile&TileMatrix=0&TileCol={0}&TileRow=0&TIME=2012-01-01'
+        if DEBUG:
+            print '\nTesting: WMSEmptyVector and the occupancy map'
+            print 'URL: ' + req_url.format(0)
+        # Tile 0,0 of the top level is the one before the last record
+        copyfile(idx, saved_idx)
+        with open(idx, 'r+b') as f:
+            f.seek(os.path.getsize(idx) - 32)
+            f.write(struct.pack('>qq', 0, 0))
+        os.mkdir(endpoint)
+        with open(endpoint_conf, 'w') as f:
+            f.write('Alias /onearth/test/wmts_empty_vector {0}\n'
+                    '<Directory {0}>\n'
+                    '    Require all granted\n'
+                    '    WMSCache {1}\n'
+                    '    WMSEmptyVector 204\n'
+                    '</Directory>\n'.format(endpoint, os.path.join(self.image_files_path, 'cache_all_wmts.config')))
+        try:
+            restart_apache()
+            response = urllib2.urlopen(req_url.format(0))
+            self.assertEqual((response.getcode(), response.read()), (204, ''), 'Empty vector tile not answered with 204. URL: ' + req_url.format(0))
+            self.assertTrue(check_valid_mvt(get_url(req_url.format(1))), 'Vector tile with data is not valid. URL: ' + req_url.format(1))
+
+            # Same answers with the occupancy map
+            run_command('oe_create_cache_config -o {0} {1}'.format(idx, idm))
+            restart_apache()
+            response = urllib2.urlopen(req_url.format(0))
+            self.assertEqual(response.getcode(), 204, 'Empty vector tile not answered with 204 with an occupancy map. URL: ' + req_url.format(0))
+            self.assertTrue(check_valid_mvt(get_url(req_url.format(1))), 'Vector tile with data is not valid with an occupancy map. URL: ' + req_url.format(1))
+
+            # The index gets the tile back, in place, same size and in the same second as the map,
+            # but not at the same time as the index the map was made from
+            sparse_mtime = os.stat(idx).st_mtime
+            idm_mtime = int(os.stat(idm).st_mtime) + (0.25 if sparse_mtime % 1 >= 0.5 else 0.75)
+            copyfile(saved_idx, idx)
+            os.utime(idx, (idm_mtime, idm_mtime))
+            restart_apache()
+            self.assertTrue(check_valid_mvt(get_url(req_url.format(0))), 'Occupancy map of a previous index was used. URL: ' + req_url.format(0))
+        finally:
+            copyfile(saved_idx, idx)
+            os.remove(saved_idx)
+            if os.path.exists(idm):
+                os.remove(idm)
+            os.remove(endpoint_conf)
+            os.rmdir(endpoint)
+            restart_apache()
+
+    def test_blank_tile(self):
+        """
+        38. WMSBlankTile is sent from memory for a date with no data, with an ETag made from its content, Cache-Control no-cache, and a 304 for a matching If-None-Match.
+        """
+        endpoint = os.path.join(os.path.dirname(self.image_files_path), 'wmts_blank_endpoint')
+        endpoint_conf = '/etc/httpd/conf.d/oe_test_blank_tile.conf'
+        # No index for the date and no default index, so there is no tile and no empty tile
+        req_url = 'http://localhost/onearth/test/wmts_blank/wmts.cgi?layer=snap_test_1a&tilematrixset=EPSG4326_16km&Service=WMTS&Request=GetTile&Version=1.0.0&Format=image%2Fjpeg&TileMatrix=0&TileCol=0&TileRow=0&TIME=2017-01-01'
+        if DEBUG:
+            print '\nTesting: WMSBlankTile for a date with no data'
+            print 'URL: ' + req_url
+        os.mkdir(endpoint)
+        copyfile(os.path.join(os.path.dirname(self.image_files_path), 'twms_endpoint/black.jpg'), os.path.join(endpoint, 'blank.jpg'))
+        with open(os.path.join(endpoint, 'blank.jpg'), 'rb') as f:
+            blank = f.read()
+        # FNV-1a of the content, the same ETag mod_wmts_wrapper sends for the same tile
+        h = 2166136261
+        for c in blank:
+            h = ((h ^ ord(c)) * 16777619) & 0xffffffff
+        with open(endpoint_conf, 'w') as f:
+            f.write('Alias /onearth/test/wmts_blank {0}\n'
+                    '<Directory {0}>\n'
+                    '    Require all granted\n'
+                    '    WMSBlankTile image/jpeg blank.jpg\n'
+                    '    WMSCache {1}\n'
+                    '</Directory>\n'.format(endpoint, os.path.join(self.image_files_path, 'cache_all_wmts.config')))
+        try:
+            restart_apache()
+            # There is no CGI in the endpoint, so only the module can answer
+            response = get_url(req_url)
+            self.assertEqual(response.read(), blank, 'Blank tile not sent for a date with no data. URL: ' + req_url)
+            self.assertEqual(response.info().getheader('ETag'), '"b{0:x}-{1}"'.format(h, len(blank)), 'Blank tile ETag is not made from its content. URL: ' + req_url)
+            self.assertEqual(response.info().getheader('Cache-Control'), 'no-cache', 'Blank tile can be cached without checking. URL: ' + req_url)
+
+            request = urllib2.Request(req_url, headers={'If-None-Match': response.info().getheader('ETag')})
+            try:
+                urllib2.urlopen(request)
+                r_code = 200
+            except urllib2.HTTPError as e:
+                r_code = e.code
+            self.assertEqual(r_code, 304, 'Blank tile with a matching ETag returned {0} instead of 304. URL: {1}'.format(r_code, req_url))
+        finally:
+            os.remove(endpoint_conf)
+            rmtree(endpoint)
+            restart_apache()
+
     # TEARDOWN
 
     @classmethod